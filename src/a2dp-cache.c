@@ -0,0 +1,260 @@
+/*
+ * BlueALSA - a2dp-cache.c
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "a2dp-cache.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "shared/log.h"
+
+/* Cached configurations indexed by the selection policy, the codec ID and
+ * the capabilities of the remote endpoint. Both keys and values are stored
+ * as hex strings, which is also the format of the cache file. */
+static GHashTable *cache = NULL;
+/* location of the cache file, if NULL the cache is not persistent */
+static char *cache_path = NULL;
+/* ID of the GLib source which will save the cache file */
+static unsigned int cache_save_source_id = 0;
+
+static char *bin2hex(const void *bin, size_t size) {
+
+	static const char digits[] = "0123456789abcdef";
+	const uint8_t *data = bin;
+	char *hex = g_malloc(size * 2 + 1);
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		hex[i * 2 + 0] = digits[data[i] >> 4];
+		hex[i * 2 + 1] = digits[data[i] & 0x0F];
+	}
+
+	hex[i * 2] = '\0';
+	return hex;
+}
+
+static int hex2bin(const char *hex, void *bin, size_t size) {
+
+	uint8_t *data = bin;
+	size_t i;
+
+	if (strlen(hex) != size * 2)
+		return -1;
+
+	for (i = 0; i < size; i++) {
+		int hi = g_ascii_xdigit_value(hex[i * 2 + 0]);
+		int lo = g_ascii_xdigit_value(hex[i * 2 + 1]);
+		if (hi == -1 || lo == -1)
+			return -1;
+		data[i] = (hi << 4) | lo;
+	}
+
+	return 0;
+}
+
+static char *a2dp_cache_key(uint8_t codec, unsigned int policy,
+		const void *capabilities, size_t size) {
+	char *hex = bin2hex(capabilities, size);
+	char *key = g_strdup_printf("%02x:%02x:%s", policy, codec, hex);
+	g_free(hex);
+	return key;
+}
+
+static int a2dp_cache_load(const char *path) {
+
+	GError *err = NULL;
+	gchar *contents;
+	gchar **lines;
+	size_t i;
+
+	if (!g_file_get_contents(path, &contents, NULL, &err)) {
+		if (err->code != G_FILE_ERROR_NOENT)
+			warn("Couldn't load A2DP cache: %s", err->message);
+		g_error_free(err);
+		return -1;
+	}
+
+	lines = g_strsplit(contents, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+
+		char *value;
+
+		if (lines[i][0] == '\0')
+			continue;
+
+		if ((value = strchr(lines[i], ' ')) == NULL) {
+			warn("Invalid A2DP cache entry: %s", lines[i]);
+			continue;
+		}
+
+		*value++ = '\0';
+		g_hash_table_insert(cache, g_strdup(lines[i]), g_strdup(value));
+
+	}
+
+	debug("Loaded A2DP cache: %s (%u entries)", path, g_hash_table_size(cache));
+
+	g_strfreev(lines);
+	g_free(contents);
+	return 0;
+}
+
+static int a2dp_cache_save(const char *path) {
+
+	GString *contents = g_string_new(NULL);
+	GError *err = NULL;
+	GHashTableIter iter;
+	const char *key;
+	const char *value;
+	int ret = 0;
+
+	g_hash_table_iter_init(&iter, cache);
+	while (g_hash_table_iter_next(&iter, (gpointer)&key, (gpointer)&value))
+		g_string_append_printf(contents, "%s %s\n", key, value);
+
+	gchar *dir = g_path_get_dirname(path);
+	if (g_mkdir_with_parents(dir, 0755) == -1)
+		warn("Couldn't create state directory: %s: %s", dir, strerror(errno));
+	g_free(dir);
+
+	/* the file is replaced atomically */
+	if (!g_file_set_contents(path, contents->str, contents->len, &err)) {
+		warn("Couldn't save A2DP cache: %s", err->message);
+		g_error_free(err);
+		ret = -1;
+	}
+
+	g_string_free(contents, TRUE);
+	return ret;
+}
+
+static gboolean a2dp_cache_save_dispatch(void *userdata) {
+	(void)userdata;
+	cache_save_source_id = 0;
+	a2dp_cache_save(cache_path);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * Initialize A2DP configuration cache.
+ *
+ * The cache is meant to be used from the main thread only, so there is no
+ * locking involved.
+ *
+ * @param path Location of the cache file. If the file exists, it is loaded
+ *   right away. It is updated shortly after new configuration is stored,
+ *   and when the cache is released.
+ *   If NULL, the cache is kept in memory only.
+ * @return On success this function returns 0. Otherwise, -1 is returned. */
+int a2dp_cache_init(const char *path) {
+
+	a2dp_cache_free();
+
+	cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	if (path != NULL) {
+		cache_path = g_strdup(path);
+		a2dp_cache_load(path);
+	}
+
+	return 0;
+}
+
+/**
+ * Release A2DP configuration cache resources. */
+void a2dp_cache_free(void) {
+	/* flush pending changes before the cache is gone */
+	if (cache_save_source_id != 0) {
+		g_source_remove(cache_save_source_id);
+		a2dp_cache_save_dispatch(NULL);
+	}
+	if (cache != NULL)
+		g_hash_table_unref(cache);
+	g_free(cache_path);
+	cache = NULL;
+	cache_path = NULL;
+}
+
+/**
+ * Lookup cached A2DP configuration.
+ *
+ * @param codec A2DP codec ID.
+ * @param policy Identifier of the policy used for the configuration
+ *   selection. Configurations selected with other policy are not returned.
+ * @param capabilities Capabilities of the remote endpoint.
+ * @param configuration Address where the cached configuration will be
+ *   stored. It is allowed to point to the capabilities buffer.
+ * @param size Size of the capabilities and the configuration blobs.
+ * @return If the configuration has been found, this function returns true. */
+bool a2dp_cache_lookup(uint8_t codec, unsigned int policy,
+		const void *capabilities, void *configuration, size_t size) {
+
+	const char *value;
+	bool found = false;
+
+	if (cache == NULL)
+		return false;
+
+	char *key = a2dp_cache_key(codec, policy, capabilities, size);
+	if ((value = g_hash_table_lookup(cache, key)) != NULL)
+		found = hex2bin(value, configuration, size) == 0;
+	g_free(key);
+
+	return found;
+}
+
+/**
+ * Store selected A2DP configuration in the cache.
+ *
+ * @param codec A2DP codec ID.
+ * @param policy Identifier of the policy used for the configuration
+ *   selection.
+ * @param capabilities Capabilities of the remote endpoint.
+ * @param configuration Selected configuration.
+ * @param size Size of the capabilities and the configuration blobs. */
+void a2dp_cache_store(uint8_t codec, unsigned int policy,
+		const void *capabilities, const void *configuration, size_t size) {
+
+	if (cache == NULL)
+		return;
+
+	char *key = a2dp_cache_key(codec, policy, capabilities, size);
+	char *value = bin2hex(configuration, size);
+	const char *current;
+
+	if ((current = g_hash_table_lookup(cache, key)) != NULL &&
+			strcmp(current, value) == 0) {
+		g_free(key);
+		g_free(value);
+		return;
+	}
+
+	/* Such a number of distinct configurations is rather not possible in the
+	 * real life. Anyway, make sure that the cache will not grow unbounded by
+	 * evicting an arbitrary entry. */
+	if (current == NULL && g_hash_table_size(cache) >= A2DP_CACHE_SIZE) {
+		GHashTableIter iter;
+		g_hash_table_iter_init(&iter, cache);
+		if (g_hash_table_iter_next(&iter, NULL, NULL))
+			g_hash_table_iter_remove(&iter);
+	}
+
+	g_hash_table_insert(cache, key, value);
+
+	/* The cache file is saved with a delay, so it is not written on the
+	 * main loop for every new configuration, and all changes made in the
+	 * meantime are coalesced into a single write. */
+	if (cache_path != NULL && cache_save_source_id == 0)
+		cache_save_source_id = g_timeout_add_seconds(A2DP_CACHE_SAVE_DELAY,
+				a2dp_cache_save_dispatch, NULL);
+
+}
@@ -0,0 +1,39 @@
+/*
+ * BlueALSA - a2dp-cache.h
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_A2DPCACHE_H_
+#define BLUEALSA_A2DPCACHE_H_
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* directory where the persistent state is stored */
+#define BLUEALSA_STATE_DIR LOCAL_STATE_DIR "/lib/bluealsa"
+
+/* the maximal number of cached configurations */
+#define A2DP_CACHE_SIZE 256
+
+/* delay in seconds before changes are saved to the cache file */
+#define A2DP_CACHE_SAVE_DELAY 5
+
+int a2dp_cache_init(const char *path);
+void a2dp_cache_free(void);
+
+bool a2dp_cache_lookup(uint8_t codec, unsigned int policy,
+		const void *capabilities, void *configuration, size_t size);
+void a2dp_cache_store(uint8_t codec, unsigned int policy,
+		const void *capabilities, const void *configuration, size_t size);
+
+#endif
@@ -237,6 +237,12 @@ typedef struct {
 	uint8_t rfa2:5;
 } __attribute__ ((packed)) a2dp_ldac_t;
 
+/* MPEG bit rate field is transmitted in the big-endian byte order */
+#define MPEG_BIT_RATE_BSWAP(b) ((((b) & 0xff) << 8) | (((b) >> 8) & 0xff))
+#define MPEG_GET_BITRATE(a) MPEG_BIT_RATE_BSWAP((a).bitrate)
+#define MPEG_SET_BITRATE(a, b) do { (a).bitrate = MPEG_BIT_RATE_BSWAP(b); } while (0)
+#define MPEG_INIT_BITRATE(b) .bitrate = MPEG_BIT_RATE_BSWAP(b),
+
 #elif __BYTE_ORDER == __BIG_ENDIAN
 
 typedef struct {
@@ -292,6 +298,10 @@ typedef struct {
 	uint8_t channel_mode:3;
 } __attribute__ ((packed)) a2dp_ldac_t;
 
+#define MPEG_GET_BITRATE(a) ((a).bitrate)
+#define MPEG_SET_BITRATE(a, b) do { (a).bitrate = (b); } while (0)
+#define MPEG_INIT_BITRATE(b) .bitrate = (b),
+
 #else
 # error "Unknown byte order"
 #endif
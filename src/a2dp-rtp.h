@@ -57,4 +57,12 @@ typedef struct rtp_media_header {
 #endif
 } __attribute__ ((packed)) rtp_media_header_t;
 
+/**
+ * MPEG audio-specific header (RFC 2250). */
+typedef struct rtp_mpeg_audio_header {
+	uint16_t mbz;
+	/* offset of the fragment within the MPEG frame */
+	uint16_t offset;
+} __attribute__ ((packed)) rtp_mpeg_audio_header_t;
+
 #endif
@@ -37,12 +37,13 @@ struct ctl_elem {
 	char name[44 /* internal ALSA constraint */ + 1];
 	/* if true, element is a playback control */
 	bool playback;
+	/* if true, element has not been announced yet */
+	bool fresh;
 };
 
 struct ctl_elem_update {
 	char name[sizeof(((struct ctl_elem *)0)->name)];
 	unsigned int event_mask;
-	struct ctl_elem *_elem;
 };
 
 struct bluealsa_ctl {
@@ -54,21 +55,32 @@ struct bluealsa_ctl {
 
 	/* if true, show battery meter */
 	bool battery;
+	/* if true, events carry the device and transport state */
+	bool event_payload;
 
-	/* list of all BT devices */
-	struct ba_msg_device *devices;
+	/* cache of all BT devices */
+	struct ba_msg_device **devices;
 	size_t devices_count;
 
-	/* list of all transports */
-	struct ba_msg_transport *transports;
+	/* cache of all transports */
+	struct ba_msg_transport **transports;
 	size_t transports_count;
 
-	/* list of control elements */
+	/* if true, cache has been synchronized with the server */
+	bool synced;
+
+	/* list of control elements sorted by the device and transport */
 	struct ctl_elem *elems;
 	size_t elems_count;
 
-	/* list of control element update events */
+	/* elements have to be sorted (new element was inserted) */
+	bool elems_sort;
+	/* element names have to be regenerated */
+	bool elems_rename;
+
+	/* queue of control element update events */
 	struct ctl_elem_update *updates;
+	size_t updates_head;
 	size_t updates_count;
 
 };
@@ -86,7 +98,7 @@ static int bluealsa_get_device_id(const struct bluealsa_ctl *ctl,
 	size_t i;
 
 	for (i = 0; i < ctl->devices_count; i++)
-		if (bacmp(&ctl->devices[i].addr, &device->addr) == 0)
+		if (ctl->devices[i] == device)
 			return i;
 
 	return -1;
@@ -213,155 +225,212 @@ static int bluealsa_ctl_elem_cmp(const struct ctl_elem *e1, const struct ctl_ele
 	return updated;
 }
 
-static int bluealsa_ctl_elem_update_cmp(const void *p1, const void *p2) {
-	return strcmp(((struct ctl_elem_update *)p1)->name, ((struct ctl_elem_update *)p2)->name);
-}
+/**
+ * Compare two control elements by the device and transport key.
+ *
+ * Elements which belong to the same device and transport are adjacent in
+ * the list sorted with this function. */
+static int bluealsa_ctl_elem_key_cmp(const void *p1, const void *p2) {
+
+	const struct ctl_elem *e1 = (const struct ctl_elem *)p1;
+	const struct ctl_elem *e2 = (const struct ctl_elem *)p2;
+	const uint8_t t1 = e1->transport != NULL ? e1->transport->type : BA_PCM_TYPE_NULL;
+	const uint8_t t2 = e2->transport != NULL ? e2->transport->type : BA_PCM_TYPE_NULL;
+	int ret;
 
-static void bluealsa_close(snd_ctl_ext_t *ext) {
-	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
-	close(ctl->fd);
-	close(ctl->event_fd);
-	free(ctl->devices);
-	free(ctl->transports);
-	free(ctl->elems);
-	free(ctl->updates);
-	free(ctl);
+	if ((ret = bacmp(&e1->device->addr, &e2->device->addr)) != 0)
+		return ret;
+	if (t1 != t2)
+		return t1 - t2;
+	if (e1->playback != e2->playback)
+		return e2->playback - e1->playback;
+	return e2->type - e1->type;
 }
 
-static int bluealsa_elem_count(snd_ctl_ext_t *ext) {
-	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
+/**
+ * Queue control element update event.
+ *
+ * Removal followed by the addition of an element with the same name is
+ * reported as a value change. Value change of an element which has been
+ * already queued is not reported twice. */
+static void bluealsa_queue_update(struct bluealsa_ctl *ctl, const char *name,
+		unsigned int event_mask) {
 
-	size_t count = 0;
-	ssize_t cnt;
+	struct ctl_elem_update *tmp;
 	size_t i;
 
-	if ((cnt = bluealsa_get_devices(ctl->fd, &ctl->devices)) == -1)
-		return -errno;
-	ctl->devices_count = cnt;
+	for (i = ctl->updates_count; i > ctl->updates_head; i--) {
+		struct ctl_elem_update *update = &ctl->updates[i - 1];
+		if (strcmp(update->name, name) != 0)
+			continue;
+		if (event_mask == SND_CTL_EVENT_MASK_VALUE &&
+				update->event_mask != SND_CTL_EVENT_MASK_REMOVE)
+			return;
+		if (event_mask == SND_CTL_EVENT_MASK_ADD &&
+				update->event_mask == SND_CTL_EVENT_MASK_REMOVE) {
+			update->event_mask = SND_CTL_EVENT_MASK_VALUE;
+			return;
+		}
+		break;
+	}
 
-	if ((cnt = bluealsa_get_transports(ctl->fd, &ctl->transports)) == -1)
-		return -errno;
-	ctl->transports_count = cnt;
+	if ((tmp = realloc(ctl->updates, sizeof(*tmp) * (ctl->updates_count + 1))) == NULL)
+		return;
+
+	ctl->updates = tmp;
+	tmp = &ctl->updates[ctl->updates_count++];
+	strcpy(tmp->name, name);
+	tmp->event_mask = event_mask;
 
-	for (i = 0; i < ctl->devices_count; i++) {
-		/* add additional element for battery level */
-		if (ctl->battery && ctl->devices[i].battery)
-			count++;
+}
+
+/**
+ * Add new control element.
+ *
+ * The element is appended to the list, so the list has to be sorted and
+ * element names have to be regenerated - see bluealsa_elems_commit(). */
+static void bluealsa_elem_add(struct bluealsa_ctl *ctl, enum ctl_elem_type type,
+		struct ba_msg_device *device, struct ba_msg_transport *transport, bool playback) {
+
+	struct ctl_elem *tmp;
+
+	if ((tmp = realloc(ctl->elems, sizeof(*tmp) * (ctl->elems_count + 1))) == NULL)
+		return;
+
+	ctl->elems = tmp;
+	tmp = &ctl->elems[ctl->elems_count++];
+	tmp->type = type;
+	tmp->device = device;
+	tmp->transport = transport;
+	tmp->name[0] = '\0';
+	tmp->playback = playback;
+	tmp->fresh = true;
+
+	ctl->elems_sort = true;
+	ctl->elems_rename = true;
+
+}
+
+/**
+ * Add control elements for the given transport. */
+static void bluealsa_elems_add_transport(struct bluealsa_ctl *ctl,
+		struct ba_msg_device *device, struct ba_msg_transport *transport) {
+
+	/* Every stream has two controls associated to itself - volume adjustment
+	 * and mute switch. A2DP transport contains only one stream. However, SCO
+	 * transport represent both streams - playback and capture. */
+	switch (BA_PCM_TYPE(transport->type)) {
+	case BA_PCM_TYPE_NULL:
+		break;
+	case BA_PCM_TYPE_A2DP:
+		bluealsa_elem_add(ctl, CTL_ELEM_TYPE_VOLUME, device, transport,
+				transport->type & BA_PCM_STREAM_PLAYBACK);
+		bluealsa_elem_add(ctl, CTL_ELEM_TYPE_SWITCH, device, transport,
+				transport->type & BA_PCM_STREAM_PLAYBACK);
+		break;
+	case BA_PCM_TYPE_SCO:
+		if (transport->codec == 0)
+			break;
+		bluealsa_elem_add(ctl, CTL_ELEM_TYPE_VOLUME, device, transport, true);
+		bluealsa_elem_add(ctl, CTL_ELEM_TYPE_SWITCH, device, transport, true);
+		bluealsa_elem_add(ctl, CTL_ELEM_TYPE_VOLUME, device, transport, false);
+		bluealsa_elem_add(ctl, CTL_ELEM_TYPE_SWITCH, device, transport, false);
+		break;
 	}
 
-	for (i = 0; i < ctl->transports_count; i++) {
-		/* Every stream has two controls associated to itself - volume adjustment
-		 * and mute switch. A2DP transport contains only one stream. However, SCO
-		 * transport represent both streams - playback and capture. */
-		switch (BA_PCM_TYPE(ctl->transports[i].type)) {
-		case BA_PCM_TYPE_NULL:
+}
+
+/**
+ * Remove control elements associated with the given device and transport.
+ *
+ * If the transport is NULL, device specific elements are removed. Note, that
+ * removal does not change the order of remaining elements. */
+static void bluealsa_elems_remove(struct bluealsa_ctl *ctl,
+		const struct ba_msg_device *device, const struct ba_msg_transport *transport) {
+
+	size_t i, count;
+
+	for (i = count = 0; i < ctl->elems_count; i++) {
+		struct ctl_elem *elem = &ctl->elems[i];
+		if (elem->device == device && elem->transport == transport) {
+			if (!elem->fresh)
+				bluealsa_queue_update(ctl, elem->name, SND_CTL_EVENT_MASK_REMOVE);
+			ctl->elems_rename = true;
 			continue;
-		case BA_PCM_TYPE_A2DP:
-			count += 2;
-			break;
-		case BA_PCM_TYPE_SCO:
-			if (ctl->transports[i].codec != 0)
-				count += 4;
-			break;
 		}
+		if (count != i)
+			ctl->elems[count] = *elem;
+		count++;
 	}
 
-	ctl->elems = malloc(sizeof(*ctl->elems) * count);
 	ctl->elems_count = count;
-	count = 0;
-
-	/* construct control elements based on received transports */
-	for (i = 0; i < ctl->transports_count; i++) {
 
-		struct ba_msg_transport *transport = &ctl->transports[i];
-		struct ba_msg_device *device = NULL;
-		size_t ii;
-
-		/* get device structure for given transport */
-		for (ii = 0; ii < ctl->devices_count; ii++)
-			if (bacmp(&ctl->devices[ii].addr, &transport->addr) == 0) {
-				device = &ctl->devices[ii];
-				break;
-			}
+}
 
-		/* If the timing is right, the device list might not contain all devices.
-		 * It will happen, when between the get devices and get transports calls
-		 * a new BT device has been connected. */
-		if (device == NULL)
-			continue;
+/**
+ * Queue value change events for the given device and transport.
+ *
+ * @param ctl An address to the bluealsa ctl structure.
+ * @param device An address to the cached device structure.
+ * @param transport An address to the cached transport structure, or NULL
+ *   for device specific elements.
+ * @param device_old An address to the device state before the change.
+ * @param transport_old An address to the transport state before the
+ *   change, or NULL for device specific elements. */
+static void bluealsa_elems_update(struct bluealsa_ctl *ctl,
+		const struct ba_msg_device *device, const struct ba_msg_transport *transport,
+		struct ba_msg_device *device_old, struct ba_msg_transport *transport_old) {
 
-		switch (BA_PCM_TYPE(transport->type)) {
-		case BA_PCM_TYPE_NULL:
-			break;
+	size_t i;
 
-		case BA_PCM_TYPE_A2DP:
+	for (i = 0; i < ctl->elems_count; i++) {
 
-			ctl->elems[count].type = CTL_ELEM_TYPE_VOLUME;
-			ctl->elems[count].device = device;
-			ctl->elems[count].transport = transport;
-			ctl->elems[count].playback = transport->type & BA_PCM_STREAM_PLAYBACK;
-			bluealsa_set_elem_name(&ctl->elems[count], -1);
-			count++;
+		const struct ctl_elem *elem = &ctl->elems[i];
+		struct ctl_elem tmp = *elem;
 
-			ctl->elems[count].type = CTL_ELEM_TYPE_SWITCH;
-			ctl->elems[count].device = device;
-			ctl->elems[count].transport = transport;
-			ctl->elems[count].playback = transport->type & BA_PCM_STREAM_PLAYBACK;
-			bluealsa_set_elem_name(&ctl->elems[count], -1);
-			count++;
+		if (elem->fresh || elem->device != device || elem->transport != transport)
+			continue;
 
-			break;
+		tmp.device = device_old;
+		tmp.transport = transport_old;
+		if (bluealsa_ctl_elem_cmp(elem, &tmp) > 0)
+			bluealsa_queue_update(ctl, elem->name, SND_CTL_EVENT_MASK_VALUE);
 
-		case BA_PCM_TYPE_SCO:
+	}
 
-			if (ctl->transports[i].codec == 0)
-				break;
+}
 
-			ctl->elems[count].type = CTL_ELEM_TYPE_VOLUME;
-			ctl->elems[count].device = device;
-			ctl->elems[count].transport = transport;
-			ctl->elems[count].playback = true;
-			bluealsa_set_elem_name(&ctl->elems[count], -1);
-			count++;
-
-			ctl->elems[count].type = CTL_ELEM_TYPE_SWITCH;
-			ctl->elems[count].device = device;
-			ctl->elems[count].transport = transport;
-			ctl->elems[count].playback = true;
-			bluealsa_set_elem_name(&ctl->elems[count], -1);
-			count++;
-
-			ctl->elems[count].type = CTL_ELEM_TYPE_VOLUME;
-			ctl->elems[count].device = device;
-			ctl->elems[count].transport = transport;
-			ctl->elems[count].playback = false;
-			bluealsa_set_elem_name(&ctl->elems[count], -1);
-			count++;
-
-			ctl->elems[count].type = CTL_ELEM_TYPE_SWITCH;
-			ctl->elems[count].device = device;
-			ctl->elems[count].transport = transport;
-			ctl->elems[count].playback = false;
-			bluealsa_set_elem_name(&ctl->elems[count], -1);
-			count++;
+/**
+ * Sort control elements and regenerate their names.
+ *
+ * Elements which have been added or renamed are announced with the update
+ * events. This function shall be called after every cache modification. */
+static void bluealsa_elems_commit(struct bluealsa_ctl *ctl) {
+
+	/* Elements are appended to the end of the list, so the list has to be
+	 * sorted only if something was added. Removal retains the order. */
+	if (ctl->elems_sort) {
+		qsort(ctl->elems, ctl->elems_count, sizeof(*ctl->elems), bluealsa_ctl_elem_key_cmp);
+		ctl->elems_sort = false;
+	}
 
-			break;
+	if (!ctl->elems_rename || ctl->elems_count == 0)
+		return;
 
-		}
+	/* The number of elements depends on the server, so previous names are
+	 * stored on the heap. Upon failure, names will be regenerated with the
+	 * next commit. */
+	char (*names)[sizeof(ctl->elems->name)];
+	size_t i;
 
+	if ((names = malloc(sizeof(*names) * ctl->elems_count)) == NULL) {
+		SNDERR("Couldn't regenerate element names: %s", strerror(ENOMEM));
+		return;
 	}
 
-	/* construct device specific elements */
-	for (i = 0; i < ctl->devices_count; i++) {
-		/* add additional element for battery level */
-		if (ctl->battery && ctl->devices[i].battery) {
-			ctl->elems[count].type = CTL_ELEM_TYPE_BATTERY;
-			ctl->elems[count].device = &ctl->devices[i];
-			ctl->elems[count].transport = NULL;
-			ctl->elems[count].playback = true;
-			bluealsa_set_elem_name(&ctl->elems[count], -1);
-			count++;
-		}
+	for (i = 0; i < ctl->elems_count; i++) {
+		strcpy(names[i], ctl->elems[i].name);
+		bluealsa_set_elem_name(&ctl->elems[i], -1);
 	}
 
 	/* Detect element name duplicates and annotate them with the consecutive
@@ -384,7 +453,296 @@ static int bluealsa_elem_count(snd_ctl_ext_t *ext) {
 
 	}
 
-	return count;
+	for (i = 0; i < ctl->elems_count; i++) {
+		struct ctl_elem *elem = &ctl->elems[i];
+		if (elem->fresh)
+			bluealsa_queue_update(ctl, elem->name, SND_CTL_EVENT_MASK_ADD);
+		else if (strcmp(names[i], elem->name) != 0) {
+			bluealsa_queue_update(ctl, names[i], SND_CTL_EVENT_MASK_REMOVE);
+			bluealsa_queue_update(ctl, elem->name, SND_CTL_EVENT_MASK_ADD);
+		}
+		elem->fresh = false;
+	}
+
+	ctl->elems_rename = false;
+	free(names);
+
+}
+
+static struct ba_msg_device *bluealsa_cache_lookup_device(
+		const struct bluealsa_ctl *ctl, const bdaddr_t *addr) {
+
+	size_t i;
+
+	for (i = 0; i < ctl->devices_count; i++)
+		if (bacmp(&ctl->devices[i]->addr, addr) == 0)
+			return ctl->devices[i];
+
+	return NULL;
+}
+
+/**
+ * Lookup cached transport.
+ *
+ * Type of the SCO transport contains both stream directions, so a match
+ * on any stream direction is sufficient. */
+static struct ba_msg_transport *bluealsa_cache_lookup_transport(
+		const struct bluealsa_ctl *ctl, const bdaddr_t *addr, uint8_t type) {
+
+	const uint8_t mask = BA_PCM_STREAM_PLAYBACK | BA_PCM_STREAM_CAPTURE;
+	size_t i;
+
+	for (i = 0; i < ctl->transports_count; i++) {
+		struct ba_msg_transport *t = ctl->transports[i];
+		if (bacmp(&t->addr, addr) == 0 &&
+				BA_PCM_TYPE(t->type) == BA_PCM_TYPE(type) &&
+				t->type & type & mask)
+			return t;
+	}
+
+	return NULL;
+}
+
+static void bluealsa_cache_remove_transport(struct bluealsa_ctl *ctl,
+		struct ba_msg_transport *transport) {
+
+	size_t i;
+
+	for (i = 0; i < ctl->transports_count; i++)
+		if (ctl->transports[i] == transport) {
+			bluealsa_elems_remove(ctl,
+					bluealsa_cache_lookup_device(ctl, &transport->addr), transport);
+			memmove(&ctl->transports[i], &ctl->transports[i + 1],
+					sizeof(*ctl->transports) * (--ctl->transports_count - i));
+			free(transport);
+			return;
+		}
+
+}
+
+static void bluealsa_cache_remove_device(struct bluealsa_ctl *ctl,
+		struct ba_msg_device *device) {
+
+	size_t i;
+
+	for (i = ctl->transports_count; i > 0; i--)
+		if (bacmp(&ctl->transports[i - 1]->addr, &device->addr) == 0)
+			bluealsa_cache_remove_transport(ctl, ctl->transports[i - 1]);
+
+	bluealsa_elems_remove(ctl, device, NULL);
+
+	for (i = 0; i < ctl->devices_count; i++)
+		if (ctl->devices[i] == device) {
+			memmove(&ctl->devices[i], &ctl->devices[i + 1],
+					sizeof(*ctl->devices) * (--ctl->devices_count - i));
+			free(device);
+			break;
+		}
+
+	/* device ID numbers might have changed */
+	ctl->elems_rename = true;
+
+}
+
+/**
+ * Update (or insert) device in the cache.
+ *
+ * @return On success this function returns an address of the cached device
+ *   structure. Otherwise, NULL is returned. */
+static struct ba_msg_device *bluealsa_cache_update_device(struct bluealsa_ctl *ctl,
+		const struct ba_msg_device *device) {
+
+	struct ba_msg_device *d;
+	struct ba_msg_device old = { 0 };
+
+	if ((d = bluealsa_cache_lookup_device(ctl, &device->addr)) != NULL)
+		old = *d;
+	else {
+
+		struct ba_msg_device **tmp;
+		if ((tmp = realloc(ctl->devices, sizeof(*tmp) * (ctl->devices_count + 1))) == NULL)
+			return NULL;
+		ctl->devices = tmp;
+
+		if ((d = malloc(sizeof(*d))) == NULL)
+			return NULL;
+		ctl->devices[ctl->devices_count++] = d;
+
+	}
+
+	*d = *device;
+
+	if (strncmp(old.name, d->name, sizeof(d->name)) != 0)
+		ctl->elems_rename = true;
+
+	const bool battery_old = ctl->battery && old.battery;
+	const bool battery = ctl->battery && d->battery;
+
+	if (battery && !battery_old)
+		bluealsa_elem_add(ctl, CTL_ELEM_TYPE_BATTERY, d, NULL, true);
+	else if (!battery && battery_old)
+		bluealsa_elems_remove(ctl, d, NULL);
+	else if (battery)
+		bluealsa_elems_update(ctl, d, NULL, &old, NULL);
+
+	return d;
+}
+
+/**
+ * Update (or insert) transport in the cache. */
+static void bluealsa_cache_update_transport(struct bluealsa_ctl *ctl,
+		struct ba_msg_device *device, const struct ba_msg_transport *transport) {
+
+	struct ba_msg_transport *t;
+	struct ba_msg_transport old;
+
+	/* transports without audio stream (e.g. RFCOMM) are not cached */
+	if (BA_PCM_TYPE(transport->type) == BA_PCM_TYPE_NULL)
+		return;
+
+	if ((t = bluealsa_cache_lookup_transport(ctl, &transport->addr, transport->type)) == NULL) {
+
+		struct ba_msg_transport **tmp;
+		if ((tmp = realloc(ctl->transports, sizeof(*tmp) * (ctl->transports_count + 1))) == NULL)
+			return;
+		ctl->transports = tmp;
+
+		if ((t = malloc(sizeof(*t))) == NULL)
+			return;
+		ctl->transports[ctl->transports_count++] = t;
+
+		*t = *transport;
+		bluealsa_elems_add_transport(ctl, device, t);
+		return;
+	}
+
+	old = *t;
+	*t = *transport;
+
+	/* If element attributes have changed, re-create associated elements.
+	 * Otherwise, patch cached transport in place and report new values. */
+	if (old.channels != t->channels || (old.codec == 0) != (t->codec == 0)) {
+		bluealsa_elems_remove(ctl, device, t);
+		bluealsa_elems_add_transport(ctl, device, t);
+	}
+	else
+		bluealsa_elems_update(ctl, device, t, device, &old);
+
+}
+
+/**
+ * Synchronize cache with the server state.
+ *
+ * @return On success this function returns 0. Otherwise, negative error
+ *   code is returned. */
+static int bluealsa_cache_sync(struct bluealsa_ctl *ctl) {
+
+	struct ba_msg_device *devices;
+	struct ba_msg_transport *transports;
+	size_t devices_count, transports_count;
+	size_t i, ii;
+
+	/* get devices and transports within a single round trip */
+	if (bluealsa_get_snapshot(ctl->fd, &devices, &devices_count,
+				&transports, &transports_count) == -1)
+		return -errno;
+
+	/* remove entries which are no longer available */
+	for (i = ctl->transports_count; i > 0; i--) {
+		const struct ba_msg_transport *t = ctl->transports[i - 1];
+		for (ii = 0; ii < transports_count; ii++)
+			if (bacmp(&transports[ii].addr, &t->addr) == 0 &&
+					transports[ii].type == t->type)
+				break;
+		if (ii == transports_count)
+			bluealsa_cache_remove_transport(ctl, ctl->transports[i - 1]);
+	}
+	for (i = ctl->devices_count; i > 0; i--) {
+		const struct ba_msg_device *d = ctl->devices[i - 1];
+		for (ii = 0; ii < devices_count; ii++)
+			if (bacmp(&devices[ii].addr, &d->addr) == 0)
+				break;
+		if (ii == devices_count)
+			bluealsa_cache_remove_device(ctl, ctl->devices[i - 1]);
+	}
+
+	for (i = 0; i < devices_count; i++)
+		bluealsa_cache_update_device(ctl, &devices[i]);
+
+	for (i = 0; i < transports_count; i++) {
+		struct ba_msg_device *d;
+		/* The snapshot is taken atomically, so every transport should have its
+		 * device on the list. However, do not trust the server blindly. */
+		if ((d = bluealsa_cache_lookup_device(ctl, &transports[i].addr)) != NULL)
+			bluealsa_cache_update_transport(ctl, d, &transports[i]);
+	}
+
+	bluealsa_elems_commit(ctl);
+	ctl->synced = true;
+
+	free(devices);
+	free(transports);
+	return 0;
+}
+
+/**
+ * Patch cache with the state carried by the event payload. */
+static void bluealsa_cache_apply_event(struct bluealsa_ctl *ctl,
+		const struct ba_msg_event *event) {
+
+	struct ba_msg_device *d = bluealsa_cache_lookup_device(ctl, &event->addr);
+	struct ba_msg_transport *t;
+
+	if (event->events & BA_EVENT_TRANSPORT_REMOVED &&
+			(t = bluealsa_cache_lookup_transport(ctl, &event->addr, event->type)) != NULL)
+		bluealsa_cache_remove_transport(ctl, t);
+
+	/* missing device payload means, that device has been disconnected */
+	if (event->payload & BA_EVENT_PAYLOAD_DEVICE)
+		d = bluealsa_cache_update_device(ctl, &event->device);
+	else if (d != NULL) {
+		bluealsa_cache_remove_device(ctl, d);
+		d = NULL;
+	}
+
+	if (d != NULL && event->payload & BA_EVENT_PAYLOAD_TRANSPORT)
+		bluealsa_cache_update_transport(ctl, d, &event->transport);
+
+	bluealsa_elems_commit(ctl);
+
+}
+
+static void bluealsa_close(snd_ctl_ext_t *ext) {
+	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
+	size_t i;
+	close(ctl->fd);
+	close(ctl->event_fd);
+	for (i = 0; i < ctl->devices_count; i++)
+		free(ctl->devices[i]);
+	for (i = 0; i < ctl->transports_count; i++)
+		free(ctl->transports[i]);
+	free(ctl->devices);
+	free(ctl->transports);
+	free(ctl->elems);
+	free(ctl->updates);
+	free(ctl);
+}
+
+static int bluealsa_elem_count(snd_ctl_ext_t *ext) {
+	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
+
+	if (!ctl->synced) {
+
+		int ret;
+		if ((ret = bluealsa_cache_sync(ctl)) < 0)
+			return ret;
+
+		/* initial elements are enumerated, so there is no need to announce them */
+		ctl->updates_head = ctl->updates_count = 0;
+
+	}
+
+	return ctl->elems_count;
 }
 
 static int bluealsa_elem_list(snd_ctl_ext_t *ext, unsigned int offset, snd_ctl_elem_id_t *id) {
@@ -606,28 +964,27 @@ static void bluealsa_subscribe_events(snd_ctl_ext_t *ext, int subscribe) {
 static int bluealsa_read_event(snd_ctl_ext_t *ext, snd_ctl_elem_id_t *id, unsigned int *event_mask) {
 	struct bluealsa_ctl *ctl = (struct bluealsa_ctl *)ext->private_data;
 
-	if (ctl->updates_count) {
-		ctl->updates_count--;
+	if (ctl->updates_head < ctl->updates_count) {
+
+		const struct ctl_elem_update *update = &ctl->updates[ctl->updates_head++];
 
 		snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
-		snd_ctl_elem_id_set_name(id, ctl->updates[ctl->updates_count].name);
-		*event_mask = ctl->updates[ctl->updates_count].event_mask;
+		snd_ctl_elem_id_set_name(id, update->name);
+		*event_mask = update->event_mask;
 
-		if (ctl->updates_count == 0) {
-			free(ctl->updates);
-			ctl->updates = NULL;
-		}
+		if (ctl->updates_head == ctl->updates_count)
+			ctl->updates_head = ctl->updates_count = 0;
 
 		return 1;
 	}
 
 	struct ba_msg_event event;
-	ssize_t ret;
+	int ret;
 
 	/* This code reads events from the socket until the EAGAIN is returned.
 	 * Since EAGAIN is returned when operation would block (there is no more
 	 * data to read), we are compliant with the ALSA specification. */
-	while ((ret = recv(ctl->event_fd, &event, sizeof(event), MSG_DONTWAIT)) == -1 && errno == EINTR)
+	while ((ret = bluealsa_event_recv(ctl->event_fd, &event, MSG_DONTWAIT)) == -1 && errno == EINTR)
 		continue;
 	if (ret == -1)
 		return -errno;
@@ -644,55 +1001,14 @@ static int bluealsa_read_event(snd_ctl_ext_t *ext, snd_ctl_elem_id_t *id, unsign
 		return -ENODEV;
 	}
 
-	/* Save current control elements for later usage. The call to the
-	 * bluealsa_elem_count() will overwrite these pointers. */
-	struct ba_msg_device *devices = ctl->devices;
-	struct ba_msg_transport *transports = ctl->transports;
-	struct ctl_elem *elems = ctl->elems;
-	size_t count = ctl->elems_count;
-
-	if ((ret = bluealsa_elem_count(ext)) < 0)
+	/* If the event carries the current state, cached elements are patched in
+	 * place. Otherwise, we have to synchronize with the server. In both cases
+	 * update events are queued for elements which have been changed. */
+	if (ctl->event_payload)
+		bluealsa_cache_apply_event(ctl, &event);
+	else if ((ret = bluealsa_cache_sync(ctl)) < 0)
 		return ret;
 
-	/* This part is kinda tricky, however not very complicated. We are going
-	 * to allocate buffer, which will store references to our previous control
-	 * elements and to the new ones. Then, we are going to sort these elements
-	 * alphabetically by name - name acts as a unique identifier. Finally, we
-	 * are going to compare adjacent elements, and if names do match (the same
-	 * element), we will check if such an element should be marked for update.
-	 * Otherwise, element is added or removed. */
-
-	ctl->updates_count = count + ctl->elems_count;
-	ctl->updates = malloc(sizeof(*ctl->updates) * ctl->updates_count);
-
-	struct ctl_elem_update *_tmp = ctl->updates;
-	size_t i;
-
-	for (i = 0; i < count; i++, _tmp++) {
-		strcpy(_tmp->name, elems[i].name);
-		_tmp->event_mask = SND_CTL_EVENT_MASK_REMOVE;
-		_tmp->_elem = &elems[i];
-	}
-	for (i = 0; i < ctl->elems_count; i++, _tmp++) {
-		strcpy(_tmp->name, ctl->elems[i].name);
-		_tmp->event_mask = SND_CTL_EVENT_MASK_ADD;
-		_tmp->_elem = &ctl->elems[i];
-	}
-
-	qsort(ctl->updates, ctl->updates_count, sizeof(*ctl->updates), bluealsa_ctl_elem_update_cmp);
-
-	for (i = 0; i + 1 < ctl->updates_count; i++)
-		if (strcmp(ctl->updates[i].name, ctl->updates[i + 1].name) == 0) {
-			ctl->updates[i].event_mask = ctl->updates[i + 1].event_mask = 0;
-			if (bluealsa_ctl_elem_cmp(ctl->updates[i]._elem, ctl->updates[i + 1]._elem) != 0)
-				ctl->updates[i].event_mask = SND_CTL_EVENT_MASK_VALUE;
-			i++;
-		}
-
-	free(devices);
-	free(transports);
-	free(elems);
-
 	return bluealsa_read_event(ext, id, event_mask);
 }
 
@@ -752,8 +1068,9 @@ SND_CTL_PLUGIN_DEFINE_FUNC(bluealsa) {
 	if ((ctl = calloc(1, sizeof(*ctl))) == NULL)
 		return -ENOMEM;
 
+	uint32_t caps = BA_CAPABILITY_EVENT_PAYLOAD;
 	if ((ctl->fd = bluealsa_open(interface)) == -1 ||
-			(ctl->event_fd = bluealsa_open(interface)) == -1) {
+			(ctl->event_fd = bluealsa_open_caps(interface, &caps)) == -1) {
 		SNDERR("BlueALSA connection failed: %s", strerror(errno));
 		ret = -errno;
 		goto fail;
@@ -767,6 +1084,7 @@ SND_CTL_PLUGIN_DEFINE_FUNC(bluealsa) {
 	strncpy(ctl->ext.longname, "Bluetooth Audio Hub Controller", sizeof(ctl->ext.longname) - 1);
 	strncpy(ctl->ext.mixername, "BlueALSA Plugin", sizeof(ctl->ext.mixername) - 1);
 	ctl->battery = strcmp(battery, "yes") == 0;
+	ctl->event_payload = caps & BA_CAPABILITY_EVENT_PAYLOAD;
 
 	ctl->ext.callback = &bluealsa_snd_ctl_ext_callback;
 	ctl->ext.private_data = ctl;
@@ -30,6 +30,7 @@
 #include "shared/ctl-proto.h"
 #include "shared/defs.h"
 #include "shared/log.h"
+#include "shared/pcm-ring.h"
 #include "shared/rt.h"
 
 
@@ -47,6 +48,17 @@ struct bluealsa_pcm {
 	size_t pcm_buffer_size;
 	int pcm_fd;
 
+	/* Shared memory ring buffer. If the server supports it, PCM data are
+	 * transferred directly to/from the ring buffer - there is no FIFO nor
+	 * our IO thread. In such a case the pcm_fd is the server notification
+	 * eventfd and the event_fd is the client notification eventfd. */
+	bool shm;
+	struct ba_pcm_ring *ring;
+	uint32_t ring_size;
+	/* last seen ring position consumed by the server (playback) or
+	 * produced by the server (capture) */
+	uint32_t ring_ptr;
+
 	/* virtual hardware - ring buffer */
 	snd_pcm_uframes_t io_ptr;
 	pthread_t io_thread;
@@ -241,6 +253,14 @@ static int bluealsa_start(snd_pcm_ioplug_t *io) {
 		return -errno;
 	}
 
+	/* With the shared memory ring buffer there is nothing to start - the
+	 * server IO thread is the only one which paces the transfer. Just let
+	 * the server know, that the data are waiting in the ring. */
+	if (pcm->ring != NULL) {
+		eventfd_write(pcm->pcm_fd, 1);
+		return 0;
+	}
+
 	/* State has to be updated before the IO thread is created - if the state
 	 * does not indicate "running", the IO thread will be suspended until the
 	 * "resume" signal is delivered. This requirement is only (?) theoretical,
@@ -284,11 +304,79 @@ static int bluealsa_stop(snd_pcm_ioplug_t *io) {
 
 static snd_pcm_sframes_t bluealsa_pointer(snd_pcm_ioplug_t *io) {
 	struct bluealsa_pcm *pcm = io->private_data;
+
 	if (pcm->pcm_fd == -1)
 		return -ENODEV;
+
+	if (pcm->ring != NULL) {
+
+		struct ba_pcm_ring *ring = pcm->ring;
+		const bool playback = io->stream == SND_PCM_STREAM_PLAYBACK;
+		uint32_t pos = __atomic_load_n(playback ? &ring->tail : &ring->head, __ATOMIC_ACQUIRE);
+		int32_t delta = pos - pcm->ring_ptr;
+
+		if (ba_pcm_ring_closed(ring))
+			return -ENODEV;
+
+		/* Data left in the ring after the drop might be still consumed by
+		 * the server, so the position might be behind our pointer. */
+		if (delta < 0)
+			delta = 0;
+
+		/* update hardware pointer with whole frames only */
+		delta /= pcm->frame_size;
+		pcm->ring_ptr += delta * pcm->frame_size;
+		pcm->io_ptr = (pcm->io_ptr + delta) % io->buffer_size;
+
+		if (io->state == SND_PCM_STATE_RUNNING) {
+			/* server has consumed everything we have written */
+			if (playback && ba_pcm_ring_len_out(ring) == 0)
+				return -EPIPE;
+			/* server has produced more than we are able to store */
+			if (!playback && ba_pcm_ring_len_out(ring) > io->buffer_size * pcm->frame_size)
+				return -EPIPE;
+		}
+
+	}
+
 	return pcm->io_ptr;
 }
 
+/**
+ * Transfer PCM data directly to/from the shared memory ring buffer. */
+static snd_pcm_sframes_t bluealsa_transfer(snd_pcm_ioplug_t *io,
+		const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset,
+		snd_pcm_uframes_t size) {
+	struct bluealsa_pcm *pcm = io->private_data;
+	struct ba_pcm_ring *ring = pcm->ring;
+
+	if (ring == NULL || ba_pcm_ring_closed(ring))
+		return -ENODEV;
+
+	char *buffer = areas->addr + (areas->first + areas->step * offset) / 8;
+	size_t len = size * pcm->frame_size;
+	size_t avail;
+
+	if (io->stream == SND_PCM_STREAM_PLAYBACK) {
+		if ((avail = ba_pcm_ring_len_in(ring)) < len)
+			len = avail - avail % pcm->frame_size;
+		len = ba_pcm_ring_write(ring, buffer, len);
+		/* Notify server about new data, but only if the PCM is running.
+		 * Otherwise, data will be consumed before the start threshold
+		 * has been reached. */
+		if (len > 0 && (io->state == SND_PCM_STATE_RUNNING ||
+					io->state == SND_PCM_STATE_DRAINING))
+			eventfd_write(pcm->pcm_fd, 1);
+	}
+	else {
+		if ((avail = ba_pcm_ring_len_out(ring)) < len)
+			len = avail - avail % pcm->frame_size;
+		len = ba_pcm_ring_read(ring, buffer, len);
+	}
+
+	return len / pcm->frame_size;
+}
+
 static int bluealsa_close(snd_pcm_ioplug_t *io) {
 	struct bluealsa_pcm *pcm = io->private_data;
 	debug("Closing: %d", pcm->fd);
@@ -305,7 +393,42 @@ static int bluealsa_hw_params(snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *params)
 
 	pcm->frame_size = (snd_pcm_format_physical_width(io->format) * io->channels) / 8;
 
-	if ((pcm->pcm_fd = bluealsa_open_transport(pcm->fd, &pcm->transport)) == -1) {
+	if (pcm->shm) {
+
+		int fds[3];
+
+		if (bluealsa_open_transport_shm(pcm->fd, &pcm->transport,
+					io->buffer_size * pcm->frame_size, fds) == -1) {
+			debug("Couldn't open PCM ring buffer: %s", strerror(errno));
+			return -errno;
+		}
+
+		pcm->ring = ba_pcm_ring_map(fds[0], &pcm->ring_size);
+		close(fds[0]);
+
+		/* Replace our internal event file descriptor with the one signaled by
+		 * the server, so poll descriptors reported to the application stay
+		 * the same during the whole PCM lifetime. */
+		if (pcm->ring == NULL || dup2(fds[2], pcm->event_fd) == -1) {
+			int err = errno;
+			if (pcm->ring != NULL)
+				ba_pcm_ring_unmap(pcm->ring, pcm->ring_size);
+			pcm->ring = NULL;
+			close(fds[1]);
+			close(fds[2]);
+			return -err;
+		}
+
+		close(fds[2]);
+		pcm->pcm_fd = fds[1];
+		pcm->pcm_buffer_size = pcm->ring_size;
+		debug("Ring buffer size: %zd", pcm->pcm_buffer_size);
+
+		if (io->stream == SND_PCM_STREAM_PLAYBACK)
+			eventfd_write(pcm->event_fd, 1);
+
+	}
+	else if ((pcm->pcm_fd = bluealsa_open_transport(pcm->fd, &pcm->transport)) == -1) {
 		debug("Couldn't open PCM FIFO: %s", strerror(errno));
 		return -errno;
 	}
@@ -316,7 +439,7 @@ static int bluealsa_hw_params(snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *params)
 	if (io->stream == SND_PCM_STREAM_PLAYBACK)
 		eventfd_write(pcm->event_fd, 1);
 
-	if (pcm->io.stream == SND_PCM_STREAM_PLAYBACK) {
+	if (pcm->ring == NULL && pcm->io.stream == SND_PCM_STREAM_PLAYBACK) {
 		/* By default, the size of the pipe buffer is set to a too large value for
 		 * our purpose. On modern Linux system it is 65536 bytes. Large buffer in
 		 * the playback mode might contribute to an unnecessary audio delay. Since
@@ -338,6 +461,25 @@ static int bluealsa_hw_params(snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *params)
 static int bluealsa_hw_free(snd_pcm_ioplug_t *io) {
 	struct bluealsa_pcm *pcm = io->private_data;
 	debug("Freeing HW: %d", pcm->fd);
+
+	if (pcm->ring != NULL) {
+
+		/* let the server know that we are not going to use the ring */
+		ba_pcm_ring_close(pcm->ring);
+		eventfd_write(pcm->pcm_fd, 1);
+		ba_pcm_ring_unmap(pcm->ring, pcm->ring_size);
+		pcm->ring = NULL;
+
+		/* Detach our event file descriptor from the server one. Otherwise,
+		 * server might notify us about closed ring buffer. */
+		int fd;
+		if ((fd = eventfd(0, EFD_CLOEXEC)) != -1) {
+			dup2(fd, pcm->event_fd);
+			close(fd);
+		}
+
+	}
+
 	if (close_transport(pcm) == -1)
 		return -errno;
 	return 0;
@@ -361,6 +503,14 @@ static int bluealsa_prepare(snd_pcm_ioplug_t *io) {
 	pcm->io_hw_ptr = 0;
 	pcm->io_ptr = 0;
 
+	if (pcm->ring != NULL) {
+		/* Drop stale capture data. For playback, data left in the ring will
+		 * be dropped by the server upon the PCM_DROP request. */
+		if (io->stream == SND_PCM_STREAM_CAPTURE)
+			ba_pcm_ring_drop(pcm->ring);
+		pcm->ring_ptr = __atomic_load_n(&pcm->ring->head, __ATOMIC_ACQUIRE);
+	}
+
 	/* Indicate that our PCM is ready for i/o, even though is is not 100%
 	 * true - the IO thread is not running yet. Applications using
 	 * snd_pcm_sw_params_set_start_threshold() require PCM to be usable
@@ -385,7 +535,7 @@ static int bluealsa_pause(snd_pcm_ioplug_t *io, int enable) {
 				enable ? BA_COMMAND_PCM_PAUSE : BA_COMMAND_PCM_RESUME) == -1)
 		return -errno;
 
-	if (enable == 0) {
+	if (enable == 0 && pcm->io_started) {
 		io->state = SND_PCM_STATE_RUNNING;
 		pthread_kill(pcm->io_thread, SIGIO);
 	}
@@ -428,8 +578,10 @@ static int bluealsa_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp) {
 	/* bytes queued in the PCM ring buffer */
 	delay += io->appl_ptr - io->hw_ptr;
 
-	/* bytes queued in the FIFO buffer */
-	if (ioctl(pcm->pcm_fd, FIONREAD, &size) != -1)
+	/* bytes queued in the FIFO buffer (ring buffer data are already
+	 * accounted in the PCM ring buffer pointers) */
+	if (pcm->ring == NULL &&
+			ioctl(pcm->pcm_fd, FIONREAD, &size) != -1)
 		delay += size / pcm->frame_size;
 
 	/* On the server side, the delay stat will not be available until the PCM
@@ -493,6 +645,8 @@ static int bluealsa_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfd,
 
 		if (event & 0xDEAD0000)
 			goto fail;
+		if (pcm->ring != NULL && ba_pcm_ring_closed(pcm->ring))
+			goto fail;
 
 		/* Return POLLERR if PCM is suspended or xrun has occurred. */
 		if (io->state == SND_PCM_STATE_SUSPENDED ||
@@ -515,7 +669,8 @@ static int bluealsa_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfd,
 		 * never gets written to again.
 		 * To prevent this possibility, we bump the internal trigger. */
 		if (snd_pcm_stream(io->pcm) == SND_PCM_STREAM_PLAYBACK && (
-					!pcm->io_started || (io->state != SND_PCM_STATE_RUNNING &&
+					(pcm->ring == NULL && !pcm->io_started) ||
+					(io->state != SND_PCM_STATE_RUNNING &&
 						io->state != SND_PCM_STATE_DRAINING)))
 			eventfd_write(pcm->event_fd, 1);
 
@@ -537,6 +692,7 @@ static const snd_pcm_ioplug_callback_t bluealsa_callback = {
 	.start = bluealsa_start,
 	.stop = bluealsa_stop,
 	.pointer = bluealsa_pointer,
+	.transfer = bluealsa_transfer,
 	.close = bluealsa_close,
 	.hw_params = bluealsa_hw_params,
 	.hw_free = bluealsa_hw_free,
@@ -627,6 +783,7 @@ SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa) {
 	const char *profile = NULL;
 	struct bluealsa_pcm *pcm;
 	long delay = 0;
+	int shm = 0;
 	int ret;
 
 	snd_config_for_each(i, next, conf) {
@@ -669,6 +826,13 @@ SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa) {
 			}
 			continue;
 		}
+		if (strcmp(id, "shm") == 0) {
+			if ((shm = snd_config_get_bool(n)) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
 
 		SNDERR("Unknown field %s", id);
 		return -EINVAL;
@@ -695,12 +859,17 @@ SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa) {
 	pcm->pcm_fd = -1;
 	pcm->delay_ex = delay;
 
-	if ((pcm->fd = bluealsa_open(interface)) == -1) {
+	uint32_t capabilities = shm ? BA_CAPABILITY_PCM_SHM : 0;
+	if ((pcm->fd = bluealsa_open_caps(interface, &capabilities)) == -1) {
 		SNDERR("BlueALSA connection failed: %s", strerror(errno));
 		ret = -errno;
 		goto fail;
 	}
 
+	/* fall back to the FIFO if server does not support shared memory */
+	if ((pcm->shm = capabilities & BA_CAPABILITY_PCM_SHM) != shm)
+		SNDERR("BlueALSA shared memory not supported: Using FIFO");
+
 	if ((pcm->event_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
 		ret = -errno;
 		goto fail;
@@ -716,7 +885,9 @@ SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa) {
 	pcm->io.version = SND_PCM_IOPLUG_VERSION;
 	pcm->io.name = "BlueALSA";
 	pcm->io.flags = SND_PCM_IOPLUG_FLAG_LISTED;
-	pcm->io.mmap_rw = 1;
+	/* When the shared memory ring buffer is used, PCM data are transferred
+	 * with our transfer callback straight into the ring buffer. */
+	pcm->io.mmap_rw = !pcm->shm;
 	pcm->io.callback = &bluealsa_callback;
 	pcm->io.private_data = pcm;
 
@@ -1,6 +1,6 @@
 /*
  * BlueALSA - at.c
- * Copyright (c) 2016-2018 Arkadiusz Bokowy
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
  *               2017 Juha Kuikka
  *
  * This file is a part of bluez-alsa.
@@ -12,6 +12,7 @@
 #include "at.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -64,48 +65,55 @@ char *at_build(char *buffer, enum bt_at_type type, const char *command,
 /**
  * Parse AT message.
  *
+ * The input string is modified in place - the end of the message and the
+ * separator between the command and the value are overwritten with the
+ * null byte, and the command is converted to uppercase. Parsed command and
+ * value point into the input string.
+ *
+ * Empty messages (also the <LF> left over from the response which has been
+ * split between reads) are skipped, so this function might be used for the
+ * incremental parsing. If the input string does not contain the complete
+ * message, this function fails with the EAGAIN error. In such a case, one
+ * shall append more data to the input string and try once more.
+ *
  * @param str String to parse.
  * @param at Address of the AT structure, where the parsed information will
  *   be stored.
  * @return On success this function returns a pointer to the next message
  *   within the input string. If the input string contains only one message,
  *   returned value will point to the end null byte. On error, this function
- *   returns NULL. */
-char *at_parse(const char *str, struct bt_at *at) {
+ *   returns NULL and errno is set to indicate the error: EAGAIN - message
+ *   is not complete, EBADMSG - message is malformed. */
+char *at_parse(char *str, struct bt_at *at) {
 
-	char *command = at->command;
-	bool is_command = false;
-	const char *feed;
+	char *command;
+	char *feed;
 	char *tmp;
 
-	/* locate <CR> character, which indicates end of message */
-	if ((feed = strchr(str, '\r')) == NULL)
-		return NULL;
-
-	/* consume empty message */
-	if (feed == str)
-		return at_parse(feed + 1, at);
+	for (;;) {
 
-	/* check whether we are parsing AT command */
-	if (strncasecmp(str, "AT", 2) == 0) {
-		is_command = true;
-		str += 2;
-	}
-	else {
-		/* response starts with <LF> sequence */
-		if (str[0] != '\n')
+		/* locate <CR> character, which indicates end of message */
+		if ((feed = strchr(str, '\r')) == NULL) {
+			errno = EAGAIN;
 			return NULL;
-		str += 1;
-	}
+		}
 
-	strncpy(command, str, sizeof(at->command) - 1);
-	at->value = NULL;
+		/* consume empty message */
+		if (feed == str)
+			str = feed + 1;
+		else if (feed == str + 1 && str[0] == '\n')
+			str = feed + 1;
+		else
+			break;
 
-	/* check everything twice (we don't want to be hacked) */
-	if ((size_t)(feed - str) < sizeof(at->command))
-		command[feed - str] = '\0';
+	}
 
-	if (is_command) {
+	/* check whether we are parsing AT command */
+	if ((str[0] == 'A' || str[0] == 'a') && (str[1] == 'T' || str[1] == 't')) {
+
+		command = str + 2;
+		at->value = NULL;
+		*feed = '\0';
 
 		/* determine command type */
 		if ((tmp = strchr(command, '=')) != NULL) {
@@ -127,7 +135,15 @@ char *at_parse(const char *str, struct bt_at *at) {
 	}
 	else {
 
+		/* response starts with <LF> sequence */
+		if (str[0] != '\n') {
+			errno = EBADMSG;
+			return NULL;
+		}
+
+		command = str + 1;
 		at->type = AT_TYPE_RESP;
+		*feed = '\0';
 
 		if ((tmp = strchr(command, ':')) == NULL)
 			/* provide support for GSM standard */
@@ -138,9 +154,10 @@ char *at_parse(const char *str, struct bt_at *at) {
 			*tmp = '\0';
 		}
 		else {
-			/* unsolicited (with empty command) result code */
-			at->value = memmove(command + 1, command, sizeof(at->command) - 1);
-			command[0] = command[sizeof(at->command) - 1] = '\0';
+			/* Unsolicited (with empty command) result code. The command has
+			 * to be an empty string, so use the end of the message. */
+			at->value = command;
+			command = feed;
 		}
 
 		/* consume <LF> from the end of the response */
@@ -149,16 +166,16 @@ char *at_parse(const char *str, struct bt_at *at) {
 
 	}
 
+	at->command = command;
+
 	/* In the BT specification, all AT commands are in uppercase letters.
 	 * However, if someone will not respect this "convention", we will make
 	 * life easier by converting received command to all uppercase. */
-	while (*command != '\0') {
-		*command = toupper(*command);
-		command++;
-	}
+	for (tmp = command; *tmp != '\0'; tmp++)
+		*tmp = toupper(*tmp);
 
 	debug("AT message: %s: command:%s, value:%s", at_type2str(at->type), at->command, at->value);
-	return (char *)&feed[1];
+	return &feed[1];
 }
 
 /**
@@ -1,6 +1,6 @@
 /*
  * BlueALSA - at.c
- * Copyright (c) 2016-2017 Arkadiusz Bokowy
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
  *               2017 Juha Kuikka
  *
  * This file is a part of bluez-alsa.
@@ -24,15 +24,20 @@ enum bt_at_type {
 	__AT_TYPE_MAX
 };
 
+/**
+ * Parsed AT message.
+ *
+ * Both the command and the value point into the parsed buffer, which is
+ * modified in place. Hence, they are valid as long as the buffer is. */
 struct bt_at {
 	enum bt_at_type type;
-	char command[256];
+	char *command;
 	char *value;
 };
 
 char *at_build(char *buffer, enum bt_at_type type, const char *command,
 		const char *value);
-char *at_parse(const char *str, struct bt_at *at);
+char *at_parse(char *str, struct bt_at *at);
 int at_parse_cind(const char *str, enum hfp_ind map[20]);
 const char *at_type2str(enum bt_at_type type);
 
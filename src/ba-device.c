@@ -81,6 +81,14 @@ void ba_device_free(struct ba_device *d) {
 		ba_transport_free(t);
 	}
 
+	/* reconfiguration has not been completed */
+	if (d->a2dp_handover_timer != 0)
+		g_source_remove(d->a2dp_handover_timer);
+	if (d->a2dp_handover != NULL) {
+		transport_free_pcm(d->a2dp_handover);
+		free(d->a2dp_handover);
+	}
+
 	g_hash_table_unref(d->transports);
 	free(d);
 }
@@ -24,6 +24,8 @@
 
 #include "ba-adapter.h"
 
+struct ba_pcm;
+
 struct ba_device {
 
 	/* backward reference to adapter */
@@ -56,6 +58,14 @@ struct ba_device {
 	/* hash-map with connected transports */
 	GHashTable *transports;
 
+	/* PCM of the A2DP source transport which is being reconfigured with
+	 * another codec. It is handed over from the cleared transport to the
+	 * newly configured one, so the PCM client is not disconnected. */
+	struct ba_pcm *a2dp_handover;
+	/* timeout source which drops the handed over PCM if it has not been
+	 * taken over by the new transport in a timely manner */
+	unsigned int a2dp_handover_timer;
+
 };
 
 struct ba_device *ba_device_new(
@@ -14,7 +14,9 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -35,6 +37,54 @@
 #include "utils.h"
 #include "shared/log.h"
 
+/* Index of all transports by the D-Bus object path. The index has its own
+ * lock, so the lookup does not contend with the devices mutex. */
+static GHashTable *transports_index = NULL;
+static pthread_mutex_t transports_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Time in seconds after which the PCM handed over by the transport replaced
+ * due to the codec switch is dropped, if no transport has taken it over. */
+#define TRANSPORT_A2DP_HANDOVER_TIMEOUT 10
+
+/* Time in milliseconds for which the IO thread is waited for, when it is
+ * requested to free the PCM ring buffer. */
+#define TRANSPORT_PCM_FREE_TIMEOUT 500
+
+struct transport_a2dp_handover {
+	int hci_dev_id;
+	bdaddr_t addr;
+};
+
+/**
+ * Drop PCM which has not been taken over by any transport. */
+static gboolean transport_a2dp_handover_timeout(void *userdata) {
+
+	const struct transport_a2dp_handover *data = userdata;
+	const unsigned int id = g_source_get_id(g_main_current_source());
+	struct ba_adapter *a;
+	struct ba_device *d;
+
+	if ((a = ba_adapter_lookup(data->hci_dev_id)) == NULL)
+		return FALSE;
+
+	pthread_mutex_lock(&a->devices_mutex);
+
+	/* make sure that the PCM has not been taken over in the meantime */
+	if ((d = ba_device_lookup(a, &data->addr)) != NULL &&
+			d->a2dp_handover_timer == id) {
+		warn("Dropping PCM not taken over by any transport: %d", d->a2dp_handover->fd);
+		d->a2dp_handover_timer = 0;
+		transport_free_pcm(d->a2dp_handover);
+		free(d->a2dp_handover);
+		d->a2dp_handover = NULL;
+		bluealsa_ctl_send_event(a->ctl, BA_EVENT_TRANSPORT_REMOVED, &d->addr,
+				BA_PCM_TYPE_A2DP | BA_PCM_STREAM_PLAYBACK);
+	}
+
+	pthread_mutex_unlock(&a->devices_mutex);
+	return FALSE;
+}
+
 static int io_thread_create(struct ba_transport *t) {
 
 	void *(*routine)(void *) = NULL;
@@ -44,6 +94,9 @@ static int io_thread_create(struct ba_transport *t) {
 		routine = rfcomm_thread;
 	else if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_SCO)
 		routine = io_thread_sco;
+	else if (t->type.profile & BA_TRANSPORT_PROFILE_A2DP_SOURCE &&
+			t->a2dp.pcm.passthrough)
+		routine = io_thread_a2dp_source_passthrough;
 	else if (t->type.profile & BA_TRANSPORT_PROFILE_A2DP_SOURCE)
 		switch (t->type.codec) {
 		case A2DP_CODEC_SBC:
@@ -51,6 +104,7 @@ static int io_thread_create(struct ba_transport *t) {
 			break;
 #if ENABLE_MPEG
 		case A2DP_CODEC_MPEG12:
+			routine = io_thread_a2dp_source_mpeg;
 			break;
 #endif
 #if ENABLE_AAC
@@ -78,12 +132,23 @@ static int io_thread_create(struct ba_transport *t) {
 			break;
 #if ENABLE_MPEG
 		case A2DP_CODEC_MPEG12:
+			routine = io_thread_a2dp_sink_mpeg;
 			break;
 #endif
 #if ENABLE_AAC
 		case A2DP_CODEC_MPEG24:
 			routine = io_thread_a2dp_sink_aac;
 			break;
+#endif
+#if ENABLE_APTX && HAVE_APTX_DECODE
+		case A2DP_CODEC_VENDOR_APTX:
+			routine = io_thread_a2dp_sink_aptx;
+			break;
+#endif
+#if ENABLE_LDAC && HAVE_LDAC_DECODE
+		case A2DP_CODEC_VENDOR_LDAC:
+			routine = io_thread_a2dp_sink_ldac;
+			break;
 #endif
 		default:
 			warn("Codec not supported: %u", t->type.codec);
@@ -131,6 +196,7 @@ struct ba_transport *transport_new(
 	t->type = type;
 
 	pthread_mutex_init(&t->mutex, NULL);
+	pthread_cond_init(&t->pcm_freed, NULL);
 
 	t->state = TRANSPORT_IDLE;
 	t->thread = config.main_thread;
@@ -148,6 +214,13 @@ struct ba_transport *transport_new(
 		goto fail;
 
 	g_hash_table_insert(device->transports, t->dbus_path, t);
+
+	pthread_mutex_lock(&transports_index_mutex);
+	if (transports_index == NULL)
+		transports_index = g_hash_table_new(g_str_hash, g_str_equal);
+	g_hash_table_insert(transports_index, t->dbus_path, t);
+	pthread_mutex_unlock(&transports_index_mutex);
+
 	return t;
 
 fail:
@@ -180,8 +253,8 @@ struct ba_transport *transport_new_a2dp(
 	if ((t = transport_new(device, type, dbus_owner, dbus_path)) == NULL)
 		return NULL;
 
-	t->a2dp.ch1_volume = 127;
-	t->a2dp.ch2_volume = 127;
+	__atomic_store_n(&t->a2dp.ch1_volume, 127, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->a2dp.ch2_volume, 127, __ATOMIC_RELAXED);
 
 	if (cconfig_size > 0) {
 		t->a2dp.cconfig = malloc(cconfig_size);
@@ -191,13 +264,31 @@ struct ba_transport *transport_new_a2dp(
 
 	t->a2dp.pcm.fd = -1;
 	t->a2dp.pcm.client = -1;
+	t->a2dp.pcm.ring_fd = -1;
 	pthread_mutex_init(&t->a2dp.drained_mtx, NULL);
 	pthread_cond_init(&t->a2dp.drained, NULL);
 
 	t->acquire = transport_acquire_bt_a2dp;
 	t->release = transport_release_bt_a2dp;
 
-	bluealsa_ctl_send_event(device->a->ctl, BA_EVENT_TRANSPORT_ADDED, &device->addr,
+	enum ba_event event = BA_EVENT_TRANSPORT_ADDED;
+
+	/* Take over the PCM of the transport which has been replaced due to the
+	 * codec switch. From the client point of view, the transport has only
+	 * been changed, so do not announce it as a new one. */
+	if (type.profile == BA_TRANSPORT_PROFILE_A2DP_SOURCE &&
+			device->a2dp_handover != NULL) {
+		debug("Taking over PCM: %d", device->a2dp_handover->fd);
+		t->a2dp.pcm = *device->a2dp_handover;
+		free(device->a2dp_handover);
+		device->a2dp_handover = NULL;
+		if (device->a2dp_handover_timer != 0)
+			g_source_remove(device->a2dp_handover_timer);
+		device->a2dp_handover_timer = 0;
+		event = BA_EVENT_TRANSPORT_CHANGED;
+	}
+
+	bluealsa_ctl_send_event(device->a->ctl, event, &device->addr,
 			BA_PCM_TYPE_A2DP | (type.profile == BA_TRANSPORT_PROFILE_A2DP_SOURCE ?
 				BA_PCM_STREAM_PLAYBACK : BA_PCM_STREAM_CAPTURE));
 
@@ -254,9 +345,11 @@ struct ba_transport *transport_new_sco(
 
 	t->sco.spk_pcm.fd = -1;
 	t->sco.spk_pcm.client = -1;
+	t->sco.spk_pcm.ring_fd = -1;
 
 	t->sco.mic_pcm.fd = -1;
 	t->sco.mic_pcm.client = -1;
+	t->sco.mic_pcm.ring_fd = -1;
 
 	pthread_mutex_init(&t->sco.spk_drained_mtx, NULL);
 	pthread_cond_init(&t->sco.spk_drained, NULL);
@@ -280,6 +373,39 @@ struct ba_transport *ba_transport_lookup(
 	return g_hash_table_lookup(device->transports, dbus_path);
 }
 
+/**
+ * Lookup transport by the D-Bus object path.
+ *
+ * This function does not require the devices mutex. Instead, upon success
+ * the transport index is kept locked, so the transport can not be freed in
+ * the meantime. The lock shall be released with ba_transport_index_unlock()
+ * as soon as possible. Note, that while holding the index lock, acquiring
+ * the devices mutex is not allowed.
+ *
+ * @param dbus_path D-Bus object path of the transport.
+ * @return On success this function returns the transport. Otherwise, NULL
+ *   is returned and the index is not locked. */
+struct ba_transport *ba_transport_index_lookup(const char *dbus_path) {
+
+	struct ba_transport *t = NULL;
+
+	pthread_mutex_lock(&transports_index_mutex);
+
+	if (transports_index != NULL)
+		t = g_hash_table_lookup(transports_index, dbus_path);
+
+	if (t == NULL)
+		pthread_mutex_unlock(&transports_index_mutex);
+
+	return t;
+}
+
+/**
+ * Release the lock acquired by the ba_transport_index_lookup(). */
+void ba_transport_index_unlock(void) {
+	pthread_mutex_unlock(&transports_index_mutex);
+}
+
 void ba_transport_free(struct ba_transport *t) {
 
 	if (t == NULL || t->state == TRANSPORT_LIMBO)
@@ -288,12 +414,23 @@ void ba_transport_free(struct ba_transport *t) {
 	t->state = TRANSPORT_LIMBO;
 	debug("Freeing transport: %s", ba_transport_type_to_string(t->type));
 
+	/* Remove transport from the index before anything else, so the lock-free
+	 * property updates will not touch resources which are about to be freed.
+	 * The transport might not be indexed if the transport_new() has failed. */
+	pthread_mutex_lock(&transports_index_mutex);
+	if (transports_index != NULL && t->dbus_path != NULL &&
+			g_hash_table_lookup(transports_index, t->dbus_path) == t)
+		g_hash_table_remove(transports_index, t->dbus_path);
+	pthread_mutex_unlock(&transports_index_mutex);
+
 	/* If the transport is active, prior to releasing resources, we have to
 	 * terminate the IO thread (or at least make sure it is not running any
 	 * more). Not doing so might result in an undefined behavior or even a
 	 * race condition (closed and reused file descriptor). */
 	transport_pthread_cancel(t->thread);
 
+	ba_capture_free(t->capture);
+
 	/* if possible, try to release resources gracefully */
 	if (t->release != NULL)
 		t->release(t);
@@ -306,6 +443,7 @@ void ba_transport_free(struct ba_transport *t) {
 		close(t->sig_fd[1]);
 
 	pthread_mutex_destroy(&t->mutex);
+	pthread_cond_destroy(&t->pcm_freed);
 
 	unsigned int pcm_type = BA_PCM_TYPE_NULL;
 	struct ba_device *d = t->d;
@@ -320,15 +458,37 @@ void ba_transport_free(struct ba_transport *t) {
 		pcm_type = BA_PCM_TYPE_SCO | BA_PCM_STREAM_PLAYBACK | BA_PCM_STREAM_CAPTURE;
 		pthread_mutex_destroy(&t->sco.spk_drained_mtx);
 		pthread_cond_destroy(&t->sco.spk_drained);
-		transport_release_pcm(&t->sco.spk_pcm);
-		transport_release_pcm(&t->sco.mic_pcm);
+		transport_free_pcm(&t->sco.spk_pcm);
+		transport_free_pcm(&t->sco.mic_pcm);
 		if (t->sco.rfcomm != NULL)
 			t->sco.rfcomm->rfcomm.sco = NULL;
 	}
 	else if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_A2DP) {
 		pcm_type = BA_PCM_TYPE_A2DP | (t->type.profile == BA_TRANSPORT_PROFILE_A2DP_SOURCE ?
 				BA_PCM_STREAM_PLAYBACK : BA_PCM_STREAM_CAPTURE);
-		transport_release_pcm(&t->a2dp.pcm);
+		/* The IO thread has been terminated already, so the PCM can be safely
+		 * moved to the device. It will be taken over by the next transport,
+		 * which is not a new one from the client point of view. */
+		if (t->a2dp.handover && t->a2dp.pcm.fd != -1 && d->a2dp_handover == NULL &&
+				(d->a2dp_handover = malloc(sizeof(*d->a2dp_handover))) != NULL) {
+			debug("Handing over PCM: %d", t->a2dp.pcm.fd);
+			*d->a2dp_handover = t->a2dp.pcm;
+			t->a2dp.pcm.fd = -1;
+			t->a2dp.pcm.client = -1;
+			t->a2dp.pcm.ring = NULL;
+			t->a2dp.pcm.ring_fd = -1;
+			t->a2dp.pcm.output = NULL;
+			pcm_type = BA_PCM_TYPE_NULL;
+			struct transport_a2dp_handover *data;
+			if ((data = malloc(sizeof(*data))) != NULL) {
+				data->hci_dev_id = d->a->hci_dev_id;
+				data->addr = d->addr;
+				d->a2dp_handover_timer = g_timeout_add_seconds_full(G_PRIORITY_DEFAULT,
+						TRANSPORT_A2DP_HANDOVER_TIMEOUT, transport_a2dp_handover_timeout,
+						data, free);
+			}
+		}
+		transport_free_pcm(&t->a2dp.pcm);
 		pthread_mutex_destroy(&t->a2dp.drained_mtx);
 		pthread_cond_destroy(&t->a2dp.drained);
 		free(t->a2dp.cconfig);
@@ -349,6 +509,51 @@ int transport_send_signal(struct ba_transport *t, enum ba_transport_signal sig)
 	return write(t->sig_fd[1], &sig, sizeof(sig));
 }
 
+/**
+ * Free ring buffer of the released PCM. */
+static void transport_free_pcm_ring(struct ba_pcm *pcm) {
+	if (pcm->fd == -1 && pcm->ring != NULL) {
+		debug("Freeing PCM ring buffer: %p", pcm->ring);
+		ba_pcm_ring_unmap(pcm->ring, pcm->ring_size);
+		pcm->ring = NULL;
+	}
+}
+
+/**
+ * Receive signal sent to the transport IO thread.
+ *
+ * This function shall be called by the IO thread only. Requests which are
+ * common for all IO threads are handled here, so the IO thread is required
+ * only to dispatch the remaining ones. */
+enum ba_transport_signal transport_recv_signal(struct ba_transport *t) {
+
+	enum ba_transport_signal sig = -1;
+	int oldstate;
+
+	if (read(t->sig_fd[0], &sig, sizeof(sig)) != sizeof(sig))
+		warn("Couldn't read signal: %s", strerror(errno));
+
+	if (sig == TRANSPORT_PCM_FREE) {
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+		pthread_mutex_lock(&t->mutex);
+
+		if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_A2DP)
+			transport_free_pcm_ring(&t->a2dp.pcm);
+		else if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_SCO) {
+			transport_free_pcm_ring(&t->sco.spk_pcm);
+			transport_free_pcm_ring(&t->sco.mic_pcm);
+		}
+
+		pthread_cond_broadcast(&t->pcm_freed);
+		pthread_mutex_unlock(&t->mutex);
+		pthread_setcancelstate(oldstate, NULL);
+
+	}
+
+	return sig;
+}
+
 int transport_send_rfcomm(struct ba_transport *t, const char command[32]) {
 
 	char msg[sizeof(enum ba_transport_signal) + 32];
@@ -623,35 +828,27 @@ int transport_drain_pcm(struct ba_transport *t) {
 	return 0;
 }
 
-static int transport_acquire_bt_a2dp(struct ba_transport *t) {
+/**
+ * Set up the BT link of the A2DP transport with the Acquire reply. */
+static int transport_acquire_bt_a2dp_reply(struct ba_transport *t,
+		GDBusMessage *rep, GError **err) {
 
-	GDBusMessage *msg, *rep;
 	GUnixFDList *fd_list;
-	GError *err = NULL;
-
-	/* Check whether transport is already acquired - keep-alive mode. */
-	if (t->bt_fd != -1) {
-		debug("Reusing transport: %d", t->bt_fd);
-		goto final;
-	}
-
-	msg = g_dbus_message_new_method_call(t->dbus_owner, t->dbus_path, BLUEZ_IFACE_MEDIA_TRANSPORT,
-			t->state == TRANSPORT_PENDING ? "TryAcquire" : "Acquire");
-
-	if ((rep = g_dbus_connection_send_message_with_reply_sync(config.dbus, msg,
-					G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL, &err)) == NULL)
-		goto fail;
+	int fd;
 
 	if (g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR) {
-		g_dbus_message_to_gerror(rep, &err);
-		goto fail;
+		g_dbus_message_to_gerror(rep, err);
+		return -1;
 	}
 
-	g_variant_get(g_dbus_message_get_body(rep), "(hqq)", (int32_t *)&t->bt_fd,
+	g_variant_get(g_dbus_message_get_body(rep), "(hqq)", (int32_t *)&fd,
 			(uint16_t *)&t->mtu_read, (uint16_t *)&t->mtu_write);
 
 	fd_list = g_dbus_message_get_unix_fd_list(rep);
-	t->bt_fd = g_unix_fd_list_get(fd_list, 0, &err);
+	if ((fd = g_unix_fd_list_get(fd_list, 0, err)) == -1)
+		return -1;
+
+	t->bt_fd = fd;
 
 	/* Minimize audio delay and increase responsiveness (seeking, stopping) by
 	 * decreasing the BT socket output buffer. We will use a tripled write MTU
@@ -664,6 +861,28 @@ static int transport_acquire_bt_a2dp(struct ba_transport *t) {
 		warn("Couldn't get socket queued bytes: %s", strerror(errno));
 
 	debug("New transport: %d (MTU: R:%zu W:%zu)", t->bt_fd, t->mtu_read, t->mtu_write);
+	return t->bt_fd;
+}
+
+static int transport_acquire_bt_a2dp(struct ba_transport *t) {
+
+	GDBusMessage *msg, *rep;
+	GError *err = NULL;
+
+	/* Check whether transport is already acquired - keep-alive mode. */
+	if (t->bt_fd != -1) {
+		debug("Reusing transport: %d", t->bt_fd);
+		goto final;
+	}
+
+	msg = g_dbus_message_new_method_call(t->dbus_owner, t->dbus_path, BLUEZ_IFACE_MEDIA_TRANSPORT,
+			t->state == TRANSPORT_PENDING ? "TryAcquire" : "Acquire");
+
+	if ((rep = g_dbus_connection_send_message_with_reply_sync(config.dbus, msg,
+					G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL, &err)) == NULL)
+		goto fail;
+
+	transport_acquire_bt_a2dp_reply(t, rep, &err);
 
 fail:
 	g_object_unref(msg);
@@ -678,6 +897,81 @@ final:
 	return t->bt_fd;
 }
 
+static void transport_acquire_bt_a2dp_async_finish(GObject *source,
+		GAsyncResult *result, void *userdata) {
+
+	char *dbus_path = userdata;
+	struct ba_transport *t;
+	GDBusMessage *rep;
+	GError *err = NULL;
+
+	if ((rep = g_dbus_connection_send_message_with_reply_finish(
+					G_DBUS_CONNECTION(source), result, &err)) == NULL)
+		goto fail;
+
+	/* The transport might have been removed while we were waiting for the
+	 * reply. In such case, the file descriptor will be closed together with
+	 * the reply message. */
+	if ((t = ba_transport_index_lookup(dbus_path)) == NULL) {
+		debug("Acquired transport has been removed: %s", dbus_path);
+		goto fail;
+	}
+
+	pthread_mutex_lock(&t->mutex);
+	if (t->bt_fd == -1)
+		transport_acquire_bt_a2dp_reply(t, rep, &err);
+	else
+		debug("Reusing transport: %d", t->bt_fd);
+	pthread_mutex_unlock(&t->mutex);
+
+	ba_transport_index_unlock();
+
+fail:
+	if (rep != NULL)
+		g_object_unref(rep);
+	if (err != NULL) {
+		error("Couldn't acquire transport: %s", err->message);
+		g_error_free(err);
+	}
+	free(dbus_path);
+}
+
+/**
+ * Acquire the A2DP transport without blocking the caller.
+ *
+ * This function might be called from the GLib main loop, in which case the
+ * synchronous acquisition would block the dispatching of all other D-Bus
+ * messages until the reply from BlueZ is received. Upon reply, the transport
+ * is looked up by its D-Bus object path, so it is safe to call this function
+ * with the transport which might be removed in the meantime.
+ *
+ * @param t Pointer to the A2DP transport structure.
+ * @return On success this function returns 0. Otherwise -1 is returned and
+ *   errno is set to indicate the error. */
+int transport_acquire_bt_a2dp_async(struct ba_transport *t) {
+
+	GDBusMessage *msg;
+	char *dbus_path;
+
+	if (t->bt_fd != -1) {
+		debug("Reusing transport: %d", t->bt_fd);
+		return 0;
+	}
+
+	if ((dbus_path = strdup(t->dbus_path)) == NULL)
+		return -1;
+
+	msg = g_dbus_message_new_method_call(t->dbus_owner, t->dbus_path,
+			BLUEZ_IFACE_MEDIA_TRANSPORT, "Acquire");
+
+	g_dbus_connection_send_message_with_reply(config.dbus, msg,
+			G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL,
+			transport_acquire_bt_a2dp_async_finish, dbus_path);
+
+	g_object_unref(msg);
+	return 0;
+}
+
 static int transport_release_bt_a2dp(struct ba_transport *t) {
 
 	GDBusMessage *msg = NULL, *rep = NULL;
@@ -820,10 +1114,80 @@ int transport_release_pcm(struct ba_pcm *pcm) {
 	pcm->fd = -1;
 	pcm->client = -1;
 
+	/* The ring buffer mapping is kept until the PCM is opened again or the
+	 * transport is freed, because our IO thread might still be using it. We
+	 * only mark the ring as closed and notify the client about that fact. */
+	if (pcm->ring != NULL) {
+		ba_pcm_ring_close(pcm->ring);
+		eventfd_write(pcm->ring_fd, 0xDEAD0000);
+		close(pcm->ring_fd);
+		pcm->ring_fd = -1;
+	}
+
 	pthread_setcancelstate(oldstate, NULL);
 	return 0;
 }
 
+/**
+ * Release PCM and free associated ring buffer.
+ *
+ * This function shall be called only when the transport IO thread is not
+ * running, or when the PCM is not used by it anymore. */
+void transport_free_pcm(struct ba_pcm *pcm) {
+	transport_release_pcm(pcm);
+	if (pcm->ring != NULL) {
+		ba_pcm_ring_unmap(pcm->ring, pcm->ring_size);
+		pcm->ring = NULL;
+	}
+}
+
+/**
+ * Release PCM and free associated ring buffer in a synchronous manner.
+ *
+ * The ring buffer might be used by the running IO thread, so it can not be
+ * unmapped behind its back. In such a case the IO thread is requested to
+ * free the ring buffer by itself and this function waits until it is done
+ * or the IO thread exits. This function shall be called with the transport
+ * mutex locked.
+ *
+ * Since the caller might hold other locks as well (e.g. the devices mutex),
+ * the wait is bounded with the TRANSPORT_PCM_FREE_TIMEOUT. On timeout, the
+ * ring buffer is left to be freed by the IO thread later.
+ *
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to ETIMEDOUT. */
+int transport_free_pcm_sync(struct ba_transport *t, struct ba_pcm *pcm) {
+
+	transport_release_pcm(pcm);
+
+	if (pcm->ring != NULL &&
+			!pthread_equal(t->thread, config.main_thread) &&
+			!pthread_equal(t->thread, pthread_self())) {
+
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += TRANSPORT_PCM_FREE_TIMEOUT / 1000;
+		ts.tv_nsec += (TRANSPORT_PCM_FREE_TIMEOUT % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_nsec -= 1000000000;
+			ts.tv_sec++;
+		}
+
+		transport_send_signal(t, TRANSPORT_PCM_FREE);
+		while (pcm->ring != NULL && !pthread_equal(t->thread, config.main_thread))
+			if (pthread_cond_timedwait(&t->pcm_freed, &t->mutex, &ts) == ETIMEDOUT &&
+					pcm->ring != NULL && !pthread_equal(t->thread, config.main_thread)) {
+				warn("PCM ring buffer not freed by IO thread in time");
+				errno = ETIMEDOUT;
+				return -1;
+			}
+
+	}
+
+	transport_free_pcm(pcm);
+	return 0;
+}
+
 /**
  * Synchronous transport thread cancellation. */
 void transport_pthread_cancel(pthread_t thread) {
@@ -856,6 +1220,7 @@ void transport_pthread_cleanup(struct ba_transport *t) {
 	/* Make sure, that after termination, this thread handler will not
 	 * be used anymore. */
 	t->thread = config.main_thread;
+	pthread_cond_broadcast(&t->pcm_freed);
 
 	transport_pthread_cleanup_unlock(t);
 
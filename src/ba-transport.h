@@ -26,7 +26,10 @@
 
 #include "ba-device.h"
 #include "bluez.h"
+#include "capture.h"
 #include "hfp.h"
+#include "pcm-output.h"
+#include "shared/pcm-ring.h"
 
 #define BA_TRANSPORT_PROFILE_A2DP_SOURCE (1 << 0)
 #define BA_TRANSPORT_PROFILE_A2DP_SINK   (2 << 0)
@@ -71,6 +74,7 @@ enum ba_transport_signal {
 	TRANSPORT_PCM_RESUME,
 	TRANSPORT_PCM_SYNC,
 	TRANSPORT_PCM_DROP,
+	TRANSPORT_PCM_FREE,
 	TRANSPORT_SET_VOLUME,
 	TRANSPORT_SEND_RFCOMM,
 };
@@ -80,6 +84,37 @@ struct ba_pcm {
 	int fd;
 	/* associated client */
 	int client;
+	/* shared memory ring buffer (optional) */
+	struct ba_pcm_ring *ring;
+	/* The header of the ring buffer is writable by the client, so the size
+	 * of the mapped data area and our own position in the ring are kept
+	 * here, out of the client reach. */
+	uint32_t ring_size;
+	uint32_t ring_pos;
+	/* client notification eventfd used with the ring buffer */
+	int ring_fd;
+	/* built-in output used instead of the FIFO (optional) */
+	struct ba_pcm_output *output;
+	/* FIFO transfers encoded frames instead of PCM */
+	bool passthrough;
+};
+
+/**
+ * Transport statistics updated by the IO thread.
+ *
+ * Counters shall be accessed with relaxed atomic operations, so they can be
+ * read by other threads without locking. They are free-running and wrap
+ * around on overflow. */
+struct ba_transport_stats {
+	/* number of bytes and packets transferred over the BT link */
+	uint32_t bt_bytes;
+	uint32_t bt_packets;
+	/* number of lost RTP packets */
+	uint32_t rtp_lost;
+	/* CPU time spent in the audio codec in microseconds */
+	uint32_t codec_time;
+	/* the last known number of bytes queued in the BT socket */
+	uint32_t bt_queued;
 };
 
 struct ba_transport {
@@ -118,14 +153,32 @@ struct ba_transport {
 	 * control event. */
 	int sig_fd[2];
 
+	/* Condition signaled by the IO thread when it has freed released PCM
+	 * resources upon the TRANSPORT_PCM_FREE request, or when it has exited.
+	 * It shall be waited for with the transport mutex. */
+	pthread_cond_t pcm_freed;
+
 	/* Overall delay in 1/10 of millisecond, caused by the data transfer and
 	 * the audio encoder or decoder. */
 	unsigned int delay;
 
+	/* IO thread statistics */
+	struct ba_transport_stats stats;
+
+	/* Traffic capture (optional). This structure is allocated on the first
+	 * capture request and it is kept until the transport is freed, so the
+	 * IO thread can access it without any locking. */
+	struct ba_capture *capture;
+
 	union {
 
 		struct {
 
+			/* Volume and delay might be updated by the D-Bus signal handler
+			 * without holding the devices mutex, as soon as the transport is
+			 * added to the transport index. Hence, mute, volume and delay
+			 * fields shall be always accessed with atomic operations. */
+
 			/* if non-zero, equivalent of volume = 0 */
 			uint8_t ch1_muted;
 			uint8_t ch2_muted;
@@ -153,6 +206,10 @@ struct ba_transport {
 			pthread_mutex_t drained_mtx;
 			pthread_cond_t drained;
 
+			/* If true, the PCM will be handed over to the transport which
+			 * is going to replace this one, see the ba_device structure. */
+			bool handover;
+
 		} a2dp;
 
 		struct {
@@ -232,18 +289,25 @@ struct ba_transport *ba_transport_lookup(
 		struct ba_device *device,
 		const char *dbus_path);
 
+struct ba_transport *ba_transport_index_lookup(const char *dbus_path);
+void ba_transport_index_unlock(void);
+
 void ba_transport_free(struct ba_transport *t);
 
 int transport_send_signal(struct ba_transport *t, enum ba_transport_signal sig);
+enum ba_transport_signal transport_recv_signal(struct ba_transport *t);
 int transport_send_rfcomm(struct ba_transport *t, const char command[32]);
 
 unsigned int transport_get_channels(const struct ba_transport *t);
 unsigned int transport_get_sampling(const struct ba_transport *t);
 
 int transport_set_state(struct ba_transport *t, enum ba_transport_state state);
+int transport_acquire_bt_a2dp_async(struct ba_transport *t);
 
 int transport_drain_pcm(struct ba_transport *t);
 int transport_release_pcm(struct ba_pcm *pcm);
+void transport_free_pcm(struct ba_pcm *pcm);
+int transport_free_pcm_sync(struct ba_transport *t, struct ba_pcm *pcm);
 
 void transport_pthread_cancel(pthread_t thread);
 void transport_pthread_cleanup(struct ba_transport *t);
@@ -55,8 +55,16 @@ struct ba_config config = {
 	.a2dp.volume = false,
 	.a2dp.force_mono = false,
 	.a2dp.force_44100 = false,
+	.a2dp.policy = BA_A2DP_POLICY_QUALITY,
 	.a2dp.keep_alive = 0,
 
+#if ENABLE_MPEG
+	/* These are LAME defaults - a good trade-off between the encoding
+	 * speed and the quality of the output stream. */
+	.mpeg_quality = 5,
+	.mpeg_vbr_quality = 4,
+#endif
+
 #if ENABLE_AAC
 	/* There are two issues with the afterburner: a) it uses a LOT of power,
 	 * b) it generates larger payload. These two reasons are good enough to
@@ -29,10 +29,15 @@
 #include "bluez-a2dp.h"
 #include "shared/ctl-proto.h"
 
-struct ba_config {
+/* Policy of the A2DP codec configuration selection. */
+enum ba_a2dp_policy {
+	/* favor the highest audio quality */
+	BA_A2DP_POLICY_QUALITY,
+	/* favor low CPU usage and Bluetooth bandwidth */
+	BA_A2DP_POLICY_EFFICIENCY,
+};
 
-	/* used HCI device */
-	struct hci_dev_info hci_dev;
+struct ba_config {
 
 	/* set of enabled profiles */
 	struct {
@@ -87,13 +92,30 @@ struct ba_config {
 		 * to force lower sampling in order to save Bluetooth bandwidth. */
 		bool force_44100;
 
+		/* Policy used by the SelectConfiguration when choosing among the
+		 * configurations supported by the remote endpoint. Selected
+		 * configurations are cached, so every endpoint gets the same
+		 * configuration across reconnections. */
+		enum ba_a2dp_policy policy;
+
 		/* The number of seconds for keeping A2DP transport alive after PCM has
 		 * been closed. One might set this value to negative number for infinite
 		 * time. This option applies for the source profile only. */
 		int keep_alive;
 
+		/* Built-in PCM output for the sink profile in the "BACKEND[:ARGS]"
+		 * format. The output is used by one sink transport at a time - the
+		 * first one which has been started. Audio of other sink transports
+		 * is passed to the PCM FIFO, as if the output was not set. */
+		const char *sink_output;
+
 	} a2dp;
 
+#if ENABLE_MPEG
+	uint8_t mpeg_quality;
+	uint8_t mpeg_vbr_quality;
+#endif
+
 #if ENABLE_AAC
 	bool aac_afterburner;
 	uint8_t aac_vbr_mode;
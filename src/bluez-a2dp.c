@@ -62,7 +62,8 @@ static const a2dp_mpeg_t a2dp_mpeg = {
 		MPEG_CHANNEL_MODE_DUAL_CHANNEL |
 		MPEG_CHANNEL_MODE_STEREO |
 		MPEG_CHANNEL_MODE_JOINT_STEREO,
-	.mpf = 1,
+	/* NOTE: Media payload format 2 (RFC 3119) is not supported. */
+	.mpf = 0,
 	.frequency =
 		MPEG_SAMPLING_FREQ_16000 |
 		MPEG_SAMPLING_FREQ_22050 |
@@ -70,7 +71,7 @@ static const a2dp_mpeg_t a2dp_mpeg = {
 		MPEG_SAMPLING_FREQ_32000 |
 		MPEG_SAMPLING_FREQ_44100 |
 		MPEG_SAMPLING_FREQ_48000,
-	.bitrate =
+	MPEG_INIT_BITRATE(
 		MPEG_BIT_RATE_VBR |
 		MPEG_BIT_RATE_320000 |
 		MPEG_BIT_RATE_256000 |
@@ -86,7 +87,42 @@ static const a2dp_mpeg_t a2dp_mpeg = {
 		MPEG_BIT_RATE_48000 |
 		MPEG_BIT_RATE_40000 |
 		MPEG_BIT_RATE_32000 |
-		MPEG_BIT_RATE_FREE,
+		MPEG_BIT_RATE_FREE)
+};
+
+static const a2dp_mpeg_t a2dp_mpeg_mp3 = {
+	/* NOTE: LAME library can encode MPEG layer III only,
+	 *       and it does not support dual channel mode. */
+	.layer = MPEG_LAYER_MP3,
+	.crc = 1,
+	.channel_mode =
+		MPEG_CHANNEL_MODE_MONO |
+		MPEG_CHANNEL_MODE_STEREO |
+		MPEG_CHANNEL_MODE_JOINT_STEREO,
+	.mpf = 0,
+	.frequency =
+		MPEG_SAMPLING_FREQ_16000 |
+		MPEG_SAMPLING_FREQ_22050 |
+		MPEG_SAMPLING_FREQ_24000 |
+		MPEG_SAMPLING_FREQ_32000 |
+		MPEG_SAMPLING_FREQ_44100 |
+		MPEG_SAMPLING_FREQ_48000,
+	MPEG_INIT_BITRATE(
+		MPEG_BIT_RATE_VBR |
+		MPEG_BIT_RATE_320000 |
+		MPEG_BIT_RATE_256000 |
+		MPEG_BIT_RATE_224000 |
+		MPEG_BIT_RATE_192000 |
+		MPEG_BIT_RATE_160000 |
+		MPEG_BIT_RATE_128000 |
+		MPEG_BIT_RATE_112000 |
+		MPEG_BIT_RATE_96000 |
+		MPEG_BIT_RATE_80000 |
+		MPEG_BIT_RATE_64000 |
+		MPEG_BIT_RATE_56000 |
+		MPEG_BIT_RATE_48000 |
+		MPEG_BIT_RATE_40000 |
+		MPEG_BIT_RATE_32000)
 };
 
 static const struct bluez_a2dp_channel_mode a2dp_mpeg_channels[] = {
@@ -96,6 +132,12 @@ static const struct bluez_a2dp_channel_mode a2dp_mpeg_channels[] = {
 	{ BLUEZ_A2DP_CHM_JOINT_STEREO, MPEG_CHANNEL_MODE_JOINT_STEREO },
 };
 
+static const struct bluez_a2dp_channel_mode a2dp_mpeg_mp3_channels[] = {
+	{ BLUEZ_A2DP_CHM_MONO, MPEG_CHANNEL_MODE_MONO },
+	{ BLUEZ_A2DP_CHM_STEREO, MPEG_CHANNEL_MODE_STEREO },
+	{ BLUEZ_A2DP_CHM_JOINT_STEREO, MPEG_CHANNEL_MODE_JOINT_STEREO },
+};
+
 static const struct bluez_a2dp_sampling_freq a2dp_mpeg_samplings[] = {
 	{ 16000, MPEG_SAMPLING_FREQ_16000 },
 	{ 22050, MPEG_SAMPLING_FREQ_22050 },
@@ -230,10 +272,10 @@ static const struct bluez_a2dp_codec a2dp_codec_sink_sbc = {
 static const struct bluez_a2dp_codec a2dp_codec_source_mpeg = {
 	.dir = BLUEZ_A2DP_SOURCE,
 	.id = A2DP_CODEC_MPEG12,
-	.cfg = &a2dp_mpeg,
-	.cfg_size = sizeof(a2dp_mpeg),
-	.channels = a2dp_mpeg_channels,
-	.channels_size = ARRAYSIZE(a2dp_mpeg_channels),
+	.cfg = &a2dp_mpeg_mp3,
+	.cfg_size = sizeof(a2dp_mpeg_mp3),
+	.channels = a2dp_mpeg_mp3_channels,
+	.channels_size = ARRAYSIZE(a2dp_mpeg_mp3_channels),
 	.samplings = a2dp_mpeg_samplings,
 	.samplings_size = ARRAYSIZE(a2dp_mpeg_samplings),
 };
@@ -318,9 +360,15 @@ static const struct bluez_a2dp_codec a2dp_codec_sink_ldac = {
 static const struct bluez_a2dp_codec *a2dp_codecs[] = {
 #if ENABLE_LDAC
 	&a2dp_codec_source_ldac,
+# if HAVE_LDAC_DECODE
+	&a2dp_codec_sink_ldac,
+# endif
 #endif
 #if ENABLE_APTX
 	&a2dp_codec_source_aptx,
+# if HAVE_APTX_DECODE
+	&a2dp_codec_sink_aptx,
+# endif
 #endif
 #if ENABLE_AAC
 	&a2dp_codec_source_aac,
@@ -17,6 +17,7 @@
 
 #include <gio/gunixfdlist.h>
 
+#include "a2dp-cache.h"
 #include "a2dp-codecs.h"
 #include "ba-transport.h"
 #include "bluealsa.h"
@@ -24,13 +25,23 @@
 #include "bluez-iface.h"
 #include "ctl.h"
 #include "utils.h"
+#include "shared/defs.h"
 #include "shared/log.h"
+#include "shared/rt.h"
+
+/* Timeout in milliseconds of BlueZ calls made during the A2DP stream
+ * reconfiguration. These calls are made by the control thread, so they
+ * shall not block it for too long. */
+#define BLUEZ_A2DP_RECONFIGURE_TIMEOUT 5000
 
 /**
  * Structure describing registered D-Bus object. */
 struct dbus_object_data {
 	/* D-Bus object registration ID */
 	unsigned int id;
+	/* HCI device ID of the adapter for which the object has been registered,
+	 * or -1 if the object is not bound to any particular adapter */
+	int hci_dev_id;
 	struct ba_transport_type ttype;
 	/* determine whether profile is used */
 	bool connected;
@@ -38,9 +49,15 @@ struct dbus_object_data {
 
 static GHashTable *dbus_object_data_map = NULL;
 
+/* number of registration calls awaiting BlueZ reply */
+static unsigned int register_calls_pending = 0;
+/* time-stamp of the first call in the current registration batch */
+static struct timespec register_calls_ts;
+
 /**
- * Get D-Bus object reference count for given transport type. */
-static int bluez_get_dbus_object_count(struct ba_transport_type ttype) {
+ * Get D-Bus object reference count for given adapter and transport type. */
+static int bluez_get_dbus_object_count(const struct ba_adapter *a,
+		struct ba_transport_type ttype) {
 
 	GHashTableIter iter;
 	struct dbus_object_data *obj;
@@ -48,7 +65,8 @@ static int bluez_get_dbus_object_count(struct ba_transport_type ttype) {
 
 	g_hash_table_iter_init(&iter, dbus_object_data_map);
 	while (g_hash_table_iter_next(&iter, NULL, (gpointer)&obj))
-		if (obj->ttype.profile == ttype.profile &&
+		if (obj->hci_dev_id == a->hci_dev_id &&
+				obj->ttype.profile == ttype.profile &&
 				obj->ttype.codec == ttype.codec && obj->connected)
 			count++;
 
@@ -122,13 +140,22 @@ static bool bluez_a2dp_codec_check_sampling_freq(
 }
 
 /**
- * Select (best) channel mode configuration. */
+ * Select (best) channel mode configuration.
+ *
+ * If the number of channels is non-zero, only channel modes with such
+ * a number of channels are taken into account. */
 static unsigned int bluez_a2dp_codec_select_channel_mode(
 		const struct bluez_a2dp_codec *codec,
-		unsigned int capabilities) {
+		unsigned int capabilities,
+		unsigned int channels) {
 
 	size_t i;
 
+	if (channels != 0)
+		for (i = 0; i < codec->channels_size; i++)
+			if ((codec->channels[i].mode == BLUEZ_A2DP_CHM_MONO ? 1 : 2) != channels)
+				capabilities &= ~codec->channels[i].value;
+
 	/* If monophonic sound has been forced, check whether given codec supports
 	 * such a channel mode. Since mono channel mode shall be stored at index 0
 	 * we can simply check for its existence with a simple index lookup. */
@@ -146,14 +173,24 @@ static unsigned int bluez_a2dp_codec_select_channel_mode(
 }
 
 /**
- * Select (best) sampling frequency configuration. */
+ * Select (best) sampling frequency configuration.
+ *
+ * If the sampling frequency is non-zero, only such a frequency might be
+ * selected. */
 static unsigned int bluez_a2dp_codec_select_sampling_freq(
 		const struct bluez_a2dp_codec *codec,
-		unsigned int capabilities) {
+		unsigned int capabilities,
+		unsigned int sampling) {
 
 	size_t i;
 
-	if (config.a2dp.force_44100)
+	if (sampling != 0)
+		for (i = 0; i < codec->samplings_size; i++)
+			if ((unsigned int)codec->samplings[i].frequency != sampling)
+				capabilities &= ~codec->samplings[i].value;
+
+	if (config.a2dp.force_44100 ||
+			config.a2dp.policy == BA_A2DP_POLICY_EFFICIENCY)
 		for (i = 0; i < codec->samplings_size; i++)
 			if (codec->samplings[i].frequency == 44100) {
 				if (capabilities & codec->samplings[i].value)
@@ -161,6 +198,15 @@ static unsigned int bluez_a2dp_codec_select_sampling_freq(
 				break;
 			}
 
+	/* Most of the audio content is sampled at 44.1 kHz, so it does not
+	 * require resampling. Otherwise, favor the lowest frequency which is
+	 * still good enough for music playback. */
+	if (config.a2dp.policy == BA_A2DP_POLICY_EFFICIENCY)
+		for (i = 0; i < codec->samplings_size; i++)
+			if (codec->samplings[i].frequency >= 32000 &&
+					capabilities & codec->samplings[i].value)
+				return codec->samplings[i].value;
+
 	/* favor higher sampling frequencies */
 	for (i = codec->samplings_size; i > 0; i--)
 		if (capabilities & codec->samplings[i - 1].value)
@@ -169,6 +215,18 @@ static unsigned int bluez_a2dp_codec_select_sampling_freq(
 	return 0;
 }
 
+/**
+ * Get identifier of the configuration selection policy.
+ *
+ * Besides the policy itself, the identifier includes all options which
+ * affect the configuration selection, so cached configurations will not
+ * be used if any of these options has been changed. */
+static unsigned int bluez_a2dp_policy_id(void) {
+	return config.a2dp.policy |
+		(config.a2dp.force_mono << 4) |
+		(config.a2dp.force_44100 << 5);
+}
+
 /**
  * Set transport state using BlueZ state string. */
 static int bluez_a2dp_set_transport_state(
@@ -186,25 +244,24 @@ static int bluez_a2dp_set_transport_state(
 	return -1;
 }
 
-static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void *userdata) {
-
-	const char *endpoint_path = g_dbus_method_invocation_get_object_path(inv);
-	GVariant *params = g_dbus_method_invocation_get_parameters(inv);
-	const struct bluez_a2dp_codec *codec = userdata;
-
-	const uint8_t *data;
-	uint8_t *capabilities;
-	size_t size = 0;
-
-	params = g_variant_get_child_value(params, 0);
-	data = g_variant_get_fixed_array(params, &size, sizeof(uint8_t));
-	capabilities = g_memdup(data, size);
-	g_variant_unref(params);
-
-	if (size != codec->cfg_size) {
-		error("Invalid capabilities size: %zu != %zu", size, codec->cfg_size);
-		goto fail;
-	}
+/**
+ * Select A2DP codec configuration.
+ *
+ * @param codec Local A2DP codec.
+ * @param capabilities Capabilities of the remote endpoint. On success, this
+ *   buffer is overwritten with the selected configuration.
+ * @param channels If non-zero, the number of channels which shall be used
+ *   by the selected configuration.
+ * @param sampling If non-zero, the sampling frequency which shall be used
+ *   by the selected configuration.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to ENOTSUP for not supported codec or EINVAL if the
+ *   configuration could not be selected. */
+static int bluez_a2dp_select_configuration(
+		const struct bluez_a2dp_codec *codec,
+		void *capabilities,
+		unsigned int channels,
+		unsigned int sampling) {
 
 	switch (codec->id) {
 	case A2DP_CODEC_SBC: {
@@ -213,12 +270,12 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 		unsigned int cap_chm = cap->channel_mode;
 		unsigned int cap_freq = cap->frequency;
 
-		if ((cap->channel_mode = bluez_a2dp_codec_select_channel_mode(codec, cap_chm)) == 0) {
+		if ((cap->channel_mode = bluez_a2dp_codec_select_channel_mode(codec, cap_chm, channels)) == 0) {
 			error("No supported channel modes: %#x", cap_chm);
 			goto fail;
 		}
 
-		if ((cap->frequency = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq)) == 0) {
+		if ((cap->frequency = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq, sampling)) == 0) {
 			error("No supported sampling frequencies: %#x", cap_freq);
 			goto fail;
 		}
@@ -255,6 +312,9 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 		}
 
 		int bitpool = a2dp_sbc_default_bitpool(cap->frequency, cap->channel_mode);
+		if (config.a2dp.policy == BA_A2DP_POLICY_EFFICIENCY)
+			/* roughly the middle quality recommended by the A2DP specification */
+			bitpool = MAX(bitpool * 2 / 3, cap->min_bitpool);
 		cap->min_bitpool = MAX(SBC_MIN_BITPOOL, cap->min_bitpool);
 		cap->max_bitpool = MIN(bitpool, cap->max_bitpool);
 
@@ -264,20 +324,54 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 #if ENABLE_MPEG
 	case A2DP_CODEC_MPEG12: {
 
+		const a2dp_mpeg_t *cfg = (a2dp_mpeg_t *)codec->cfg;
 		a2dp_mpeg_t *cap = (a2dp_mpeg_t *)capabilities;
 		unsigned int cap_chm = cap->channel_mode;
 		unsigned int cap_freq = cap->frequency;
+		unsigned int cap_layer = cap->layer & cfg->layer;
+		unsigned int cap_bitrate = MPEG_GET_BITRATE(*cap) & MPEG_GET_BITRATE(*cfg);
 
-		if ((cap->channel_mode = bluez_a2dp_codec_select_channel_mode(codec, cap_chm)) == 0) {
+		if ((cap->channel_mode = bluez_a2dp_codec_select_channel_mode(codec, cap_chm, channels)) == 0) {
 			error("No supported channel modes: %#x", cap_chm);
 			goto fail;
 		}
 
-		if ((cap->frequency = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq)) == 0) {
+		if ((cap->frequency = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq, sampling)) == 0) {
 			error("No supported sampling frequencies: %#x", cap_freq);
 			goto fail;
 		}
 
+		if (cap_layer & MPEG_LAYER_MP3)
+			cap->layer = MPEG_LAYER_MP3;
+		else if (cap_layer & MPEG_LAYER_MP2)
+			cap->layer = MPEG_LAYER_MP2;
+		else if (cap_layer & MPEG_LAYER_MP1)
+			cap->layer = MPEG_LAYER_MP1;
+		else {
+			error("No supported layers: %#x", cap->layer);
+			goto fail;
+		}
+
+		/* L2CAP channel is reliable, so there is no need for
+		 * the CRC protection, which only increases the payload */
+		cap->crc = 0;
+		cap->mpf = 0;
+
+		unsigned int bitrate = cap_bitrate & ~MPEG_BIT_RATE_VBR;
+		if (config.a2dp.policy == BA_A2DP_POLICY_EFFICIENCY &&
+				(bitrate & ((MPEG_BIT_RATE_128000 << 1) - 1)) != 0)
+			bitrate &= (MPEG_BIT_RATE_128000 << 1) - 1;
+		if (bitrate == 0) {
+			error("No supported bit rates: %#x", MPEG_GET_BITRATE(*cap));
+			goto fail;
+		}
+
+		/* select the highest bit rate - in case of VBR it is used
+		 * as an upper limit for the encoder */
+		while (bitrate & (bitrate - 1))
+			bitrate &= bitrate - 1;
+		MPEG_SET_BITRATE(*cap, (cap_bitrate & MPEG_BIT_RATE_VBR) | bitrate);
+
 		break;
 	}
 #endif
@@ -289,7 +383,11 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 		unsigned int cap_chm = cap->channels;
 		unsigned int cap_freq = AAC_GET_FREQUENCY(*cap);
 
-		if (cap->object_type & AAC_OBJECT_TYPE_MPEG4_AAC_SCA)
+		if (config.a2dp.policy == BA_A2DP_POLICY_EFFICIENCY &&
+				cap->object_type & AAC_OBJECT_TYPE_MPEG4_AAC_LC)
+			/* other object types are computationally more demanding */
+			cap->object_type = AAC_OBJECT_TYPE_MPEG4_AAC_LC;
+		else if (cap->object_type & AAC_OBJECT_TYPE_MPEG4_AAC_SCA)
 			cap->object_type = AAC_OBJECT_TYPE_MPEG4_AAC_SCA;
 		else if (cap->object_type & AAC_OBJECT_TYPE_MPEG4_AAC_LTP)
 			cap->object_type = AAC_OBJECT_TYPE_MPEG4_AAC_LTP;
@@ -302,13 +400,13 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 			goto fail;
 		}
 
-		if ((cap->channels = bluez_a2dp_codec_select_channel_mode(codec, cap_chm)) == 0) {
+		if ((cap->channels = bluez_a2dp_codec_select_channel_mode(codec, cap_chm, channels)) == 0) {
 			error("No supported channels: %#x", cap_chm);
 			goto fail;
 		}
 
 		unsigned int freq;
-		if ((freq = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq)) != 0)
+		if ((freq = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq, sampling)) != 0)
 			AAC_SET_FREQUENCY(*cap, freq);
 		else {
 			error("No supported sampling frequencies: %#x", cap_freq);
@@ -326,12 +424,12 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 		unsigned int cap_chm = cap->channel_mode;
 		unsigned int cap_freq = cap->frequency;
 
-		if ((cap->channel_mode = bluez_a2dp_codec_select_channel_mode(codec, cap_chm)) == 0) {
+		if ((cap->channel_mode = bluez_a2dp_codec_select_channel_mode(codec, cap_chm, channels)) == 0) {
 			error("No supported channel modes: %#x", cap_chm);
 			goto fail;
 		}
 
-		if ((cap->frequency = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq)) == 0) {
+		if ((cap->frequency = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq, sampling)) == 0) {
 			error("No supported sampling frequencies: %#x", cap_freq);
 			goto fail;
 		}
@@ -347,12 +445,12 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 		unsigned int cap_chm = cap->channel_mode;
 		unsigned int cap_freq = cap->frequency;
 
-		if ((cap->channel_mode = bluez_a2dp_codec_select_channel_mode(codec, cap_chm)) == 0) {
+		if ((cap->channel_mode = bluez_a2dp_codec_select_channel_mode(codec, cap_chm, channels)) == 0) {
 			error("No supported channel modes: %#x", cap_chm);
 			goto fail;
 		}
 
-		if ((cap->frequency = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq)) == 0) {
+		if ((cap->frequency = bluez_a2dp_codec_select_sampling_freq(codec, cap_freq, sampling)) == 0) {
 			error("No supported sampling frequencies: %#x", cap_freq);
 			goto fail;
 		}
@@ -362,15 +460,57 @@ static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void
 #endif
 
 	default:
-		debug("Endpoint path not supported: %s", endpoint_path);
-		g_dbus_method_invocation_return_error(inv, G_DBUS_ERROR,
-				G_DBUS_ERROR_UNKNOWN_OBJECT, "Not supported");
-		goto final;
+		errno = ENOTSUP;
+		return -1;
 	}
 
+	return 0;
+
+fail:
+	errno = EINVAL;
+	return -1;
+}
+
+static void bluez_endpoint_select_configuration(GDBusMethodInvocation *inv, void *userdata) {
+
+	const char *endpoint_path = g_dbus_method_invocation_get_object_path(inv);
+	GVariant *params = g_dbus_method_invocation_get_parameters(inv);
+	const struct bluez_a2dp_codec *codec = userdata;
+
+	const unsigned int policy = bluez_a2dp_policy_id();
 	GVariantBuilder caps;
+	const uint8_t *data;
+	uint8_t *capabilities;
+	size_t size = 0;
 	size_t i;
 
+	params = g_variant_get_child_value(params, 0);
+	data = g_variant_get_fixed_array(params, &size, sizeof(uint8_t));
+	capabilities = g_memdup(data, size);
+
+	if (size != codec->cfg_size) {
+		error("Invalid capabilities size: %zu != %zu", size, codec->cfg_size);
+		goto fail;
+	}
+
+	if (a2dp_cache_lookup(codec->id, policy, data, capabilities, size)) {
+		debug("Using cached configuration: %s", endpoint_path);
+		goto reply;
+	}
+
+	if (bluez_a2dp_select_configuration(codec, capabilities, 0, 0) == -1) {
+		if (errno == ENOTSUP) {
+			debug("Endpoint path not supported: %s", endpoint_path);
+			g_dbus_method_invocation_return_error(inv, G_DBUS_ERROR,
+					G_DBUS_ERROR_UNKNOWN_OBJECT, "Not supported");
+			goto final;
+		}
+		goto fail;
+	}
+
+	a2dp_cache_store(codec->id, policy, data, capabilities, size);
+
+reply:
 	g_variant_builder_init(&caps, G_VARIANT_TYPE("ay"));
 	for (i = 0; i < size; i++)
 		g_variant_builder_add(&caps, "y", capabilities[i]);
@@ -385,6 +525,7 @@ fail:
 			G_DBUS_ERROR_INVALID_ARGS, "Invalid capabilities");
 
 final:
+	g_variant_unref(params);
 	g_free(capabilities);
 }
 
@@ -494,9 +635,28 @@ static int bluez_endpoint_set_configuration(GDBusMethodInvocation *inv, void *us
 
 #if ENABLE_MPEG
 			case A2DP_CODEC_MPEG12: {
-				a2dp_mpeg_t *cap = (a2dp_mpeg_t *)capabilities;
+
+				const a2dp_mpeg_t *cap = (a2dp_mpeg_t *)capabilities;
 				cap_chm = cap->channel_mode;
 				cap_freq = cap->frequency;
+
+				if (cap->layer != MPEG_LAYER_MP1 &&
+						cap->layer != MPEG_LAYER_MP2 &&
+						cap->layer != MPEG_LAYER_MP3) {
+					error("Invalid configuration: %s", "Invalid MPEG layer");
+					goto fail;
+				}
+
+				if (!(cap->layer & ((a2dp_mpeg_t *)codec->cfg)->layer)) {
+					error("Invalid configuration: %s", "Unsupported MPEG layer");
+					goto fail;
+				}
+
+				if (cap->mpf) {
+					error("Invalid configuration: %s", "Unsupported media payload format");
+					goto fail;
+				}
+
 				break;
 			}
 #endif
@@ -622,9 +782,9 @@ static int bluez_endpoint_set_configuration(GDBusMethodInvocation *inv, void *us
 		goto fail;
 	}
 
-	t->a2dp.ch1_volume = volume;
-	t->a2dp.ch2_volume = volume;
-	t->a2dp.delay = delay;
+	__atomic_store_n(&t->a2dp.ch1_volume, volume, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->a2dp.ch2_volume, volume, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->a2dp.delay, delay, __ATOMIC_RELAXED);
 
 	debug("%s configured for device %s",
 			ba_transport_type_to_string(t->type),
@@ -635,6 +795,21 @@ static int bluez_endpoint_set_configuration(GDBusMethodInvocation *inv, void *us
 	bluez_a2dp_set_transport_state(t, state);
 
 	g_dbus_method_invocation_return_value(inv, NULL);
+
+	/* Resume the playback of the PCM taken over from the transport which has
+	 * been replaced due to the codec switch. Normally, the transport is
+	 * acquired when the PCM is opened by the client. The reply has to be sent
+	 * first, otherwise BlueZ will not let us acquire this transport. Since we
+	 * are running in the main loop, the acquisition has to be asynchronous. */
+	if (t->type.profile == BA_TRANSPORT_PROFILE_A2DP_SOURCE &&
+			t->a2dp.pcm.fd != -1) {
+		pthread_mutex_lock(&t->mutex);
+		transport_send_signal(t, TRANSPORT_PCM_OPEN);
+		pthread_mutex_unlock(&t->mutex);
+		if (transport_acquire_bt_a2dp_async(t) == -1)
+			error("Couldn't resume PCM: %s", strerror(errno));
+	}
+
 	goto final;
 
 fail:
@@ -744,23 +919,99 @@ static const GDBusInterfaceVTable endpoint_vtable = {
 	.method_call = bluez_endpoint_method_call,
 };
 
+/**
+ * Finish registration call.
+ *
+ * If BlueZ has rejected the registration, the D-Bus object is released, so
+ * it might be registered once more later. */
+static void bluez_register_call_finish(GObject *source, GAsyncResult *result,
+		gpointer userdata) {
+
+	GDBusConnection *conn = G_DBUS_CONNECTION(source);
+	gchar *path = userdata;
+	GDBusMessage *rep;
+	GError *err = NULL;
+
+	if ((rep = g_dbus_connection_send_message_with_reply_finish(conn, result, &err)) != NULL &&
+			g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR)
+		g_dbus_message_to_gerror(rep, &err);
+
+	if (err != NULL) {
+
+		gpointer hash = GINT_TO_POINTER(g_str_hash(path));
+		struct dbus_object_data *obj;
+
+		warn("Couldn't register %s: %s", path, err->message);
+		if ((obj = g_hash_table_lookup(dbus_object_data_map, hash)) != NULL) {
+			g_dbus_connection_unregister_object(conn, obj->id);
+			g_hash_table_remove(dbus_object_data_map, hash);
+		}
+
+		g_error_free(err);
+	}
+	else
+		debug("Registered in BlueZ: %s", path);
+
+	if (--register_calls_pending == 0) {
+		struct timespec now, diff;
+		gettimestamp(&now);
+		difftimespec(&register_calls_ts, &now, &diff);
+		info("BlueZ registration completed in %ld ms",
+				diff.tv_sec * 1000 + diff.tv_nsec / 1000000);
+	}
+
+	if (rep != NULL)
+		g_object_unref(rep);
+	g_free(path);
+}
+
+/**
+ * Send registration call to BlueZ.
+ *
+ * The call is sent asynchronously, so all registrations are issued at once
+ * and BlueZ replies are handled in the main loop as they arrive. The D-Bus
+ * object shall be added to the object data map beforehand.
+ *
+ * @param conn D-Bus connection.
+ * @param msg Registration method call message.
+ * @param path Path of the registered D-Bus object. */
+static void bluez_register_call(GDBusConnection *conn, GDBusMessage *msg,
+		const char *path) {
+
+	if (register_calls_pending++ == 0)
+		gettimestamp(&register_calls_ts);
+
+	g_dbus_connection_send_message_with_reply(conn, msg,
+			G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL,
+			bluez_register_call_finish, g_strdup(path));
+
+}
+
 /**
  * Register A2DP endpoint.
  *
+ * Every adapter has its own set of endpoints, so the connected endpoint
+ * accounting is done per adapter. However, the codec configuration as well
+ * as the D-Bus connection are shared.
+ *
+ * @param a Adapter for which the endpoint shall be registered.
  * @param uuid
  * @param profile
  * @param codec
- * @return On success this function returns 0. Otherwise -1 is returned. */
+ * @return On success this function returns 0. Otherwise -1 is returned.
+ *   Note, that the BlueZ reply is handled asynchronously, so the returned
+ *   value does not reflect the final registration status. */
 static int bluez_register_a2dp_endpoint(
+		const struct ba_adapter *a,
 		const char *uuid,
 		uint32_t profile,
 		const struct bluez_a2dp_codec *codec) {
 
 	struct ba_transport_type ttype = {
 		.profile = profile, .codec = codec->id };
-	gchar *transport_path = g_strdup_printf("%s/%d",
-		g_dbus_transport_type_to_bluez_object_path(ttype),
-		bluez_get_dbus_object_count(ttype) + 1);
+	gchar *transport_path = g_strdup_printf("%s/%s/%d",
+		g_dbus_transport_type_to_bluez_object_path(ttype), a->hci_name,
+		bluez_get_dbus_object_count(a, ttype) + 1);
 	gpointer hash = GINT_TO_POINTER(g_str_hash(transport_path));
 
 	if (g_hash_table_contains(dbus_object_data_map, hash)) {
@@ -770,12 +1021,12 @@ static int bluez_register_a2dp_endpoint(
 	}
 
 	GDBusConnection *conn = config.dbus;
-	GDBusMessage *msg = NULL, *rep = NULL;
+	GDBusMessage *msg;
 	GError *err = NULL;
-	int ret = 0;
 	size_t i;
 
 	struct dbus_object_data dbus_object = {
+		.hci_dev_id = a->hci_dev_id,
 		.ttype = ttype,
 	};
 
@@ -786,7 +1037,7 @@ static int bluez_register_a2dp_endpoint(
 		goto fail;
 
 	char adapter_path[32];
-	snprintf(adapter_path, sizeof(adapter_path), "/org/bluez/%s", config.hci_dev.name);
+	snprintf(adapter_path, sizeof(adapter_path), "/org/bluez/%s", a->hci_name);
 	msg = g_dbus_message_new_method_call(BLUEZ_SERVICE, adapter_path,
 			BLUEZ_IFACE_MEDIA, "RegisterEndpoint");
 
@@ -807,8 +1058,79 @@ static int bluez_register_a2dp_endpoint(
 	g_dbus_message_set_body(msg, g_variant_new("(oa{sv})", transport_path, &properties));
 	g_variant_builder_clear(&properties);
 
-	if ((rep = g_dbus_connection_send_message_with_reply_sync(conn, msg,
-					G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL, &err)) == NULL)
+	g_hash_table_insert(dbus_object_data_map, hash,
+			g_memdup(&dbus_object, sizeof(dbus_object)));
+
+	bluez_register_call(conn, msg, transport_path);
+	g_free(transport_path);
+	g_object_unref(msg);
+	return 0;
+
+fail:
+	warn("Couldn't register endpoint: %s", err->message);
+	g_free(transport_path);
+	g_error_free(err);
+	return -1;
+}
+
+/**
+ * Register A2DP endpoints for given adapter. */
+static void bluez_register_a2dp_adapter(const struct ba_adapter *a) {
+
+	const struct bluez_a2dp_codec **cc = config.a2dp.codecs;
+
+	while (*cc != NULL) {
+		const struct bluez_a2dp_codec *c = *cc++;
+		switch (c->dir) {
+		case BLUEZ_A2DP_SOURCE:
+			if (config.enable.a2dp_source)
+				bluez_register_a2dp_endpoint(a, BLUETOOTH_UUID_A2DP_SOURCE, BA_TRANSPORT_PROFILE_A2DP_SOURCE, c);
+			break;
+		case BLUEZ_A2DP_SINK:
+			if (config.enable.a2dp_sink)
+				bluez_register_a2dp_endpoint(a, BLUETOOTH_UUID_A2DP_SINK, BA_TRANSPORT_PROFILE_A2DP_SINK, c);
+			break;
+		}
+	}
+
+}
+
+/**
+ * Register A2DP endpoints for all available adapters. */
+void bluez_register_a2dp(void) {
+	size_t i;
+	for (i = 0; i < ARRAYSIZE(config.adapters); i++)
+		if (config.adapters[i] != NULL)
+			bluez_register_a2dp_adapter(config.adapters[i]);
+}
+
+/**
+ * Lookup remote A2DP sink stream end-point which supports given codec.
+ *
+ * @param device_path BlueZ D-Bus object path of the remote device.
+ * @param codec Local A2DP codec.
+ * @param capabilities Address where the capabilities of the found SEP will
+ *   be stored. The size of this buffer shall be at least codec->cfg_size.
+ * @return On success this function returns newly allocated D-Bus object
+ *   path of the SEP, which shall be freed with g_free(). Otherwise, NULL is
+ *   returned and errno is set to indicate the error. */
+static char *bluez_a2dp_lookup_remote_sep(
+		const char *device_path,
+		const struct bluez_a2dp_codec *codec,
+		void *capabilities) {
+
+	GDBusMessage *msg = NULL, *rep = NULL;
+	GVariantIter *objects = NULL;
+	GError *err = NULL;
+	char *sep_path = NULL;
+	int ret = ENOTSUP;
+
+	msg = g_dbus_message_new_method_call(BLUEZ_SERVICE, "/",
+			"org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
+
+	if ((rep = g_dbus_connection_send_message_with_reply_sync(config.dbus, msg,
+					G_DBUS_SEND_MESSAGE_FLAGS_NONE, BLUEZ_A2DP_RECONFIGURE_TIMEOUT,
+					NULL, NULL, &err)) == NULL)
 		goto fail;
 
 	if (g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR) {
@@ -816,49 +1138,207 @@ static int bluez_register_a2dp_endpoint(
 		goto fail;
 	}
 
-	g_hash_table_insert(dbus_object_data_map, hash,
-			g_memdup(&dbus_object, sizeof(dbus_object)));
+	const size_t device_path_len = strlen(device_path);
+	GVariantIter *interfaces;
+	const char *object_path;
+
+	g_variant_get(g_dbus_message_get_body(rep), "(a{oa{sa{sv}}})", &objects);
+	while (sep_path == NULL &&
+			g_variant_iter_next(objects, "{&oa{sa{sv}}}", &object_path, &interfaces)) {
+
+		GVariantIter *properties;
+		const char *interface;
+
+		/* remote SEPs are exported as children of the device object */
+		if (strncmp(object_path, device_path, device_path_len) != 0 ||
+				object_path[device_path_len] != '/')
+			goto next;
+
+		while (g_variant_iter_next(interfaces, "{&sa{sv}}", &interface, &properties)) {
+
+			GVariant *value;
+			const char *key;
+			const uint8_t *data = NULL;
+			size_t size = 0;
+			bool sink = false;
+			int id = -1;
+
+			if (strcmp(interface, BLUEZ_IFACE_MEDIA_ENDPOINT) != 0)
+				goto next_interface;
+
+			while (g_variant_iter_next(properties, "{&sv}", &key, &value)) {
+				if (strcmp(key, "UUID") == 0)
+					sink = strcasecmp(g_variant_get_string(value, NULL),
+							BLUETOOTH_UUID_A2DP_SINK) == 0;
+				else if (strcmp(key, "Codec") == 0)
+					id = g_variant_get_byte(value);
+				else if (strcmp(key, "Capabilities") == 0 && data == NULL) {
+					const uint8_t *tmp = g_variant_get_fixed_array(value, &size, sizeof(uint8_t));
+					/* variant data stays valid as long as the reply is referenced */
+					data = size == codec->cfg_size ? tmp : NULL;
+				}
+				g_variant_unref(value);
+			}
 
-	goto final;
+			/* For vendor codecs, the codec ID is the same for all of them. The
+			 * actual codec is identified by the vendor header of capabilities. */
+			if (sink && data != NULL && id == (codec->id & 0xFF) &&
+					(id != A2DP_CODEC_VENDOR ||
+					 memcmp(data, codec->cfg, sizeof(a2dp_vendor_codec_t)) == 0)) {
+				memcpy(capabilities, data, size);
+				sep_path = g_strdup(object_path);
+			}
 
-fail:
-	ret = -1;
+next_interface:
+			g_variant_iter_free(properties);
+		}
 
-final:
-	g_free(transport_path);
+next:
+		g_variant_iter_free(interfaces);
+	}
+
+fail:
+	if (objects != NULL)
+		g_variant_iter_free(objects);
 	if (msg != NULL)
 		g_object_unref(msg);
 	if (rep != NULL)
 		g_object_unref(rep);
 	if (err != NULL) {
-		warn("Couldn't register endpoint: %s", err->message);
-		g_dbus_connection_unregister_object(conn, dbus_object.id);
+		error("Couldn't get remote SEPs: %s", err->message);
 		g_error_free(err);
+		ret = EIO;
 	}
-
-	return ret;
+	if (sep_path == NULL)
+		errno = ret;
+	return sep_path;
 }
 
 /**
- * Register A2DP endpoints. */
-void bluez_register_a2dp(void) {
+ * Reconfigure A2DP source stream with another codec.
+ *
+ * The remote stream end-point (SEP) which supports given codec is looked up
+ * and the stream is reconfigured with the configuration selected for our
+ * local end-point. In the result, BlueZ clears the current transport and
+ * sets up a new one for the end-point registered for the new codec.
+ *
+ * Remote SEPs are exposed by BlueZ 5.52 and later, with the experimental
+ * interfaces enabled. Since BlueZ is called synchronously, this function
+ * shall not be called from the main thread, nor with the devices mutex
+ * locked - our end-point is called back before the reply is received.
+ * Every call is bounded with the BLUEZ_A2DP_RECONFIGURE_TIMEOUT, though.
+ *
+ * Note, that the reply might be received before our end-point is called,
+ * so the new transport might not exist when this function returns.
+ *
+ * @param transport_path BlueZ D-Bus object path of the current transport.
+ * @param codec_id Audio codec ID of the new configuration.
+ * @param channels If non-zero, the number of channels which shall be used
+ *   by the new configuration.
+ * @param sampling If non-zero, the sampling frequency which shall be used
+ *   by the new configuration.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. ENOTSUP means, that the codec
+ *   is not supported by either side, or a configuration matching given
+ *   constraints can not be selected. */
+int bluez_a2dp_reconfigure(
+		const char *transport_path,
+		uint16_t codec_id,
+		unsigned int channels,
+		unsigned int sampling) {
 
 	const struct bluez_a2dp_codec **cc = config.a2dp.codecs;
+	const struct bluez_a2dp_codec *codec = NULL;
+	struct ba_adapter *a;
 
 	while (*cc != NULL) {
 		const struct bluez_a2dp_codec *c = *cc++;
-		switch (c->dir) {
-		case BLUEZ_A2DP_SOURCE:
-			if (config.enable.a2dp_source)
-				bluez_register_a2dp_endpoint(BLUETOOTH_UUID_A2DP_SOURCE, BA_TRANSPORT_PROFILE_A2DP_SOURCE, c);
-			break;
-		case BLUEZ_A2DP_SINK:
-			if (config.enable.a2dp_sink)
-				bluez_register_a2dp_endpoint(BLUETOOTH_UUID_A2DP_SINK, BA_TRANSPORT_PROFILE_A2DP_SINK, c);
+		if (c->dir == BLUEZ_A2DP_SOURCE && c->id == codec_id) {
+			codec = c;
 			break;
 		}
 	}
 
+	if (codec == NULL || !config.enable.a2dp_source) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if ((a = ba_adapter_lookup(g_dbus_bluez_object_path_to_hci_dev_id(transport_path))) == NULL) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	GDBusMessage *msg = NULL, *rep = NULL;
+	GError *err = NULL;
+	uint8_t *capabilities;
+	char *device_path;
+	char *sep_path;
+	int ret = -1;
+	size_t i;
+
+	capabilities = g_malloc(codec->cfg_size);
+	device_path = g_path_get_dirname(transport_path);
+
+	if ((sep_path = bluez_a2dp_lookup_remote_sep(device_path, codec, capabilities)) == NULL)
+		goto final;
+
+	if (bluez_a2dp_select_configuration(codec, capabilities, channels, sampling) == -1) {
+		errno = ENOTSUP;
+		goto final;
+	}
+
+	struct ba_transport_type ttype = {
+		.profile = BA_TRANSPORT_PROFILE_A2DP_SOURCE, .codec = codec_id };
+	char endpoint_path[64];
+	snprintf(endpoint_path, sizeof(endpoint_path), "%s/%s/1",
+			g_dbus_transport_type_to_bluez_object_path(ttype), a->hci_name);
+
+	debug("Reconfiguring %s: %s -> %s", transport_path, sep_path, endpoint_path);
+
+	GVariantBuilder caps;
+	GVariantBuilder properties;
+
+	g_variant_builder_init(&caps, G_VARIANT_TYPE("ay"));
+	g_variant_builder_init(&properties, G_VARIANT_TYPE("a{sv}"));
+
+	for (i = 0; i < codec->cfg_size; i++)
+		g_variant_builder_add(&caps, "y", capabilities[i]);
+
+	g_variant_builder_add(&properties, "{sv}", "Capabilities", g_variant_builder_end(&caps));
+
+	msg = g_dbus_message_new_method_call(BLUEZ_SERVICE, sep_path,
+			BLUEZ_IFACE_MEDIA_ENDPOINT, "SetConfiguration");
+	g_dbus_message_set_body(msg, g_variant_new("(oa{sv})", endpoint_path, &properties));
+	g_variant_builder_clear(&properties);
+
+	if ((rep = g_dbus_connection_send_message_with_reply_sync(config.dbus, msg,
+					G_DBUS_SEND_MESSAGE_FLAGS_NONE, BLUEZ_A2DP_RECONFIGURE_TIMEOUT,
+					NULL, NULL, &err)) == NULL)
+		goto fail;
+
+	if (g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR) {
+		g_dbus_message_to_gerror(rep, &err);
+		goto fail;
+	}
+
+	ret = 0;
+	goto final;
+
+fail:
+	error("Couldn't reconfigure A2DP stream: %s", err->message);
+	g_error_free(err);
+	errno = EIO;
+
+final:
+	if (msg != NULL)
+		g_object_unref(msg);
+	if (rep != NULL)
+		g_object_unref(rep);
+	g_free(capabilities);
+	g_free(device_path);
+	g_free(sep_path);
+	return ret;
 }
 
 static void bluez_profile_new_connection(GDBusMethodInvocation *inv, void *userdata) {
@@ -1018,7 +1498,9 @@ static const GDBusInterfaceVTable profile_vtable = {
  * @param profile
  * @param version
  * @param features
- * @return On success this function returns 0. Otherwise -1 is returned. */
+ * @return On success this function returns 0. Otherwise -1 is returned.
+ *   Note, that the BlueZ reply is handled asynchronously, so the returned
+ *   value does not reflect the final registration status. */
 static int bluez_register_profile(
 		const char *uuid,
 		uint32_t profile,
@@ -1035,11 +1517,11 @@ static int bluez_register_profile(
 	}
 
 	GDBusConnection *conn = config.dbus;
-	GDBusMessage *msg = NULL, *rep = NULL;
+	GDBusMessage *msg;
 	GError *err = NULL;
-	int ret = 0;
 
 	struct dbus_object_data dbus_object = {
+		.hci_dev_id = -1,
 		.ttype = ttype,
 	};
 
@@ -1063,35 +1545,17 @@ static int bluez_register_profile(
 	g_dbus_message_set_body(msg, g_variant_new("(osa{sv})", profile_path, uuid, &options));
 	g_variant_builder_clear(&options);
 
-	if ((rep = g_dbus_connection_send_message_with_reply_sync(conn, msg,
-					G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL, &err)) == NULL)
-		goto fail;
-
-	if (g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR) {
-		g_dbus_message_to_gerror(rep, &err);
-		goto fail;
-	}
-
 	g_hash_table_insert(dbus_object_data_map, hash,
 			g_memdup(&dbus_object, sizeof(dbus_object)));
 
-	goto final;
+	bluez_register_call(conn, msg, profile_path);
+	g_object_unref(msg);
+	return 0;
 
 fail:
-	ret = -1;
-
-final:
-	if (msg != NULL)
-		g_object_unref(msg);
-	if (rep != NULL)
-		g_object_unref(rep);
-	if (err != NULL) {
-		warn("Couldn't register profile: %s", err->message);
-		g_dbus_connection_unregister_object(conn, dbus_object.id);
-		g_error_free(err);
-	}
-
-	return ret;
+	warn("Couldn't register profile: %s", err->message);
+	g_error_free(err);
+	return -1;
 }
 
 /**
@@ -1129,21 +1593,62 @@ static void bluez_signal_interfaces_added(GDBusConnection *conn, const gchar *se
 	(void)signal;
 	(void)userdata;
 
-	char *device_path = g_strdup_printf("/org/bluez/%s", config.hci_dev.name);
 	GVariantIter *interfaces;
 	const char *object;
+	struct ba_adapter *a;
 
 	g_variant_get(params, "(&oa{sa{sv}})", &object, &interfaces);
 
-	if (strcmp(object, device_path) == 0)
-		bluez_register_a2dp();
+	/* register endpoints if one of our adapters has (re)appeared */
+	if ((a = ba_adapter_lookup(g_dbus_bluez_object_path_to_hci_dev_id(object))) != NULL) {
+		char adapter_path[32];
+		snprintf(adapter_path, sizeof(adapter_path), "/org/bluez/%s", a->hci_name);
+		if (strcmp(object, adapter_path) == 0)
+			bluez_register_a2dp_adapter(a);
+	}
+
 	if (strcmp(object, "/org/bluez") == 0)
 		bluez_register_hfp();
 
 	g_variant_iter_free(interfaces);
-	g_free(device_path);
 }
 
+/**
+ * Update transport state.
+ *
+ * State change might start or stop the IO thread, so it has to be done with
+ * the devices mutex acquired. */
+static void bluez_transport_update_state(const char *transport_path, const char *state) {
+
+	struct ba_adapter *a;
+	struct ba_transport *t;
+
+	int hci_dev_id = g_dbus_bluez_object_path_to_hci_dev_id(transport_path);
+	if ((a = ba_adapter_lookup(hci_dev_id)) == NULL) {
+		error("Adapter not available: %s", transport_path);
+		return;
+	}
+
+	pthread_mutex_lock(&a->devices_mutex);
+
+	if ((t = ba_transport_index_lookup(transport_path)) == NULL)
+		error("Transport not available: %s", transport_path);
+	else {
+		ba_transport_index_unlock();
+		bluez_a2dp_set_transport_state(t, state);
+	}
+
+	pthread_mutex_unlock(&a->devices_mutex);
+
+}
+
+/**
+ * Handle transport properties change.
+ *
+ * This signal might be received at high rate (e.g. volume knob turning), so
+ * the volume and the delay are updated without acquiring the devices mutex.
+ * The transport is found using the path index, and these properties are
+ * stored atomically. Only the state change takes the slow path. */
 static void bluez_signal_transport_changed(GDBusConnection *conn, const gchar *sender,
 		const gchar *transport_path, const gchar *interface, const gchar *signal, GVariant *params,
 		void *userdata) {
@@ -1158,34 +1663,23 @@ static void bluez_signal_transport_changed(GDBusConnection *conn, const gchar *s
 		return;
 	}
 
-	struct ba_adapter *a = NULL;
-	struct ba_device *d = NULL;
-	struct ba_transport *t = NULL;
+	struct ba_transport *t;
 
 	GVariantIter *properties = NULL;
 	GVariantIter *unknown = NULL;
 	GVariant *value = NULL;
+	gchar *state = NULL;
 	const char *iface;
 	const char *key;
 
-	int hci_dev_id = g_dbus_bluez_object_path_to_hci_dev_id(transport_path);
-	if ((a = ba_adapter_lookup(hci_dev_id)) == NULL) {
-		error("Adapter not available: %s", transport_path);
-		goto fail;
-	}
-
-	pthread_mutex_lock(&a->devices_mutex);
+	/* event which shall be sent when the index lock is released */
+	unsigned int event_pcm_type = BA_PCM_TYPE_NULL;
+	struct ba_ctl *event_ctl = NULL;
+	bdaddr_t event_addr;
 
-	bdaddr_t addr;
-	g_dbus_bluez_object_path_to_bdaddr(transport_path, &addr);
-	if ((d = ba_device_lookup(a, &addr)) == NULL) {
-		error("Device not available: %s", transport_path);
-		goto fail;
-	}
-
-	if ((t = ba_transport_lookup(d, transport_path)) == NULL) {
+	if ((t = ba_transport_index_lookup(transport_path)) == NULL) {
 		error("Transport not available: %s", transport_path);
-		goto fail;
+		return;
 	}
 
 	g_variant_get(params, "(&sa{sv}as)", &iface, &properties, &unknown);
@@ -1200,7 +1694,8 @@ static void bluez_signal_transport_changed(GDBusConnection *conn, const gchar *s
 				goto fail;
 			}
 
-			bluez_a2dp_set_transport_state(t, g_variant_get_string(value, NULL));
+			g_free(state);
+			state = g_variant_dup_string(value, NULL);
 
 		}
 		else if (strcmp(key, "Delay") == 0) {
@@ -1211,7 +1706,7 @@ static void bluez_signal_transport_changed(GDBusConnection *conn, const gchar *s
 				goto fail;
 			}
 
-			t->a2dp.delay = g_variant_get_uint16(value);
+			__atomic_store_n(&t->a2dp.delay, g_variant_get_uint16(value), __ATOMIC_RELAXED);
 
 		}
 		else if (strcmp(key, "Volume") == 0) {
@@ -1223,11 +1718,14 @@ static void bluez_signal_transport_changed(GDBusConnection *conn, const gchar *s
 			}
 
 			/* received volume is in range [0, 127]*/
-			t->a2dp.ch1_volume = t->a2dp.ch2_volume = g_variant_get_uint16(value);
+			const uint8_t volume = g_variant_get_uint16(value);
+			__atomic_store_n(&t->a2dp.ch1_volume, volume, __ATOMIC_RELAXED);
+			__atomic_store_n(&t->a2dp.ch2_volume, volume, __ATOMIC_RELAXED);
 
-			bluealsa_ctl_send_event(a->ctl, BA_EVENT_VOLUME_CHANGED, &d->addr,
-					BA_PCM_TYPE_A2DP | (t->type.profile == BA_TRANSPORT_PROFILE_A2DP_SOURCE ?
-						BA_PCM_STREAM_PLAYBACK : BA_PCM_STREAM_CAPTURE));
+			event_ctl = t->d->a->ctl;
+			event_addr = t->d->addr;
+			event_pcm_type = BA_PCM_TYPE_A2DP | (t->type.profile == BA_TRANSPORT_PROFILE_A2DP_SOURCE ?
+					BA_PCM_STREAM_PLAYBACK : BA_PCM_STREAM_CAPTURE);
 
 		}
 
@@ -1236,10 +1734,19 @@ static void bluez_signal_transport_changed(GDBusConnection *conn, const gchar *s
 	}
 
 fail:
-	if (a != NULL)
-		pthread_mutex_unlock(&a->devices_mutex);
+	ba_transport_index_unlock();
+	/* Sending an event might block on the control event pipe, so it shall
+	 * not be done with the transport index locked. */
+	if (event_pcm_type != BA_PCM_TYPE_NULL)
+		bluealsa_ctl_send_event(event_ctl, BA_EVENT_VOLUME_CHANGED, &event_addr, event_pcm_type);
+	if (state != NULL) {
+		bluez_transport_update_state(transport_path, state);
+		g_free(state);
+	}
 	if (properties != NULL)
 		g_variant_iter_free(properties);
+	if (unknown != NULL)
+		g_variant_iter_free(unknown);
 	if (value != NULL)
 		g_variant_unref(value);
 }
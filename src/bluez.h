@@ -11,6 +11,12 @@
 #ifndef BLUEALSA_BLUEZ_H_
 #define BLUEALSA_BLUEZ_H_
 
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdint.h>
+
 /* List of Bluetooth audio profiles. */
 #define BLUETOOTH_UUID_A2DP_SOURCE "0000110A-0000-1000-8000-00805F9B34FB"
 #define BLUETOOTH_UUID_A2DP_SINK   "0000110B-0000-1000-8000-00805F9B34FB"
@@ -21,6 +27,11 @@
 
 void bluez_register(void);
 void bluez_register_a2dp(void);
+int bluez_a2dp_reconfigure(
+		const char *transport_path,
+		uint16_t codec_id,
+		unsigned int channels,
+		unsigned int sampling);
 void bluez_register_hfp(void);
 int bluez_subscribe_signals(void);
 
@@ -0,0 +1,319 @@
+/*
+ * BlueALSA - capture.c
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "capture.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+
+#include "shared/defs.h"
+#include "shared/log.h"
+
+/* Bluetooth HCI UART transport layer packets with the direction pseudo
+ * header - the same link type is used by the btmon and the hcidump. */
+#define PCAP_LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR 201
+
+#define H4_ACL_PACKET 0x02
+#define H4_SCO_PACKET 0x03
+
+/* interval of the ring flushing in milliseconds */
+#define CAPTURE_FLUSH_INTERVAL 100
+
+struct __attribute__ ((packed)) pcap_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct __attribute__ ((packed)) pcap_record {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+	/* direction pseudo header: 0 - sent, 1 - received */
+	uint32_t direction;
+	uint8_t h4_type;
+	/* ACL or SCO header followed by the L2CAP header for ACL packets */
+	uint8_t header[8];
+};
+
+/**
+ * Write single captured packet to the pcap file. */
+static ssize_t ba_capture_write_packet(const struct ba_capture *c,
+		const struct ba_capture_packet *p) {
+
+	const size_t len = MIN(p->len, sizeof(p->data));
+	struct pcap_record rec = {
+		.ts_sec = p->ts.tv_sec,
+		.ts_usec = p->ts.tv_usec,
+		.direction = htobe32(p->dir == BA_CAPTURE_DIR_RX),
+	};
+	size_t header_len;
+
+	/* Connection handle is not known at this level, so the zero is used.
+	 * For ACL packets, the L2CAP header with the first dynamically allocated
+	 * channel ID is synthesized. */
+	switch (c->type) {
+	case BA_CAPTURE_TYPE_ACL: {
+		const uint16_t acl_handle = htole16(0x2000);
+		const uint16_t acl_len = htole16(p->len + 4);
+		const uint16_t l2cap_len = htole16(p->len);
+		const uint16_t l2cap_cid = htole16(0x0040);
+		rec.h4_type = H4_ACL_PACKET;
+		memcpy(&rec.header[0], &acl_handle, 2);
+		memcpy(&rec.header[2], &acl_len, 2);
+		memcpy(&rec.header[4], &l2cap_len, 2);
+		memcpy(&rec.header[6], &l2cap_cid, 2);
+		header_len = 8;
+	} break;
+	case BA_CAPTURE_TYPE_SCO:
+	default:
+		rec.h4_type = H4_SCO_PACKET;
+		rec.header[0] = rec.header[1] = 0;
+		rec.header[2] = p->len;
+		header_len = 3;
+	}
+
+	const size_t phdr_len = sizeof(rec.direction) + sizeof(rec.h4_type) + header_len;
+	rec.incl_len = phdr_len + len;
+	rec.orig_len = phdr_len + p->len;
+
+	struct iovec io[] = {
+		{ .iov_base = &rec, .iov_len = offsetof(struct pcap_record, header) + header_len },
+		{ .iov_base = (void *)p->data, .iov_len = len },
+	};
+
+	return writev(c->fd, io, ARRAYSIZE(io));
+}
+
+/**
+ * Write all packets available in the ring to the pcap file. */
+static void ba_capture_flush(struct ba_capture *c) {
+
+	const uint32_t head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+	uint32_t tail = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+
+	for (; tail != head; tail++) {
+		const struct ba_capture_packet *p = &c->packets[tail % BA_CAPTURE_SLOTS];
+		if (ba_capture_write_packet(c, p) == -1)
+			warn("Couldn't write captured packet: %s", strerror(errno));
+	}
+
+	__atomic_store_n(&c->tail, tail, __ATOMIC_RELEASE);
+
+}
+
+static void *ba_capture_thread(void *arg) {
+	struct ba_capture *c = (struct ba_capture *)arg;
+
+	struct pollfd pfd = { c->event_fd, POLLIN, 0 };
+	uint32_t dropped = 0;
+
+	for (;;) {
+
+		int ret = poll(&pfd, 1, CAPTURE_FLUSH_INTERVAL);
+		ba_capture_flush(c);
+
+		const uint32_t _dropped = __atomic_load_n(&c->dropped, __ATOMIC_RELAXED);
+		if (_dropped != dropped) {
+			warn("Capture ring overflow: %u packets dropped", _dropped - dropped);
+			dropped = _dropped;
+		}
+
+		if (ret > 0)
+			break;
+
+	}
+
+	return NULL;
+}
+
+/**
+ * Create new traffic capture.
+ *
+ * @param type Type of the captured packets.
+ * @return On success this function returns newly allocated capture structure,
+ *   which shall be freed with the ba_capture_free(). On error, NULL is
+ *   returned and errno is set to indicate the error. */
+struct ba_capture *ba_capture_new(enum ba_capture_type type) {
+
+	struct ba_capture *c;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		return NULL;
+
+	c->type = type;
+	c->fd = -1;
+	c->event_fd = -1;
+
+	return c;
+}
+
+/**
+ * Free traffic capture resources.
+ *
+ * The IO thread which records packets shall be terminated beforehand. */
+void ba_capture_free(struct ba_capture *c) {
+	if (c == NULL)
+		return;
+	ba_capture_stop(c);
+	free(c);
+}
+
+/**
+ * Start recording packets into the pcap file.
+ *
+ * @param c The capture structure.
+ * @param path Location of the pcap file, which will be overwritten.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+int ba_capture_start(struct ba_capture *c, const char *path) {
+
+	const struct pcap_header header = {
+		.magic = 0xA1B2C3D4,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = BA_CAPTURE_SNAPLEN + sizeof(((struct pcap_record *)0)->header) + 5,
+		.linktype = PCAP_LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR,
+	};
+	int err;
+
+	if (c->enabled) {
+		errno = EALREADY;
+		return -1;
+	}
+
+	debug("Starting traffic capture: %s", path);
+
+	if ((c->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640)) == -1)
+		return -1;
+	if (write(c->fd, &header, sizeof(header)) != sizeof(header))
+		goto fail;
+	if ((c->event_fd = eventfd(0, EFD_CLOEXEC)) == -1)
+		goto fail;
+
+	/* discard packets which might have been stored after the last stop */
+	c->tail = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+	c->dropped = 0;
+
+	if ((err = pthread_create(&c->thread, NULL, ba_capture_thread, c)) != 0) {
+		errno = err;
+		goto fail;
+	}
+
+	pthread_setname_np(c->thread, "bacapture");
+	__atomic_store_n(&c->enabled, 1, __ATOMIC_RELEASE);
+	return 0;
+
+fail:
+	err = errno;
+	if (c->event_fd != -1)
+		close(c->event_fd);
+	close(c->fd);
+	c->event_fd = -1;
+	c->fd = -1;
+	errno = err;
+	return -1;
+}
+
+/**
+ * Stop recording packets.
+ *
+ * Packets which are already in the ring are written to the pcap file before
+ * this function returns. */
+void ba_capture_stop(struct ba_capture *c) {
+
+	if (!c->enabled)
+		return;
+
+	debug("Stopping traffic capture");
+	__atomic_store_n(&c->enabled, 0, __ATOMIC_RELEASE);
+
+	eventfd_write(c->event_fd, 1);
+	pthread_join(c->thread, NULL);
+
+	close(c->event_fd);
+	close(c->fd);
+	c->event_fd = -1;
+	c->fd = -1;
+
+}
+
+/**
+ * Record packet.
+ *
+ * This function is meant to be called by the IO thread only. It does not
+ * block nor make any system call, except for obtaining the time-stamp.
+ *
+ * @param c The capture structure. If NULL, this function does nothing.
+ * @param dir Direction of the packet.
+ * @param data Packet data.
+ * @param len Length of the packet. */
+void ba_capture_packet(struct ba_capture *c, enum ba_capture_dir dir,
+		const void *data, size_t len) {
+	const struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+	ba_capture_packetv(c, dir, &iov, 1);
+}
+
+/**
+ * Record packet scattered across multiple buffers.
+ *
+ * @param c The capture structure. If NULL, this function does nothing.
+ * @param dir Direction of the packet.
+ * @param iov Buffers with the packet data, as for the writev().
+ * @param iovcnt The number of buffers. */
+void ba_capture_packetv(struct ba_capture *c, enum ba_capture_dir dir,
+		const struct iovec *iov, int iovcnt) {
+
+	if (c == NULL || !__atomic_load_n(&c->enabled, __ATOMIC_ACQUIRE))
+		return;
+
+	const uint32_t head = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+	const uint32_t tail = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail == BA_CAPTURE_SLOTS) {
+		__atomic_add_fetch(&c->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct ba_capture_packet *p = &c->packets[head % BA_CAPTURE_SLOTS];
+	struct timespec ts;
+
+	size_t len = 0;
+	int i;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	p->ts.tv_sec = ts.tv_sec;
+	p->ts.tv_usec = ts.tv_nsec / 1000;
+	p->dir = dir;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (len < sizeof(p->data))
+			memcpy(&p->data[len], iov[i].iov_base, MIN(iov[i].iov_len, sizeof(p->data) - len));
+		len += iov[i].iov_len;
+	}
+
+	p->len = len;
+
+	__atomic_store_n(&c->head, head + 1, __ATOMIC_RELEASE);
+
+}
@@ -0,0 +1,90 @@
+/*
+ * BlueALSA - capture.h
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_CAPTURE_H_
+#define BLUEALSA_CAPTURE_H_
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+/* the maximal number of recorded bytes per packet */
+#define BA_CAPTURE_SNAPLEN 1024
+/* the number of packets in the ring, it has to be a power of 2 */
+#define BA_CAPTURE_SLOTS 128
+
+enum ba_capture_type {
+	BA_CAPTURE_TYPE_ACL,
+	BA_CAPTURE_TYPE_SCO,
+};
+
+enum ba_capture_dir {
+	BA_CAPTURE_DIR_TX,
+	BA_CAPTURE_DIR_RX,
+};
+
+struct ba_capture_packet {
+	struct timeval ts;
+	/* original length of the packet */
+	uint16_t len;
+	/* packet direction, see ba_capture_dir */
+	uint8_t dir;
+	uint8_t data[BA_CAPTURE_SNAPLEN];
+};
+
+/**
+ * Traffic capture of a single transport.
+ *
+ * Packets are stored by the IO thread in the ring without any locking nor
+ * system calls. The ring is emptied by a separate thread, which writes
+ * recorded packets to the pcap file. If the ring is full, new packets are
+ * dropped, so the IO thread timing is never affected. */
+struct ba_capture {
+
+	/* Ring indices are free-running. The head is advanced by the IO thread
+	 * (the only producer) and the tail by the flush thread. */
+	uint32_t head;
+	uint32_t tail;
+	/* number of packets dropped due to the ring overflow */
+	uint32_t dropped;
+
+	/* if non-zero, packets are recorded */
+	int enabled;
+
+	enum ba_capture_type type;
+
+	/* output pcap file */
+	int fd;
+	/* flush thread termination notification */
+	int event_fd;
+	pthread_t thread;
+
+	struct ba_capture_packet packets[BA_CAPTURE_SLOTS];
+
+};
+
+struct ba_capture *ba_capture_new(enum ba_capture_type type);
+void ba_capture_free(struct ba_capture *c);
+
+int ba_capture_start(struct ba_capture *c, const char *path);
+void ba_capture_stop(struct ba_capture *c);
+
+void ba_capture_packet(struct ba_capture *c, enum ba_capture_dir dir,
+		const void *data, size_t len);
+void ba_capture_packetv(struct ba_capture *c, enum ba_capture_dir dir,
+		const struct iovec *iov, int iovcnt);
+
+#endif
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -33,6 +34,8 @@
 #include "utils.h"
 #include "shared/defs.h"
 #include "shared/log.h"
+#include "shared/pcm-ring.h"
+#include "shared/rt.h"
 
 /* Special PCM type for internal usage only. */
 #define BA_PCM_TYPE_RFCOMM 0x1F
@@ -42,8 +45,17 @@
 #define CTL_PFDS_IDX_EVT   1
 #define __CTL_PFDS_IDX_MAX 2
 
+/* Time window in which events for the same transport are coalesced. */
+#define CTL_EVENT_COALESCE_MS 20
+/* Events which do not change the set of available transports. Such events
+ * can be merged together without losing any information. */
+#define CTL_EVENT_MASK_MERGEABLE ( \
+		BA_EVENT_TRANSPORT_CHANGED | \
+		BA_EVENT_VOLUME_CHANGED | \
+		BA_EVENT_BATTERY)
+
 #define ctl_pfds_idx(i) g_array_index(ctl->pfds, struct pollfd, i)
-#define ctl_subs_idx(i) g_array_index(ctl->subs, enum ba_event, i)
+#define ctl_clients_idx(i) g_array_index(ctl->clients, struct ba_ctl_client, i)
 
 /**
  * Lookup a transport matching BT address and profile.
@@ -130,6 +142,58 @@ static struct ba_pcm *ctl_lookup_pcm(struct ba_transport *t, uint8_t type, int c
 	return NULL;
 }
 
+/**
+ * Send message to the client.
+ *
+ * If the controller is processing a batch request, the message is appended
+ * to the batch buffer, which will be sent when all requests are processed.
+ * Otherwise, the message is sent right away - with the framing header, if
+ * the client does not use the legacy protocol.
+ *
+ * @param ctl Pointer to the controller structure.
+ * @param client Pointer to the client structure.
+ * @param type Type of the message.
+ * @param buf Address of the message buffer.
+ * @param len Length of the message.
+ * @return On success this function returns the number of bytes sent or
+ *   queued. Otherwise, -1 is returned and errno is set appropriately. */
+static ssize_t ctl_send(struct ba_ctl *ctl, struct ba_ctl_client *client,
+		enum ba_msg_type type, const void *buf, size_t len) {
+
+	if (ctl->batch != NULL) {
+		g_byte_array_append(ctl->batch, buf, len);
+		return len;
+	}
+
+	if (client->version == BLUEALSA_CRL_PROTO_VERSION_LEGACY)
+		return send(client->fd, buf, len, MSG_NOSIGNAL);
+
+	struct ba_msg_header header = { .type = type, .length = len };
+	struct iovec io[] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = (void *)buf, .iov_len = len },
+	};
+	struct msghdr msg = {
+		.msg_iov = io,
+		.msg_iovlen = ARRAYSIZE(io),
+	};
+
+	return sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+}
+
+static struct ba_msg_device *ctl_device(const struct ba_device *d,
+		struct ba_msg_device *device) {
+
+	bacpy(&device->addr, &d->addr);
+	strncpy(device->name, d->name, sizeof(device->name) - 1);
+	device->name[sizeof(device->name) - 1] = '\0';
+
+	device->battery = d->battery.enabled;
+	device->battery_level = d->battery.level;
+
+	return device;
+}
+
 static struct ba_msg_transport *ctl_transport(const struct ba_transport *t,
 		struct ba_msg_transport *transport) {
 
@@ -143,11 +207,11 @@ static struct ba_msg_transport *ctl_transport(const struct ba_transport *t,
 	if (t->type.profile & BA_TRANSPORT_PROFILE_MASK_A2DP) {
 		transport->type = BA_PCM_TYPE_A2DP | (t->type.profile == BA_TRANSPORT_PROFILE_A2DP_SOURCE ?
 				BA_PCM_STREAM_PLAYBACK : BA_PCM_STREAM_CAPTURE);
-		transport->ch1_muted = t->a2dp.ch1_muted;
-		transport->ch1_volume = t->a2dp.ch1_volume;
-		transport->ch2_muted = t->a2dp.ch2_muted;
-		transport->ch2_volume = t->a2dp.ch2_volume;
-		transport->delay = t->a2dp.delay;
+		transport->ch1_muted = __atomic_load_n(&t->a2dp.ch1_muted, __ATOMIC_RELAXED);
+		transport->ch1_volume = __atomic_load_n(&t->a2dp.ch1_volume, __ATOMIC_RELAXED);
+		transport->ch2_muted = __atomic_load_n(&t->a2dp.ch2_muted, __ATOMIC_RELAXED);
+		transport->ch2_volume = __atomic_load_n(&t->a2dp.ch2_volume, __ATOMIC_RELAXED);
+		transport->delay = __atomic_load_n(&t->a2dp.delay, __ATOMIC_RELAXED);
 	}
 
 	if (IS_BA_TRANSPORT_PROFILE_SCO(t->type.profile)) {
@@ -162,26 +226,22 @@ static struct ba_msg_transport *ctl_transport(const struct ba_transport *t,
 	return transport;
 }
 
-static void ctl_thread_cmd_ping(struct ba_ctl *ctl, struct ba_request *req, int fd) {
-	(void)ctl;
+static void ctl_thread_cmd_ping(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
 	(void)req;
 	static const struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
-	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
 }
 
-static void ctl_thread_cmd_subscribe(struct ba_ctl *ctl, struct ba_request *req, int fd) {
+static void ctl_thread_cmd_subscribe(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
 
 	static const struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
-	size_t i;
 
-	for (i = __CTL_PFDS_IDX_MAX; i < ctl->pfds->len; i++)
-		if (ctl_pfds_idx(i).fd == fd)
-			ctl_subs_idx(i - __CTL_PFDS_IDX_MAX) = req->events;
+	client->events = req->events;
 
-	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
 }
 
-static void ctl_thread_cmd_list_devices(struct ba_ctl *ctl, struct ba_request *req, int fd) {
+static void ctl_thread_cmd_list_devices(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
 	(void)req;
 
 	static const struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
@@ -193,22 +253,15 @@ static void ctl_thread_cmd_list_devices(struct ba_ctl *ctl, struct ba_request *r
 
 	for (g_hash_table_iter_init(&iter_d, ctl->a->devices);
 			g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d); ) {
-
-		bacpy(&device.addr, &d->addr);
-		strncpy(device.name, d->name, sizeof(device.name) - 1);
-		device.name[sizeof(device.name) - 1] = '\0';
-
-		device.battery = d->battery.enabled;
-		device.battery_level = d->battery.level;
-
-		send(fd, &device, sizeof(device), MSG_NOSIGNAL);
+		ctl_device(d, &device);
+		ctl_send(ctl, client, BA_MSG_TYPE_DEVICE, &device, sizeof(device));
 	}
 
 	pthread_mutex_unlock(&ctl->a->devices_mutex);
-	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
 }
 
-static void ctl_thread_cmd_list_transports(struct ba_ctl *ctl, struct ba_request *req, int fd) {
+static void ctl_thread_cmd_list_transports(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
 	(void)req;
 
 	static const struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
@@ -224,14 +277,14 @@ static void ctl_thread_cmd_list_transports(struct ba_ctl *ctl, struct ba_request
 		for (g_hash_table_iter_init(&iter_t, d->transports);
 				g_hash_table_iter_next(&iter_t, NULL, (gpointer)&t); ) {
 			ctl_transport(t, &transport);
-			send(fd, &transport, sizeof(transport), MSG_NOSIGNAL);
+			ctl_send(ctl, client, BA_MSG_TYPE_TRANSPORT, &transport, sizeof(transport));
 		}
 
 	pthread_mutex_unlock(&ctl->a->devices_mutex);
-	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
 }
 
-static void ctl_thread_cmd_transport_get(struct ba_ctl *ctl, struct ba_request *req, int fd) {
+static void ctl_thread_cmd_transport_get(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
 
 	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
 	struct ba_msg_transport transport;
@@ -249,14 +302,14 @@ static void ctl_thread_cmd_transport_get(struct ba_ctl *ctl, struct ba_request *
 	}
 
 	ctl_transport(t, &transport);
-	send(fd, &transport, sizeof(transport), MSG_NOSIGNAL);
+	ctl_send(ctl, client, BA_MSG_TYPE_TRANSPORT, &transport, sizeof(transport));
 
 fail:
 	pthread_mutex_unlock(&ctl->a->devices_mutex);
-	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
 }
 
-static void ctl_thread_cmd_transport_set_volume(struct ba_ctl *ctl, struct ba_request *req, int fd) {
+static void ctl_thread_cmd_transport_set_volume(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
 
 	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
 	struct ba_transport *t;
@@ -279,10 +332,10 @@ static void ctl_thread_cmd_transport_set_volume(struct ba_ctl *ctl, struct ba_re
 	switch (BA_PCM_TYPE(req->type)) {
 	case BA_PCM_TYPE_A2DP:
 
-		t->a2dp.ch1_muted = req->ch1_muted;
-		t->a2dp.ch2_muted = req->ch2_muted;
-		t->a2dp.ch1_volume = req->ch1_volume;
-		t->a2dp.ch2_volume = req->ch2_volume;
+		__atomic_store_n(&t->a2dp.ch1_muted, req->ch1_muted, __ATOMIC_RELAXED);
+		__atomic_store_n(&t->a2dp.ch2_muted, req->ch2_muted, __ATOMIC_RELAXED);
+		__atomic_store_n(&t->a2dp.ch1_volume, req->ch1_volume, __ATOMIC_RELAXED);
+		__atomic_store_n(&t->a2dp.ch2_volume, req->ch2_volume, __ATOMIC_RELAXED);
 
 		if (config.a2dp.volume) {
 			GError *err = NULL;
@@ -316,10 +369,142 @@ static void ctl_thread_cmd_transport_set_volume(struct ba_ctl *ctl, struct ba_re
 
 fail:
 	pthread_mutex_unlock(&ctl->a->devices_mutex);
-	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
+}
+
+static void ctl_thread_cmd_transport_capture(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
+
+	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	struct ba_transport *t;
+
+	pthread_mutex_lock(&ctl->a->devices_mutex);
+
+	switch (ctl_lookup_transport(ctl->a, &req->addr, req->type, &t)) {
+	case -1:
+		status.code = BA_STATUS_CODE_DEVICE_NOT_FOUND;
+		goto fail;
+	case -2:
+		status.code = BA_STATUS_CODE_STREAM_NOT_FOUND;
+		goto fail;
+	}
+
+	if (!req->capture) {
+		if (t->capture != NULL)
+			ba_capture_stop(t->capture);
+		goto fail;
+	}
+
+	if (t->capture == NULL) {
+		struct ba_capture *c;
+		if ((c = ba_capture_new(IS_BA_TRANSPORT_PROFILE_SCO(t->type.profile) ?
+						BA_CAPTURE_TYPE_SCO : BA_CAPTURE_TYPE_ACL)) == NULL) {
+			status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+			goto fail;
+		}
+		/* publish capture structure to the IO thread */
+		__atomic_store_n(&t->capture, c, __ATOMIC_RELEASE);
+	}
+
+	const char *profile = "sco";
+	if (t->type.profile == BA_TRANSPORT_PROFILE_A2DP_SOURCE)
+		profile = "a2dp-source";
+	else if (t->type.profile == BA_TRANSPORT_PROFILE_A2DP_SINK)
+		profile = "a2dp-sink";
+
+	char addr[18];
+	char path[128];
+
+	ba2str(&t->d->addr, addr);
+	snprintf(path, sizeof(path), BLUEALSA_RUN_STATE_DIR "/%s-%s-%s.pcap",
+			ctl->a->hci_name, addr, profile);
+
+	if (ba_capture_start(t->capture, path) == -1) {
+		if (errno == EALREADY)
+			status.code = BA_STATUS_CODE_DEVICE_BUSY;
+		else {
+			error("Couldn't start traffic capture: %s", strerror(errno));
+			status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+		}
+	}
+
+fail:
+	pthread_mutex_unlock(&ctl->a->devices_mutex);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
+}
+
+static void ctl_thread_cmd_transport_set_codec(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
+
+	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	struct ba_transport *t;
+	struct ba_device *d;
+
+	pthread_mutex_lock(&ctl->a->devices_mutex);
+
+	switch (ctl_lookup_transport(ctl->a, &req->addr, req->type, &t)) {
+	case -1:
+		status.code = BA_STATUS_CODE_DEVICE_NOT_FOUND;
+		goto fail;
+	case -2:
+		status.code = BA_STATUS_CODE_STREAM_NOT_FOUND;
+		goto fail;
+	}
+
+	/* Only the initiator of the A2DP stream can select the codec. */
+	if (t->type.profile != BA_TRANSPORT_PROFILE_A2DP_SOURCE) {
+		status.code = BA_STATUS_CODE_FORBIDDEN;
+		goto fail;
+	}
+
+	if (t->type.codec == req->codec)
+		goto fail;
+
+	/* The PCM format can not be changed while the PCM is opened, so the new
+	 * configuration has to use the same one. */
+	const unsigned int channels = transport_get_channels(t);
+	const unsigned int sampling = transport_get_sampling(t);
+	char *transport_path;
+
+	if ((transport_path = strdup(t->dbus_path)) == NULL) {
+		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+		goto fail;
+	}
+
+	t->a2dp.handover = true;
+
+	debug("Switching codec: %s: %s -> %s", batostr_(&req->addr),
+			bluetooth_a2dp_codec_to_string(t->type.codec),
+			bluetooth_a2dp_codec_to_string(req->codec));
+
+	/* During the reconfiguration BlueZ calls our end-points, which are
+	 * handled by the main thread. Hence, we have to release the lock. */
+	pthread_mutex_unlock(&ctl->a->devices_mutex);
+	int ret = bluez_a2dp_reconfigure(transport_path, req->codec, channels, sampling);
+	int err = errno;
+	pthread_mutex_lock(&ctl->a->devices_mutex);
+
+	if (ret == -1)
+		status.code = err == ENOTSUP ?
+			BA_STATUS_CODE_CODEC_NOT_SUPPORTED : BA_STATUS_CODE_ERROR_UNKNOWN;
+
+	/* The SetConfiguration reply and the call of our end-point are dispatched
+	 * by different threads, so the new transport might not be set up yet.
+	 * The PCM is resumed by the new transport when it takes it over, and
+	 * the PCM which is not taken over is dropped after a timeout. However,
+	 * if the old transport has not been cleared, it shall not be handed
+	 * over anymore. */
+	if (ret == -1 &&
+			(d = ba_device_lookup(ctl->a, &req->addr)) != NULL &&
+			(t = ba_transport_lookup(d, transport_path)) != NULL)
+		t->a2dp.handover = false;
+
+	free(transport_path);
+
+fail:
+	pthread_mutex_unlock(&ctl->a->devices_mutex);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
 }
 
-static void ctl_thread_cmd_pcm_open(struct ba_ctl *ctl, struct ba_request *req, int fd) {
+static void ctl_thread_cmd_pcm_open(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
 
 	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
 	struct ba_transport *t;
@@ -352,38 +537,155 @@ static void ctl_thread_cmd_pcm_open(struct ba_ctl *ctl, struct ba_request *req,
 		goto final;
 	}
 
-	if (pipe(pipefd) == -1) {
-		error("Couldn't create FIFO: %s", strerror(errno));
-		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+	/* PCM is consumed by the built-in output */
+	if (t_pcm->output != NULL) {
+		status.code = BA_STATUS_CODE_DEVICE_BUSY;
+		goto final;
+	}
+
+	/* Passing encoded data through the PCM FIFO would be a disaster if the
+	 * client had not negotiated the passthrough mode, so reject it. */
+	const bool passthrough = req->pcm_flags & BA_PCM_FLAG_PASSTHROUGH;
+	if (passthrough && !(client->capabilities & BA_CAPABILITY_PCM_PASSTHROUGH)) {
+		status.code = BA_STATUS_CODE_FORBIDDEN;
+		goto final;
+	}
+
+	if (passthrough) {
+		if (t->type.profile != BA_TRANSPORT_PROFILE_A2DP_SOURCE) {
+			status.code = BA_STATUS_CODE_FORBIDDEN;
+			goto final;
+		}
+		switch (t->type.codec) {
+		case A2DP_CODEC_SBC:
+#if ENABLE_MPEG
+		case A2DP_CODEC_MPEG12:
+#endif
+#if ENABLE_AAC
+		case A2DP_CODEC_MPEG24:
+#endif
+			break;
+		default:
+			status.code = BA_STATUS_CODE_CODEC_NOT_SUPPORTED;
+			goto final;
+		}
+	}
+
+	/* The IO thread routine is selected upon thread creation, so it is not
+	 * possible to switch modes while the thread is still running (e.g. in the
+	 * keep-alive mode after the previous client has closed the PCM). */
+	if (!pthread_equal(t->thread, config.main_thread) &&
+			t_pcm->passthrough != passthrough) {
+		status.code = BA_STATUS_CODE_DEVICE_BUSY;
+		goto final;
+	}
+
+	const bool shm = !passthrough &&
+		req->pcm_flags & BA_PCM_FLAG_SHM &&
+		client->capabilities & BA_CAPABILITY_PCM_SHM;
+	/* file descriptors sent to the client */
+	int fds[3] = { -1, -1, -1 };
+	size_t fds_count = 1;
+
+	/* Free ring buffer left by the previous PCM client (if any). The IO thread
+	 * is not stopped when the client disconnects, so it might be still using
+	 * the ring buffer (e.g. in the keep-alive mode). If the IO thread does
+	 * not respond in time (e.g. it is stalled on the BT link), report the
+	 * PCM as busy rather than blocking all other control clients. */
+	if (transport_free_pcm_sync(t, t_pcm) == -1) {
+		status.code = BA_STATUS_CODE_DEVICE_BUSY;
 		goto final;
 	}
 
+	if (shm) {
+
+		/* The ring buffer has to be big enough to store the whole client
+		 * buffer, but do not let the client exhaust our memory. */
+		size_t size = MIN(MAX(req->pcm_buffer_size, 4096), 1024 * 1024 * 16);
+
+		t_pcm->ring_pos = 0;
+		if ((fds[0] = ba_pcm_ring_create(size)) == -1 ||
+				(t_pcm->ring = ba_pcm_ring_map(fds[0], &t_pcm->ring_size)) == NULL ||
+				(fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+				(fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			error("Couldn't create PCM ring buffer: %s", strerror(errno));
+			status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+			goto fail;
+		}
+
+		debug("PCM ring buffer size: %u", t_pcm->ring_size);
+
+		/* The server-side eventfd (signaled by the client when new data is
+		 * available) replaces the FIFO, so it might be polled by our IO
+		 * thread. The client-side eventfd is used for client notifications
+		 * - it is also duplicated, so the client might poll it. */
+		t_pcm->fd = fds[1];
+		if ((t_pcm->ring_fd = dup(fds[2])) == -1) {
+			status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+			goto fail;
+		}
+
+		fds_count = 3;
+
+	}
+	else if (passthrough) {
+
+		/* The SOCK_SEQPACKET socket preserves boundaries of the messages, so
+		 * our IO thread will always receive complete codec frames. */
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pipefd) == -1) {
+			error("Couldn't create PCM socket: %s", strerror(errno));
+			status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+			goto final;
+		}
+
+		t_pcm->fd = pipefd[0];
+		fds[0] = pipefd[1];
+
+	}
+	else {
+
+		if (pipe(pipefd) == -1) {
+			error("Couldn't create FIFO: %s", strerror(errno));
+			status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
+			goto final;
+		}
+
+		if (req->type & BA_PCM_STREAM_PLAYBACK) {
+			t_pcm->fd = pipefd[0];
+			fds[0] = pipefd[1];
+		}
+		else {
+			t_pcm->fd = pipefd[1];
+			fds[0] = pipefd[0];
+		}
+
+	}
+
 	union {
-		char buf[CMSG_SPACE(sizeof(int))];
+		char buf[CMSG_SPACE(sizeof(fds))];
 		struct cmsghdr _align;
 	} control_un;
-	struct iovec io = { .iov_base = "", .iov_len = 1 };
+	/* The file descriptor is transferred with the PCM message, which
+	 * has no payload. Legacy clients expect a single dummy byte. */
+	struct ba_msg_header header = { .type = BA_MSG_TYPE_PCM, .length = 0 };
+	struct iovec io = { .iov_base = &header, .iov_len = sizeof(header) };
+	if (client->version == BLUEALSA_CRL_PROTO_VERSION_LEGACY) {
+		io.iov_base = "";
+		io.iov_len = 1;
+	}
+
 	struct msghdr msg = {
 		.msg_iov = &io,
 		.msg_iovlen = 1,
 		.msg_control = control_un.buf,
-		.msg_controllen = sizeof(control_un.buf),
+		.msg_controllen = CMSG_SPACE(sizeof(int) * fds_count),
 	};
 
 	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
 	cmsg->cmsg_level = SOL_SOCKET;
 	cmsg->cmsg_type = SCM_RIGHTS;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-	int *fdptr = (int *)CMSG_DATA(cmsg);
-
-	if (req->type & BA_PCM_STREAM_PLAYBACK) {
-		t_pcm->fd = pipefd[0];
-		*fdptr = pipefd[1];
-	}
-	else {
-		t_pcm->fd = pipefd[1];
-		*fdptr = pipefd[0];
-	}
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds_count);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fds_count);
 
 	/* Set our internal FIFO endpoint as non-blocking. */
 	if (fcntl(t_pcm->fd, F_SETFL, O_NONBLOCK) == -1) {
@@ -391,6 +693,8 @@ static void ctl_thread_cmd_pcm_open(struct ba_ctl *ctl, struct ba_request *req,
 		goto fail;
 	}
 
+	t_pcm->passthrough = passthrough;
+
 	/* Notify our IO thread, that the FIFO has just been created - it may be
 	 * used for poll() right away. */
 	transport_send_signal(t, TRANSPORT_PCM_OPEN);
@@ -405,28 +709,42 @@ static void ctl_thread_cmd_pcm_open(struct ba_ctl *ctl, struct ba_request *req,
 			goto fail;
 		}
 
-	if (sendmsg(fd, &msg, 0) == -1) {
+	if (sendmsg(client->fd, &msg, MSG_NOSIGNAL) == -1) {
 		status.code = BA_STATUS_CODE_ERROR_UNKNOWN;
 		goto fail;
 	}
 
-	t_pcm->client = fd;
-	close(*fdptr);
+	t_pcm->client = client->fd;
+	for (size_t i = 0; i < fds_count; i++)
+		close(fds[i]);
 	goto final;
 
 fail:
-	close(pipefd[0]);
-	close(pipefd[1]);
+	if (shm) {
+		for (size_t i = 0; i < ARRAYSIZE(fds); i++)
+			if (fds[i] != -1)
+				close(fds[i]);
+		if (t_pcm->ring_fd != -1)
+			close(t_pcm->ring_fd);
+		t_pcm->ring_fd = -1;
+		if (t_pcm->ring != NULL)
+			ba_pcm_ring_unmap(t_pcm->ring, t_pcm->ring_size);
+		t_pcm->ring = NULL;
+	}
+	else {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
 	t_pcm->fd = -1;
 
 final:
 	pthread_mutex_unlock(&t->mutex);
 fail_lookup:
 	pthread_mutex_unlock(&ctl->a->devices_mutex);
-	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
 }
 
-static void ctl_thread_cmd_pcm_control(struct ba_ctl *ctl, struct ba_request *req, int fd) {
+static void ctl_thread_cmd_pcm_control(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
 
 	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
 	struct ba_transport *t;
@@ -442,7 +760,7 @@ static void ctl_thread_cmd_pcm_control(struct ba_ctl *ctl, struct ba_request *re
 		status.code = BA_STATUS_CODE_STREAM_NOT_FOUND;
 		goto fail;
 	}
-	if ((t_pcm = ctl_lookup_pcm(t, req->type, fd)) == NULL) {
+	if ((t_pcm = ctl_lookup_pcm(t, req->type, client->fd)) == NULL) {
 		status.code = BA_STATUS_CODE_FORBIDDEN;
 		goto fail;
 	}
@@ -468,10 +786,10 @@ static void ctl_thread_cmd_pcm_control(struct ba_ctl *ctl, struct ba_request *re
 
 fail:
 	pthread_mutex_unlock(&ctl->a->devices_mutex);
-	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
 }
 
-static void ctl_thread_cmd_rfcomm_send(struct ba_ctl *ctl, struct ba_request *req, int fd) {
+static void ctl_thread_cmd_rfcomm_send(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
 
 	struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
 	struct ba_transport *t;
@@ -491,31 +809,344 @@ static void ctl_thread_cmd_rfcomm_send(struct ba_ctl *ctl, struct ba_request *re
 
 fail:
 	pthread_mutex_unlock(&ctl->a->devices_mutex);
-	send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
+}
+
+static void ctl_thread_cmd_snapshot(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
+	(void)req;
+
+	static const struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	struct ba_msg_snapshot snapshot = { 0 };
+	struct ba_msg_device device;
+	struct ba_msg_transport transport;
+	GByteArray *devices = g_byte_array_new();
+	GByteArray *transports = g_byte_array_new();
+	GHashTableIter iter_d, iter_t;
+	struct ba_device *d;
+	struct ba_transport *t;
+
+	pthread_mutex_lock(&ctl->a->devices_mutex);
+
+	for (g_hash_table_iter_init(&iter_d, ctl->a->devices);
+			g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d); ) {
+
+		ctl_device(d, &device);
+		g_byte_array_append(devices, (guint8 *)&device, sizeof(device));
+		snapshot.devices++;
+
+		for (g_hash_table_iter_init(&iter_t, d->transports);
+				g_hash_table_iter_next(&iter_t, NULL, (gpointer)&t); ) {
+			ctl_transport(t, &transport);
+			g_byte_array_append(transports, (guint8 *)&transport, sizeof(transport));
+			snapshot.transports++;
+		}
+
+	}
+
+	pthread_mutex_unlock(&ctl->a->devices_mutex);
+
+	/* Put everything into a single message, so the client will get the
+	 * consistent state of the controller within one round trip. */
+	g_byte_array_prepend(devices, (guint8 *)&snapshot, sizeof(snapshot));
+	g_byte_array_append(devices, transports->data, transports->len);
+	ctl_send(ctl, client, BA_MSG_TYPE_SNAPSHOT, devices->data, devices->len);
+
+	g_byte_array_free(devices, TRUE);
+	g_byte_array_free(transports, TRUE);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
+}
+
+static void ctl_thread_cmd_stats(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
+	(void)req;
+
+	static const struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	struct ba_msg_transport_stats stats;
+	GHashTableIter iter_d, iter_t;
+	struct ba_device *d;
+	struct ba_transport *t;
+
+	pthread_mutex_lock(&ctl->a->devices_mutex);
+
+	for (g_hash_table_iter_init(&iter_d, ctl->a->devices);
+			g_hash_table_iter_next(&iter_d, NULL, (gpointer)&d); )
+		for (g_hash_table_iter_init(&iter_t, d->transports);
+				g_hash_table_iter_next(&iter_t, NULL, (gpointer)&t); ) {
+
+			/* RFCOMM transport has no audio */
+			if (t->type.profile == BA_TRANSPORT_PROFILE_RFCOMM)
+				continue;
+
+			memset(&stats, 0, sizeof(stats));
+			ctl_transport(t, &stats.transport);
+			stats.bt_bytes = __atomic_load_n(&t->stats.bt_bytes, __ATOMIC_RELAXED);
+			stats.bt_packets = __atomic_load_n(&t->stats.bt_packets, __ATOMIC_RELAXED);
+			stats.rtp_lost = __atomic_load_n(&t->stats.rtp_lost, __ATOMIC_RELAXED);
+			stats.codec_time = __atomic_load_n(&t->stats.codec_time, __ATOMIC_RELAXED);
+			stats.bt_queued = __atomic_load_n(&t->stats.bt_queued, __ATOMIC_RELAXED);
+
+			ctl_send(ctl, client, BA_MSG_TYPE_STATS, &stats, sizeof(stats));
+		}
+
+	pthread_mutex_unlock(&ctl->a->devices_mutex);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
+}
+
+static void ctl_thread_cmd_batch(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req);
+
+static void (*ctl_commands[__BA_COMMAND_MAX])(struct ba_ctl *, struct ba_ctl_client *, struct ba_request *) = {
+	[BA_COMMAND_PING] = ctl_thread_cmd_ping,
+	[BA_COMMAND_SUBSCRIBE] = ctl_thread_cmd_subscribe,
+	[BA_COMMAND_LIST_DEVICES] = ctl_thread_cmd_list_devices,
+	[BA_COMMAND_LIST_TRANSPORTS] = ctl_thread_cmd_list_transports,
+	[BA_COMMAND_TRANSPORT_GET] = ctl_thread_cmd_transport_get,
+	[BA_COMMAND_TRANSPORT_SET_VOLUME] = ctl_thread_cmd_transport_set_volume,
+	[BA_COMMAND_PCM_OPEN] = ctl_thread_cmd_pcm_open,
+	[BA_COMMAND_PCM_PAUSE] = ctl_thread_cmd_pcm_control,
+	[BA_COMMAND_PCM_RESUME] = ctl_thread_cmd_pcm_control,
+	[BA_COMMAND_PCM_DRAIN] = ctl_thread_cmd_pcm_control,
+	[BA_COMMAND_PCM_DROP] = ctl_thread_cmd_pcm_control,
+	[BA_COMMAND_RFCOMM_SEND] = ctl_thread_cmd_rfcomm_send,
+	[BA_COMMAND_SNAPSHOT] = ctl_thread_cmd_snapshot,
+	[BA_COMMAND_BATCH] = ctl_thread_cmd_batch,
+	[BA_COMMAND_STATS] = ctl_thread_cmd_stats,
+	[BA_COMMAND_TRANSPORT_CAPTURE] = ctl_thread_cmd_transport_capture,
+	[BA_COMMAND_TRANSPORT_SET_CODEC] = ctl_thread_cmd_transport_set_codec,
+};
+
+/**
+ * Execute requests embedded in the batch request.
+ *
+ * Requests are executed in order. Responses for all of them are sent back
+ * to the client as a single message, which is followed by the status of
+ * the batch request itself. Note, that requests which have to transfer file
+ * descriptors (PCM open) and nested batches are not allowed. */
+static void ctl_thread_cmd_batch(struct ba_ctl *ctl, struct ba_ctl_client *client, struct ba_request *req) {
+
+	static const struct ba_msg_status status = { BA_STATUS_CODE_SUCCESS };
+	static const struct ba_msg_status forbidden = { BA_STATUS_CODE_FORBIDDEN };
+	GByteArray *batch = g_byte_array_new();
+	size_t i;
+
+	ctl->batch = batch;
+
+	for (i = 1; i <= req->batch_count; i++) {
+
+		struct ba_request *r = &req[i];
+		struct ba_msg_batch entry = { 0 };
+		const size_t offset = batch->len;
+
+		/* reserve space for the entry header */
+		g_byte_array_append(batch, (guint8 *)&entry, sizeof(entry));
+
+		switch (r->command) {
+		case BA_COMMAND_PCM_OPEN:
+		case BA_COMMAND_BATCH:
+			ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &forbidden, sizeof(forbidden));
+			break;
+		default:
+			if (r->command < __BA_COMMAND_MAX && ctl_commands[r->command] != NULL)
+				ctl_commands[r->command](ctl, client, r);
+			else {
+				warn("Invalid batch command: %u", r->command);
+				ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &forbidden, sizeof(forbidden));
+			}
+		}
+
+		entry.length = batch->len - offset - sizeof(entry);
+		memcpy(&batch->data[offset], &entry, sizeof(entry));
+
+	}
+
+	ctl->batch = NULL;
+
+	ctl_send(ctl, client, BA_MSG_TYPE_BATCH, batch->data, batch->len);
+	g_byte_array_free(batch, TRUE);
+	ctl_send(ctl, client, BA_MSG_TYPE_STATUS, &status, sizeof(status));
+}
+
+/**
+ * Receive request message from the client.
+ *
+ * @param client Pointer to the client structure.
+ * @param requests Address of the array with at least 1 + BA_BATCH_MAX
+ *   elements, where received requests will be stored.
+ * @return On success this function returns the number of received requests.
+ *   If the client has closed the connection or the message is malformed, -1
+ *   is returned. */
+static ssize_t ctl_recv(struct ba_ctl_client *client, struct ba_request *requests) {
+
+	union {
+		uint8_t data[sizeof(struct ba_msg_header) + BA_MSG_REQUEST_MAX];
+		struct ba_msg_header header;
+	} buffer;
+	const uint8_t *payload = buffer.data;
+	size_t count = 1;
+	ssize_t len;
+
+	if ((len = recv(client->fd, buffer.data, sizeof(buffer.data), MSG_DONTWAIT)) <= 0) {
+		if (len == 0)
+			debug("Client closed connection: %d", client->fd);
+		return -1;
+	}
+
+	if (client->version != BLUEALSA_CRL_PROTO_VERSION_LEGACY) {
+		if (len < (ssize_t)sizeof(buffer.header) ||
+				buffer.header.type != BA_MSG_TYPE_REQUEST ||
+				buffer.header.length != len - sizeof(buffer.header)) {
+			debug("Invalid request message: %d", client->fd);
+			return -1;
+		}
+		payload += sizeof(buffer.header);
+		len -= sizeof(buffer.header);
+	}
+
+	if (len < (ssize_t)sizeof(requests->command)) {
+		debug("Invalid request length: %zd", len);
+		return -1;
+	}
+
+	/* framed request might be truncated - missing fields are zeroed */
+	memset(requests, 0, sizeof(*requests));
+	memcpy(requests, payload, MIN((size_t)len, sizeof(*requests)));
+
+	/* The batch request is the only one which is followed by other
+	 * requests within the same message. Make sure, that the length
+	 * of the received message matches the number of requests. */
+	if (requests[0].command == BA_COMMAND_BATCH)
+		count += requests[0].batch_count;
+
+	if ((size_t)len != sizeof(*requests) * count &&
+			(client->version == BLUEALSA_CRL_PROTO_VERSION_LEGACY || count != 1 ||
+			 (size_t)len > sizeof(*requests))) {
+		debug("Invalid request length: %zd != %zd", len, sizeof(*requests) * count);
+		return -1;
+	}
+
+	if (count > 1)
+		memcpy(requests, payload, len);
+
+	return count;
+}
+
+/**
+ * Queue event notification for the subscribed client.
+ *
+ * If the last queued event for the same device and transport carries state
+ * change notifications only, the new event is merged into it. Events which
+ * add or remove transports are never merged, so their order is preserved.
+ *
+ * @param client Pointer to the client structure.
+ * @param ev Address of the event structure.
+ * @return This function returns true if the event has been queued. */
+static bool ctl_queue_event(struct ba_ctl_client *client, const struct ba_msg_event *ev) {
+
+	GArray *pending = client->events_pending;
+	const uint8_t events = ev->events & client->events;
+	size_t i;
+
+	if (events == 0)
+		return false;
+
+	for (i = pending->len; i > 0; i--) {
+		struct ba_msg_event *e = &g_array_index(pending, struct ba_msg_event, i - 1);
+		if (e->type != ev->type || bacmp(&e->addr, &ev->addr) != 0)
+			continue;
+		if (!(e->events & ~CTL_EVENT_MASK_MERGEABLE) &&
+				!(events & ~CTL_EVENT_MASK_MERGEABLE)) {
+			e->events |= events;
+			return true;
+		}
+		break;
+	}
+
+	struct ba_msg_event e = { .events = events, .addr = ev->addr, .type = ev->type };
+	g_array_append_val(pending, e);
+	return true;
+}
+
+/**
+ * Update event payload with the current device and transport state.
+ *
+ * This function is not thread-safe. The devices mutex has to be acquired
+ * before calling it. */
+static void ctl_event_payload(struct ba_adapter *a, struct ba_msg_event *ev) {
+
+	struct ba_device *d;
+	struct ba_transport *t;
+
+	ev->payload = 0;
+	memset(&ev->device, 0, sizeof(ev->device));
+	memset(&ev->transport, 0, sizeof(ev->transport));
+
+	if ((d = ba_device_lookup(a, &ev->addr)) != NULL) {
+		ctl_device(d, &ev->device);
+		ev->payload |= BA_EVENT_PAYLOAD_DEVICE;
+	}
+
+	if (ev->type != BA_PCM_TYPE_NULL &&
+			ctl_lookup_transport(a, &ev->addr, ev->type, &t) == 0) {
+		ctl_transport(t, &ev->transport);
+		ev->payload |= BA_EVENT_PAYLOAD_TRANSPORT;
+	}
+
+}
+
+/**
+ * Send pending event notifications to all subscribed clients. */
+static void ctl_flush_events(struct ba_ctl *ctl) {
+
+	size_t i, j;
+
+	/* Fill in the state payload for all events in one go, so the devices
+	 * mutex is not held while sending data to (possibly slow) clients. */
+	pthread_mutex_lock(&ctl->a->devices_mutex);
+	for (i = 0; i < ctl->clients->len; i++) {
+		struct ba_ctl_client *client = &ctl_clients_idx(i);
+		if (client->capabilities & BA_CAPABILITY_EVENT_PAYLOAD)
+			for (j = 0; j < client->events_pending->len; j++)
+				ctl_event_payload(ctl->a, &g_array_index(client->events_pending, struct ba_msg_event, j));
+	}
+	pthread_mutex_unlock(&ctl->a->devices_mutex);
+
+	for (i = 0; i < ctl->clients->len; i++) {
+		struct ba_ctl_client *client = &ctl_clients_idx(i);
+		const size_t size = client->capabilities & BA_CAPABILITY_EVENT_PAYLOAD ?
+			sizeof(struct ba_msg_event) : BA_MSG_EVENT_BASIC_SIZE;
+		for (j = 0; j < client->events_pending->len; j++) {
+			struct ba_msg_event *ev = &g_array_index(client->events_pending, struct ba_msg_event, j);
+			debug("Sending notification: %B => %d", ev->events, client->fd);
+			ctl_send(ctl, client, BA_MSG_TYPE_EVENT, ev, size);
+		}
+		g_array_set_size(client->events_pending, 0);
+	}
+
+	ctl->evt_pending = false;
+}
+
+/**
+ * Get the poll() timeout for the pending events flush. */
+static int ctl_flush_events_timeout(struct ba_ctl *ctl) {
+
+	struct timespec now, diff;
+
+	if (!ctl->evt_pending)
+		return -1;
+
+	gettimestamp(&now);
+	if (difftimespec(&now, &ctl->evt_flush_ts, &diff) <= 0)
+		return 0;
+
+	return diff.tv_sec * 1000 + (diff.tv_nsec + 999999) / 1000000;
 }
 
 static void *ctl_thread(void *arg) {
 	struct ba_ctl *ctl = (struct ba_ctl *)arg;
 
-	static void (*commands[__BA_COMMAND_MAX])(struct ba_ctl *, struct ba_request *, int) = {
-		[BA_COMMAND_PING] = ctl_thread_cmd_ping,
-		[BA_COMMAND_SUBSCRIBE] = ctl_thread_cmd_subscribe,
-		[BA_COMMAND_LIST_DEVICES] = ctl_thread_cmd_list_devices,
-		[BA_COMMAND_LIST_TRANSPORTS] = ctl_thread_cmd_list_transports,
-		[BA_COMMAND_TRANSPORT_GET] = ctl_thread_cmd_transport_get,
-		[BA_COMMAND_TRANSPORT_SET_VOLUME] = ctl_thread_cmd_transport_set_volume,
-		[BA_COMMAND_PCM_OPEN] = ctl_thread_cmd_pcm_open,
-		[BA_COMMAND_PCM_PAUSE] = ctl_thread_cmd_pcm_control,
-		[BA_COMMAND_PCM_RESUME] = ctl_thread_cmd_pcm_control,
-		[BA_COMMAND_PCM_DRAIN] = ctl_thread_cmd_pcm_control,
-		[BA_COMMAND_PCM_DROP] = ctl_thread_cmd_pcm_control,
-		[BA_COMMAND_RFCOMM_SEND] = ctl_thread_cmd_rfcomm_send,
-	};
-
 	debug("Starting controller loop: %s", ctl->a->hci_name);
 	for (;;) {
 
-		if (poll((struct pollfd *)ctl->pfds->data, ctl->pfds->len, -1) == -1) {
+		if (poll((struct pollfd *)ctl->pfds->data, ctl->pfds->len,
+					ctl_flush_events_timeout(ctl)) == -1) {
 			if (errno == EINTR)
 				continue;
 			error("Controller poll error: %s", strerror(errno));
@@ -528,18 +1159,13 @@ static void *ctl_thread(void *arg) {
 		for (i = __CTL_PFDS_IDX_MAX; i < ctl->pfds->len; i++)
 			if (ctl_pfds_idx(i).revents & POLLIN) {
 
-				const int fd = ctl_pfds_idx(i).fd;
-				struct ba_request request;
-				ssize_t len;
+				struct ba_ctl_client *client = &ctl_clients_idx(i - __CTL_PFDS_IDX_MAX);
+				struct ba_request requests[1 + BA_BATCH_MAX];
+				const int fd = client->fd;
 
-				if ((len = recv(fd, &request, sizeof(request), MSG_DONTWAIT)) != sizeof(request)) {
+				if (ctl_recv(client, requests) == -1) {
 					/* if the request cannot be retrieved, release resources */
 
-					if (len == 0)
-						debug("Client closed connection: %d", fd);
-					else
-						debug("Invalid request length: %zd != %zd", len, sizeof(request));
-
 					GHashTableIter iter_d, iter_t;
 					struct ba_device *d;
 					struct ba_transport *t;
@@ -572,17 +1198,18 @@ static void *ctl_thread(void *arg) {
 
 					pthread_mutex_unlock(&ctl->a->devices_mutex);
 
+					g_array_free(client->events_pending, TRUE);
 					g_array_remove_index_fast(ctl->pfds, i);
-					g_array_remove_index_fast(ctl->subs, i - __CTL_PFDS_IDX_MAX);
+					g_array_remove_index_fast(ctl->clients, i - __CTL_PFDS_IDX_MAX);
 					close(fd);
 					continue;
 				}
 
 				/* validate and execute requested command */
-				if (request.command < __BA_COMMAND_MAX && commands[request.command] != NULL)
-					commands[request.command](ctl, &request, fd);
+				if (requests[0].command < __BA_COMMAND_MAX && ctl_commands[requests[0].command] != NULL)
+					ctl_commands[requests[0].command](ctl, client, requests);
 				else
-					warn("Invalid command: %u", request.command);
+					warn("Invalid command: %u", requests[0].command);
 
 			}
 
@@ -590,25 +1217,44 @@ static void *ctl_thread(void *arg) {
 		if (ctl_pfds_idx(CTL_PFDS_IDX_SRV).revents & POLLIN) {
 
 			struct pollfd fd = { -1, POLLIN, 0 };
-			uint16_t ver = 0;
+			struct ba_msg_hello hello = { 0 };
+			ssize_t len = 0;
 
 			fd.fd = accept(ctl_pfds_idx(CTL_PFDS_IDX_SRV).fd, NULL, NULL);
 			debug("Received new connection: %d", fd.fd);
 
+			/* Legacy clients send the protocol version only, so the length of
+			 * the handshake message determines the protocol framing. */
 			errno = ETIMEDOUT;
 			if (poll(&fd, 1, 500) <= 0 ||
-					recv(fd.fd, &ver, sizeof(ver), MSG_DONTWAIT) != sizeof(ver)) {
+					(len = recv(fd.fd, &hello, sizeof(hello), MSG_DONTWAIT)) < (ssize_t)sizeof(hello.version)) {
 				warn("Couldn't receive protocol version: %s", strerror(errno));
 				close(fd.fd);
 			}
-			else if (ver != BLUEALSA_CRL_PROTO_VERSION) {
-				warn("Invalid protocol version: %#06x != %#06x", ver, BLUEALSA_CRL_PROTO_VERSION);
+			else if (!(hello.version == BLUEALSA_CRL_PROTO_VERSION && len == sizeof(hello)) &&
+					!(hello.version == BLUEALSA_CRL_PROTO_VERSION_LEGACY && len == sizeof(hello.version))) {
+				warn("Invalid protocol version: %#06x != %#06x", hello.version, BLUEALSA_CRL_PROTO_VERSION);
 				close(fd.fd);
 			}
 			else {
-				debug("New client accepted: %d", fd.fd);
+
+				struct ba_ctl_client client = {
+					.fd = fd.fd,
+					.version = hello.version,
+					.events_pending = g_array_new(FALSE, FALSE, sizeof(struct ba_msg_event)),
+				};
+
+				if (client.version != BLUEALSA_CRL_PROTO_VERSION_LEGACY) {
+					/* reply with capabilities supported by both sides */
+					client.capabilities = hello.capabilities & BA_CAPABILITIES_ALL;
+					hello.capabilities = client.capabilities;
+					send(fd.fd, &hello, sizeof(hello), MSG_NOSIGNAL);
+				}
+
+				debug("New client accepted: %d (%#06x)", fd.fd, client.version);
 				g_array_append_val(ctl->pfds, fd);
-				g_array_set_size(ctl->subs, ctl->subs->len + 1);
+				g_array_append_val(ctl->clients, client);
+
 			}
 
 		}
@@ -616,21 +1262,36 @@ static void *ctl_thread(void *arg) {
 		/* generate notifications for subscribed clients */
 		if (ctl_pfds_idx(CTL_PFDS_IDX_EVT).revents & POLLIN) {
 
-			struct ba_msg_event ev;
-			size_t i;
+			/* Writes to the PIPE are atomic, so we can safely read more than
+			 * one event at once - there will be no partial reads. */
+			struct ba_msg_event events[16];
+			ssize_t len;
+			size_t i, j;
 
-			if (read(ctl_pfds_idx(CTL_PFDS_IDX_EVT).fd, &ev, sizeof(ev)) == -1)
+			if ((len = read(ctl_pfds_idx(CTL_PFDS_IDX_EVT).fd, events, sizeof(events))) == -1) {
 				warn("Couldn't read controller event: %s", strerror(errno));
+				len = 0;
+			}
 
-			for (i = 0; i < ctl->subs->len; i++)
-				if (ctl_subs_idx(i) & ev.events) {
-					const int client = ctl_pfds_idx(i + __CTL_PFDS_IDX_MAX).fd;
-					debug("Sending notification: %B => %d", ev.events, client);
-					send(client, &ev, sizeof(ev), MSG_NOSIGNAL);
-				}
+			for (i = 0; i < len / sizeof(*events); i++)
+				for (j = 0; j < ctl->clients->len; j++)
+					if (ctl_queue_event(&ctl_clients_idx(j), &events[i]) &&
+							!ctl->evt_pending) {
+						/* start the coalescing window */
+						gettimestamp(&ctl->evt_flush_ts);
+						ctl->evt_flush_ts.tv_nsec += CTL_EVENT_COALESCE_MS * 1000000;
+						if (ctl->evt_flush_ts.tv_nsec >= 1000000000) {
+							ctl->evt_flush_ts.tv_nsec -= 1000000000;
+							ctl->evt_flush_ts.tv_sec++;
+						}
+						ctl->evt_pending = true;
+					}
 
 		}
 
+		if (ctl_flush_events_timeout(ctl) == 0)
+			ctl_flush_events(ctl);
+
 		debug("+-+-");
 	}
 
@@ -653,13 +1314,16 @@ struct ba_ctl *bluealsa_ctl_init(struct ba_adapter *adapter) {
 
 	ctl->evt[0] = -1;
 	ctl->evt[1] = -1;
+	ctl->evt_pending = false;
+
+	ctl->batch = NULL;
 
 	/* Create arrays for handling connected clients. Note, that it is not
 	 * necessary to clear pfds array, because we have to initialize pollfd
 	 * struct by ourself anyway. Also, make sure to reserve some space, so
 	 * for most cases reallocation will not be required. */
 	ctl->pfds = g_array_sized_new(FALSE, FALSE, sizeof(struct pollfd), __CTL_PFDS_IDX_MAX + 16);
-	ctl->subs = g_array_sized_new(FALSE, TRUE, sizeof(enum ba_event), 16);
+	ctl->clients = g_array_sized_new(FALSE, TRUE, sizeof(struct ba_ctl_client), 16);
 
 	struct sockaddr_un saddr = { .sun_family = AF_UNIX };
 	snprintf(saddr.sun_path, sizeof(saddr.sun_path) - 1,
@@ -741,15 +1405,22 @@ void bluealsa_ctl_free(struct ba_ctl *ctl) {
 
 	if (ctl->pfds != NULL)
 		g_array_free(ctl->pfds, TRUE);
-	if (ctl->subs != NULL)
-		g_array_free(ctl->subs, TRUE);
+	if (ctl->clients != NULL) {
+		for (i = 0; i < ctl->clients->len; i++)
+			g_array_free(ctl_clients_idx(i).events_pending, TRUE);
+		g_array_free(ctl->clients, TRUE);
+	}
 
 	free(ctl);
 
 }
 
 /**
- * Send notification event to subscribed clients. */
+ * Send notification event to subscribed clients.
+ *
+ * Events are not delivered right away. Instead, they are queued for a short
+ * period of time, so a burst of events for the same transport (e.g. volume
+ * knob turning) results in a single notification. */
 int bluealsa_ctl_send_event(
 		struct ba_ctl *ctl,
 		enum ba_event event,
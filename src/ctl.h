@@ -16,12 +16,32 @@
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <glib.h>
 
 #include "ba-adapter.h"
 #include "shared/ctl-proto.h"
 
+/* State of the client connected to the controller. */
+struct ba_ctl_client {
+
+	/* client socket */
+	int fd;
+
+	/* negotiated protocol version */
+	uint16_t version;
+	/* negotiated capabilities */
+	uint32_t capabilities;
+
+	/* bit-mask with event subscriptions */
+	enum ba_event events;
+	/* events waiting for the coalescing window to elapse */
+	GArray *events_pending;
+
+};
+
 struct ba_ctl {
 
 	pthread_t thread;
@@ -33,11 +53,18 @@ struct ba_ctl {
 
 	/* special file descriptors + connected clients */
 	GArray *pfds;
-	/* event subscriptions for connected clients */
-	GArray *subs;
+	/* state of connected clients */
+	GArray *clients;
 
 	/* PIPE for transferring events */
 	int evt[2];
+	/* time when pending events shall be flushed */
+	struct timespec evt_flush_ts;
+	bool evt_pending;
+
+	/* If not NULL, response messages are collected in this buffer instead
+	 * of being sent right away. It is used for batch request handling. */
+	GByteArray *batch;
 
 };
 
@@ -20,9 +20,12 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <sbc/sbc.h>
 #if ENABLE_AAC
@@ -31,6 +34,10 @@
 # define AACENCODER_LIB_VERSION LIB_VERSION( \
 		AACENCODER_LIB_VL0, AACENCODER_LIB_VL1, AACENCODER_LIB_VL2)
 #endif
+#if ENABLE_MPEG
+# include <lame/lame.h>
+# include <mpg123.h>
+#endif
 #if ENABLE_APTX
 # include <openaptx.h>
 #endif
@@ -43,6 +50,7 @@
 #include "a2dp-rtp.h"
 #include "ba-transport.h"
 #include "bluealsa.h"
+#include "pcm-output.h"
 #include "utils.h"
 #include "shared/defs.h"
 #include "shared/ffb.h"
@@ -58,20 +66,58 @@ static void io_thread_scale_pcm(const struct ba_transport *t, int16_t *buffer,
 	double ch1_scale = 0;
 	double ch2_scale = 0;
 
-	if (!t->a2dp.ch1_muted)
-		ch1_scale = pow(10, (-64 + 64.0 * t->a2dp.ch1_volume / 127) / 20);
-	if (!t->a2dp.ch2_muted)
-		ch2_scale = pow(10, (-64 + 64.0 * t->a2dp.ch2_volume / 127) / 20);
+	if (!__atomic_load_n(&t->a2dp.ch1_muted, __ATOMIC_RELAXED))
+		ch1_scale = pow(10, (-64 + 64.0 * __atomic_load_n(&t->a2dp.ch1_volume, __ATOMIC_RELAXED) / 127) / 20);
+	if (!__atomic_load_n(&t->a2dp.ch2_muted, __ATOMIC_RELAXED))
+		ch2_scale = pow(10, (-64 + 64.0 * __atomic_load_n(&t->a2dp.ch2_volume, __ATOMIC_RELAXED) / 127) / 20);
 
 	snd_pcm_scale_s16le(buffer, samples, channels, ch1_scale, ch2_scale);
 }
 
+/**
+ * Read PCM signal from the transport PCM shared memory ring buffer. */
+static ssize_t io_thread_read_pcm_ring(struct ba_pcm *pcm, int16_t *buffer, size_t samples) {
+
+	struct ba_pcm_ring *ring = pcm->ring;
+	eventfd_t event;
+	size_t len;
+
+	if (ba_pcm_ring_closed(ring)) {
+		debug("PCM has been closed: %d", pcm->fd);
+		transport_release_pcm(pcm);
+		return 0;
+	}
+
+	/* Clear notification counter prior to reading data, so the data which
+	 * will be written in the meantime will not be left unnoticed. */
+	eventfd_read(pcm->fd, &event);
+
+	len = ba_pcm_ring_pread(ring, pcm->ring_size, &pcm->ring_pos,
+			buffer, samples * sizeof(int16_t));
+
+	/* keep our end readable if there is still something in the ring */
+	if (ba_pcm_ring_plen_out(ring, pcm->ring_size, pcm->ring_pos) >= sizeof(int16_t))
+		eventfd_write(pcm->fd, 1);
+
+	if (len == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* notify client that there is a free space in the ring */
+	eventfd_write(pcm->ring_fd, 1);
+	return len / sizeof(int16_t);
+}
+
 /**
  * Read PCM signal from the transport PCM FIFO. */
 static ssize_t io_thread_read_pcm(struct ba_pcm *pcm, int16_t *buffer, size_t samples) {
 
 	ssize_t ret;
 
+	if (pcm->ring != NULL)
+		return io_thread_read_pcm_ring(pcm, buffer, samples);
+
 	/* If the passed file descriptor is invalid (e.g. -1) is means, that other
 	 * thread (the controller) has closed the connection. If the connection was
 	 * closed during this call, we will still read correct data, because Linux
@@ -97,6 +143,12 @@ static ssize_t io_thread_read_pcm(struct ba_pcm *pcm, int16_t *buffer, size_t sa
 /**
  * Flush read buffer of the transport PCM FIFO. */
 static ssize_t io_thread_read_pcm_flush(struct ba_pcm *pcm) {
+	if (pcm->ring != NULL) {
+		size_t len = ba_pcm_ring_pdrop(pcm->ring, pcm->ring_size, &pcm->ring_pos);
+		eventfd_write(pcm->ring_fd, 1);
+		debug("PCM read buffer flushed: %zu", len / sizeof(int16_t));
+		return len;
+	}
 	ssize_t rv = splice(pcm->fd, NULL, config.null_fd, NULL, 1024 * 32, SPLICE_F_NONBLOCK);
 	if (rv == -1 && errno == EAGAIN)
 		rv = 0;
@@ -104,10 +156,114 @@ static ssize_t io_thread_read_pcm_flush(struct ba_pcm *pcm) {
 	return rv;
 }
 
+/**
+ * Read encoded audio frames from the transport PCM socket.
+ *
+ * In the passthrough mode the FIFO is replaced with the SOCK_SEQPACKET
+ * socket, so every successful read returns exactly one client message. If
+ * the message does not fit into the given buffer, it is discarded and the
+ * errno is set to EMSGSIZE. */
+static ssize_t io_thread_read_encoded(struct ba_pcm *pcm, uint8_t *buffer, size_t size) {
+
+	struct iovec io = { .iov_base = buffer, .iov_len = size };
+	struct msghdr msg = { .msg_iov = &io, .msg_iovlen = 1 };
+	ssize_t ret;
+
+	while ((ret = recvmsg(pcm->fd, &msg, 0)) == -1 &&
+			errno == EINTR)
+		continue;
+
+	if (ret > 0 && msg.msg_flags & MSG_TRUNC) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (ret > 0)
+		return ret;
+
+	if (ret == 0)
+		debug("PCM has been closed: %d", pcm->fd);
+	if (errno == EBADF)
+		ret = 0;
+	if (ret == 0)
+		transport_release_pcm(pcm);
+
+	return ret;
+}
+
+/**
+ * Flush messages queued in the transport PCM socket. */
+static ssize_t io_thread_read_encoded_flush(struct ba_pcm *pcm) {
+	ssize_t rv = 0;
+	ssize_t len;
+	while ((len = recv(pcm->fd, NULL, 0, MSG_DONTWAIT | MSG_TRUNC)) > 0)
+		rv += len;
+	debug("PCM read buffer flushed: %zd bytes", rv);
+	return rv;
+}
+
+/**
+ * Write PCM signal to the transport PCM shared memory ring buffer.
+ *
+ * In contrast to the FIFO, this function never blocks. If there is not
+ * enough space in the ring buffer, the excess of samples is dropped - the
+ * same way as the capture over-run is handled by the real hardware. */
+static ssize_t io_thread_write_pcm_ring(struct ba_pcm *pcm, const int16_t *buffer, size_t samples) {
+
+	struct ba_pcm_ring *ring = pcm->ring;
+	size_t len = samples * sizeof(int16_t);
+
+	if (ba_pcm_ring_closed(ring)) {
+		debug("PCM has been closed: %d", pcm->fd);
+		transport_release_pcm(pcm);
+		return 0;
+	}
+
+	if ((len -= ba_pcm_ring_pwrite(ring, pcm->ring_size, &pcm->ring_pos, buffer, len)) != 0)
+		debug("PCM ring buffer overrun: %zu", len / sizeof(int16_t));
+
+	eventfd_write(pcm->ring_fd, 1);
+	return samples;
+}
+
+/**
+ * Get the address where the PCM signal might be generated in place.
+ *
+ * @param pcm The transport PCM structure.
+ * @param samples The number of samples which will be generated.
+ * @return If the PCM uses the shared memory ring buffer with the contiguous
+ *   free space big enough for the given number of samples, the address of
+ *   this space is returned. Otherwise, NULL is returned and the PCM signal
+ *   shall be written with the io_thread_write_pcm() function. */
+static int16_t *io_thread_write_pcm_ring_ptr(struct ba_pcm *pcm, size_t samples) {
+
+	size_t len;
+	void *ptr;
+
+	if (pcm->output != NULL || pcm->ring == NULL ||
+			ba_pcm_ring_closed(pcm->ring))
+		return NULL;
+
+	ptr = ba_pcm_ring_pwrite_ptr(pcm->ring, pcm->ring_size, pcm->ring_pos, &len);
+	return len >= samples * sizeof(int16_t) ? ptr : NULL;
+}
+
+/**
+ * Commit PCM signal generated in place in the ring buffer. */
+static void io_thread_write_pcm_ring_commit(struct ba_pcm *pcm, size_t samples) {
+	ba_pcm_ring_pwrite_commit(pcm->ring, &pcm->ring_pos, samples * sizeof(int16_t));
+	eventfd_write(pcm->ring_fd, 1);
+}
+
 /**
  * Write PCM signal to the transport PCM FIFO. */
 static ssize_t io_thread_write_pcm(struct ba_pcm *pcm, const int16_t *buffer, size_t samples) {
 
+	if (pcm->output != NULL)
+		return ba_pcm_output_write(pcm->output, buffer, samples);
+	if (pcm->ring != NULL)
+		return io_thread_write_pcm_ring(pcm, buffer, samples);
+
 	struct pollfd pfd = { pcm->fd, POLLOUT, 0 };
 	const uint8_t *head = (uint8_t *)buffer;
 	size_t len = samples * sizeof(int16_t);
@@ -138,10 +294,80 @@ static ssize_t io_thread_write_pcm(struct ba_pcm *pcm, const int16_t *buffer, si
 	return samples;
 }
 
+/* set when the built-in PCM output is owned by some transport */
+static bool io_thread_pcm_output_busy = false;
+
+/**
+ * Open built-in PCM output for the sink transport, if configured.
+ *
+ * With the built-in output, decoded PCM is written directly to the output
+ * device by our IO thread, so the PCM FIFO is not used at all. The output
+ * is used by one transport at a time. If it is already in use, the PCM
+ * FIFO is used as a fallback. */
+static void io_thread_open_pcm_output(struct ba_transport *t) {
+
+	if (config.a2dp.sink_output == NULL)
+		return;
+
+	/* The built-in output is a single device, so it can not be shared by
+	 * multiple sink transports. Only the first one gets it, others fall
+	 * back to the PCM FIFO. */
+	if (__atomic_exchange_n(&io_thread_pcm_output_busy, true, __ATOMIC_ACQ_REL)) {
+		info("PCM output is used by another transport: %s", batostr_(&t->d->addr));
+		return;
+	}
+
+	if ((t->a2dp.pcm.output = ba_pcm_output_open(config.a2dp.sink_output,
+					transport_get_channels(t), transport_get_sampling(t))) == NULL) {
+		warn("Couldn't open PCM output: %s", strerror(errno));
+		__atomic_store_n(&io_thread_pcm_output_busy, false, __ATOMIC_RELEASE);
+	}
+
+}
+
 /**
- * Write data to the BT SEQPACKET socket. */
-static ssize_t io_thread_write_bt(const struct ba_transport *t,
-		const uint8_t *buffer, size_t len, int *coutq) {
+ * Close built-in PCM output. */
+static void io_thread_close_pcm_output(struct ba_pcm *pcm) {
+	if (pcm->output != NULL) {
+		ba_pcm_output_close(pcm->output);
+		pcm->output = NULL;
+		__atomic_store_n(&io_thread_pcm_output_busy, false, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Account CPU time spent in the audio codec.
+ *
+ * @param t Transport for which the statistics shall be updated.
+ * @param since Thread CPU time-stamp taken before calling the codec. */
+static void io_thread_stats_codec(struct ba_transport *t, const struct timespec *since) {
+	struct timespec now, diff;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	difftimespec(since, &now, &diff);
+	__atomic_fetch_add(&t->stats.codec_time,
+			diff.tv_sec * 1000000 + diff.tv_nsec / 1000, __ATOMIC_RELAXED);
+}
+
+/**
+ * Account packet transferred over the BT link. */
+static void io_thread_stats_bt(struct ba_transport *t, size_t len) {
+	__atomic_fetch_add(&t->stats.bt_bytes, len, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&t->stats.bt_packets, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Account RTP packets lost on the BT link. */
+static void io_thread_stats_rtp_lost(struct ba_transport *t, unsigned int lost) {
+	__atomic_fetch_add(&t->stats.rtp_lost, lost, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write data scattered across multiple buffers to the BT SEQPACKET socket.
+ *
+ * All buffers are sent as a single packet, so there is no need to assemble
+ * headers and payload in a contiguous memory region. */
+static ssize_t io_thread_writev_bt(struct ba_transport *t,
+		const struct iovec *iov, int iovcnt, int *coutq) {
 
 	struct pollfd pfd = { t->bt_fd, POLLOUT, 0 };
 	ssize_t ret;
@@ -152,7 +378,7 @@ static ssize_t io_thread_write_bt(const struct ba_transport *t,
 		*coutq = abs(t->a2dp.bt_fd_coutq_init - *coutq);
 
 retry:
-	if ((ret = write(pfd.fd, buffer, len)) == -1)
+	if ((ret = writev(pfd.fd, iov, iovcnt)) == -1)
 		switch (errno) {
 		case EINTR:
 			goto retry;
@@ -163,9 +389,23 @@ retry:
 			goto retry;
 		}
 
+	if (ret != -1) {
+		ba_capture_packetv(t->capture, BA_CAPTURE_DIR_TX, iov, iovcnt);
+		io_thread_stats_bt(t, ret);
+	}
+	__atomic_store_n(&t->stats.bt_queued, *coutq, __ATOMIC_RELAXED);
+
 	return ret;
 }
 
+/**
+ * Write data to the BT SEQPACKET socket. */
+static ssize_t io_thread_write_bt(struct ba_transport *t,
+		const uint8_t *buffer, size_t len, int *coutq) {
+	const struct iovec iov = { .iov_base = (void *)buffer, .iov_len = len };
+	return io_thread_writev_bt(t, &iov, 1, coutq);
+}
+
 /**
  * Initialize RTP headers.
  *
@@ -243,6 +483,9 @@ void *io_thread_a2dp_sink_sbc(void *arg) {
 		goto fail_ffb;
 	}
 
+	io_thread_open_pcm_output(t);
+	pthread_cleanup_push(PTHREAD_CLEANUP(io_thread_close_pcm_output), &t->a2dp.pcm);
+
 	/* Lock transport during thread cancellation. This handler shall be at
 	 * the top of the cleanup stack - lastly pushed. */
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
@@ -275,9 +518,7 @@ void *io_thread_a2dp_sink_sbc(void *arg) {
 
 		if (pfds[0].revents & POLLIN) {
 			/* dispatch incoming event */
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
+			transport_recv_signal(t);
 			continue;
 		}
 
@@ -298,7 +539,10 @@ void *io_thread_a2dp_sink_sbc(void *arg) {
 			goto fail;
 		}
 
-		if (t->a2dp.pcm.fd == -1) {
+		ba_capture_packet(t->capture, BA_CAPTURE_DIR_RX, bt.data, len);
+		io_thread_stats_bt(t, len);
+
+		if (t->a2dp.pcm.fd == -1 && t->a2dp.pcm.output == NULL) {
 			seq_number = -1;
 			continue;
 		}
@@ -317,11 +561,19 @@ void *io_thread_a2dp_sink_sbc(void *arg) {
 
 		uint16_t _seq_number = ntohs(rtp_header->seq_number);
 		if (++seq_number != _seq_number) {
-			if (seq_number != 0)
+			if (seq_number != 0) {
 				warn("Missing RTP packet: %u != %u", _seq_number, seq_number);
+				io_thread_stats_rtp_lost(t, (uint16_t)(_seq_number - seq_number));
+			}
 			seq_number = _seq_number;
 		}
 
+		/* The CPU time is sampled once per RTP packet, since sampling it for
+		 * every frame would be a significant overhead. Note, that the time
+		 * spent on writing PCM samples is accounted as well. */
+		struct timespec ts_codec;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts_codec);
+
 		/* decode retrieved SBC frames */
 		size_t frames = rtp_media_header->frame_count;
 		while (frames--) {
@@ -329,8 +581,10 @@ void *io_thread_a2dp_sink_sbc(void *arg) {
 			ssize_t len;
 			size_t decoded;
 
-			if ((len = sbc_decode(&sbc, rtp_payload, rtp_payload_len,
-							pcm.data, ffb_blen_in(&pcm), &decoded)) < 0) {
+			len = sbc_decode(&sbc, rtp_payload, rtp_payload_len,
+					pcm.data, ffb_blen_in(&pcm), &decoded);
+
+			if (len < 0) {
 				error("SBC decoding error: %s", strerror(-len));
 				break;
 			}
@@ -345,11 +599,14 @@ void *io_thread_a2dp_sink_sbc(void *arg) {
 
 		}
 
+		io_thread_stats_codec(t, &ts_codec);
+
 	}
 
 fail:
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	pthread_cleanup_pop(!locked);
+	pthread_cleanup_pop(1);
 fail_ffb:
 	pthread_cleanup_pop(1);
 	pthread_cleanup_pop(1);
@@ -453,9 +710,7 @@ void *io_thread_a2dp_source_sbc(void *arg) {
 
 		if (pfds[0].revents & POLLIN) {
 			/* dispatch incoming event */
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
+			enum ba_transport_signal sig = transport_recv_signal(t);
 			switch (sig) {
 			case TRANSPORT_PCM_OPEN:
 			case TRANSPORT_PCM_RESUME:
@@ -514,6 +769,9 @@ void *io_thread_a2dp_source_sbc(void *arg) {
 		size_t pcm_frames = 0;
 		size_t sbc_frames = 0;
 
+		struct timespec ts_codec;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts_codec);
+
 		/* Generate as many SBC frames as possible to fill the output buffer
 		 * without overflowing it. The size of the output buffer is based on
 		 * the socket MTU, so such a transfer should be most efficient. */
@@ -538,6 +796,8 @@ void *io_thread_a2dp_source_sbc(void *arg) {
 
 		}
 
+		io_thread_stats_codec(t, &ts_codec);
+
 		rtp_header->seq_number = htons(++seq_number);
 		rtp_header->timestamp = htonl(timestamp);
 		rtp_media_header->frame_count = sbc_frames;
@@ -585,8 +845,174 @@ fail_init:
 	return NULL;
 }
 
-#if ENABLE_AAC
-void *io_thread_a2dp_sink_aac(void *arg) {
+#if ENABLE_MPEG
+/**
+ * Bit rates (in kbps) of the MPEG audio layer III indexed by the MPEG-1
+ * and MPEG-2 (also MPEG-2.5) versions and the bit rate index. */
+static const unsigned int io_thread_mp3_bitrates[2][15] = {
+	{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+	{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+};
+
+/**
+ * Get the sampling frequency of the MPEG audio layer III frame.
+ *
+ * @param header Address of the valid MPEG audio frame header.
+ * @return This function returns the sampling frequency in Hz. */
+static unsigned int io_thread_mp3_frame_sampling(const uint8_t *header) {
+	static const unsigned int samplings[] = { 44100, 48000, 32000 };
+	const unsigned int version = (header[1] >> 3) & 0x03;
+	return samplings[(header[2] >> 2) & 0x03] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+}
+
+/**
+ * Get the length of the MPEG audio layer III frame.
+ *
+ * @param header Address of the MPEG audio frame header (4 bytes).
+ * @return On success this function returns the length of the frame in
+ *   bytes, including the header. If the header is not valid or the frame
+ *   is in the free format, 0 is returned. */
+static size_t io_thread_mp3_frame_length(const uint8_t *header) {
+
+	/* frame sync followed by the layer III identifier */
+	if (header[0] != 0xFF || (header[1] & 0xE6) != 0xE2)
+		return 0;
+
+	/* 0 - MPEG-2.5, 1 - reserved, 2 - MPEG-2, 3 - MPEG-1 */
+	const unsigned int version = (header[1] >> 3) & 0x03;
+	const unsigned int bitrate_index = header[2] >> 4;
+	const unsigned int sampling_index = (header[2] >> 2) & 0x03;
+	const unsigned int padding = (header[2] >> 1) & 0x01;
+
+	if (version == 1 || bitrate_index == 0 || bitrate_index == 15 || sampling_index == 3)
+		return 0;
+
+	const bool mpeg1 = version == 3;
+	const unsigned int sampling = io_thread_mp3_frame_sampling(header);
+	const unsigned int bitrate = io_thread_mp3_bitrates[!mpeg1][bitrate_index] * 1000;
+
+	return (mpeg1 ? 144 : 72) * bitrate / sampling + padding;
+}
+
+/**
+ * Get the channel mode of the MPEG audio layer III frame.
+ *
+ * @param header Address of the valid MPEG audio frame header.
+ * @return This function returns the channel mode as defined for the A2DP
+ *   MPEG codec configuration (one of the MPEG_CHANNEL_MODE_* values). */
+static unsigned int io_thread_mp3_frame_channel_mode(const uint8_t *header) {
+	static const unsigned int modes[] = {
+		MPEG_CHANNEL_MODE_STEREO, MPEG_CHANNEL_MODE_JOINT_STEREO,
+		MPEG_CHANNEL_MODE_DUAL_CHANNEL, MPEG_CHANNEL_MODE_MONO };
+	return modes[header[3] >> 6];
+}
+
+/**
+ * Get the number of PCM frames encoded in the MPEG audio layer III frame.
+ *
+ * @param header Address of the valid MPEG audio frame header.
+ * @return This function returns the number of PCM frames. */
+static unsigned int io_thread_mp3_frame_samples(const uint8_t *header) {
+	/* MPEG-2 and MPEG-2.5 frames contain a single granule */
+	return ((header[1] >> 3) & 0x03) == 3 ? 1152 : 576;
+}
+
+/**
+ * Write MPEG audio frames to the BT socket.
+ *
+ * According to the RFC 2250, as many frames as possible shall be packed into
+ * a single RTP packet. If a single frame does not fit into the packet, it is
+ * fragmented and the offset of every fragment is stored in the MPEG audio
+ * header.
+ *
+ * @param t Transport for which the frames shall be written.
+ * @param buffer Buffer with the initialized RTP header followed by the MPEG
+ *   audio header. The size of this buffer shall be at least the writing MTU.
+ * @param mpeg Buffer with complete MPEG audio frames. Written frames are
+ *   removed from this buffer.
+ * @param frame_samples The number of PCM frames encoded in one MPEG frame.
+ * @param samplerate Sampling frequency of the encoded audio.
+ * @param seq_number Address of the RTP sequence number.
+ * @param timestamp Address of the RTP timestamp (90 kHz clock).
+ * @param coutq Address where the number of BT queued bytes will be stored.
+ * @return On success this function returns 0. If the BT socket has been
+ *   disconnected, -1 is returned. */
+static int io_thread_write_rtp_mpeg(struct ba_transport *t, uint8_t *buffer,
+		ffb_uint8_t *mpeg, unsigned int frame_samples, unsigned int samplerate,
+		uint16_t *seq_number, uint32_t *timestamp, int *coutq) {
+
+	rtp_header_t *rtp_header = (rtp_header_t *)buffer;
+	rtp_mpeg_audio_header_t *rtp_mpeg_audio_header = (rtp_mpeg_audio_header_t *)(buffer + RTP_HEADER_LEN);
+	uint8_t *rtp_payload = (uint8_t *)(rtp_mpeg_audio_header + 1);
+	const size_t payload_len_max = t->mtu_write - (rtp_payload - buffer);
+
+	while (ffb_len_out(mpeg) > 0) {
+
+		const size_t mpeg_len = ffb_len_out(mpeg);
+		size_t payload_len = 0;
+		size_t frames = 0;
+		size_t frame_len;
+
+		while (mpeg_len - payload_len >= 4 &&
+				(frame_len = io_thread_mp3_frame_length(&mpeg->data[payload_len])) != 0 &&
+				payload_len + frame_len <= MIN(mpeg_len, payload_len_max)) {
+			payload_len += frame_len;
+			frames++;
+		}
+
+		/* the first frame is too big (or it is not parsable) */
+		if (payload_len == 0) {
+			if ((payload_len = io_thread_mp3_frame_length(mpeg->data)) == 0 ||
+					payload_len > mpeg_len)
+				payload_len = mpeg_len;
+			frames = 1;
+		}
+
+		rtp_header->timestamp = htonl(*timestamp);
+
+		size_t offset;
+		for (offset = 0; offset < payload_len; ) {
+
+			const size_t chunk_len = MIN(payload_len - offset, payload_len_max);
+			rtp_header->markbit = offset + chunk_len == payload_len;
+			rtp_header->seq_number = htons(++*seq_number);
+			rtp_mpeg_audio_header->offset = htons(offset);
+			memcpy(rtp_payload, &mpeg->data[offset], chunk_len);
+
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+			ssize_t ret = io_thread_write_bt(t, buffer, (rtp_payload - buffer) + chunk_len, coutq);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+			if (ret == -1) {
+				if (errno == ECONNRESET || errno == ENOTCONN) {
+					/* exit thread upon BT socket disconnection */
+					debug("BT socket disconnected: %d", t->bt_fd);
+					return -1;
+				}
+				error("BT socket write error: %s", strerror(errno));
+			}
+
+			offset += chunk_len;
+
+		}
+
+		/* get a timestamp for the next RTP packet - unlike other payloads,
+		 * the MPEG audio uses the 90 kHz clock */
+		*timestamp += (uint64_t)frames * frame_samples * IO_THREAD_RTP_MPEG_CLOCK / samplerate;
+		ffb_shift(mpeg, payload_len);
+
+	}
+
+	return 0;
+}
+
+static pthread_once_t io_thread_mpg123_once = PTHREAD_ONCE_INIT;
+static void io_thread_mpg123_init(void) {
+	/* prior to the mpg123 1.27 this call was mandatory */
+	mpg123_init();
+}
+
+void *io_thread_a2dp_sink_mpeg(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
 
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
@@ -603,51 +1029,55 @@ void *io_thread_a2dp_sink_aac(void *arg) {
 		goto fail_open;
 	}
 
-	HANDLE_AACDECODER handle;
-	AAC_DECODER_ERROR err;
+	pthread_once(&io_thread_mpg123_once, io_thread_mpg123_init);
 
-	if ((handle = aacDecoder_Open(TT_MP4_LATM_MCP1, 1)) == NULL) {
-		error("Couldn't open AAC decoder");
+	mpg123_handle *handle;
+	int err;
+
+	if ((handle = mpg123_new(NULL, &err)) == NULL) {
+		error("Couldn't open MPG123 decoder: %s", mpg123_plain_strerror(err));
 		goto fail_open;
 	}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(aacDecoder_Close), handle);
+	pthread_cleanup_push(PTHREAD_CLEANUP(mpg123_delete), handle);
 
 	const unsigned int channels = transport_get_channels(t);
-#ifdef AACDECODER_LIB_VL0
-	if ((err = aacDecoder_SetParam(handle, AAC_PCM_MIN_OUTPUT_CHANNELS, channels)) != AAC_DEC_OK) {
-		error("Couldn't set min output channels: %s", aacdec_strerror(err));
-		goto fail_init;
-	}
-	if ((err = aacDecoder_SetParam(handle, AAC_PCM_MAX_OUTPUT_CHANNELS, channels)) != AAC_DEC_OK) {
-		error("Couldn't set max output channels: %s", aacdec_strerror(err));
+	const unsigned int samplerate = transport_get_sampling(t);
+
+	mpg123_param(handle, MPG123_RESYNC_LIMIT, -1, 0);
+	mpg123_param(handle, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
+
+	/* restrict the output to the format of our PCM */
+	mpg123_format_none(handle);
+	if (mpg123_format(handle, samplerate, channels == 1 ? MPG123_MONO : MPG123_STEREO,
+				MPG123_ENC_SIGNED_16) != MPG123_OK) {
+		error("Couldn't set MPG123 output format: %s", mpg123_strerror(handle));
 		goto fail_init;
 	}
-#else
-	if ((err = aacDecoder_SetParam(handle, AAC_PCM_OUTPUT_CHANNELS, channels)) != AAC_DEC_OK) {
-		error("Couldn't set output channels: %s", aacdec_strerror(err));
+
+	if (mpg123_open_feed(handle) != MPG123_OK) {
+		error("Couldn't open MPG123 feed: %s", mpg123_strerror(handle));
 		goto fail_init;
 	}
-#endif
 
 	ffb_uint8_t bt = { 0 };
-	ffb_uint8_t latm = { 0 };
 	ffb_int16_t pcm = { 0 };
 	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &latm);
 	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
 
-	if (ffb_init(&pcm, 2048 * channels) == NULL ||
-			ffb_init(&latm, t->mtu_read) == NULL ||
+	if (ffb_init(&pcm, mpg123_outblock(handle) / sizeof(int16_t)) == NULL ||
 			ffb_init(&bt, t->mtu_read) == NULL) {
 		error("Couldn't create data buffers: %s", strerror(ENOMEM));
 		goto fail_ffb;
 	}
 
+	io_thread_open_pcm_output(t);
+	pthread_cleanup_push(PTHREAD_CLEANUP(io_thread_close_pcm_output), &t->a2dp.pcm);
+
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
 
 	uint16_t seq_number = -1;
-	int markbit_quirk = -3;
+	bool resync = false;
 
 	struct pollfd pfds[] = {
 		{ t->sig_fd[0], POLLIN, 0 },
@@ -661,7 +1091,6 @@ void *io_thread_a2dp_sink_aac(void *arg) {
 	for (;;) {
 		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
-		CStreamInfo *aacinf;
 		ssize_t len;
 
 		/* add BT socket to the poll if transport is active */
@@ -676,9 +1105,7 @@ void *io_thread_a2dp_sink_aac(void *arg) {
 
 		if (pfds[0].revents & POLLIN) {
 			/* dispatch incoming event */
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
+			transport_recv_signal(t);
 			continue;
 		}
 
@@ -689,24 +1116,26 @@ void *io_thread_a2dp_sink_aac(void *arg) {
 
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-		/* it seems that zero is never returned... */
 		if (len == 0) {
 			debug("BT socket has been closed: %d", pfds[1].fd);
-			/* Prevent sending the release request to the BlueZ. If the socket has
-			 * been closed, it means that BlueZ has already closed the connection. */
 			close(pfds[1].fd);
 			t->bt_fd = -1;
 			goto fail;
 		}
 
-		if (t->a2dp.pcm.fd == -1) {
+		ba_capture_packet(t->capture, BA_CAPTURE_DIR_RX, bt.data, len);
+		io_thread_stats_bt(t, len);
+
+		if (t->a2dp.pcm.fd == -1 && t->a2dp.pcm.output == NULL) {
 			seq_number = -1;
 			continue;
 		}
 
 		const rtp_header_t *rtp_header = (rtp_header_t *)bt.data;
-		uint8_t *rtp_latm = (uint8_t *)&rtp_header->csrc[rtp_header->cc];
-		size_t rtp_latm_len = len - (rtp_latm - (uint8_t *)rtp_header);
+		const rtp_mpeg_audio_header_t *rtp_mpeg_audio_header =
+			(rtp_mpeg_audio_header_t *)&rtp_header->csrc[rtp_header->cc];
+		const uint8_t *rtp_payload = (uint8_t *)(rtp_mpeg_audio_header + 1);
+		size_t rtp_payload_len = len - (rtp_payload - (uint8_t *)rtp_header);
 
 #if ENABLE_PAYLOADCHECK
 		if (rtp_header->paytype < 96) {
@@ -715,64 +1144,64 @@ void *io_thread_a2dp_sink_aac(void *arg) {
 		}
 #endif
 
-		/* If in the first N packets mark bit is not set, it might mean, that
-		 * the mark bit will not be set at all. In such a case, activate mark
-		 * bit quirk workaround. */
-		if (markbit_quirk < 0) {
-			if (rtp_header->markbit)
-				markbit_quirk = 0;
-			else if (++markbit_quirk == 0) {
-				warn("Activating RTP mark bit quirk workaround");
-				markbit_quirk = 1;
-			}
-		}
-
 		uint16_t _seq_number = ntohs(rtp_header->seq_number);
 		if (++seq_number != _seq_number) {
-			if (seq_number != 0)
+			if (seq_number != 0) {
 				warn("Missing RTP packet: %u != %u", _seq_number, seq_number);
+				io_thread_stats_rtp_lost(t, (uint16_t)(_seq_number - seq_number));
+				resync = true;
+			}
 			seq_number = _seq_number;
 		}
 
-		if (ffb_len_in(&latm) < rtp_latm_len) {
-			debug("Resizing LATM buffer: %zd -> %zd", latm.size, latm.size + t->mtu_read);
-			size_t prev_len = ffb_len_out(&latm);
-			ffb_init(&latm, latm.size + t->mtu_read);
-			ffb_seek(&latm, prev_len);
+		/* Remaining fragments of the MPEG frame which beginning has been
+		 * lost are useless, so drop them until the next frame boundary. */
+		if (resync) {
+			if (ntohs(rtp_mpeg_audio_header->offset) != 0)
+				continue;
+			resync = false;
 		}
 
-		memcpy(latm.tail, rtp_latm, rtp_latm_len);
-		ffb_seek(&latm, rtp_latm_len);
+		/* Feed the decoder with the RTP payload and get all available frames.
+		 * Since the MPG123 keeps track of the stream on its own, fragmented
+		 * frames are reassembled without any extra effort on our side. */
+		struct timespec ts_codec;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts_codec);
+		for (;;) {
 
-		if (markbit_quirk != 1 && !rtp_header->markbit) {
-			debug("Fragmented RTP packet [%u]: LATM len: %zd", seq_number, rtp_latm_len);
-			continue;
-		}
+			size_t decoded;
 
-		unsigned int data_len = ffb_len_out(&latm);
-		unsigned int valid = ffb_len_out(&latm);
+			err = mpg123_decode(handle, rtp_payload, rtp_payload_len,
+					(unsigned char *)pcm.data, ffb_blen_in(&pcm), &decoded);
+
+			/* the whole payload is consumed by the first call */
+			rtp_payload_len = 0;
+
+			if (decoded > 0) {
+				const size_t samples = decoded / sizeof(int16_t);
+				io_thread_scale_pcm(t, pcm.data, samples, channels);
+				if (io_thread_write_pcm(&t->a2dp.pcm, pcm.data, samples) == -1)
+					error("FIFO write error: %s", strerror(errno));
+			}
+
+			if (err == MPG123_NEED_MORE)
+				break;
+			if (err == MPG123_ERR) {
+				error("MPG123 decoding error: %s", mpg123_strerror(handle));
+				break;
+			}
 
-		if ((err = aacDecoder_Fill(handle, &latm.data, &data_len, &valid)) != AAC_DEC_OK)
-			error("AAC buffer fill error: %s", aacdec_strerror(err));
-		else if ((err = aacDecoder_DecodeFrame(handle, pcm.tail, ffb_blen_in(&pcm), 0)) != AAC_DEC_OK)
-			error("AAC decode frame error: %s", aacdec_strerror(err));
-		else if ((aacinf = aacDecoder_GetStreamInfo(handle)) == NULL)
-			error("Couldn't get AAC stream info");
-		else {
-			const size_t samples = aacinf->frameSize * aacinf->numChannels;
-			io_thread_scale_pcm(t, pcm.data, samples, channels);
-			if (io_thread_write_pcm(&t->a2dp.pcm, pcm.data, samples) == -1)
-				error("FIFO write error: %s", strerror(errno));
-			ffb_rewind(&latm);
 		}
 
+		io_thread_stats_codec(t, &ts_codec);
+
 	}
 
 fail:
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	pthread_cleanup_pop(!locked);
-fail_ffb:
 	pthread_cleanup_pop(1);
+fail_ffb:
 	pthread_cleanup_pop(1);
 	pthread_cleanup_pop(1);
 fail_init:
@@ -781,104 +1210,108 @@ fail_open:
 	pthread_cleanup_pop(1);
 	return NULL;
 }
-#endif
 
-#if ENABLE_AAC
-void *io_thread_a2dp_source_aac(void *arg) {
+void *io_thread_a2dp_source_mpeg(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
-	const a2dp_aac_t *cconfig = (a2dp_aac_t *)t->a2dp.cconfig;
+	const a2dp_mpeg_t *cconfig = (a2dp_mpeg_t *)t->a2dp.cconfig;
 
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
 
 	bool locked = !transport_pthread_cleanup_lock(t);
 
-	HANDLE_AACENCODER handle;
-	AACENC_InfoStruct aacinf;
-	AACENC_ERROR err;
-
-	/* create AAC encoder without the Meta Data module */
-	const unsigned int channels = transport_get_channels(t);
-	if ((err = aacEncOpen(&handle, 0x07, channels)) != AACENC_OK) {
-		error("Couldn't open AAC encoder: %s", aacenc_strerror(err));
+	lame_t handle;
+	if ((handle = lame_init()) == NULL) {
+		error("Couldn't open LAME encoder: %s", strerror(ENOMEM));
 		goto fail_open;
 	}
 
-	pthread_cleanup_push(PTHREAD_CLEANUP(aacEncClose), &handle);
+	pthread_cleanup_push(PTHREAD_CLEANUP(lame_close), handle);
 
-	unsigned int aot = AOT_NONE;
-	unsigned int bitrate = AAC_GET_BITRATE(*cconfig);
-	unsigned int samplerate = transport_get_sampling(t);
-	unsigned int channelmode = channels == 1 ? MODE_1 : MODE_2;
+	const unsigned int channels = transport_get_channels(t);
+	const unsigned int samplerate = transport_get_sampling(t);
+	MPEG_mode mode = NOT_SET;
 
-	switch (cconfig->object_type) {
-	case AAC_OBJECT_TYPE_MPEG2_AAC_LC:
-#if AACENCODER_LIB_VERSION <= 0x03040C00 /* 3.4.12 */
-		aot = AOT_MP2_AAC_LC;
+	switch (cconfig->channel_mode) {
+	case MPEG_CHANNEL_MODE_MONO:
+		mode = MONO;
 		break;
-#endif
-	case AAC_OBJECT_TYPE_MPEG4_AAC_LC:
-		aot = AOT_AAC_LC;
-		break;
-	case AAC_OBJECT_TYPE_MPEG4_AAC_LTP:
-		aot = AOT_AAC_LTP;
+	case MPEG_CHANNEL_MODE_STEREO:
+		mode = STEREO;
 		break;
-	case AAC_OBJECT_TYPE_MPEG4_AAC_SCA:
-		aot = AOT_AAC_SCAL;
+	case MPEG_CHANNEL_MODE_JOINT_STEREO:
+		mode = JOINT_STEREO;
 		break;
 	}
 
-	if ((err = aacEncoder_SetParam(handle, AACENC_AOT, aot)) != AACENC_OK) {
-		error("Couldn't set audio object type: %s", aacenc_strerror(err));
+	/* get the index of the highest bit rate allowed by the configuration */
+	unsigned int bitrate_index = 0;
+	unsigned int bitrate = MPEG_GET_BITRATE(*cconfig) & ~MPEG_BIT_RATE_VBR;
+	while ((bitrate >>= 1) != 0)
+		bitrate_index++;
+	/* sampling frequencies below 32 kHz are handled by the MPEG-2 */
+	bitrate = io_thread_mp3_bitrates[samplerate < 32000][bitrate_index];
+
+	if (lame_set_num_channels(handle, channels) != 0) {
+		error("Couldn't set number of channels: %u", channels);
 		goto fail_init;
 	}
-	if ((err = aacEncoder_SetParam(handle, AACENC_BITRATE, bitrate)) != AACENC_OK) {
-		error("Couldn't set bitrate: %s", aacenc_strerror(err));
+	if (lame_set_mode(handle, mode) != 0) {
+		error("Couldn't set channel mode: %#x", cconfig->channel_mode);
 		goto fail_init;
 	}
-	if ((err = aacEncoder_SetParam(handle, AACENC_SAMPLERATE, samplerate)) != AACENC_OK) {
-		error("Couldn't set sampling rate: %s", aacenc_strerror(err));
+	if (lame_set_in_samplerate(handle, samplerate) != 0 ||
+			lame_set_out_samplerate(handle, samplerate) != 0) {
+		error("Couldn't set sampling rate: %u", samplerate);
 		goto fail_init;
 	}
-	if ((err = aacEncoder_SetParam(handle, AACENC_CHANNELMODE, channelmode)) != AACENC_OK) {
-		error("Couldn't set channel mode: %s", aacenc_strerror(err));
+	if (lame_set_error_protection(handle, cconfig->crc) != 0) {
+		error("Couldn't set CRC mode: %u", cconfig->crc);
 		goto fail_init;
 	}
-	if (cconfig->vbr) {
-		if ((err = aacEncoder_SetParam(handle, AACENC_BITRATEMODE, config.aac_vbr_mode)) != AACENC_OK) {
-			error("Couldn't set VBR bitrate mode %u: %s", config.aac_vbr_mode, aacenc_strerror(err));
+	if (lame_set_quality(handle, config.mpeg_quality) != 0) {
+		error("Couldn't set encoder quality: %u", config.mpeg_quality);
+		goto fail_init;
+	}
+	if (MPEG_GET_BITRATE(*cconfig) & MPEG_BIT_RATE_VBR) {
+		if (lame_set_VBR(handle, vbr_default) != 0 ||
+				lame_set_VBR_quality(handle, config.mpeg_vbr_quality) != 0 ||
+				lame_set_VBR_max_bitrate_kbps(handle, bitrate) != 0) {
+			error("Couldn't set VBR quality: %u", config.mpeg_vbr_quality);
 			goto fail_init;
 		}
 	}
-	if ((err = aacEncoder_SetParam(handle, AACENC_AFTERBURNER, config.aac_afterburner)) != AACENC_OK) {
-		error("Couldn't enable afterburner: %s", aacenc_strerror(err));
-		goto fail_init;
+	else {
+		if (lame_set_VBR(handle, vbr_off) != 0 ||
+				lame_set_brate(handle, bitrate) != 0) {
+			error("Couldn't set bit rate: %u", bitrate);
+			goto fail_init;
+		}
 	}
-	if ((err = aacEncoder_SetParam(handle, AACENC_TRANSMUX, TT_MP4_LATM_MCP1)) != AACENC_OK) {
-		error("Couldn't enable LATM transport type: %s", aacenc_strerror(err));
+	/* Xing/LAME tag frame is meaningful for files only */
+	if (lame_set_bWriteVbrTag(handle, 0) != 0) {
+		error("Couldn't disable VBR tag");
 		goto fail_init;
 	}
-	if ((err = aacEncoder_SetParam(handle, AACENC_HEADER_PERIOD, 1)) != AACENC_OK) {
-		error("Couldn't set LATM header period: %s", aacenc_strerror(err));
+	if (lame_init_params(handle) != 0) {
+		error("Couldn't initialize LAME encoder");
 		goto fail_init;
 	}
 
-	if ((err = aacEncEncode(handle, NULL, NULL, NULL, NULL)) != AACENC_OK) {
-		error("Couldn't initialize AAC encoder: %s", aacenc_strerror(err));
-		goto fail_init;
-	}
-	if ((err = aacEncInfo(handle, &aacinf)) != AACENC_OK) {
-		error("Couldn't get encoder info: %s", aacenc_strerror(err));
-		goto fail_init;
-	}
+	const size_t mpeg_pcm_samples = lame_get_framesize(handle) * channels;
+	/* worst case estimation of the output buffer size recommended by LAME */
+	const size_t mpeg_buffer_len = 5 * lame_get_framesize(handle) / 4 + 7200;
 
 	ffb_uint8_t bt = { 0 };
+	ffb_uint8_t mpeg = { 0 };
 	ffb_int16_t pcm = { 0 };
 	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &mpeg);
 	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
 
-	if (ffb_init(&pcm, aacinf.inputChannels * aacinf.frameLength) == NULL ||
-			ffb_init(&bt, RTP_HEADER_LEN + aacinf.maxOutBufBytes) == NULL) {
+	if (ffb_init(&pcm, mpeg_pcm_samples) == NULL ||
+			ffb_init(&mpeg, mpeg_buffer_len) == NULL ||
+			ffb_init(&bt, t->mtu_write) == NULL) {
 		error("Couldn't create data buffers: %s", strerror(ENOMEM));
 		goto fail_ffb;
 	}
@@ -886,35 +1319,13 @@ void *io_thread_a2dp_source_aac(void *arg) {
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
 
 	rtp_header_t *rtp_header;
+	rtp_mpeg_audio_header_t *rtp_mpeg_audio_header;
 
-	/* initialize RTP header and get anchor for payload */
-	uint8_t *rtp_payload = io_thread_init_rtp(bt.data, &rtp_header, NULL);
+	/* initialize RTP headers (payload follows the MPEG audio header) */
+	rtp_mpeg_audio_header = (rtp_mpeg_audio_header_t *)io_thread_init_rtp(bt.data, &rtp_header, NULL);
 	uint16_t seq_number = ntohs(rtp_header->seq_number);
 	uint32_t timestamp = ntohl(rtp_header->timestamp);
-
-	int in_bufferIdentifiers[] = { IN_AUDIO_DATA };
-	int out_bufferIdentifiers[] = { OUT_BITSTREAM_DATA };
-	int in_bufSizes[] = { pcm.size * sizeof(*pcm.data) };
-	int out_bufSizes[] = { aacinf.maxOutBufBytes };
-	int in_bufElSizes[] = { sizeof(*pcm.data) };
-	int out_bufElSizes[] = { sizeof(*bt.data) };
-
-	AACENC_BufDesc in_buf = {
-		.numBufs = 1,
-		.bufs = (void **)&pcm.data,
-		.bufferIdentifiers = in_bufferIdentifiers,
-		.bufSizes = in_bufSizes,
-		.bufElSizes = in_bufElSizes,
-	};
-	AACENC_BufDesc out_buf = {
-		.numBufs = 1,
-		.bufs = (void **)&rtp_payload,
-		.bufferIdentifiers = out_bufferIdentifiers,
-		.bufSizes = out_bufSizes,
-		.bufElSizes = out_bufElSizes,
-	};
-	AACENC_InArgs in_args = { 0 };
-	AACENC_OutArgs out_args = { 0 };
+	memset(rtp_mpeg_audio_header, 0, sizeof(*rtp_mpeg_audio_header));
 
 	/* array with historical data of queued bytes for BT socket */
 	int coutq_history[IO_THREAD_COUTQ_HISTORY_SIZE] = { 0 };
@@ -958,9 +1369,7 @@ void *io_thread_a2dp_source_aac(void *arg) {
 
 		if (pfds[0].revents & POLLIN) {
 			/* dispatch incoming event */
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
+			enum ba_transport_signal sig = transport_recv_signal(t);
 			switch (sig) {
 			case TRANSPORT_PCM_OPEN:
 			case TRANSPORT_PCM_RESUME:
@@ -1005,75 +1414,43 @@ void *io_thread_a2dp_source_aac(void *arg) {
 		/* move tail pointer */
 		ffb_seek(&pcm, samples);
 
-		while ((in_args.numInSamples = ffb_len_out(&pcm)) > 0) {
-
-			if ((err = aacEncEncode(handle, &in_buf, &out_buf, &in_args, &out_args)) != AACENC_OK)
-				error("AAC encoding error: %s", aacenc_strerror(err));
-
-			if (out_args.numOutBytes > 0) {
-
-				size_t payload_len_max = t->mtu_write - RTP_HEADER_LEN;
-				size_t payload_len = out_args.numOutBytes;
-				rtp_header->timestamp = htonl(timestamp);
-
-				/* If the size of the RTP packet exceeds writing MTU, the RTP payload
-				 * should be fragmented. According to the RFC 3016, fragmentation of
-				 * the audioMuxElement requires no extra header - the payload should
-				 * be fragmented and spread across multiple RTP packets. */
-				for (;;) {
-
-					ssize_t ret;
-					size_t len;
-
-					len = payload_len > payload_len_max ? payload_len_max : payload_len;
-					rtp_header->markbit = payload_len <= payload_len_max;
-					rtp_header->seq_number = htons(++seq_number);
-
-					pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-
-					coutq_i = (coutq_i + 1) % ARRAYSIZE(coutq_history);
-					if ((ret = io_thread_write_bt(t, bt.data, RTP_HEADER_LEN + len, &coutq_history[coutq_i])) == -1) {
-						if (errno == ECONNRESET || errno == ENOTCONN) {
-							/* exit thread upon BT socket disconnection */
-							debug("BT socket disconnected: %d", t->bt_fd);
-							goto fail;
-						}
-						error("BT socket write error: %s", strerror(errno));
-						break;
-					}
-
-					pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-
-					/* account written payload only */
-					ret -= RTP_HEADER_LEN;
+		/* encode only when the whole MPEG frame worth of PCM is available */
+		if (ffb_len_in(&pcm) > 0)
+			continue;
 
-					/* break if the last part of the payload has been written */
-					if ((payload_len -= ret) == 0)
-						break;
+		const unsigned int pcm_frames = mpeg_pcm_samples / channels;
+		struct timespec ts_codec;
+		int len;
 
-					/* move rest of data to the beginning of the payload */
-					debug("Payload fragmentation: extra %zd bytes", payload_len);
-					memmove(rtp_payload, rtp_payload + ret, payload_len);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts_codec);
+		if (channels == 1)
+			len = lame_encode_buffer(handle, pcm.data, NULL, pcm_frames,
+					mpeg.tail, ffb_len_in(&mpeg));
+		else
+			len = lame_encode_buffer_interleaved(handle, pcm.data, pcm_frames,
+					mpeg.tail, ffb_len_in(&mpeg));
+		io_thread_stats_codec(t, &ts_codec);
 
-				}
+		ffb_rewind(&pcm);
 
-			}
+		if (len < 0) {
+			error("LAME encoding error: %s", lame_encode_strerror(len));
+			continue;
+		}
 
-			/* keep data transfer at a constant bit rate, also
-			 * get a timestamp for the next RTP frame */
-			unsigned int frames = out_args.numInSamples / channels;
-			asrsync_sync(&asrs, frames);
-			timestamp += frames * 10000 / samplerate;
+		ffb_seek(&mpeg, len);
 
-			/* update busy delay (encoding overhead) */
-			t->delay = asrsync_get_busy_usec(&asrs) / 100;
+		/* LAME delivers complete MPEG frames only */
+		coutq_i = (coutq_i + 1) % ARRAYSIZE(coutq_history);
+		if (io_thread_write_rtp_mpeg(t, bt.data, &mpeg, pcm_frames, samplerate,
+					&seq_number, &timestamp, &coutq_history[coutq_i]) == -1)
+			goto fail;
 
-			/* If the input buffer was not consumed, we have to append new data to
-			 * the existing one. Since we do not use ring buffer, we will simply
-			 * move unprocessed data to the front of our linear buffer. */
-			ffb_shift(&pcm, out_args.numInSamples);
+		/* keep data transfer at a constant bit rate */
+		asrsync_sync(&asrs, pcm_frames);
 
-		}
+		/* update busy delay (encoding overhead) */
+		t->delay = asrsync_get_busy_usec(&asrs) / 100;
 
 	}
 
@@ -1084,6 +1461,7 @@ final:
 fail_ffb:
 	pthread_cleanup_pop(1);
 	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
 fail_init:
 	pthread_cleanup_pop(1);
 fail_open:
@@ -1092,8 +1470,8 @@ fail_open:
 }
 #endif
 
-#if ENABLE_APTX
-void *io_thread_a2dp_source_aptx(void *arg) {
+#if ENABLE_AAC
+void *io_thread_a2dp_sink_aac(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
 
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
@@ -1101,11 +1479,1292 @@ void *io_thread_a2dp_source_aptx(void *arg) {
 
 	bool locked = !transport_pthread_cleanup_lock(t);
 
-	APTXENC handle = malloc(SizeofAptxbtenc());
-	pthread_cleanup_push(PTHREAD_CLEANUP(free), handle);
+	if (t->bt_fd == -1) {
+		error("Invalid BT socket: %d", t->bt_fd);
+		goto fail_open;
+	}
+	if (t->mtu_read <= 0) {
+		error("Invalid reading MTU: %zu", t->mtu_read);
+		goto fail_open;
+	}
+
+	HANDLE_AACDECODER handle;
+	AAC_DECODER_ERROR err;
+
+	if ((handle = aacDecoder_Open(TT_MP4_LATM_MCP1, 1)) == NULL) {
+		error("Couldn't open AAC decoder");
+		goto fail_open;
+	}
+
+	pthread_cleanup_push(PTHREAD_CLEANUP(aacDecoder_Close), handle);
+
+	const unsigned int channels = transport_get_channels(t);
+#ifdef AACDECODER_LIB_VL0
+	if ((err = aacDecoder_SetParam(handle, AAC_PCM_MIN_OUTPUT_CHANNELS, channels)) != AAC_DEC_OK) {
+		error("Couldn't set min output channels: %s", aacdec_strerror(err));
+		goto fail_init;
+	}
+	if ((err = aacDecoder_SetParam(handle, AAC_PCM_MAX_OUTPUT_CHANNELS, channels)) != AAC_DEC_OK) {
+		error("Couldn't set max output channels: %s", aacdec_strerror(err));
+		goto fail_init;
+	}
+#else
+	if ((err = aacDecoder_SetParam(handle, AAC_PCM_OUTPUT_CHANNELS, channels)) != AAC_DEC_OK) {
+		error("Couldn't set output channels: %s", aacdec_strerror(err));
+		goto fail_init;
+	}
+#endif
+
+	ffb_uint8_t bt = { 0 };
+	ffb_uint8_t latm = { 0 };
+	ffb_int16_t pcm = { 0 };
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &latm);
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+
+	if (ffb_init(&pcm, 2048 * channels) == NULL ||
+			ffb_init(&latm, t->mtu_read) == NULL ||
+			ffb_init(&bt, t->mtu_read) == NULL) {
+		error("Couldn't create data buffers: %s", strerror(ENOMEM));
+		goto fail_ffb;
+	}
+
+	io_thread_open_pcm_output(t);
+	pthread_cleanup_push(PTHREAD_CLEANUP(io_thread_close_pcm_output), &t->a2dp.pcm);
+
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
+
+	uint16_t seq_number = -1;
+	int markbit_quirk = -3;
+	/* drop packets up to the end of the broken audioMuxElement */
+	bool resync = false;
+
+	struct pollfd pfds[] = {
+		{ t->sig_fd[0], POLLIN, 0 },
+		{ -1, POLLIN, 0 },
+	};
+
+	transport_pthread_cleanup_unlock(t);
+	locked = false;
+
+	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
+	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+		CStreamInfo *aacinf;
+		ssize_t len;
+
+		/* add BT socket to the poll if transport is active */
+		pfds[1].fd = t->state == TRANSPORT_ACTIVE ? t->bt_fd : -1;
+
+		if (poll(pfds, ARRAYSIZE(pfds), -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			error("Transport poll error: %s", strerror(errno));
+			goto fail;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			/* dispatch incoming event */
+			transport_recv_signal(t);
+			continue;
+		}
+
+		if ((len = read(pfds[1].fd, bt.tail, ffb_len_in(&bt))) == -1) {
+			debug("BT read error: %s", strerror(errno));
+			continue;
+		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		/* it seems that zero is never returned... */
+		if (len == 0) {
+			debug("BT socket has been closed: %d", pfds[1].fd);
+			/* Prevent sending the release request to the BlueZ. If the socket has
+			 * been closed, it means that BlueZ has already closed the connection. */
+			close(pfds[1].fd);
+			t->bt_fd = -1;
+			goto fail;
+		}
+
+		ba_capture_packet(t->capture, BA_CAPTURE_DIR_RX, bt.data, len);
+		io_thread_stats_bt(t, len);
+
+		if (t->a2dp.pcm.fd == -1 && t->a2dp.pcm.output == NULL) {
+			seq_number = -1;
+			continue;
+		}
+
+		const rtp_header_t *rtp_header = (rtp_header_t *)bt.data;
+		uint8_t *rtp_latm = (uint8_t *)&rtp_header->csrc[rtp_header->cc];
+		size_t rtp_latm_len = len - (rtp_latm - (uint8_t *)rtp_header);
+
+#if ENABLE_PAYLOADCHECK
+		if (rtp_header->paytype < 96) {
+			warn("Unsupported RTP payload type: %u", rtp_header->paytype);
+			continue;
+		}
+#endif
+
+		/* If in the first N packets mark bit is not set, it might mean, that
+		 * the mark bit will not be set at all. In such a case, activate mark
+		 * bit quirk workaround. */
+		if (markbit_quirk < 0) {
+			if (rtp_header->markbit)
+				markbit_quirk = 0;
+			else if (++markbit_quirk == 0) {
+				warn("Activating RTP mark bit quirk workaround");
+				markbit_quirk = 1;
+			}
+		}
+
+		uint16_t _seq_number = ntohs(rtp_header->seq_number);
+		if (++seq_number != _seq_number) {
+			if (seq_number != 0) {
+				warn("Missing RTP packet: %u != %u", _seq_number, seq_number);
+				io_thread_stats_rtp_lost(t, (uint16_t)(_seq_number - seq_number));
+				/* drop incomplete audioMuxElement */
+				ffb_rewind(&latm);
+				resync = true;
+			}
+			seq_number = _seq_number;
+		}
+
+		/* The LATM buffer is used only for the reassembly of fragmented
+		 * audioMuxElement. Complete RTP payload is fed to the decoder right
+		 * from the BT buffer. */
+		const bool fragment = markbit_quirk != 1 && !rtp_header->markbit;
+
+		/* After the packet loss, we do not know whether the received packet
+		 * is a beginning of the audioMuxElement, or a remainder of the broken
+		 * one. So, wait for the packet with the mark bit set - the end of the
+		 * audioMuxElement. With the mark bit quirk, every packet is complete. */
+		if (resync) {
+			if (markbit_quirk == 1 || !fragment)
+				resync = false;
+			if (markbit_quirk != 1) {
+				debug("Dropping RTP packet [%u]: LATM resync", seq_number);
+				continue;
+			}
+		}
+		if (fragment || ffb_len_out(&latm) > 0) {
+
+			if (ffb_len_in(&latm) < rtp_latm_len) {
+				debug("Resizing LATM buffer: %zd -> %zd", latm.size, latm.size + t->mtu_read);
+				size_t prev_len = ffb_len_out(&latm);
+				ffb_init(&latm, latm.size + t->mtu_read);
+				ffb_seek(&latm, prev_len);
+			}
+
+			memcpy(latm.tail, rtp_latm, rtp_latm_len);
+			ffb_seek(&latm, rtp_latm_len);
+
+			if (fragment) {
+				debug("Fragmented RTP packet [%u]: LATM len: %zd", seq_number, rtp_latm_len);
+				continue;
+			}
+
+			rtp_latm = latm.data;
+			rtp_latm_len = ffb_len_out(&latm);
+
+		}
+
+		/* Decode directly into the shared memory ring buffer if possible,
+		 * otherwise use our intermediate PCM buffer. */
+		int16_t *output = io_thread_write_pcm_ring_ptr(&t->a2dp.pcm, pcm.size);
+		if (output == NULL)
+			output = pcm.data;
+
+		unsigned int data_len = rtp_latm_len;
+		unsigned int valid = rtp_latm_len;
+		struct timespec ts_codec;
+
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts_codec);
+		if ((err = aacDecoder_Fill(handle, &rtp_latm, &data_len, &valid)) == AAC_DEC_OK)
+			err = aacDecoder_DecodeFrame(handle, output, ffb_blen_in(&pcm), 0);
+		io_thread_stats_codec(t, &ts_codec);
+
+		ffb_rewind(&latm);
+
+		if (err != AAC_DEC_OK)
+			error("AAC decoding error: %s", aacdec_strerror(err));
+		else if ((aacinf = aacDecoder_GetStreamInfo(handle)) == NULL)
+			error("Couldn't get AAC stream info");
+		else {
+			const size_t samples = aacinf->frameSize * aacinf->numChannels;
+			io_thread_scale_pcm(t, output, samples, channels);
+			if (output != pcm.data)
+				io_thread_write_pcm_ring_commit(&t->a2dp.pcm, samples);
+			else if (io_thread_write_pcm(&t->a2dp.pcm, pcm.data, samples) == -1)
+				error("FIFO write error: %s", strerror(errno));
+		}
+
+	}
+
+fail:
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_pop(!locked);
+	pthread_cleanup_pop(1);
+fail_ffb:
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+fail_init:
+	pthread_cleanup_pop(1);
+fail_open:
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+#endif
+
+#if ENABLE_AAC
+/**
+ * LATM stream parameters stored in the StreamMuxConfig. */
+struct io_thread_latm_config {
+	unsigned int samplerate;
+	unsigned int channels;
+	/* number of payloads in the audioMuxElement */
+	unsigned int subframes;
+};
+
+/**
+ * Read bits from the LATM bit stream.
+ *
+ * @param data Address of the LATM bit stream.
+ * @param len The length of the bit stream in bytes.
+ * @param pos Address of the bit position. It is advanced even if there is
+ *   not enough data, so the overrun can be checked afterwards.
+ * @param n The number of bits to read, at most 32.
+ * @return This function returns the read value. */
+static uint32_t io_thread_latm_bits(const uint8_t *data, size_t len,
+		size_t *pos, unsigned int n) {
+	uint32_t value = 0;
+	for (; n > 0; n--, (*pos)++) {
+		value <<= 1;
+		if (*pos < len * 8)
+			value |= (data[*pos / 8] >> (7 - *pos % 8)) & 0x01;
+	}
+	return value;
+}
+
+/**
+ * Read the LatmGetValue() field from the LATM bit stream. */
+static uint32_t io_thread_latm_value(const uint8_t *data, size_t len, size_t *pos) {
+	unsigned int bytes = io_thread_latm_bits(data, len, pos, 2);
+	uint32_t value = 0;
+	do
+		value = value << 8 | io_thread_latm_bits(data, len, pos, 8);
+	while (bytes-- > 0);
+	return value;
+}
+
+/**
+ * Parse the StreamMuxConfig of the LATM audioMuxElement.
+ *
+ * The audioMuxElement is expected to carry the StreamMuxConfig in-band (the
+ * muxConfigPresent is set), which is the format produced by our encoder.
+ *
+ * @param data Address of the audioMuxElement.
+ * @param len The length of the audioMuxElement.
+ * @param config Address where the parsed configuration will be stored.
+ * @return If the StreamMuxConfig has been parsed, 1 is returned. If the
+ *   audioMuxElement uses the previous StreamMuxConfig, 0 is returned. If
+ *   the configuration is not valid or it is not supported, -1 is returned. */
+static int io_thread_latm_stream_mux_config(const uint8_t *data, size_t len,
+		struct io_thread_latm_config *config) {
+
+	static const unsigned int samplings[] = {
+		96000, 88200, 64000, 48000, 44100, 32000, 24000,
+		22050, 16000, 12000, 11025, 8000, 7350 };
+
+	size_t pos = 0;
+
+	/* useSameStreamMux */
+	if (io_thread_latm_bits(data, len, &pos, 1))
+		return 0;
+
+	const unsigned int version = io_thread_latm_bits(data, len, &pos, 1);
+	if (version == 1) {
+		/* audioMuxVersionA has to be zero */
+		if (io_thread_latm_bits(data, len, &pos, 1))
+			return -1;
+		/* taraBufferFullness */
+		io_thread_latm_value(data, len, &pos);
+	}
+
+	/* allStreamsSameTimeFraming */
+	io_thread_latm_bits(data, len, &pos, 1);
+	const unsigned int subframes = io_thread_latm_bits(data, len, &pos, 6) + 1;
+
+	/* only a single program with a single layer is supported */
+	if (io_thread_latm_bits(data, len, &pos, 4) != 0 ||
+			io_thread_latm_bits(data, len, &pos, 3) != 0)
+		return -1;
+
+	if (version == 1)
+		/* ascLen */
+		io_thread_latm_value(data, len, &pos);
+
+	/* AudioSpecificConfig: audioObjectType, samplingFrequencyIndex
+	 * and channelConfiguration */
+	if (io_thread_latm_bits(data, len, &pos, 5) == 31)
+		io_thread_latm_bits(data, len, &pos, 6);
+
+	unsigned int samplerate;
+	const unsigned int sampling_index = io_thread_latm_bits(data, len, &pos, 4);
+	if (sampling_index == 0x0F)
+		samplerate = io_thread_latm_bits(data, len, &pos, 24);
+	else if (sampling_index < ARRAYSIZE(samplings))
+		samplerate = samplings[sampling_index];
+	else
+		return -1;
+
+	const unsigned int channels = io_thread_latm_bits(data, len, &pos, 4);
+
+	if (pos > len * 8)
+		return -1;
+
+	config->samplerate = samplerate;
+	config->channels = channels;
+	config->subframes = subframes;
+	return 1;
+}
+
+/**
+ * Write LATM payload to the BT socket.
+ *
+ * If the size of the RTP packet exceeds writing MTU, the RTP payload is
+ * fragmented. According to the RFC 3016, fragmentation of the audioMuxElement
+ * requires no extra header - the payload should be fragmented and spread
+ * across multiple RTP packets. Fragments are written directly from the
+ * payload buffer, so no data is moved around.
+ *
+ * @param t Transport for which the payload shall be written.
+ * @param rtp_header The initialized RTP header.
+ * @param payload Address of the LATM payload.
+ * @param payload_len The length of the LATM payload.
+ * @param seq_number Address of the RTP sequence number.
+ * @param coutq Address where the number of BT queued bytes will be stored.
+ * @return On success this function returns 0. If the BT socket has been
+ *   disconnected, -1 is returned. */
+static int io_thread_write_rtp_latm(struct ba_transport *t, rtp_header_t *rtp_header,
+		const uint8_t *payload, size_t payload_len, uint16_t *seq_number, int *coutq) {
+
+	const size_t payload_len_max = t->mtu_write - RTP_HEADER_LEN;
+	struct iovec iov[] = {
+		{ .iov_base = rtp_header, .iov_len = RTP_HEADER_LEN },
+		{ .iov_base = NULL, .iov_len = 0 },
+	};
+
+	for (;;) {
+
+		ssize_t ret;
+		size_t len;
+
+		len = payload_len > payload_len_max ? payload_len_max : payload_len;
+		rtp_header->markbit = payload_len <= payload_len_max;
+		rtp_header->seq_number = htons(++*seq_number);
+
+		iov[1].iov_base = (void *)payload;
+		iov[1].iov_len = len;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ret = io_thread_writev_bt(t, iov, ARRAYSIZE(iov), coutq);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (ret == -1) {
+			if (errno == ECONNRESET || errno == ENOTCONN) {
+				/* exit thread upon BT socket disconnection */
+				debug("BT socket disconnected: %d", t->bt_fd);
+				return -1;
+			}
+			error("BT socket write error: %s", strerror(errno));
+			break;
+		}
+
+		/* account written payload only */
+		ret -= RTP_HEADER_LEN;
+
+		/* break if the last part of the payload has been written */
+		if ((payload_len -= ret) == 0)
+			break;
+
+		debug("Payload fragmentation: extra %zu bytes", payload_len);
+		payload += ret;
+
+	}
+
+	return 0;
+}
+
+void *io_thread_a2dp_source_aac(void *arg) {
+	struct ba_transport *t = (struct ba_transport *)arg;
+	const a2dp_aac_t *cconfig = (a2dp_aac_t *)t->a2dp.cconfig;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
+
+	bool locked = !transport_pthread_cleanup_lock(t);
+
+	HANDLE_AACENCODER handle;
+	AACENC_InfoStruct aacinf;
+	AACENC_ERROR err;
+
+	/* create AAC encoder without the Meta Data module */
+	const unsigned int channels = transport_get_channels(t);
+	if ((err = aacEncOpen(&handle, 0x07, channels)) != AACENC_OK) {
+		error("Couldn't open AAC encoder: %s", aacenc_strerror(err));
+		goto fail_open;
+	}
+
+	pthread_cleanup_push(PTHREAD_CLEANUP(aacEncClose), &handle);
+
+	unsigned int aot = AOT_NONE;
+	unsigned int bitrate = AAC_GET_BITRATE(*cconfig);
+	unsigned int samplerate = transport_get_sampling(t);
+	unsigned int channelmode = channels == 1 ? MODE_1 : MODE_2;
+
+	switch (cconfig->object_type) {
+	case AAC_OBJECT_TYPE_MPEG2_AAC_LC:
+#if AACENCODER_LIB_VERSION <= 0x03040C00 /* 3.4.12 */
+		aot = AOT_MP2_AAC_LC;
+		break;
+#endif
+	case AAC_OBJECT_TYPE_MPEG4_AAC_LC:
+		aot = AOT_AAC_LC;
+		break;
+	case AAC_OBJECT_TYPE_MPEG4_AAC_LTP:
+		aot = AOT_AAC_LTP;
+		break;
+	case AAC_OBJECT_TYPE_MPEG4_AAC_SCA:
+		aot = AOT_AAC_SCAL;
+		break;
+	}
+
+	if ((err = aacEncoder_SetParam(handle, AACENC_AOT, aot)) != AACENC_OK) {
+		error("Couldn't set audio object type: %s", aacenc_strerror(err));
+		goto fail_init;
+	}
+	if ((err = aacEncoder_SetParam(handle, AACENC_BITRATE, bitrate)) != AACENC_OK) {
+		error("Couldn't set bitrate: %s", aacenc_strerror(err));
+		goto fail_init;
+	}
+	if ((err = aacEncoder_SetParam(handle, AACENC_SAMPLERATE, samplerate)) != AACENC_OK) {
+		error("Couldn't set sampling rate: %s", aacenc_strerror(err));
+		goto fail_init;
+	}
+	if ((err = aacEncoder_SetParam(handle, AACENC_CHANNELMODE, channelmode)) != AACENC_OK) {
+		error("Couldn't set channel mode: %s", aacenc_strerror(err));
+		goto fail_init;
+	}
+	if (cconfig->vbr) {
+		if ((err = aacEncoder_SetParam(handle, AACENC_BITRATEMODE, config.aac_vbr_mode)) != AACENC_OK) {
+			error("Couldn't set VBR bitrate mode %u: %s", config.aac_vbr_mode, aacenc_strerror(err));
+			goto fail_init;
+		}
+	}
+	/* Try to fit every access unit into a single RTP packet, so the payload
+	 * fragmentation will not be required. Some space is reserved for the LATM
+	 * header, which is sent with every frame. However, the peak bit rate can
+	 * not be lower than the target bit rate. */
+	const size_t latm_payload_len_max = t->mtu_write - RTP_HEADER_LEN - IO_THREAD_LATM_HEADER_LEN;
+	const unsigned int peak_bitrate = t->mtu_write > RTP_HEADER_LEN + IO_THREAD_LATM_HEADER_LEN ?
+		latm_payload_len_max * 8 * samplerate / 1024 : 0;
+	if (peak_bitrate >= bitrate) {
+		if ((err = aacEncoder_SetParam(handle, AACENC_PEAK_BITRATE, peak_bitrate)) != AACENC_OK) {
+			error("Couldn't set peak bitrate: %s", aacenc_strerror(err));
+			goto fail_init;
+		}
+	}
+	else
+		debug("Writing MTU too small for AAC frame without fragmentation: %zu", t->mtu_write);
+	if ((err = aacEncoder_SetParam(handle, AACENC_AFTERBURNER, config.aac_afterburner)) != AACENC_OK) {
+		error("Couldn't enable afterburner: %s", aacenc_strerror(err));
+		goto fail_init;
+	}
+	if ((err = aacEncoder_SetParam(handle, AACENC_TRANSMUX, TT_MP4_LATM_MCP1)) != AACENC_OK) {
+		error("Couldn't enable LATM transport type: %s", aacenc_strerror(err));
+		goto fail_init;
+	}
+	if ((err = aacEncoder_SetParam(handle, AACENC_HEADER_PERIOD, 1)) != AACENC_OK) {
+		error("Couldn't set LATM header period: %s", aacenc_strerror(err));
+		goto fail_init;
+	}
+
+	if ((err = aacEncEncode(handle, NULL, NULL, NULL, NULL)) != AACENC_OK) {
+		error("Couldn't initialize AAC encoder: %s", aacenc_strerror(err));
+		goto fail_init;
+	}
+	if ((err = aacEncInfo(handle, &aacinf)) != AACENC_OK) {
+		error("Couldn't get encoder info: %s", aacenc_strerror(err));
+		goto fail_init;
+	}
+
+	ffb_uint8_t bt = { 0 };
+	ffb_int16_t pcm = { 0 };
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+
+	if (ffb_init(&pcm, aacinf.inputChannels * aacinf.frameLength) == NULL ||
+			ffb_init(&bt, RTP_HEADER_LEN + aacinf.maxOutBufBytes) == NULL) {
+		error("Couldn't create data buffers: %s", strerror(ENOMEM));
+		goto fail_ffb;
+	}
+
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
+
+	rtp_header_t *rtp_header;
+
+	/* initialize RTP header and get anchor for payload */
+	uint8_t *rtp_payload = io_thread_init_rtp(bt.data, &rtp_header, NULL);
+	uint16_t seq_number = ntohs(rtp_header->seq_number);
+	uint32_t timestamp = ntohl(rtp_header->timestamp);
+
+	int in_bufferIdentifiers[] = { IN_AUDIO_DATA };
+	int out_bufferIdentifiers[] = { OUT_BITSTREAM_DATA };
+	int in_bufSizes[] = { pcm.size * sizeof(*pcm.data) };
+	int out_bufSizes[] = { aacinf.maxOutBufBytes };
+	int in_bufElSizes[] = { sizeof(*pcm.data) };
+	int out_bufElSizes[] = { sizeof(*bt.data) };
+
+	AACENC_BufDesc in_buf = {
+		.numBufs = 1,
+		.bufs = (void **)&pcm.data,
+		.bufferIdentifiers = in_bufferIdentifiers,
+		.bufSizes = in_bufSizes,
+		.bufElSizes = in_bufElSizes,
+	};
+	AACENC_BufDesc out_buf = {
+		.numBufs = 1,
+		.bufs = (void **)&rtp_payload,
+		.bufferIdentifiers = out_bufferIdentifiers,
+		.bufSizes = out_bufSizes,
+		.bufElSizes = out_bufElSizes,
+	};
+	AACENC_InArgs in_args = { 0 };
+	AACENC_OutArgs out_args = { 0 };
+
+	/* array with historical data of queued bytes for BT socket */
+	int coutq_history[IO_THREAD_COUTQ_HISTORY_SIZE] = { 0 };
+	size_t coutq_i = 0;
+
+	int poll_timeout = -1;
+	struct asrsync asrs = { .frames = 0 };
+	struct pollfd pfds[] = {
+		{ t->sig_fd[0], POLLIN, 0 },
+		{ -1, POLLIN, 0 },
+	};
+
+	transport_pthread_cleanup_unlock(t);
+	locked = false;
+
+	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
+	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+		ssize_t samples;
+
+		/* add PCM socket to the poll if transport is active */
+		pfds[1].fd = t->state == TRANSPORT_ACTIVE ? t->a2dp.pcm.fd : -1;
+
+		switch (poll(pfds, ARRAYSIZE(pfds), poll_timeout)) {
+		case 0:
+			pthread_cond_signal(&t->a2dp.drained);
+			poll_timeout = -1;
+			locked = !transport_pthread_cleanup_lock(t);
+			if (t->a2dp.pcm.fd == -1)
+				goto final;
+			transport_pthread_cleanup_unlock(t);
+			locked = false;
+			continue;
+		case -1:
+			if (errno == EINTR)
+				continue;
+			error("Transport poll error: %s", strerror(errno));
+			goto fail;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			/* dispatch incoming event */
+			enum ba_transport_signal sig = transport_recv_signal(t);
+			switch (sig) {
+			case TRANSPORT_PCM_OPEN:
+			case TRANSPORT_PCM_RESUME:
+				poll_timeout = -1;
+				asrs.frames = 0;
+				continue;
+			case TRANSPORT_PCM_CLOSE:
+				/* reuse PCM read disconnection logic */
+				break;
+			case TRANSPORT_PCM_SYNC:
+				poll_timeout = 100;
+				continue;
+			case TRANSPORT_PCM_DROP:
+				io_thread_read_pcm_flush(&t->a2dp.pcm);
+				continue;
+			default:
+				continue;
+			}
+		}
+
+		switch (samples = io_thread_read_pcm(&t->a2dp.pcm, pcm.tail, ffb_len_in(&pcm))) {
+		case 0:
+			poll_timeout = config.a2dp.keep_alive * 1000;
+			debug("Keep-alive polling: %d", poll_timeout);
+			continue;
+		case -1:
+			if (errno == EAGAIN)
+				continue;
+			error("PCM read error: %s", strerror(errno));
+			goto fail;
+		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (asrs.frames == 0)
+			asrsync_init(&asrs, samplerate);
+
+		if (!config.a2dp.volume)
+			/* scale volume or mute audio signal */
+			io_thread_scale_pcm(t, pcm.tail, samples, channels);
+
+		/* move tail pointer */
+		ffb_seek(&pcm, samples);
+
+		while ((in_args.numInSamples = ffb_len_out(&pcm)) > 0) {
+
+			struct timespec ts_codec;
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts_codec);
+			err = aacEncEncode(handle, &in_buf, &out_buf, &in_args, &out_args);
+			io_thread_stats_codec(t, &ts_codec);
+
+			if (err != AACENC_OK)
+				error("AAC encoding error: %s", aacenc_strerror(err));
+
+			if (out_args.numOutBytes > 0) {
+
+				rtp_header->timestamp = htonl(timestamp);
+
+				coutq_i = (coutq_i + 1) % ARRAYSIZE(coutq_history);
+				if (io_thread_write_rtp_latm(t, rtp_header, rtp_payload, out_args.numOutBytes,
+							&seq_number, &coutq_history[coutq_i]) == -1)
+					goto fail;
+
+			}
+
+			/* keep data transfer at a constant bit rate, also
+			 * get a timestamp for the next RTP frame */
+			unsigned int frames = out_args.numInSamples / channels;
+			asrsync_sync(&asrs, frames);
+			timestamp += frames * 10000 / samplerate;
+
+			/* update busy delay (encoding overhead) */
+			t->delay = asrsync_get_busy_usec(&asrs) / 100;
+
+			/* If the input buffer was not consumed, we have to append new data to
+			 * the existing one. Since we do not use ring buffer, we will simply
+			 * move unprocessed data to the front of our linear buffer. */
+			ffb_shift(&pcm, out_args.numInSamples);
+
+		}
+
+	}
+
+fail:
+final:
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_pop(!locked);
+fail_ffb:
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+fail_init:
+	pthread_cleanup_pop(1);
+fail_open:
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+#endif
+
+#if ENABLE_APTX && HAVE_APTX_DECODE
+void *io_thread_a2dp_sink_aptx(void *arg) {
+	struct ba_transport *t = (struct ba_transport *)arg;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
+
+	bool locked = !transport_pthread_cleanup_lock(t);
+
+	if (t->bt_fd == -1) {
+		error("Invalid BT socket: %d", t->bt_fd);
+		goto fail_open;
+	}
+	if (t->mtu_read <= 0) {
+		error("Invalid reading MTU: %zu", t->mtu_read);
+		goto fail_open;
+	}
+
+	APTXDEC handle = malloc(SizeofAptxbtdec());
+	pthread_cleanup_push(PTHREAD_CLEANUP(free), handle);
+
+	if (handle == NULL || aptxbtdec_init(handle, __BYTE_ORDER == __LITTLE_ENDIAN) != 0) {
+		error("Couldn't initialize apt-X decoder: %s", strerror(errno));
+		goto fail_init;
+	}
+
+	ffb_uint8_t bt = { 0 };
+	ffb_int16_t pcm = { 0 };
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+
+	const unsigned int channels = transport_get_channels(t);
+	const size_t aptx_pcm_samples = 4 * channels;
+	const size_t aptx_code_len = 2 * sizeof(uint16_t);
+
+	/* Apt-X stream is not fragmented into frames, so the PCM buffer has to
+	 * be big enough to hold data decoded from the entire BT packet. */
+	if (ffb_init(&pcm, aptx_pcm_samples * (t->mtu_read / aptx_code_len)) == NULL ||
+			ffb_init(&bt, t->mtu_read) == NULL) {
+		error("Couldn't create data buffers: %s", strerror(ENOMEM));
+		goto fail_ffb;
+	}
+
+	io_thread_open_pcm_output(t);
+	pthread_cleanup_push(PTHREAD_CLEANUP(io_thread_close_pcm_output), &t->a2dp.pcm);
+
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
+
+	struct pollfd pfds[] = {
+		{ t->sig_fd[0], POLLIN, 0 },
+		{ -1, POLLIN, 0 },
+	};
+
+	transport_pthread_cleanup_unlock(t);
+	locked = false;
+
+	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
+	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+		ssize_t len;
+
+		/* add BT socket to the poll if transport is active */
+		pfds[1].fd = t->state == TRANSPORT_ACTIVE ? t->bt_fd : -1;
+
+		if (poll(pfds, ARRAYSIZE(pfds), -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			error("Transport poll error: %s", strerror(errno));
+			goto fail;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			/* dispatch incoming event */
+			transport_recv_signal(t);
+			continue;
+		}
+
+		if ((len = read(pfds[1].fd, bt.tail, ffb_len_in(&bt))) == -1) {
+			debug("BT read error: %s", strerror(errno));
+			continue;
+		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (len == 0) {
+			debug("BT socket has been closed: %d", pfds[1].fd);
+			close(pfds[1].fd);
+			t->bt_fd = -1;
+			goto fail;
+		}
+
+		ba_capture_packet(t->capture, BA_CAPTURE_DIR_RX, bt.data, len);
+		io_thread_stats_bt(t, len);
+
+		if (t->a2dp.pcm.fd == -1 && t->a2dp.pcm.output == NULL)
+			continue;
+
+		/* Apt-X stream does not use RTP encapsulation, hence there is no way
+		 * to detect lost packets. The BT packet consists of apt-X code words
+		 * only, and every one of them is decoded independently. */
+		const uint16_t *input = (uint16_t *)bt.data;
+		size_t input_len = len;
+
+		struct timespec ts_codec;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts_codec);
+
+		int16_t *output = pcm.data;
+		while (input_len >= aptx_code_len) {
+
+			int32_t pcm_l[4];
+			int32_t pcm_r[4];
+			size_t i;
+
+			if (aptxbtdec_decodestereo(handle, pcm_l, pcm_r, input) != 0) {
+				error("Apt-X decoding error: %s", strerror(errno));
+				break;
+			}
+
+			for (i = 0; i < 4; i++) {
+				*output++ = pcm_l[i];
+				*output++ = pcm_r[i];
+			}
+
+			input += 2;
+			input_len -= aptx_code_len;
+
+		}
+
+		io_thread_stats_codec(t, &ts_codec);
+
+		const size_t samples = output - pcm.data;
+		io_thread_scale_pcm(t, pcm.data, samples, channels);
+		if (io_thread_write_pcm(&t->a2dp.pcm, pcm.data, samples) == -1)
+			error("FIFO write error: %s", strerror(errno));
+
+	}
+
+fail:
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_pop(!locked);
+	pthread_cleanup_pop(1);
+fail_ffb:
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+fail_init:
+	pthread_cleanup_pop(1);
+fail_open:
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+#endif
+
+#if ENABLE_APTX
+void *io_thread_a2dp_source_aptx(void *arg) {
+	struct ba_transport *t = (struct ba_transport *)arg;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
+
+	bool locked = !transport_pthread_cleanup_lock(t);
+
+	APTXENC handle = malloc(SizeofAptxbtenc());
+	pthread_cleanup_push(PTHREAD_CLEANUP(free), handle);
+
+	if (handle == NULL || aptxbtenc_init(handle, __BYTE_ORDER == __LITTLE_ENDIAN) != 0) {
+		error("Couldn't initialize apt-X encoder: %s", strerror(errno));
+		goto fail_init;
+	}
+
+	ffb_uint8_t bt = { 0 };
+	ffb_int16_t pcm = { 0 };
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+
+	const unsigned int channels = transport_get_channels(t);
+	const size_t aptx_pcm_samples = 4 * channels;
+	const size_t aptx_code_len = 2 * sizeof(uint16_t);
+	const size_t mtu_write = t->mtu_write;
+
+	if (ffb_init(&pcm, aptx_pcm_samples * (mtu_write / aptx_code_len)) == NULL ||
+			ffb_init(&bt, mtu_write) == NULL) {
+		error("Couldn't create data buffers: %s", strerror(ENOMEM));
+		goto fail_ffb;
+	}
+
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
+
+	/* array with historical data of queued bytes for BT socket */
+	int coutq_history[IO_THREAD_COUTQ_HISTORY_SIZE] = { 0 };
+	size_t coutq_i = 0;
+
+	int poll_timeout = -1;
+	struct asrsync asrs = { .frames = 0 };
+	struct pollfd pfds[] = {
+		{ t->sig_fd[0], POLLIN, 0 },
+		{ -1, POLLIN, 0 },
+	};
+
+	transport_pthread_cleanup_unlock(t);
+	locked = false;
+
+	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
+	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+		ssize_t samples;
+
+		/* add PCM socket to the poll if transport is active */
+		pfds[1].fd = t->state == TRANSPORT_ACTIVE ? t->a2dp.pcm.fd : -1;
+
+		switch (poll(pfds, ARRAYSIZE(pfds), poll_timeout)) {
+		case 0:
+			pthread_cond_signal(&t->a2dp.drained);
+			poll_timeout = -1;
+			locked = !transport_pthread_cleanup_lock(t);
+			if (t->a2dp.pcm.fd == -1)
+				goto final;
+			transport_pthread_cleanup_unlock(t);
+			locked = false;
+			continue;
+		case -1:
+			if (errno == EINTR)
+				continue;
+			error("Transport poll error: %s", strerror(errno));
+			goto fail;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			/* dispatch incoming event */
+			enum ba_transport_signal sig = transport_recv_signal(t);
+			switch (sig) {
+			case TRANSPORT_PCM_OPEN:
+			case TRANSPORT_PCM_RESUME:
+				poll_timeout = -1;
+				asrs.frames = 0;
+				continue;
+			case TRANSPORT_PCM_CLOSE:
+				/* reuse PCM read disconnection logic */
+				break;
+			case TRANSPORT_PCM_SYNC:
+				poll_timeout = 100;
+				continue;
+			case TRANSPORT_PCM_DROP:
+				io_thread_read_pcm_flush(&t->a2dp.pcm);
+				continue;
+			default:
+				continue;
+			}
+		}
+
+		switch (samples = io_thread_read_pcm(&t->a2dp.pcm, pcm.tail, ffb_len_in(&pcm))) {
+		case 0:
+			poll_timeout = config.a2dp.keep_alive * 1000;
+			debug("Keep-alive polling: %d", poll_timeout);
+			continue;
+		case -1:
+			if (errno == EAGAIN)
+				continue;
+			error("PCM read error: %s", strerror(errno));
+			goto fail;
+		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (asrs.frames == 0)
+			asrsync_init(&asrs, transport_get_sampling(t));
+
+		if (!config.a2dp.volume)
+			/* scale volume or mute audio signal */
+			io_thread_scale_pcm(t, pcm.tail, samples, channels);
+
+		/* get overall number of input samples */
+		ffb_seek(&pcm, samples);
+		samples = ffb_len_out(&pcm);
+
+		int16_t *input = pcm.data;
+		size_t input_len = samples;
+
+		/* encode and transfer obtained data */
+		while (input_len >= aptx_pcm_samples) {
+
+			size_t output_len = ffb_len_in(&bt);
+			size_t pcm_frames = 0;
+
+			struct timespec ts_codec;
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts_codec);
+
+			/* Generate as many apt-X frames as possible to fill the output buffer
+			 * without overflowing it. The size of the output buffer is based on
+			 * the socket MTU, so such a transfer should be most efficient. */
+			while (input_len >= aptx_pcm_samples && output_len >= aptx_code_len) {
+
+				int32_t pcm_l[4];
+				int32_t pcm_r[4];
+				size_t i;
+
+				for (i = 0; i < 4; i++) {
+					pcm_l[i] = input[2 * i];
+					pcm_r[i] = input[2 * i + 1];
+				}
+
+				if (aptxbtenc_encodestereo(handle, pcm_l, pcm_r, (uint16_t *)bt.tail) != 0) {
+					error("Apt-X encoding error: %s", strerror(errno));
+					break;
+				}
+
+				input += 4 * channels;
+				input_len -= 4 * channels;
+				ffb_seek(&bt, aptx_code_len);
+				output_len -= aptx_code_len;
+				pcm_frames += 4;
+
+			}
+
+			io_thread_stats_codec(t, &ts_codec);
+
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+			coutq_i = (coutq_i + 1) % ARRAYSIZE(coutq_history);
+			if (io_thread_write_bt(t, bt.data, ffb_len_out(&bt), &coutq_history[coutq_i]) == -1) {
+				if (errno == ECONNRESET || errno == ENOTCONN) {
+					/* exit thread upon BT socket disconnection */
+					debug("BT socket disconnected: %d", t->bt_fd);
+					goto fail;
+				}
+				error("BT socket write error: %s", strerror(errno));
+			}
+
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+			/* keep data transfer at a constant bit rate */
+			asrsync_sync(&asrs, pcm_frames);
+
+			/* update busy delay (encoding overhead) */
+			t->delay = asrsync_get_busy_usec(&asrs) / 100;
+
+			/* reinitialize output buffer */
+			ffb_rewind(&bt);
+
+		}
+
+		/* If the input buffer was not consumed (due to codesize limit), we
+		 * have to append new data to the existing one. Since we do not use
+		 * ring buffer, we will simply move unprocessed data to the front
+		 * of our linear buffer. */
+		ffb_shift(&pcm, samples - input_len);
+
+	}
+
+fail:
+final:
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_pop(!locked);
+fail_ffb:
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+fail_init:
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+#endif
+
+#if ENABLE_LDAC && HAVE_LDAC_DECODE
+void *io_thread_a2dp_sink_ldac(void *arg) {
+	struct ba_transport *t = (struct ba_transport *)arg;
+	const a2dp_ldac_t *cconfig = (a2dp_ldac_t *)t->a2dp.cconfig;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
+
+	bool locked = !transport_pthread_cleanup_lock(t);
+
+	if (t->bt_fd == -1) {
+		error("Invalid BT socket: %d", t->bt_fd);
+		goto fail_open_ldac;
+	}
+	if (t->mtu_read <= 0) {
+		error("Invalid reading MTU: %zu", t->mtu_read);
+		goto fail_open_ldac;
+	}
+
+	HANDLE_LDAC_BT handle;
+	if ((handle = ldacBT_get_handle()) == NULL) {
+		error("Couldn't open LDAC decoder: %s", strerror(errno));
+		goto fail_open_ldac;
+	}
+
+	pthread_cleanup_push(PTHREAD_CLEANUP(ldacBT_free_handle), handle);
+
+	const unsigned int channels = transport_get_channels(t);
+	const unsigned int samplerate = transport_get_sampling(t);
+
+	if (ldacBT_init_handle_decode(handle, cconfig->channel_mode, samplerate, 0, 0, 0) == -1) {
+		error("Couldn't initialize LDAC decoder: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
+		goto fail_init;
+	}
+
+	ffb_uint8_t bt = { 0 };
+	ffb_int16_t pcm = { 0 };
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+
+	if (ffb_init(&pcm, LDACBT_MAX_LSU * channels) == NULL ||
+			ffb_init(&bt, t->mtu_read) == NULL) {
+		error("Couldn't create data buffers: %s", strerror(ENOMEM));
+		goto fail_ffb;
+	}
+
+	io_thread_open_pcm_output(t);
+	pthread_cleanup_push(PTHREAD_CLEANUP(io_thread_close_pcm_output), &t->a2dp.pcm);
+
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
+
+	uint16_t seq_number = -1;
+
+	struct pollfd pfds[] = {
+		{ t->sig_fd[0], POLLIN, 0 },
+		{ -1, POLLIN, 0 },
+	};
+
+	transport_pthread_cleanup_unlock(t);
+	locked = false;
+
+	debug("Starting IO loop: %s", ba_transport_type_to_string(t->type));
+	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+		ssize_t len;
+
+		/* add BT socket to the poll if transport is active */
+		pfds[1].fd = t->state == TRANSPORT_ACTIVE ? t->bt_fd : -1;
+
+		if (poll(pfds, ARRAYSIZE(pfds), -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			error("Transport poll error: %s", strerror(errno));
+			goto fail;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			/* dispatch incoming event */
+			transport_recv_signal(t);
+			continue;
+		}
+
+		if ((len = read(pfds[1].fd, bt.tail, ffb_len_in(&bt))) == -1) {
+			debug("BT read error: %s", strerror(errno));
+			continue;
+		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (len == 0) {
+			debug("BT socket has been closed: %d", pfds[1].fd);
+			close(pfds[1].fd);
+			t->bt_fd = -1;
+			goto fail;
+		}
+
+		ba_capture_packet(t->capture, BA_CAPTURE_DIR_RX, bt.data, len);
+		io_thread_stats_bt(t, len);
+
+		if (t->a2dp.pcm.fd == -1 && t->a2dp.pcm.output == NULL) {
+			seq_number = -1;
+			continue;
+		}
+
+		const rtp_header_t *rtp_header = (rtp_header_t *)bt.data;
+		const rtp_media_header_t *rtp_media_header = (rtp_media_header_t *)&rtp_header->csrc[rtp_header->cc];
+		uint8_t *rtp_payload = (uint8_t *)(rtp_media_header + 1);
+		size_t rtp_payload_len = len - (rtp_payload - (uint8_t *)rtp_header);
+
+#if ENABLE_PAYLOADCHECK
+		if (rtp_header->paytype < 96) {
+			warn("Unsupported RTP payload type: %u", rtp_header->paytype);
+			continue;
+		}
+#endif
+
+		uint16_t _seq_number = ntohs(rtp_header->seq_number);
+		if (++seq_number != _seq_number) {
+			if (seq_number != 0) {
+				warn("Missing RTP packet: %u != %u", _seq_number, seq_number);
+				io_thread_stats_rtp_lost(t, (uint16_t)(_seq_number - seq_number));
+			}
+			seq_number = _seq_number;
+		}
+
+		struct timespec ts_codec;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts_codec);
+
+		/* decode retrieved LDAC frames */
+		size_t frames = rtp_media_header->frame_count;
+		while (frames--) {
+
+			int used;
+			int decoded;
+
+			int ret = ldacBT_decode(handle, rtp_payload, (unsigned char *)pcm.data,
+					LDACBT_SMPL_FMT_S16, rtp_payload_len, &used, &decoded);
+
+			if (ret == -1) {
+				error("LDAC decoding error: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
+				break;
+			}
+
+			rtp_payload += used;
+			rtp_payload_len -= used;
+
+			const size_t samples = decoded / sizeof(int16_t);
+			io_thread_scale_pcm(t, pcm.data, samples, channels);
+			if (io_thread_write_pcm(&t->a2dp.pcm, pcm.data, samples) == -1)
+				error("FIFO write error: %s", strerror(errno));
+
+		}
+
+		io_thread_stats_codec(t, &ts_codec);
+
+	}
+
+fail:
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_pop(!locked);
+	pthread_cleanup_pop(1);
+fail_ffb:
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+fail_init:
+	pthread_cleanup_pop(1);
+fail_open_ldac:
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+#endif
+
+#if ENABLE_LDAC
+void *io_thread_a2dp_source_ldac(void *arg) {
+	struct ba_transport *t = (struct ba_transport *)arg;
+	const a2dp_ldac_t *cconfig = (a2dp_ldac_t *)t->a2dp.cconfig;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
+
+	bool locked = !transport_pthread_cleanup_lock(t);
+
+	HANDLE_LDAC_BT handle;
+	HANDLE_LDAC_ABR handle_abr;
+
+	if ((handle = ldacBT_get_handle()) == NULL) {
+		error("Couldn't open LDAC encoder: %s", strerror(errno));
+		goto fail_open_ldac;
+	}
+
+	pthread_cleanup_push(PTHREAD_CLEANUP(ldacBT_free_handle), handle);
+
+	if ((handle_abr = ldac_ABR_get_handle()) == NULL) {
+		error("Couldn't open LDAC ABR: %s", strerror(errno));
+		goto fail_open_ldac_abr;
+	}
+
+	pthread_cleanup_push(PTHREAD_CLEANUP(ldac_ABR_free_handle), handle_abr);
+
+	const unsigned int channels = transport_get_channels(t);
+	const unsigned int samplerate = transport_get_sampling(t);
+	const size_t ldac_pcm_samples = LDACBT_ENC_LSU * channels;
+
+	if (ldacBT_init_handle_encode(handle, t->mtu_write - RTP_HEADER_LEN - sizeof(rtp_media_header_t),
+				config.ldac_eqmid, cconfig->channel_mode, LDACBT_SMPL_FMT_S16, samplerate) == -1) {
+		error("Couldn't initialize LDAC encoder: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
+		goto fail_init;
+	}
 
-	if (handle == NULL || aptxbtenc_init(handle, __BYTE_ORDER == __LITTLE_ENDIAN) != 0) {
-		error("Couldn't initialize apt-X encoder: %s", strerror(errno));
+	if (ldac_ABR_Init(handle_abr, 1000 * ldac_pcm_samples / channels / samplerate) == -1) {
+		error("Couldn't initialize LDAC ABR");
+		goto fail_init;
+	}
+	if (ldac_ABR_set_thresholds(handle_abr, 6, 4, 2) == -1) {
+		error("Couldn't set LDAC ABR thresholds");
 		goto fail_init;
 	}
 
@@ -1114,22 +2773,25 @@ void *io_thread_a2dp_source_aptx(void *arg) {
 	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
 	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
 
-	const unsigned int channels = transport_get_channels(t);
-	const size_t aptx_pcm_samples = 4 * channels;
-	const size_t aptx_code_len = 2 * sizeof(uint16_t);
-	const size_t mtu_write = t->mtu_write;
-
-	if (ffb_init(&pcm, aptx_pcm_samples * (mtu_write / aptx_code_len)) == NULL ||
-			ffb_init(&bt, mtu_write) == NULL) {
+	if (ffb_init(&pcm, ldac_pcm_samples) == NULL ||
+			ffb_init(&bt, t->mtu_write) == NULL) {
 		error("Couldn't create data buffers: %s", strerror(ENOMEM));
 		goto fail_ffb;
 	}
 
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
 
-	/* array with historical data of queued bytes for BT socket */
-	int coutq_history[IO_THREAD_COUTQ_HISTORY_SIZE] = { 0 };
-	size_t coutq_i = 0;
+	rtp_header_t *rtp_header;
+	rtp_media_header_t *rtp_media_header;
+
+	/* initialize RTP headers and get anchor for payload */
+	bt.tail = io_thread_init_rtp(bt.data, &rtp_header, &rtp_media_header);
+	uint16_t seq_number = ntohs(rtp_header->seq_number);
+	uint32_t timestamp = ntohl(rtp_header->timestamp);
+	size_t ts_frames = 0;
+
+	/* number of queued bytes in the BT socket */
+	int coutq = 0;
 
 	int poll_timeout = -1;
 	struct asrsync asrs = { .frames = 0 };
@@ -1169,9 +2831,7 @@ void *io_thread_a2dp_source_aptx(void *arg) {
 
 		if (pfds[0].revents & POLLIN) {
 			/* dispatch incoming event */
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
+			enum ba_transport_signal sig = transport_recv_signal(t);
 			switch (sig) {
 			case TRANSPORT_PCM_OPEN:
 			case TRANSPORT_PCM_RESUME:
@@ -1207,7 +2867,7 @@ void *io_thread_a2dp_source_aptx(void *arg) {
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
 		if (asrs.frames == 0)
-			asrsync_init(&asrs, transport_get_sampling(t));
+			asrsync_init(&asrs, samplerate);
 
 		if (!config.a2dp.volume)
 			/* scale volume or mute audio signal */
@@ -1221,42 +2881,33 @@ void *io_thread_a2dp_source_aptx(void *arg) {
 		size_t input_len = samples;
 
 		/* encode and transfer obtained data */
-		while (input_len >= aptx_pcm_samples) {
-
-			size_t output_len = ffb_len_in(&bt);
-			size_t pcm_frames = 0;
-
-			/* Generate as many apt-X frames as possible to fill the output buffer
-			 * without overflowing it. The size of the output buffer is based on
-			 * the socket MTU, so such a transfer should be most efficient. */
-			while (input_len >= aptx_pcm_samples && output_len >= aptx_code_len) {
+		while (input_len >= ldac_pcm_samples) {
 
-				int32_t pcm_l[4];
-				int32_t pcm_r[4];
-				size_t i;
+			struct timespec ts_codec;
+			int len;
+			int encoded;
+			int frames;
+			int ret;
 
-				for (i = 0; i < 4; i++) {
-					pcm_l[i] = input[2 * i];
-					pcm_r[i] = input[2 * i + 1];
-				}
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts_codec);
+			ret = ldacBT_encode(handle, input, &len, bt.tail, &encoded, &frames);
+			io_thread_stats_codec(t, &ts_codec);
 
-				if (aptxbtenc_encodestereo(handle, pcm_l, pcm_r, (uint16_t *)bt.tail) != 0) {
-					error("Apt-X encoding error: %s", strerror(errno));
-					break;
-				}
+			if (ret != 0) {
+				error("LDAC encoding error: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
+				break;
+			}
 
-				input += 4 * channels;
-				input_len -= 4 * channels;
-				ffb_seek(&bt, aptx_code_len);
-				output_len -= aptx_code_len;
-				pcm_frames += 4;
+			rtp_media_header->frame_count = frames;
 
-			}
+			frames = len / sizeof(int16_t);
+			input += frames;
+			input_len -= frames;
 
 			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
-			coutq_i = (coutq_i + 1) % ARRAYSIZE(coutq_history);
-			if (io_thread_write_bt(t, bt.data, ffb_len_out(&bt), &coutq_history[coutq_i]) == -1) {
+			if (encoded &&
+					io_thread_write_bt(t, bt.data, ffb_len_out(&bt) + encoded, &coutq) == -1) {
 				if (errno == ECONNRESET || errno == ENOTCONN) {
 					/* exit thread upon BT socket disconnection */
 					debug("BT socket disconnected: %d", t->bt_fd);
@@ -1265,16 +2916,24 @@ void *io_thread_a2dp_source_aptx(void *arg) {
 				error("BT socket write error: %s", strerror(errno));
 			}
 
+			if (config.ldac_abr)
+				ldac_ABR_Proc(handle, handle_abr, coutq / t->mtu_write, 1);
+
 			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
 			/* keep data transfer at a constant bit rate */
-			asrsync_sync(&asrs, pcm_frames);
+			asrsync_sync(&asrs, frames / channels);
+			ts_frames += frames;
 
 			/* update busy delay (encoding overhead) */
 			t->delay = asrsync_get_busy_usec(&asrs) / 100;
 
-			/* reinitialize output buffer */
-			ffb_rewind(&bt);
+			if (encoded) {
+				timestamp += ts_frames / channels * 10000 / samplerate;
+				rtp_header->timestamp = htonl(timestamp);
+				rtp_header->seq_number = htons(++seq_number);
+				ts_frames = 0;
+			}
 
 		}
 
@@ -1295,63 +2954,113 @@ fail_ffb:
 	pthread_cleanup_pop(1);
 fail_init:
 	pthread_cleanup_pop(1);
+fail_open_ldac_abr:
+	pthread_cleanup_pop(1);
+fail_open_ldac:
 	pthread_cleanup_pop(1);
 	return NULL;
 }
 #endif
 
-#if ENABLE_LDAC
-void *io_thread_a2dp_source_ldac(void *arg) {
+/**
+ * Get the length of the SBC frame.
+ *
+ * @param header Address of the SBC frame header (3 bytes).
+ * @param frames Address where the number of PCM frames encoded in the SBC
+ *   frame will be stored.
+ * @return On success this function returns the length of the frame in bytes.
+ *   If the header is not valid, 0 is returned. */
+static size_t io_thread_sbc_frame_length(const uint8_t *header, unsigned int *frames) {
+
+	/* SBC frame sync word */
+	if (header[0] != 0x9C)
+		return 0;
+
+	const unsigned int blocks = 4 * (((header[1] >> 4) & 0x03) + 1);
+	const unsigned int mode = (header[1] >> 2) & 0x03;
+	const unsigned int subbands = header[1] & 0x01 ? 8 : 4;
+	const unsigned int channels = mode == SBC_MODE_MONO ? 1 : 2;
+	const unsigned int bitpool = header[2];
+
+	size_t len = 4 + (4 * subbands * channels) / 8;
+	if (mode == SBC_MODE_MONO || mode == SBC_MODE_DUAL_CHANNEL)
+		len += (blocks * channels * bitpool + 7) / 8;
+	else
+		len += ((mode == SBC_MODE_JOINT_STEREO ? subbands : 0) + blocks * bitpool + 7) / 8;
+
+	*frames = blocks * subbands;
+	return len;
+}
+
+/**
+ * IO thread for the A2DP source in the passthrough mode.
+ *
+ * In this mode the client delivers audio frames already encoded with the
+ * codec selected for the transport. Frames are only packetized and sent to
+ * the BT socket at the rate given by the number of PCM frames they contain.
+ * Note, that the software volume control can not be applied here. */
+void *io_thread_a2dp_source_passthrough(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
-	const a2dp_ldac_t *cconfig = (a2dp_ldac_t *)t->a2dp.cconfig;
 
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
 
 	bool locked = !transport_pthread_cleanup_lock(t);
 
-	HANDLE_LDAC_BT handle;
-	HANDLE_LDAC_ABR handle_abr;
-
-	if ((handle = ldacBT_get_handle()) == NULL) {
-		error("Couldn't open LDAC encoder: %s", strerror(errno));
-		goto fail_open_ldac;
-	}
-
-	pthread_cleanup_push(PTHREAD_CLEANUP(ldacBT_free_handle), handle);
-
-	if ((handle_abr = ldac_ABR_get_handle()) == NULL) {
-		error("Couldn't open LDAC ABR: %s", strerror(errno));
-		goto fail_open_ldac_abr;
-	}
-
-	pthread_cleanup_push(PTHREAD_CLEANUP(ldac_ABR_free_handle), handle_abr);
-
 	const unsigned int channels = transport_get_channels(t);
 	const unsigned int samplerate = transport_get_sampling(t);
-	const size_t ldac_pcm_samples = LDACBT_ENC_LSU * channels;
-
-	if (ldacBT_init_handle_encode(handle, t->mtu_write - RTP_HEADER_LEN - sizeof(rtp_media_header_t),
-				config.ldac_eqmid, cconfig->channel_mode, LDACBT_SMPL_FMT_S16, samplerate) == -1) {
-		error("Couldn't initialize LDAC encoder: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
-		goto fail_init;
-	}
+	uint8_t sbc_header = 0;
+	uint8_t sbc_bitpool_min = 0;
+	uint8_t sbc_bitpool_max = 0;
+	sbc_t sbc;
+#if ENABLE_MPEG
+	unsigned int mpeg_channel_mode = 0;
+#endif
+#if ENABLE_AAC
+	/* LATM configuration of the client stream (validated) */
+	struct io_thread_latm_config latm_config = { 0 };
+#endif
 
-	if (ldac_ABR_Init(handle_abr, 1000 * ldac_pcm_samples / channels / samplerate) == -1) {
-		error("Couldn't initialize LDAC ABR");
-		goto fail_init;
-	}
-	if (ldac_ABR_set_thresholds(handle_abr, 6, 4, 2) == -1) {
-		error("Couldn't set LDAC ABR thresholds");
+	switch (t->type.codec) {
+	case A2DP_CODEC_SBC:
+		/* get SBC frame parameters which have to be matched by the client */
+		if ((errno = -sbc_init_a2dp(&sbc, 0, t->a2dp.cconfig, t->a2dp.cconfig_size)) != 0) {
+			error("Couldn't initialize SBC codec: %s", strerror(errno));
+			goto fail_init;
+		}
+		/* the second byte of the SBC frame header */
+		sbc_header = sbc.frequency << 6 | sbc.blocks << 4 | sbc.mode << 2 |
+			sbc.allocation << 1 | sbc.subbands;
+		sbc_bitpool_min = ((a2dp_sbc_t *)t->a2dp.cconfig)->min_bitpool;
+		sbc_bitpool_max = ((a2dp_sbc_t *)t->a2dp.cconfig)->max_bitpool;
+		sbc_finish(&sbc);
+		break;
+#if ENABLE_MPEG
+	case A2DP_CODEC_MPEG12:
+		/* only the layer III frames can be packetized */
+		if (((a2dp_mpeg_t *)t->a2dp.cconfig)->layer != MPEG_LAYER_MP3) {
+			error("MPEG layer not supported in the passthrough mode: %#x",
+					((a2dp_mpeg_t *)t->a2dp.cconfig)->layer);
+			goto fail_init;
+		}
+		mpeg_channel_mode = ((a2dp_mpeg_t *)t->a2dp.cconfig)->channel_mode;
+		break;
+#endif
+#if ENABLE_AAC
+	case A2DP_CODEC_MPEG24:
+		break;
+#endif
+	default:
+		error("Codec not supported in the passthrough mode: %u", t->type.codec);
 		goto fail_init;
 	}
 
 	ffb_uint8_t bt = { 0 };
-	ffb_int16_t pcm = { 0 };
+	ffb_uint8_t enc = { 0 };
 	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &pcm);
+	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &enc);
 
-	if (ffb_init(&pcm, ldac_pcm_samples) == NULL ||
+	if (ffb_init(&enc, IO_THREAD_PASSTHROUGH_MESSAGE_SIZE) == NULL ||
 			ffb_init(&bt, t->mtu_write) == NULL) {
 		error("Couldn't create data buffers: %s", strerror(ENOMEM));
 		goto fail_ffb;
@@ -1360,16 +3069,24 @@ void *io_thread_a2dp_source_ldac(void *arg) {
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup_lock), t);
 
 	rtp_header_t *rtp_header;
-	rtp_media_header_t *rtp_media_header;
+	rtp_media_header_t *rtp_media_header = NULL;
 
-	/* initialize RTP headers and get anchor for payload */
-	bt.tail = io_thread_init_rtp(bt.data, &rtp_header, &rtp_media_header);
+	/* initialize RTP headers and get anchor for payload - media payload
+	 * header is used by the SBC only */
+	uint8_t *rtp_payload = io_thread_init_rtp(bt.data, &rtp_header,
+			t->type.codec == A2DP_CODEC_SBC ? &rtp_media_header : NULL);
 	uint16_t seq_number = ntohs(rtp_header->seq_number);
 	uint32_t timestamp = ntohl(rtp_header->timestamp);
-	size_t ts_frames = 0;
+#if ENABLE_MPEG
+	if (t->type.codec == A2DP_CODEC_MPEG12)
+		memset(rtp_payload, 0, sizeof(rtp_mpeg_audio_header_t));
+#endif
 
-	/* number of queued bytes in the BT socket */
-	int coutq = 0;
+	const size_t payload_len_max = t->mtu_write - (rtp_payload - bt.data);
+
+	/* array with historical data of queued bytes for BT socket */
+	int coutq_history[IO_THREAD_COUTQ_HISTORY_SIZE] = { 0 };
+	size_t coutq_i = 0;
 
 	int poll_timeout = -1;
 	struct asrsync asrs = { .frames = 0 };
@@ -1385,7 +3102,7 @@ void *io_thread_a2dp_source_ldac(void *arg) {
 	for (;;) {
 		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
-		ssize_t samples;
+		ssize_t len;
 
 		/* add PCM socket to the poll if transport is active */
 		pfds[1].fd = t->state == TRANSPORT_ACTIVE ? t->a2dp.pcm.fd : -1;
@@ -1409,9 +3126,7 @@ void *io_thread_a2dp_source_ldac(void *arg) {
 
 		if (pfds[0].revents & POLLIN) {
 			/* dispatch incoming event */
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
+			enum ba_transport_signal sig = transport_recv_signal(t);
 			switch (sig) {
 			case TRANSPORT_PCM_OPEN:
 			case TRANSPORT_PCM_RESUME:
@@ -1425,14 +3140,14 @@ void *io_thread_a2dp_source_ldac(void *arg) {
 				poll_timeout = 100;
 				continue;
 			case TRANSPORT_PCM_DROP:
-				io_thread_read_pcm_flush(&t->a2dp.pcm);
+				io_thread_read_encoded_flush(&t->a2dp.pcm);
 				continue;
 			default:
 				continue;
 			}
 		}
 
-		switch (samples = io_thread_read_pcm(&t->a2dp.pcm, pcm.tail, ffb_len_in(&pcm))) {
+		switch (len = io_thread_read_encoded(&t->a2dp.pcm, enc.data, enc.size)) {
 		case 0:
 			poll_timeout = config.a2dp.keep_alive * 1000;
 			debug("Keep-alive polling: %d", poll_timeout);
@@ -1440,6 +3155,10 @@ void *io_thread_a2dp_source_ldac(void *arg) {
 		case -1:
 			if (errno == EAGAIN)
 				continue;
+			if (errno == EMSGSIZE) {
+				warn("Encoded audio message too big: > %zu", enc.size);
+				continue;
+			}
 			error("PCM read error: %s", strerror(errno));
 			goto fail;
 		}
@@ -1449,73 +3168,157 @@ void *io_thread_a2dp_source_ldac(void *arg) {
 		if (asrs.frames == 0)
 			asrsync_init(&asrs, samplerate);
 
-		if (!config.a2dp.volume)
-			/* scale volume or mute audio signal */
-			io_thread_scale_pcm(t, pcm.tail, samples, channels);
-
-		/* get overall number of input samples */
-		ffb_seek(&pcm, samples);
-		samples = ffb_len_out(&pcm);
+		ffb_rewind(&enc);
+		ffb_seek(&enc, len);
 
-		int16_t *input = pcm.data;
-		size_t input_len = samples;
+		unsigned int pcm_frames = 0;
 
-		/* encode and transfer obtained data */
-		while (input_len >= ldac_pcm_samples) {
+		switch (t->type.codec) {
+		case A2DP_CODEC_SBC:
+			while (ffb_len_out(&enc) > 0) {
+
+				const size_t enc_len = ffb_len_out(&enc);
+				unsigned int frames = 0;
+				size_t payload_len = 0;
+				size_t sbc_frames = 0;
+				unsigned int frame_pcm_frames;
+				size_t frame_len = 0;
+
+				/* Pack as many SBC frames as possible into a single RTP packet. The
+				 * number of frames is limited by the media payload header field. */
+				while (enc_len - payload_len >= 3 && sbc_frames < 15) {
+
+					const uint8_t *header = &enc.data[payload_len];
+
+					/* the frame has to match the selected configuration */
+					frame_len = 0;
+					if (header[1] != sbc_header ||
+							header[2] < sbc_bitpool_min || header[2] > sbc_bitpool_max ||
+							(frame_len = io_thread_sbc_frame_length(header, &frame_pcm_frames)) == 0)
+						break;
 
-			int len;
-			int encoded;
-			int frames;
+					if (payload_len + frame_len > MIN(enc_len, payload_len_max))
+						break;
 
-			if (ldacBT_encode(handle, input, &len, bt.tail, &encoded, &frames) != 0) {
-				error("LDAC encoding error: %s", ldacBT_strerror(ldacBT_get_error_code(handle)));
-				break;
-			}
+					payload_len += frame_len;
+					frames += frame_pcm_frames;
+					sbc_frames++;
+				}
 
-			rtp_media_header->frame_count = frames;
+				if (sbc_frames == 0) {
+					/* The first frame is valid and complete, but it does not fit
+					 * into the RTP packet, so drop this single frame only. */
+					if (frame_len != 0 && frame_len <= enc_len) {
+						warn("SBC frame too big: %zu > %zu", frame_len, payload_len_max);
+						ffb_shift(&enc, frame_len);
+						continue;
+					}
+					warn("Invalid SBC frame: dropping %zu bytes", enc_len);
+					break;
+				}
 
-			frames = len / sizeof(int16_t);
-			input += frames;
-			input_len -= frames;
+				memcpy(rtp_payload, enc.data, payload_len);
+				rtp_header->seq_number = htons(++seq_number);
+				rtp_header->timestamp = htonl(timestamp);
+				rtp_media_header->frame_count = sbc_frames;
 
-			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+				pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
-			if (encoded &&
-					io_thread_write_bt(t, bt.data, ffb_len_out(&bt) + encoded, &coutq) == -1) {
-				if (errno == ECONNRESET || errno == ENOTCONN) {
-					/* exit thread upon BT socket disconnection */
-					debug("BT socket disconnected: %d", t->bt_fd);
-					goto fail;
+				coutq_i = (coutq_i + 1) % ARRAYSIZE(coutq_history);
+				if (io_thread_write_bt(t, bt.data, (rtp_payload - bt.data) + payload_len,
+							&coutq_history[coutq_i]) == -1) {
+					if (errno == ECONNRESET || errno == ENOTCONN) {
+						/* exit thread upon BT socket disconnection */
+						debug("BT socket disconnected: %d", t->bt_fd);
+						goto fail;
+					}
+					error("BT socket write error: %s", strerror(errno));
 				}
-				error("BT socket write error: %s", strerror(errno));
-			}
 
-			if (config.ldac_abr)
-				ldac_ABR_Proc(handle, handle_abr, coutq / t->mtu_write, 1);
+				pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+				timestamp += frames * 10000 / samplerate;
+				pcm_frames += frames;
+				ffb_shift(&enc, payload_len);
 
-			/* keep data transfer at a constant bit rate */
-			asrsync_sync(&asrs, frames / channels);
-			ts_frames += frames;
+			}
+			break;
+#if ENABLE_MPEG
+		case A2DP_CODEC_MPEG12: {
+
+			size_t frame_len;
+			size_t i;
+
+			/* The message has to contain only complete frames which match the
+			 * selected configuration. Since the sampling frequency is fixed, all
+			 * frames encode the same number of PCM frames. */
+			for (i = 0; i + 4 <= (size_t)len; i += frame_len) {
+				const uint8_t *header = &enc.data[i];
+				if ((frame_len = io_thread_mp3_frame_length(header)) == 0 ||
+						i + frame_len > (size_t)len ||
+						io_thread_mp3_frame_sampling(header) != samplerate ||
+						io_thread_mp3_frame_channel_mode(header) != mpeg_channel_mode)
+					break;
+				pcm_frames += io_thread_mp3_frame_samples(header);
+			}
 
-			/* update busy delay (encoding overhead) */
-			t->delay = asrsync_get_busy_usec(&asrs) / 100;
+			if (i == 0 || i != (size_t)len) {
+				warn("Invalid MPEG audio frame: dropping %zd bytes", len);
+				pcm_frames = 0;
+				break;
+			}
 
-			if (encoded) {
-				timestamp += ts_frames / channels * 10000 / samplerate;
-				rtp_header->timestamp = htonl(timestamp);
-				rtp_header->seq_number = htons(++seq_number);
-				ts_frames = 0;
+			coutq_i = (coutq_i + 1) % ARRAYSIZE(coutq_history);
+			if (io_thread_write_rtp_mpeg(t, bt.data, &enc, io_thread_mp3_frame_samples(enc.data),
+						samplerate, &seq_number, &timestamp, &coutq_history[coutq_i]) == -1)
+				goto fail;
+
+		} break;
+#endif
+#if ENABLE_AAC
+		case A2DP_CODEC_MPEG24:
+
+			/* Every message contains exactly one audioMuxElement. The stream
+			 * configuration is carried in-band, so it has to be validated before
+			 * any payload is sent. */
+			switch (io_thread_latm_stream_mux_config(enc.data, len, &latm_config)) {
+			case -1:
+				latm_config.subframes = 0;
+				break;
+			case 1:
+				if (latm_config.samplerate != samplerate ||
+						latm_config.channels != channels) {
+					warn("LATM configuration mismatch: %u Hz, %u channels",
+							latm_config.samplerate, latm_config.channels);
+					latm_config.subframes = 0;
+				}
+				break;
 			}
 
+			if (latm_config.subframes == 0) {
+				warn("Invalid LATM audioMuxElement: dropping %zd bytes", len);
+				break;
+			}
+
+			rtp_header->timestamp = htonl(timestamp);
+
+			coutq_i = (coutq_i + 1) % ARRAYSIZE(coutq_history);
+			if (io_thread_write_rtp_latm(t, rtp_header, enc.data, len,
+						&seq_number, &coutq_history[coutq_i]) == -1)
+				goto fail;
+
+			/* every payload of the audioMuxElement holds one AAC frame */
+			pcm_frames = 1024 * latm_config.subframes;
+			timestamp += pcm_frames * 10000 / samplerate;
+			break;
+#endif
 		}
 
-		/* If the input buffer was not consumed (due to codesize limit), we
-		 * have to append new data to the existing one. Since we do not use
-		 * ring buffer, we will simply move unprocessed data to the front
-		 * of our linear buffer. */
-		ffb_shift(&pcm, samples - input_len);
+		/* keep data transfer at a constant bit rate */
+		asrsync_sync(&asrs, pcm_frames);
+
+		/* update busy delay (packetization overhead) */
+		t->delay = asrsync_get_busy_usec(&asrs) / 100;
 
 	}
 
@@ -1528,13 +3331,8 @@ fail_ffb:
 	pthread_cleanup_pop(1);
 fail_init:
 	pthread_cleanup_pop(1);
-fail_open_ldac_abr:
-	pthread_cleanup_pop(1);
-fail_open_ldac:
-	pthread_cleanup_pop(1);
 	return NULL;
 }
-#endif
 
 void *io_thread_sco(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
@@ -1611,9 +3409,7 @@ void *io_thread_sco(void *arg) {
 		if (pfds[0].revents & POLLIN) {
 			/* dispatch incoming event */
 
-			enum ba_transport_signal sig = -1;
-			if (read(pfds[0].fd, &sig, sizeof(sig)) != sizeof(sig))
-				warn("Couldn't read signal: %s", strerror(errno));
+			enum ba_transport_signal sig = transport_recv_signal(t);
 
 			switch (sig) {
 			case TRANSPORT_BT_OPEN:
@@ -1704,6 +3500,9 @@ retry_sco_read:
 					continue;
 				}
 
+			ba_capture_packet(t->capture, BA_CAPTURE_DIR_RX, buffer, len);
+			io_thread_stats_bt(t, len);
+
 			switch (t->type.codec) {
 			case HFP_CODEC_CVSD:
 			default:
@@ -1746,6 +3545,9 @@ retry_sco_write:
 					continue;
 				}
 
+			ba_capture_packet(t->capture, BA_CAPTURE_DIR_TX, buffer, len);
+			io_thread_stats_bt(t, len);
+
 			switch (t->type.codec) {
 			case HFP_CODEC_CVSD:
 			default:
@@ -1840,7 +3642,7 @@ fail_ffb:
 
 #if DEBUG
 /**
- * Dump incoming BT data to a file. */
+ * Dump incoming BT data to a pcap file. */
 void *io_thread_a2dp_sink_dump(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
 
@@ -1848,11 +3650,11 @@ void *io_thread_a2dp_sink_dump(void *arg) {
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
 
 	ffb_uint8_t bt = { 0 };
-	FILE *f = NULL;
+	struct ba_capture *c;
 	char fname[64];
 	char *ptr;
 
-	sprintf(fname, "/tmp/ba-%s.dump", ba_transport_type_to_string(t->type));
+	sprintf(fname, "/tmp/ba-%s.pcap", ba_transport_type_to_string(t->type));
 	for (ptr = fname; *ptr != '\0'; ptr++) {
 		*ptr = tolower(*ptr);
 		if (*ptr == ' ' || *ptr == '(' || *ptr == ')')
@@ -1860,13 +3662,15 @@ void *io_thread_a2dp_sink_dump(void *arg) {
 	}
 
 	debug("Opening BT dump file: %s", fname);
-	if ((f = fopen(fname, "wb")) == NULL) {
+	if ((c = ba_capture_new(BA_CAPTURE_TYPE_ACL)) == NULL ||
+			ba_capture_start(c, fname) == -1) {
 		error("Couldn't create dump file: %s", strerror(errno));
+		ba_capture_free(c);
 		goto fail_open;
 	}
 
 	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_uint8_free), &bt);
-	pthread_cleanup_push(PTHREAD_CLEANUP(fclose), f);
+	pthread_cleanup_push(PTHREAD_CLEANUP(ba_capture_free), c);
 
 	if (ffb_init(&bt, t->mtu_read) == NULL) {
 		error("Couldn't create data buffer: %s", strerror(ENOMEM));
@@ -1891,8 +3695,7 @@ void *io_thread_a2dp_sink_dump(void *arg) {
 		}
 
 		if (pfds[0].revents & POLLIN) {
-			if (read(pfds[0].fd, bt.data, ffb_blen_in(&bt)) == -1)
-				warn("Couldn't read signal: %s", strerror(errno));
+			transport_recv_signal(t);
 			continue;
 		}
 
@@ -1902,7 +3705,7 @@ void *io_thread_a2dp_sink_dump(void *arg) {
 		}
 
 		debug("BT read: %zd", len);
-		fwrite(bt.data, 1, len, f);
+		ba_capture_packet(c, BA_CAPTURE_DIR_RX, bt.data, len);
 	}
 
 fail:
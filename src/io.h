@@ -17,19 +17,38 @@
 
 /* The number of snapshots of BT socket COUTQ bytes. */
 #define IO_THREAD_COUTQ_HISTORY_SIZE 16
+/* The maximal size of the encoded audio message in the passthrough mode. */
+#define IO_THREAD_PASSTHROUGH_MESSAGE_SIZE (1024 * 8)
+/* Space reserved for the LATM header (with the StreamMuxConfig) in every
+ * AAC access unit. */
+#define IO_THREAD_LATM_HEADER_LEN 16
+/* The RTP clock rate of the MPEG audio payload (RFC 3551), which does not
+ * depend on the sampling frequency. */
+#define IO_THREAD_RTP_MPEG_CLOCK 90000
 
 void *io_thread_a2dp_sink_sbc(void *arg);
 void *io_thread_a2dp_source_sbc(void *arg);
+#if ENABLE_MPEG
+void *io_thread_a2dp_sink_mpeg(void *arg);
+void *io_thread_a2dp_source_mpeg(void *arg);
+#endif
 #if ENABLE_AAC
 void *io_thread_a2dp_sink_aac(void *arg);
 void *io_thread_a2dp_source_aac(void *arg);
 #endif
 #if ENABLE_APTX
+# if HAVE_APTX_DECODE
+void *io_thread_a2dp_sink_aptx(void *arg);
+# endif
 void *io_thread_a2dp_source_aptx(void *arg);
 #endif
 #if ENABLE_LDAC
+# if HAVE_LDAC_DECODE
+void *io_thread_a2dp_sink_ldac(void *arg);
+# endif
 void *io_thread_a2dp_source_ldac(void *arg);
 #endif
+void *io_thread_a2dp_source_passthrough(void *arg);
 
 void *io_thread_sco(void *arg);
 
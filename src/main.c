@@ -29,12 +29,14 @@
 # include <ldacBT.h>
 #endif
 
+#include "a2dp-cache.h"
 #include "ba-adapter.h"
 #include "bluealsa.h"
 #include "bluez.h"
 #if ENABLE_OFONO
 # include "ofono.h"
 #endif
+#include "pcm-output.h"
 #include "utils.h"
 #include "shared/defs.h"
 #include "shared/log.h"
@@ -82,6 +84,12 @@ int main(int argc, char **argv) {
 		{ "a2dp-force-audio-cd", no_argument, NULL, 7 },
 		{ "a2dp-keep-alive", required_argument, NULL, 8 },
 		{ "a2dp-volume", no_argument, NULL, 9 },
+		{ "a2dp-sink-output", required_argument, NULL, 12 },
+		{ "a2dp-policy", required_argument, NULL, 13 },
+#if ENABLE_MPEG
+		{ "mp3-quality", required_argument, NULL, 14 },
+		{ "mp3-vbr-quality", required_argument, NULL, 15 },
+#endif
 #if ENABLE_AAC
 		{ "aac-afterburner", no_argument, NULL, 4 },
 		{ "aac-vbr-mode", required_argument, NULL, 5 },
@@ -96,6 +104,9 @@ int main(int argc, char **argv) {
 	bool syslog = false;
 	struct hci_dev_info *hci_devs;
 	int hci_devs_num;
+	/* HCI devices selected with the --device option */
+	bool hci_devs_selected[HCI_MAX_DEV] = { false };
+	int hci_dev_default = -1;
 
 	/* Check if syslog forwarding has been enabled. This check has to be
 	 * done before anything else, so we can log early stage warnings and
@@ -133,7 +144,7 @@ int main(int argc, char **argv) {
 		int i;
 		for (i = 0; i < hci_devs_num; i++)
 			if (i == 0 || hci_test_bit(HCI_UP, &hci_devs[i].flags))
-				memcpy(&config.hci_dev, &hci_devs[i], sizeof(config.hci_dev));
+				hci_dev_default = hci_devs[i].dev_id;
 	}
 
 	/* parse options */
@@ -148,12 +159,18 @@ int main(int argc, char **argv) {
 					"  -h, --help\t\tprint this help and exit\n"
 					"  -V, --version\t\tprint version and exit\n"
 					"  -S, --syslog\t\tsend output to syslog\n"
-					"  -i, --device=hciX\tHCI device to use\n"
+					"  -i, --device=hciX\tHCI device(s) to use\n"
 					"  -p, --profile=NAME\tenable BT profile\n"
 					"  --a2dp-force-mono\tforce monophonic sound\n"
 					"  --a2dp-force-audio-cd\tforce 44.1 kHz sampling\n"
 					"  --a2dp-keep-alive=SEC\tkeep A2DP transport alive\n"
 					"  --a2dp-volume\t\tcontrol volume natively\n"
+					"  --a2dp-sink-output=NAME\tbuilt-in sink output\n"
+					"  --a2dp-policy=NAME\tcodec configuration policy\n"
+#if ENABLE_MPEG
+					"  --mp3-quality=NB\tset encoder quality to NB\n"
+					"  --mp3-vbr-quality=NB\tset VBR quality to NB\n"
+#endif
 #if ENABLE_AAC
 					"  --aac-afterburner\tenable afterburner\n"
 					"  --aac-vbr-mode=NB\tset VBR mode to NB\n"
@@ -175,7 +192,14 @@ int main(int argc, char **argv) {
 					"\n"
 					"By default only output profiles are enabled, which includes A2DP Source and\n"
 					"HSP/HFP Audio Gateways. If one wants to enable other set of profiles, it is\n"
-					"required to explicitly specify all of them using `-p NAME` options.\n",
+					"required to explicitly specify all of them using `-p NAME` options.\n"
+					"\n"
+					"In order to use more than one HCI device, specify all of them using\n"
+					"`-i hciX` options. Every device gets its own controller socket.\n"
+					"\n"
+					"Available A2DP policies are `quality` (default) and `efficiency`. The\n"
+					"latter one favors lower sampling rates and bit rates. The selected codec\n"
+					"configuration is remembered for every remote device model.\n",
 					argv[0],
 					get_a2dp_codecs(config.a2dp.codecs, BLUEZ_A2DP_SOURCE),
 					get_a2dp_codecs(config.a2dp.codecs, BLUEZ_A2DP_SINK),
@@ -193,30 +217,30 @@ int main(int argc, char **argv) {
 
 			bdaddr_t addr;
 			int i = hci_devs_num;
-			int found = 0;
+			int found = -1;
 
 			if (str2ba(optarg, &addr) == 0) {
 				while (i--)
 					if (bacmp(&addr, &hci_devs[i].bdaddr) == 0) {
-						memcpy(&config.hci_dev, &hci_devs[i], sizeof(config.hci_dev));
-						found = 1;
+						found = hci_devs[i].dev_id;
 						break;
 					}
 			}
 			else {
 				while (i--)
 					if (strcmp(optarg, hci_devs[i].name) == 0) {
-						memcpy(&config.hci_dev, &hci_devs[i], sizeof(config.hci_dev));
-						found = 1;
+						found = hci_devs[i].dev_id;
 						break;
 				}
 			}
 
-			if (found == 0) {
+			if (found < 0 || found >= HCI_MAX_DEV) {
 				error("HCI device not found: %s", optarg);
 				return EXIT_FAILURE;
 			}
 
+			hci_devs_selected[found] = true;
+
 			break;
 		}
 
@@ -264,6 +288,54 @@ int main(int argc, char **argv) {
 		case 9 /* --a2dp-volume */ :
 			config.a2dp.volume = true;
 			break;
+		case 12 /* --a2dp-sink-output=NAME */ :
+			if (!ba_pcm_output_supported(optarg)) {
+				error("Unsupported PCM output: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			config.a2dp.sink_output = optarg;
+			break;
+		case 13 /* --a2dp-policy=NAME */ : {
+
+			const struct {
+				const char *name;
+				enum ba_a2dp_policy policy;
+			} map[] = {
+				{ "quality", BA_A2DP_POLICY_QUALITY },
+				{ "efficiency", BA_A2DP_POLICY_EFFICIENCY },
+			};
+
+			size_t i;
+			for (i = 0; i < ARRAYSIZE(map); i++)
+				if (strcasecmp(optarg, map[i].name) == 0) {
+					config.a2dp.policy = map[i].policy;
+					break;
+				}
+
+			if (i == ARRAYSIZE(map)) {
+				error("Invalid A2DP policy: %s", optarg);
+				return EXIT_FAILURE;
+			}
+
+			break;
+		}
+
+#if ENABLE_MPEG
+		case 14 /* --mp3-quality=NB */ :
+			config.mpeg_quality = atoi(optarg);
+			if (config.mpeg_quality > 9) {
+				error("Invalid encoder quality [0, 9]: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 15 /* --mp3-vbr-quality=NB */ :
+			config.mpeg_vbr_quality = atoi(optarg);
+			if (config.mpeg_vbr_quality > 9) {
+				error("Invalid VBR quality [0, 9]: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+#endif
 
 #if ENABLE_AAC
 		case 4 /* --aac-afterburner */ :
@@ -310,9 +382,23 @@ int main(int argc, char **argv) {
 	/* initialize random number generator */
 	srandom(time(NULL));
 
-	struct ba_adapter *a;
-	if ((a = ba_adapter_new(config.hci_dev.dev_id, NULL)) == NULL)
-		return EXIT_FAILURE;
+	a2dp_cache_init(BLUEALSA_STATE_DIR "/a2dp-cache");
+
+	{ /* create adapters for all selected HCI devices */
+
+		size_t i, count = 0;
+
+		for (i = 0; i < ARRAYSIZE(hci_devs_selected); i++)
+			if (hci_devs_selected[i]) {
+				if (ba_adapter_new(i, NULL) == NULL)
+					return EXIT_FAILURE;
+				count++;
+			}
+
+		if (count == 0 && ba_adapter_new(hci_dev_default, NULL) == NULL)
+			return EXIT_FAILURE;
+
+	}
 
 	gchar *address;
 	GError *err;
@@ -354,8 +440,13 @@ int main(int argc, char **argv) {
 	debug("Exiting main loop");
 
 	/* From all of the cleanup routines, this one cannot be omitted. We have
-	 * to unlink named socket, otherwise service will not start any more. */
-	ba_adapter_free(a);
+	 * to unlink named sockets, otherwise service will not start any more. */
+	size_t i;
+	for (i = 0; i < ARRAYSIZE(config.adapters); i++)
+		if (config.adapters[i] != NULL)
+			ba_adapter_free(config.adapters[i]);
+
+	a2dp_cache_free();
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,184 @@
+/*
+ * BlueALSA - pcm-output.c
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "pcm-output.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if ENABLE_ALSA_SINK
+# include <alsa/asoundlib.h>
+#endif
+
+#include "shared/defs.h"
+#include "shared/log.h"
+
+#if ENABLE_ALSA_SINK
+
+/* latency of the ALSA output (in microseconds) */
+#define ALSA_BUFFER_TIME 200000
+
+struct alsa_output {
+	struct ba_pcm_output base;
+	snd_pcm_t *pcm;
+	unsigned int channels;
+};
+
+/**
+ * Write samples to the ALSA output without blocking.
+ *
+ * The output device and the Bluetooth link are driven by different clocks,
+ * and our IO thread shall never be paced by the output device. So, if the
+ * device buffer is full, the excess of samples is dropped. On under-run,
+ * the playback is restarted when the buffer is filled up again, so the gap
+ * is padded with silence by the device. */
+static ssize_t alsa_output_write(struct ba_pcm_output *out,
+		const int16_t *buffer, size_t samples) {
+
+	struct alsa_output *a = (struct alsa_output *)out;
+	snd_pcm_uframes_t frames = samples / a->channels;
+	snd_pcm_sframes_t ret;
+
+	while (frames > 0) {
+		if ((ret = snd_pcm_writei(a->pcm, buffer, frames)) < 0) {
+			if (ret == -EAGAIN) {
+				debug("ALSA output overrun: %lu", frames);
+				break;
+			}
+			/* recover from the under-run or the suspend */
+			if ((ret = snd_pcm_recover(a->pcm, ret, 1)) == 0)
+				continue;
+			errno = -ret;
+			return -1;
+		}
+		buffer += ret * a->channels;
+		frames -= ret;
+	}
+
+	return samples;
+}
+
+static void alsa_output_close(struct ba_pcm_output *out) {
+	struct alsa_output *a = (struct alsa_output *)out;
+	debug("Closing ALSA output: %s", snd_pcm_name(a->pcm));
+	snd_pcm_close(a->pcm);
+	free(a);
+}
+
+static struct ba_pcm_output *alsa_output_open(const char *device,
+		unsigned int channels, unsigned int sampling) {
+
+	struct alsa_output *a;
+	int err;
+
+	if ((a = calloc(1, sizeof(*a))) == NULL)
+		return NULL;
+
+	a->base.write = alsa_output_write;
+	a->base.close = alsa_output_close;
+	a->channels = channels;
+
+	if (device == NULL)
+		device = "default";
+
+	if ((err = snd_pcm_open(&a->pcm, device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK)) != 0)
+		goto fail;
+
+	/* Let the ALSA library take care of the conversion, so every device will
+	 * be able to play audio with the transport configuration. Playback will
+	 * be started when the buffer is filled, which shall absorb the jitter of
+	 * the Bluetooth transfer. */
+	if ((err = snd_pcm_set_params(a->pcm, SND_PCM_FORMAT_S16_LE,
+					SND_PCM_ACCESS_RW_INTERLEAVED, channels, sampling, 1,
+					ALSA_BUFFER_TIME)) != 0)
+		goto fail;
+
+	debug("Opened ALSA output: %s (%u channels, %u Hz)", device, channels, sampling);
+	return &a->base;
+
+fail:
+	error("Couldn't open ALSA output %s: %s", device, snd_strerror(err));
+	if (a->pcm != NULL)
+		snd_pcm_close(a->pcm);
+	free(a);
+	errno = -err;
+	return NULL;
+}
+
+#endif
+
+static const struct {
+	const char *name;
+	struct ba_pcm_output *(*open)(const char *, unsigned int, unsigned int);
+} backends[] = {
+#if ENABLE_ALSA_SINK
+	{ "alsa", alsa_output_open },
+#endif
+	{ NULL, NULL },
+};
+
+/**
+ * Lookup PCM output backend.
+ *
+ * @param name PCM output name in the "BACKEND[:ARGS]" format.
+ * @param args Address where the pointer to the backend arguments will be
+ *   stored. If there are no arguments, NULL is stored.
+ * @return On success this function returns the backend index. Otherwise,
+ *   -1 is returned. */
+static int ba_pcm_output_lookup(const char *name, const char **args) {
+
+	const char *sep = strchr(name, ':');
+	size_t len = sep != NULL ? (size_t)(sep - name) : strlen(name);
+	size_t i;
+
+	*args = sep != NULL ? sep + 1 : NULL;
+
+	for (i = 0; backends[i].name != NULL; i++)
+		if (strlen(backends[i].name) == len &&
+				strncmp(backends[i].name, name, len) == 0)
+			return i;
+
+	return -1;
+}
+
+/**
+ * Check whether given PCM output is supported.
+ *
+ * @param name PCM output name in the "BACKEND[:ARGS]" format.
+ * @return This function returns true if the backend is available. */
+bool ba_pcm_output_supported(const char *name) {
+	const char *args;
+	return ba_pcm_output_lookup(name, &args) != -1;
+}
+
+/**
+ * Open PCM output.
+ *
+ * @param name PCM output name in the "BACKEND[:ARGS]" format, e.g. the
+ *   "alsa:hw:0,0" will open the "hw:0,0" ALSA device.
+ * @param channels The number of channels.
+ * @param sampling Sampling rate.
+ * @return On success this function returns the PCM output, which shall be
+ *   closed with the ba_pcm_output_close(). On error, NULL is returned and
+ *   errno is set to indicate the error. */
+struct ba_pcm_output *ba_pcm_output_open(const char *name,
+		unsigned int channels, unsigned int sampling) {
+
+	const char *args;
+	int i;
+
+	if ((i = ba_pcm_output_lookup(name, &args)) == -1) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	return backends[i].open(args, channels, sampling);
+}
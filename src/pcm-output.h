@@ -0,0 +1,51 @@
+/*
+ * BlueALSA - pcm-output.h
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_PCMOUTPUT_H_
+#define BLUEALSA_PCMOUTPUT_H_
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Built-in PCM output, which might be used by the sink IO thread instead
+ * of the PCM FIFO. */
+struct ba_pcm_output {
+
+	/* Write interleaved S16 samples. This function shall return the number
+	 * of written samples, or -1 on error with errno set accordingly. */
+	ssize_t (*write)(struct ba_pcm_output *out, const int16_t *buffer, size_t samples);
+
+	/* Release all resources, including the output structure itself. */
+	void (*close)(struct ba_pcm_output *out);
+
+};
+
+bool ba_pcm_output_supported(const char *name);
+struct ba_pcm_output *ba_pcm_output_open(const char *name,
+		unsigned int channels, unsigned int sampling);
+
+/**
+ * Write samples to the PCM output. */
+#define ba_pcm_output_write(out, buffer, samples) \
+	(out)->write(out, buffer, samples)
+
+/**
+ * Close PCM output. */
+#define ba_pcm_output_close(out) \
+	(out)->close(out)
+
+#endif
@@ -31,18 +31,22 @@ struct at_reader {
 	char buffer[256];
 	/* pointer to the next message within the buffer */
 	char *next;
+	/* length of the incomplete message at the beginning of the buffer */
+	size_t partial;
 };
 
 /**
  * Read AT message.
  *
- * Upon error it is required to set the next pointer of the reader structure
- * to NULL. Otherwise, this function might fail indefinitely.
+ * Messages are parsed in place, so the parsed AT structure is valid until
+ * the next call of this function. If the message has been split between
+ * reads, it is kept in the buffer and completed with the subsequent read.
  *
  * @param fd RFCOMM socket file descriptor.
  * @param reader Pointer to initialized reader structure.
  * @return On success this function returns 0. Otherwise, -1 is returned and
- *   errno is set to indicate the error. */
+ *   errno is set to indicate the error: EAGAIN - there is no complete message
+ *   in the buffer, EBADMSG - invalid message has been discarded. */
 static int rfcomm_read_at(int fd, struct at_reader *reader) {
 
 	char *buffer = reader->buffer;
@@ -53,23 +57,48 @@ static int rfcomm_read_at(int fd, struct at_reader *reader) {
 	 * parse all of them before we can read from the socket once more. */
 	if (msg == NULL) {
 
-		ssize_t len;
+		size_t len = reader->partial;
+		ssize_t ret;
+
+		/* There is no room for the rest of the message. Such a long message
+		 * is not allowed by the specification, so simply discard it. */
+		if (len == sizeof(reader->buffer) - 1) {
+			warn("AT message too long: %.32s...", buffer);
+			len = 0;
+		}
 
 retry:
-		if ((len = read(fd, buffer, sizeof(reader->buffer))) == -1) {
-			if (errno == EINTR)
+		if ((ret = read(fd, &buffer[len], sizeof(reader->buffer) - 1 - len)) <= 0) {
+			if (ret == -1 && errno == EINTR)
 				goto retry;
+			if (ret == 0)
+				errno = ECONNRESET;
 			return -1;
 		}
 
-		buffer[len] = '\0';
+		buffer[len + ret] = '\0';
+		reader->partial = 0;
 		msg = buffer;
 	}
 
 	/* parse AT message received from the RFCOMM */
 	if ((tmp = at_parse(msg, &reader->at)) == NULL) {
-		reader->next = msg;
-		errno = EBADMSG;
+		switch (errno) {
+		case EAGAIN:
+			/* keep incomplete message for the next read */
+			reader->partial = strlen(msg);
+			memmove(buffer, msg, reader->partial + 1);
+			reader->next = NULL;
+			break;
+		case EBADMSG:
+			/* discard invalid message, but keep the rest of the buffer */
+			msg += strspn(msg, "\r\n");
+			tmp = strchr(msg, '\r');
+			*tmp++ = '\0';
+			warn("Invalid AT message: %s", msg);
+			reader->next = tmp[0] != '\0' ? tmp : NULL;
+			break;
+		}
 		return -1;
 	}
 
@@ -767,9 +796,8 @@ void *rfcomm_thread(void *arg) {
 read:
 			if (rfcomm_read_at(pfds[1].fd, &reader) == -1)
 				switch (errno) {
+				case EAGAIN:
 				case EBADMSG:
-					warn("Invalid AT message: %s", reader.next);
-					reader.next = NULL;
 					continue;
 				default:
 					goto ioerror;
@@ -19,6 +19,7 @@
 #include <sys/types.h>
 #include <sys/un.h>
 
+#include "shared/defs.h"
 #include "shared/log.h"
 
 
@@ -40,6 +41,8 @@ static int bluealsa_status_to_errno(const struct ba_msg_status *status) {
 		return EBUSY;
 	case BA_STATUS_CODE_FORBIDDEN:
 		return EACCES;
+	case BA_STATUS_CODE_CODEC_NOT_SUPPORTED:
+		return ENOTSUP;
 	default:
 		/* some generic error code */
 		return EINVAL;
@@ -67,25 +70,196 @@ static char *ba2str_(const bdaddr_t *ba, char str[18]) {
 #endif
 
 /**
- * Send request to the BlueALSA server.
+ * Send framed request message to the BlueALSA server.
  *
  * @param fd Opened socket file descriptor.
- * @param req An address to the request structure.
+ * @param payload An address to the request payload.
+ * @param len The length of the request payload.
  * @return Upon success this function returns 0. Otherwise, -1 is returned
  *   and errno is set appropriately. */
-static int bluealsa_send_request(int fd, const struct ba_request *req) {
+static int bluealsa_send_msg(int fd, const void *payload, size_t len) {
+
+	struct ba_msg_header header = { .type = BA_MSG_TYPE_REQUEST, .length = len };
+	struct iovec io[] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = (void *)payload, .iov_len = len },
+	};
+	struct msghdr msg = {
+		.msg_iov = io,
+		.msg_iovlen = ARRAYSIZE(io),
+	};
+
+	return sendmsg(fd, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+/**
+ * Receive framed message from the BlueALSA server.
+ *
+ * If the message payload is longer than the given buffer, it is silently
+ * truncated. It allows newer servers to extend existing messages.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param type An address where the message type will be stored.
+ * @param buffer An address of the buffer for the message payload.
+ * @param size The size of the buffer.
+ * @param flags Flags passed to the recvmsg() call.
+ * @return Upon success this function returns the number of payload bytes
+ *   stored in the buffer. Otherwise, -1 is returned and errno is set
+ *   appropriately. If the server has closed the connection, errno is set
+ *   to ECONNRESET. */
+static ssize_t bluealsa_recv_msg(int fd, uint16_t *type, void *buffer, size_t size, int flags) {
+
+	struct ba_msg_header header;
+	struct iovec io[] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = buffer, .iov_len = size },
+	};
+	struct msghdr msg = {
+		.msg_iov = io,
+		.msg_iovlen = ARRAYSIZE(io),
+	};
+	ssize_t len;
+
+	if ((len = recvmsg(fd, &msg, flags)) == -1)
+		return -1;
+	if (len == 0) {
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	if ((size_t)len < sizeof(header) ||
+			(!(msg.msg_flags & MSG_TRUNC) && header.length != len - sizeof(header))) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	*type = header.type;
+	return len - sizeof(header);
+}
+
+/**
+ * Receive status message from the BlueALSA server.
+ *
+ * @param fd Opened socket file descriptor.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+static int bluealsa_recv_status(int fd) {
 
 	struct ba_msg_status status = { 0xAB };
+	uint16_t type;
+	ssize_t len;
 
-	if (send(fd, req, sizeof(*req), MSG_NOSIGNAL) == -1)
+	if ((len = bluealsa_recv_msg(fd, &type, &status, sizeof(status), 0)) == -1)
 		return -1;
-	if (read(fd, &status, sizeof(status)) == -1)
+	if (type != BA_MSG_TYPE_STATUS || len != sizeof(status)) {
+		errno = EBADMSG;
 		return -1;
+	}
 
 	errno = bluealsa_status_to_errno(&status);
 	return errno != 0 ? -1 : 0;
 }
 
+/**
+ * Send request to the BlueALSA server.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param req An address to the request structure.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+static int bluealsa_send_request(int fd, const struct ba_request *req) {
+	if (bluealsa_send_msg(fd, req, sizeof(*req)) == -1)
+		return -1;
+	return bluealsa_recv_status(fd);
+}
+
+/**
+ * Receive framed message of an arbitrary length.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param type An address where the message type will be stored.
+ * @param buffer An address where the message payload buffer will be stored.
+ *   This buffer should be freed with the free().
+ * @return Upon success this function returns the length of the received
+ *   payload. Otherwise, -1 is returned and errno is set appropriately. */
+static ssize_t bluealsa_recv_msg_alloc(int fd, uint16_t *type, void **buffer) {
+
+	void *buf;
+	ssize_t len;
+
+	/* peek the length of the pending message */
+	if ((len = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC)) == -1)
+		return -1;
+	if ((size_t)len < sizeof(struct ba_msg_header)) {
+		errno = len == 0 ? ECONNRESET : EBADMSG;
+		return -1;
+	}
+
+	/* allocate at least one byte, so the buffer is never NULL */
+	if ((buf = malloc(len - sizeof(struct ba_msg_header) + 1)) == NULL)
+		return -1;
+
+	if ((len = bluealsa_recv_msg(fd, type, buf, len - sizeof(struct ba_msg_header), 0)) == -1) {
+		free(buf);
+		return -1;
+	}
+
+	*buffer = buf;
+	return len;
+}
+
+/**
+ * Receive the list of messages terminated with the status message.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param type The type of list elements.
+ * @param size The size of a single list element.
+ * @param list An address where the list will be stored.
+ * @return Upon success this function returns the number of list elements.
+ *   Otherwise, -1 is returned and errno is set appropriately. */
+static ssize_t bluealsa_recv_list(int fd, enum ba_msg_type type, size_t size, void **list) {
+
+	uint8_t *_list = NULL;
+	uint8_t buffer[size];
+	uint16_t _type;
+	ssize_t len;
+	size_t i = 0;
+
+	while ((len = bluealsa_recv_msg(fd, &_type, buffer, size, 0)) != -1) {
+
+		if (_type == BA_MSG_TYPE_STATUS) {
+			struct ba_msg_status status;
+			if ((size_t)len != sizeof(status)) {
+				errno = EBADMSG;
+				goto fail;
+			}
+			memcpy(&status, buffer, sizeof(status));
+			if ((errno = bluealsa_status_to_errno(&status)) != 0)
+				goto fail;
+			*list = _list;
+			return i;
+		}
+
+		if (_type != type || (size_t)len != size) {
+			errno = EBADMSG;
+			goto fail;
+		}
+
+		uint8_t *tmp;
+		if ((tmp = realloc(_list, (i + 1) * size)) == NULL)
+			goto fail;
+		_list = tmp;
+
+		memcpy(&_list[i * size], buffer, size);
+		i++;
+
+	}
+
+fail:
+	free(_list);
+	return -1;
+}
+
 /**
  * Open BlueALSA connection.
  *
@@ -93,8 +267,26 @@ static int bluealsa_send_request(int fd, const struct ba_request *req) {
  * @return On success this function returns socket file descriptor. Otherwise,
  *   -1 is returned and errno is set to indicate the error. */
 int bluealsa_open(const char *interface) {
+	return bluealsa_open_caps(interface, NULL);
+}
+
+/**
+ * Open BlueALSA connection with capability negotiation.
+ *
+ * @param interface HCI interface to use.
+ * @param capabilities An address to the bit-mask with requested protocol
+ *   capabilities. Upon success, it is updated with the capabilities which
+ *   are supported by the server. If NULL, all known capabilities are
+ *   requested.
+ * @return On success this function returns socket file descriptor. Otherwise,
+ *   -1 is returned and errno is set to indicate the error. */
+int bluealsa_open_caps(const char *interface, uint32_t *capabilities) {
 
-	const uint16_t ver = BLUEALSA_CRL_PROTO_VERSION;
+	struct ba_msg_hello hello = {
+		.version = BLUEALSA_CRL_PROTO_VERSION,
+		.capabilities = capabilities != NULL ? *capabilities : BA_CAPABILITIES_ALL,
+	};
+	ssize_t len;
 	int fd, err;
 
 	struct sockaddr_un saddr = { .sun_family = AF_UNIX };
@@ -105,17 +297,32 @@ int bluealsa_open(const char *interface) {
 		return -1;
 
 	debug("Connecting to socket: %s", saddr.sun_path);
-	if (connect(fd, (struct sockaddr *)(&saddr), sizeof(saddr)) == -1) {
-		err = errno;
-		close(fd);
-		errno = err;
-		return -1;
+	if (connect(fd, (struct sockaddr *)(&saddr), sizeof(saddr)) == -1)
+		goto fail;
+
+	if (send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) == -1)
+		goto fail;
+
+	/* Server which does not support our protocol version will close
+	 * the connection without sending the handshake reply. */
+	if ((len = recv(fd, &hello, sizeof(hello), 0)) == -1)
+		goto fail;
+	if (len != sizeof(hello) || hello.version != BLUEALSA_CRL_PROTO_VERSION) {
+		errno = EPROTONOSUPPORT;
+		goto fail;
 	}
 
-	if (send(fd, &ver, sizeof(ver), MSG_NOSIGNAL) == -1)
-		return -1;
+	debug("Negotiated capabilities: %#x", hello.capabilities);
+	if (capabilities != NULL)
+		*capabilities = hello.capabilities;
 
 	return fd;
+
+fail:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
 }
 
 /**
@@ -135,6 +342,37 @@ int bluealsa_event_subscribe(int fd, uint8_t mask) {
 	return bluealsa_send_request(fd, &req);
 }
 
+/**
+ * Receive event notification.
+ *
+ * If the BA_CAPABILITY_EVENT_PAYLOAD capability has not been negotiated,
+ * the payload bit-mask of the received event is always zero.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param event An address where the event will be stored.
+ * @param flags Flags passed to the recvmsg() call, e.g. MSG_DONTWAIT.
+ * @return Upon success this function returns 1. If the server has closed
+ *   the connection, 0 is returned. Otherwise, -1 is returned and errno is
+ *   set appropriately. */
+int bluealsa_event_recv(int fd, struct ba_msg_event *event, int flags) {
+
+	uint16_t type;
+	ssize_t len;
+
+	/* make sure, that payload is cleared if server does not send it */
+	memset(event, 0, sizeof(*event));
+
+	if ((len = bluealsa_recv_msg(fd, &type, event, sizeof(*event), flags)) == -1)
+		return errno == ECONNRESET ? 0 : -1;
+
+	if (type != BA_MSG_TYPE_EVENT || (size_t)len < BA_MSG_EVENT_BASIC_SIZE) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	return 1;
+}
+
 /**
  * Check whether event matches given transport.
  *
@@ -165,21 +403,11 @@ int bluealsa_event_match(const struct ba_msg_transport *transport,
 ssize_t bluealsa_get_devices(int fd, struct ba_msg_device **devices) {
 
 	const struct ba_request req = { .command = BA_COMMAND_LIST_DEVICES };
-	struct ba_msg_device *_devices = NULL;
-	struct ba_msg_device device;
-	size_t i = 0;
 
-	if (send(fd, &req, sizeof(req), MSG_NOSIGNAL) == -1)
+	if (bluealsa_send_msg(fd, &req, sizeof(req)) == -1)
 		return -1;
 
-	while (recv(fd, &device, sizeof(device), 0) == sizeof(device)) {
-		_devices = realloc(_devices, (i + 1) * sizeof(*_devices));
-		memcpy(&_devices[i], &device, sizeof(*_devices));
-		i++;
-	}
-
-	*devices = _devices;
-	return i;
+	return bluealsa_recv_list(fd, BA_MSG_TYPE_DEVICE, sizeof(**devices), (void **)devices);
 }
 
 /**
@@ -194,21 +422,116 @@ ssize_t bluealsa_get_devices(int fd, struct ba_msg_device **devices) {
 ssize_t bluealsa_get_transports(int fd, struct ba_msg_transport **transports) {
 
 	const struct ba_request req = { .command = BA_COMMAND_LIST_TRANSPORTS };
+
+	if (bluealsa_send_msg(fd, &req, sizeof(req)) == -1)
+		return -1;
+
+	return bluealsa_recv_list(fd, BA_MSG_TYPE_TRANSPORT, sizeof(**transports), (void **)transports);
+}
+
+/**
+ * Get statistics of all audio transports.
+ *
+ * This function requires the BA_CAPABILITY_STATS capability to be
+ * negotiated during the connection handshake.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param stats An address where the statistics list will be stored.
+ * @return Upon success this function returns the number of transports and
+ *   the `stats` address is modified to point to the statistics list array,
+ *   which should be freed with the free(). On error, -1 is returned and
+ *   errno is set to indicate the error. */
+ssize_t bluealsa_get_stats(int fd, struct ba_msg_transport_stats **stats) {
+
+	const struct ba_request req = { .command = BA_COMMAND_STATS };
+
+	if (bluealsa_send_msg(fd, &req, sizeof(req)) == -1)
+		return -1;
+
+	return bluealsa_recv_list(fd, BA_MSG_TYPE_STATS, sizeof(**stats), (void **)stats);
+}
+
+/**
+ * Get the snapshot of the BlueALSA server state.
+ *
+ * This function retrieves connected Bluetooth devices and available PCM
+ * transports (including volume levels) within a single round trip. Since
+ * both lists are obtained atomically, every transport is guaranteed to have
+ * the corresponding device on the devices list.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param devices An address where the device list will be stored.
+ * @param devices_count An address where the number of devices will be stored.
+ * @param transports An address where the transport list will be stored.
+ * @param transports_count An address where the number of transports will
+ *   be stored.
+ * @return Upon success this function returns 0 and lists should be freed
+ *   with the free(). Otherwise, -1 is returned and errno is set to indicate
+ *   the error. */
+int bluealsa_get_snapshot(int fd,
+		struct ba_msg_device **devices, size_t *devices_count,
+		struct ba_msg_transport **transports, size_t *transports_count) {
+
+	const struct ba_request req = { .command = BA_COMMAND_SNAPSHOT };
+	struct ba_msg_status status = { 0xAB };
+	struct ba_msg_snapshot snapshot;
+	struct ba_msg_device *_devices = NULL;
 	struct ba_msg_transport *_transports = NULL;
-	struct ba_msg_transport transport;
-	size_t i = 0;
+	size_t devices_size, transports_size;
+	uint8_t *buffer;
+	uint16_t type;
+	ssize_t len;
 
-	if (send(fd, &req, sizeof(req), MSG_NOSIGNAL) == -1)
+	if (bluealsa_send_msg(fd, &req, sizeof(req)) == -1)
+		return -1;
+	if ((len = bluealsa_recv_msg_alloc(fd, &type, (void **)&buffer)) == -1)
 		return -1;
 
-	while (recv(fd, &transport, sizeof(transport), 0) == sizeof(transport)) {
-		_transports = realloc(_transports, (i + 1) * sizeof(*_transports));
-		memcpy(&_transports[i], &transport, sizeof(*_transports));
-		i++;
+	/* in case of error, status message is returned */
+	if (type == BA_MSG_TYPE_STATUS && len == sizeof(status)) {
+		memcpy(&status, buffer, sizeof(status));
+		free(buffer);
+		if ((errno = bluealsa_status_to_errno(&status)) == 0)
+			errno = EBADMSG;
+		return -1;
 	}
 
+	if (bluealsa_recv_status(fd) == -1)
+		goto fail;
+
+	if (type != BA_MSG_TYPE_SNAPSHOT || (size_t)len < sizeof(snapshot)) {
+		errno = EBADMSG;
+		goto fail;
+	}
+
+	memcpy(&snapshot, buffer, sizeof(snapshot));
+	devices_size = sizeof(*_devices) * snapshot.devices;
+	transports_size = sizeof(*_transports) * snapshot.transports;
+
+	if ((size_t)len != sizeof(snapshot) + devices_size + transports_size) {
+		errno = EBADMSG;
+		goto fail;
+	}
+
+	if ((devices_size > 0 && (_devices = malloc(devices_size)) == NULL) ||
+			(transports_size > 0 && (_transports = malloc(transports_size)) == NULL))
+		goto fail;
+
+	memcpy(_devices, buffer + sizeof(snapshot), devices_size);
+	memcpy(_transports, buffer + sizeof(snapshot) + devices_size, transports_size);
+
+	*devices = _devices;
+	*devices_count = snapshot.devices;
 	*transports = _transports;
-	return i;
+	*transports_count = snapshot.transports;
+
+	free(buffer);
+	return 0;
+
+fail:
+	free(_devices);
+	free(buffer);
+	return -1;
 }
 
 /**
@@ -229,6 +552,7 @@ int bluealsa_get_transport(int fd, const bdaddr_t *addr, uint8_t type,
 		.addr = *addr,
 		.type = type,
 	};
+	uint16_t _type;
 	ssize_t len;
 
 #if DEBUG
@@ -237,19 +561,25 @@ int bluealsa_get_transport(int fd, const bdaddr_t *addr, uint8_t type,
 	debug("Getting transport for %s type %#x", addr_, type);
 #endif
 
-	if (send(fd, &req, sizeof(req), MSG_NOSIGNAL) == -1)
+	if (bluealsa_send_msg(fd, &req, sizeof(req)) == -1)
 		return -1;
-	if ((len = read(fd, transport, sizeof(*transport))) == -1)
+	if ((len = bluealsa_recv_msg(fd, &_type, transport, sizeof(*transport), 0)) == -1)
 		return -1;
 
 	/* in case of error, status message is returned */
-	if (len != sizeof(*transport)) {
+	if (_type == BA_MSG_TYPE_STATUS) {
 		memcpy(&status, transport, sizeof(status));
-		errno = bluealsa_status_to_errno(&status);
+		if ((errno = bluealsa_status_to_errno(&status)) == 0)
+			errno = EBADMSG;
 		return -1;
 	}
 
-	if (read(fd, &status, sizeof(status)) == -1)
+	if (_type != BA_MSG_TYPE_TRANSPORT || len != sizeof(*transport)) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	if (bluealsa_recv_status(fd) == -1)
 		return -1;
 
 	/* For SCO transport, server will report that both streaming directions are
@@ -363,57 +693,229 @@ int bluealsa_set_transport_volume(int fd, const struct ba_msg_transport *transpo
 }
 
 /**
- * Open PCM transport.
+ * Start or stop traffic capture of the PCM transport.
+ *
+ * Captured packets are written by the server to the pcap file located in
+ * the BlueALSA run-state directory. This function requires the
+ * BA_CAPABILITY_CAPTURE capability to be negotiated during the connection
+ * handshake.
  *
  * @param fd Opened socket file descriptor.
  * @param transport Address to the transport structure with the addr and
  *   type fields set - other fields are not used by this function.
- * @return PCM FIFO file descriptor, or -1 on error. */
-int bluealsa_open_transport(int fd, const struct ba_msg_transport *transport) {
+ * @param enable If true, start capture, otherwise stop it.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int bluealsa_set_transport_capture(int fd, const struct ba_msg_transport *transport,
+		bool enable) {
 
-	struct ba_msg_status status = { 0xAB };
 	struct ba_request req = {
-		.command = BA_COMMAND_PCM_OPEN,
+		.command = BA_COMMAND_TRANSPORT_CAPTURE,
 		.addr = transport->addr,
 		.type = transport->type,
+		.capture = enable,
 	};
-	char buf[256] = "";
-	struct iovec io = {
-		.iov_base = &status,
-		.iov_len = sizeof(status),
+
+	return bluealsa_send_request(fd, &req);
+}
+
+/**
+ * Switch audio codec of the PCM transport.
+ *
+ * The codec is switched without closing the PCM, however, the audio stream
+ * will be interrupted for a moment. Since the PCM format can not change,
+ * the new codec has to support the number of channels and the sampling
+ * frequency of the current configuration. This function requires the
+ * BA_CAPABILITY_CODEC_SWITCH capability to be negotiated during the
+ * connection handshake.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param transport Address to the transport structure with the addr and
+ *   type fields set - other fields are not used by this function.
+ * @param codec Audio codec ID, e.g. A2DP_CODEC_SBC.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int bluealsa_set_transport_codec(int fd, const struct ba_msg_transport *transport,
+		uint16_t codec) {
+
+	struct ba_request req = {
+		.command = BA_COMMAND_TRANSPORT_SET_CODEC,
+		.addr = transport->addr,
+		.type = transport->type,
+		.codec = codec,
+	};
+
+	return bluealsa_send_request(fd, &req);
+}
+
+/**
+ * Send PCM open request and receive PCM file descriptors.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param req Address to the PCM open request.
+ * @param fds Address to the array where received file descriptors will be
+ *   stored.
+ * @param count The number of expected file descriptors.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+static int bluealsa_open_transport_fds(int fd, const struct ba_request *req,
+		int *fds, size_t count) {
+
+	struct ba_msg_status status = { 0xAB };
+	struct ba_msg_header header;
+	char buf[CMSG_SPACE(sizeof(int) * 3)] = "";
+	struct iovec io[] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = &status, .iov_len = sizeof(status) },
 	};
 	struct msghdr msg = {
-		.msg_iov = &io,
-		.msg_iovlen = 1,
+		.msg_iov = io,
+		.msg_iovlen = ARRAYSIZE(io),
 		.msg_control = buf,
 		.msg_controllen = sizeof(buf),
 	};
 	ssize_t len;
+	size_t i;
+	int err;
 
 #if DEBUG
 	char addr_[18];
-	ba2str_(&req.addr, addr_);
+	ba2str_(&req->addr, addr_);
 	debug("Requesting PCM open for %s", addr_);
 #endif
 
-	if (send(fd, &req, sizeof(req), MSG_NOSIGNAL) == -1)
+	if (bluealsa_send_msg(fd, req, sizeof(*req)) == -1)
 		return -1;
 	if ((len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1)
 		return -1;
+	if (len == 0) {
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	if ((size_t)len < sizeof(header)) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	/* in case of error, status message is returned */
+	if (header.type == BA_MSG_TYPE_STATUS) {
+		if ((errno = bluealsa_status_to_errno(&status)) == 0)
+			errno = EBADMSG;
+		return -1;
+	}
 
 	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
 	if (cmsg == NULL ||
-			cmsg->cmsg_level == IPPROTO_IP ||
-			cmsg->cmsg_type == IP_TTL) {
-		/* in case of error, status message is returned */
-		errno = bluealsa_status_to_errno(&status);
+			cmsg->cmsg_level != SOL_SOCKET ||
+			cmsg->cmsg_type != SCM_RIGHTS) {
+		errno = EBADMSG;
 		return -1;
 	}
 
-	if (read(fd, &status, sizeof(status)) == -1)
+	/* take ownership of all received file descriptors */
+	int received_fds[3] = { -1, -1, -1 };
+	size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if (received > ARRAYSIZE(received_fds))
+		received = ARRAYSIZE(received_fds);
+	memcpy(received_fds, CMSG_DATA(cmsg), sizeof(int) * received);
+
+	if (header.type != BA_MSG_TYPE_PCM || received != count) {
+		errno = EBADMSG;
+		goto fail;
+	}
+
+	if (bluealsa_recv_status(fd) == -1)
+		goto fail;
+
+	memcpy(fds, received_fds, sizeof(int) * count);
+	return 0;
+
+fail:
+	err = errno;
+	for (i = 0; i < received; i++)
+		close(received_fds[i]);
+	errno = err;
+	return -1;
+}
+
+/**
+ * Open PCM transport.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param transport Address to the transport structure with the addr and
+ *   type fields set - other fields are not used by this function.
+ * @return PCM FIFO file descriptor, or -1 on error. */
+int bluealsa_open_transport(int fd, const struct ba_msg_transport *transport) {
+
+	const struct ba_request req = {
+		.command = BA_COMMAND_PCM_OPEN,
+		.addr = transport->addr,
+		.type = transport->type,
+	};
+	int pcm_fd;
+
+	if (bluealsa_open_transport_fds(fd, &req, &pcm_fd, 1) == -1)
 		return -1;
 
-	return *((int *)CMSG_DATA(cmsg));
+	return pcm_fd;
+}
+
+/**
+ * Open PCM transport using shared memory ring buffer.
+ *
+ * This function requires the BA_CAPABILITY_PCM_SHM capability to be
+ * negotiated during the handshake.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param transport Address to the transport structure with the addr and
+ *   type fields set - other fields are not used by this function.
+ * @param size Requested size of the ring buffer in bytes.
+ * @param fds Address to the array where the shared memory file descriptor,
+ *   the server notification eventfd and the client notification eventfd
+ *   will be stored - in that order.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int bluealsa_open_transport_shm(int fd, const struct ba_msg_transport *transport,
+		size_t size, int fds[3]) {
+
+	const struct ba_request req = {
+		.command = BA_COMMAND_PCM_OPEN,
+		.addr = transport->addr,
+		.type = transport->type,
+		.pcm_flags = BA_PCM_FLAG_SHM,
+		.pcm_buffer_size = size,
+	};
+
+	return bluealsa_open_transport_fds(fd, &req, fds, 3);
+}
+
+/**
+ * Open A2DP source transport in the passthrough mode.
+ *
+ * This function requires the BA_CAPABILITY_PCM_PASSTHROUGH capability to be
+ * negotiated during the handshake. Every message written to the returned
+ * socket shall contain complete audio frames encoded with the codec and the
+ * configuration of the given transport.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param transport Address to the transport structure with the addr and
+ *   type fields set - other fields are not used by this function.
+ * @return SOCK_SEQPACKET socket file descriptor, or -1 on error. */
+int bluealsa_open_transport_passthrough(int fd, const struct ba_msg_transport *transport) {
+
+	const struct ba_request req = {
+		.command = BA_COMMAND_PCM_OPEN,
+		.addr = transport->addr,
+		.type = transport->type,
+		.pcm_flags = BA_PCM_FLAG_PASSTHROUGH,
+	};
+	int pcm_fd;
+
+	if (bluealsa_open_transport_fds(fd, &req, &pcm_fd, 1) == -1)
+		return -1;
+
+	return pcm_fd;
 }
 
 /**
@@ -471,3 +973,88 @@ int bluealsa_send_rfcomm_command(int fd, const bdaddr_t *addr, const char *comma
 
 	return bluealsa_send_request(fd, &req);
 }
+
+/**
+ * Execute multiple requests within a single round trip.
+ *
+ * Requests which transfer file descriptors (PCM open) can not be batched.
+ * For such requests the EACCES error is reported in the reply structure.
+ *
+ * @param fd Opened socket file descriptor.
+ * @param requests An array with requests to execute.
+ * @param count The number of requests, at most BA_BATCH_MAX.
+ * @param replies An array with at least count elements, where replies for
+ *   consecutive requests will be stored.
+ * @param buffer An address where the response buffer will be stored. Data
+ *   pointers in the replies array point into this buffer, so it should be
+ *   freed with the free() when replies are no longer needed.
+ * @return Upon success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set appropriately. */
+int bluealsa_batch(int fd, const struct ba_request *requests, size_t count,
+		struct ba_batch_reply *replies, void **buffer) {
+
+	struct ba_request req[1 + BA_BATCH_MAX] = {
+		{ .command = BA_COMMAND_BATCH, .batch_count = count } };
+	struct ba_msg_status status = { 0xAB };
+	uint8_t *data;
+	uint8_t *ptr;
+	uint16_t type;
+	ssize_t len;
+	size_t i;
+
+	if (count == 0 || count > BA_BATCH_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(&req[1], requests, sizeof(*requests) * count);
+
+	debug("Sending batch request: %zu", count);
+	if (bluealsa_send_msg(fd, req, sizeof(*req) * (1 + count)) == -1)
+		return -1;
+	if ((len = bluealsa_recv_msg_alloc(fd, &type, (void **)&data)) == -1)
+		return -1;
+
+	/* in case of error, status message is returned */
+	if (type == BA_MSG_TYPE_STATUS && len == sizeof(status)) {
+		memcpy(&status, data, sizeof(status));
+		if ((errno = bluealsa_status_to_errno(&status)) == 0)
+			errno = EBADMSG;
+		goto fail;
+	}
+
+	if (bluealsa_recv_status(fd) == -1)
+		goto fail;
+	if (type != BA_MSG_TYPE_BATCH)
+		goto fail_msg;
+
+	for (i = 0, ptr = data; i < count; i++) {
+
+		struct ba_msg_batch entry;
+
+		if (ptr + sizeof(entry) > data + len)
+			goto fail_msg;
+		memcpy(&entry, ptr, sizeof(entry));
+		ptr += sizeof(entry);
+
+		/* every entry has to contain at least the status message */
+		if (entry.length < sizeof(status) || ptr + entry.length > data + len)
+			goto fail_msg;
+
+		replies[i].data = ptr;
+		replies[i].size = entry.length - sizeof(status);
+		memcpy(&status, ptr + replies[i].size, sizeof(status));
+		replies[i].err = bluealsa_status_to_errno(&status);
+		ptr += entry.length;
+
+	}
+
+	*buffer = data;
+	return 0;
+
+fail_msg:
+	errno = EBADMSG;
+fail:
+	free(data);
+	return -1;
+}
@@ -14,14 +14,32 @@
 #include <stdbool.h>
 #include "shared/ctl-proto.h"
 
+/**
+ * Response for a single request embedded in the batch. */
+struct ba_batch_reply {
+	/* address of the response messages (without status) */
+	const void *data;
+	/* the length of the response messages */
+	size_t size;
+	/* request status converted to the errno value */
+	int err;
+};
+
 int bluealsa_open(const char *interface);
+int bluealsa_open_caps(const char *interface, uint32_t *capabilities);
 
 int bluealsa_event_subscribe(int fd, uint8_t mask);
+int bluealsa_event_recv(int fd, struct ba_msg_event *event, int flags);
 int bluealsa_event_match(const struct ba_msg_transport *transport,
 		const struct ba_msg_event *event);
 
 ssize_t bluealsa_get_devices(int fd, struct ba_msg_device **devices);
 ssize_t bluealsa_get_transports(int fd, struct ba_msg_transport **transports);
+ssize_t bluealsa_get_stats(int fd, struct ba_msg_transport_stats **stats);
+
+int bluealsa_get_snapshot(int fd,
+		struct ba_msg_device **devices, size_t *devices_count,
+		struct ba_msg_transport **transports, size_t *transports_count);
 
 int bluealsa_get_transport(int fd, const bdaddr_t *addr, uint8_t type,
 		struct ba_msg_transport *transport);
@@ -36,9 +54,20 @@ int bluealsa_get_transport_volume(int fd, const struct ba_msg_transport *transpo
 int bluealsa_set_transport_volume(int fd, const struct ba_msg_transport *transport,
 		bool ch1_muted, int ch1_volume, bool ch2_muted, int ch2_volume);
 
+int bluealsa_set_transport_capture(int fd, const struct ba_msg_transport *transport,
+		bool enable);
+int bluealsa_set_transport_codec(int fd, const struct ba_msg_transport *transport,
+		uint16_t codec);
+
 int bluealsa_open_transport(int fd, const struct ba_msg_transport *transport);
+int bluealsa_open_transport_shm(int fd, const struct ba_msg_transport *transport,
+		size_t size, int fds[3]);
+int bluealsa_open_transport_passthrough(int fd, const struct ba_msg_transport *transport);
 int bluealsa_control_transport(int fd, const struct ba_msg_transport *transport, enum ba_command cmd);
 
 int bluealsa_send_rfcomm_command(int fd, const bdaddr_t *addr, const char *command);
 
+int bluealsa_batch(int fd, const struct ba_request *requests, size_t count,
+		struct ba_batch_reply *replies, void **buffer);
+
 #endif
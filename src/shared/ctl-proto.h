@@ -15,13 +15,16 @@
 # include <config.h>
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 #include <bluetooth/bluetooth.h>
 
 /* Location where the control socket and pipes are stored. */
 #define BLUEALSA_RUN_STATE_DIR RUN_STATE_DIR "/bluealsa"
 /* Version of the controller communication protocol. */
-#define BLUEALSA_CRL_PROTO_VERSION 0x0500
+#define BLUEALSA_CRL_PROTO_VERSION 0x0600
+/* Legacy protocol version - fixed-size messages without framing. */
+#define BLUEALSA_CRL_PROTO_VERSION_LEGACY 0x0500
 
 enum ba_command {
 	BA_COMMAND_PING,
@@ -37,9 +40,53 @@ enum ba_command {
 	BA_COMMAND_PCM_DRAIN,
 	BA_COMMAND_PCM_DROP,
 	BA_COMMAND_RFCOMM_SEND,
+	BA_COMMAND_SNAPSHOT,
+	BA_COMMAND_BATCH,
+	BA_COMMAND_STATS,
+	BA_COMMAND_TRANSPORT_CAPTURE,
+	BA_COMMAND_TRANSPORT_SET_CODEC,
 	__BA_COMMAND_MAX
 };
 
+/**
+ * Optional protocol features negotiated during the handshake. */
+enum ba_capability {
+	BA_CAPABILITY_BATCH    = 1 << 0,
+	BA_CAPABILITY_SNAPSHOT = 1 << 1,
+	BA_CAPABILITY_EVENT_PAYLOAD = 1 << 2,
+	BA_CAPABILITY_PCM_SHM  = 1 << 3,
+	BA_CAPABILITY_STATS    = 1 << 4,
+	BA_CAPABILITY_CAPTURE  = 1 << 5,
+	BA_CAPABILITY_CODEC_SWITCH = 1 << 6,
+	BA_CAPABILITY_PCM_PASSTHROUGH = 1 << 7,
+};
+
+/* Bit-mask with all capabilities supported by this protocol revision. */
+#define BA_CAPABILITIES_ALL ( \
+		BA_CAPABILITY_BATCH | \
+		BA_CAPABILITY_SNAPSHOT | \
+		BA_CAPABILITY_EVENT_PAYLOAD | \
+		BA_CAPABILITY_PCM_SHM | \
+		BA_CAPABILITY_STATS | \
+		BA_CAPABILITY_CAPTURE | \
+		BA_CAPABILITY_CODEC_SWITCH | \
+		BA_CAPABILITY_PCM_PASSTHROUGH)
+
+/**
+ * Type of the framed message. */
+enum ba_msg_type {
+	BA_MSG_TYPE_NULL = 0,
+	BA_MSG_TYPE_REQUEST,
+	BA_MSG_TYPE_STATUS,
+	BA_MSG_TYPE_DEVICE,
+	BA_MSG_TYPE_TRANSPORT,
+	BA_MSG_TYPE_EVENT,
+	BA_MSG_TYPE_BATCH,
+	BA_MSG_TYPE_SNAPSHOT,
+	BA_MSG_TYPE_PCM,
+	BA_MSG_TYPE_STATS,
+};
+
 enum ba_status_code {
 	BA_STATUS_CODE_SUCCESS = 0,
 	BA_STATUS_CODE_ERROR_UNKNOWN,
@@ -48,6 +95,7 @@ enum ba_status_code {
 	BA_STATUS_CODE_CODEC_NOT_SELECTED,
 	BA_STATUS_CODE_DEVICE_BUSY,
 	BA_STATUS_CODE_FORBIDDEN,
+	BA_STATUS_CODE_CODEC_NOT_SUPPORTED,
 };
 
 enum ba_event {
@@ -58,12 +106,36 @@ enum ba_event {
 	BA_EVENT_BATTERY           = 1 << 4,
 };
 
+/**
+ * Validity flags of the event payload. */
+enum ba_event_payload {
+	BA_EVENT_PAYLOAD_DEVICE    = 1 << 0,
+	BA_EVENT_PAYLOAD_TRANSPORT = 1 << 1,
+};
+
 enum ba_pcm_type {
 	BA_PCM_TYPE_NULL = 0,
 	BA_PCM_TYPE_A2DP,
 	BA_PCM_TYPE_SCO,
 };
 
+/**
+ * Options of the PCM transfer requested with BA_COMMAND_PCM_OPEN. */
+enum ba_pcm_flag {
+	/* Transfer PCM data via the ring buffer placed in the shared memory
+	 * instead of the FIFO. In such a case the controller sends three file
+	 * descriptors: the shared memory, the server-side and the client-side
+	 * eventfd used for data availability notifications. */
+	BA_PCM_FLAG_SHM = 1 << 0,
+	/* Transfer audio frames already encoded with the codec selected for the
+	 * A2DP source transport (the configuration has to match the transport
+	 * cconfig), which are only packetized and paced by the server. In such
+	 * a case the FIFO is replaced with the SOCK_SEQPACKET socket, and every
+	 * message shall contain complete codec frames - for AAC exactly one LATM
+	 * audioMuxElement. This flag requires BA_CAPABILITY_PCM_PASSTHROUGH. */
+	BA_PCM_FLAG_PASSTHROUGH = 1 << 1,
+};
+
 #define BA_PCM_STREAM_PLAYBACK (1 << 6)
 #define BA_PCM_STREAM_CAPTURE  (1 << 7)
 
@@ -76,6 +148,44 @@ enum ba_pcm_type {
  * Extract PCM type enum from the given value. */
 #define BA_PCM_TYPE(v) ((v) & BA_PCM_TYPE_MASK)
 
+/**
+ * The maximal number of requests which can be embedded in a single
+ * BA_COMMAND_BATCH request. */
+#define BA_BATCH_MAX 32
+
+/**
+ * Handshake message sent by the client right after the connection has been
+ * established. The controller replies with the same message containing the
+ * negotiated capabilities - a subset of capabilities requested by the client.
+ *
+ * Clients which use the legacy protocol send the version field only. Such
+ * clients do not receive any reply and all messages are exchanged without
+ * the framing header. */
+struct __attribute__ ((packed)) ba_msg_hello {
+	/* protocol version */
+	uint16_t version;
+	/* bit-mask with capabilities */
+	uint32_t capabilities;
+};
+
+/**
+ * Header of every message exchanged with the controller (protocol version
+ * 0x0600 and above). The header is followed by the payload, which length
+ * is given in the header itself. Since the SOCK_SEQPACKET socket is used,
+ * every framed message is transferred as a single datagram.
+ *
+ * The payload of the request message is the ba_request structure. However,
+ * it might be truncated - missing trailing fields are assumed to be zero. */
+struct __attribute__ ((packed)) ba_msg_header {
+	/* message type, see ba_msg_type */
+	uint16_t type;
+	/* length of the payload */
+	uint32_t length;
+};
+
+/* The maximal length of the framed request payload. */
+#define BA_MSG_REQUEST_MAX (sizeof(struct ba_request) * (1 + BA_BATCH_MAX))
+
 struct __attribute__ ((packed)) ba_request {
 
 	enum ba_command command;
@@ -104,10 +214,31 @@ struct __attribute__ ((packed)) ba_request {
 			uint8_t ch2_volume:7;
 		};
 
+		/* if non-zero, start traffic capture, otherwise stop it
+		 * used by BA_COMMAND_TRANSPORT_CAPTURE */
+		uint8_t capture;
+
+		/* audio codec which shall be used by the transport
+		 * used by BA_COMMAND_TRANSPORT_SET_CODEC */
+		uint16_t codec;
+
 		/* RFCOMM command string to send
 		 * used by BA_COMMAND_RFCOMM_SEND */
 		char rfcomm_command[32];
 
+		/* number of requests which follow this one
+		 * used by BA_COMMAND_BATCH */
+		uint8_t batch_count;
+
+		/* PCM transfer options
+		 * used by BA_COMMAND_PCM_OPEN */
+		struct {
+			/* bit-mask with PCM flags */
+			uint8_t pcm_flags;
+			/* requested size of the shared memory ring buffer */
+			uint32_t pcm_buffer_size;
+		};
+
 	};
 
 };
@@ -120,13 +251,23 @@ struct __attribute__ ((packed)) ba_msg_status {
 	uint8_t code;
 };
 
-struct __attribute__ ((packed)) ba_msg_event {
-	/* bit-mask with events */
-	uint8_t events;
-	/* device address for which event occurred */
-	bdaddr_t addr;
-	/* transport type for which event occurred */
-	uint8_t type;
+/**
+ * Header of every entry in the BA_COMMAND_BATCH response. The header is
+ * followed by the concatenation of all messages which would have been sent
+ * by the controller for given request - including the status message. */
+struct __attribute__ ((packed)) ba_msg_batch {
+	/* length of the entry data */
+	uint32_t length;
+};
+
+/**
+ * Header of the BA_COMMAND_SNAPSHOT response. The header is followed by
+ * the array of devices and then by the array of transports. */
+struct __attribute__ ((packed)) ba_msg_snapshot {
+	/* number of connected devices */
+	uint16_t devices;
+	/* number of available transports */
+	uint16_t transports;
 };
 
 struct __attribute__ ((packed)) ba_msg_device {
@@ -170,4 +311,52 @@ struct __attribute__ ((packed)) ba_msg_transport {
 
 };
 
+struct __attribute__ ((packed)) ba_msg_event {
+
+	/* bit-mask with events */
+	uint8_t events;
+	/* device address for which event occurred */
+	bdaddr_t addr;
+	/* transport type for which event occurred */
+	uint8_t type;
+
+	/* Fields below are sent only to clients which have negotiated the
+	 * BA_CAPABILITY_EVENT_PAYLOAD capability. They describe the state at
+	 * the time of sending, so clients do not have to query it. */
+
+	/* bit-mask with valid payload structures */
+	uint8_t payload;
+	/* current state of the device */
+	struct ba_msg_device device;
+	/* current state of the transport */
+	struct ba_msg_transport transport;
+
+};
+
+/**
+ * Transport statistics sent in response to the BA_COMMAND_STATS request.
+ *
+ * All counters are free-running and wrap around, so clients shall compute
+ * rates from the difference between two subsequent samples. */
+struct __attribute__ ((packed)) ba_msg_transport_stats {
+
+	/* current state of the transport */
+	struct ba_msg_transport transport;
+
+	/* number of bytes and packets transferred over the Bluetooth link */
+	uint32_t bt_bytes;
+	uint32_t bt_packets;
+	/* number of RTP packets which were lost (A2DP sink only) */
+	uint32_t rtp_lost;
+	/* CPU time spent in the audio codec in microseconds */
+	uint32_t codec_time;
+
+	/* number of bytes queued in the Bluetooth socket (A2DP source only) */
+	uint32_t bt_queued;
+
+};
+
+/* Size of the event message without the state payload. */
+#define BA_MSG_EVENT_BASIC_SIZE offsetof(struct ba_msg_event, payload)
+
 #endif
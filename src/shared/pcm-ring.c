@@ -0,0 +1,355 @@
+/*
+ * BlueALSA - pcm-ring.c
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "shared/pcm-ring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if !HAVE_MEMFD_CREATE
+# include <sys/syscall.h>
+#endif
+
+#ifndef MFD_CLOEXEC
+# define MFD_CLOEXEC 0x0001U
+#endif
+
+#if !HAVE_MEMFD_CREATE
+# define memfd_create(name, flags) syscall(__NR_memfd_create, name, flags)
+#endif
+
+/**
+ * Create shared memory PCM ring buffer.
+ *
+ * @param size The size of the ring buffer data area in bytes. It will be
+ *   rounded up to the nearest power of 2.
+ * @return On success this function returns the file descriptor of the shared
+ *   memory, which shall be mapped with the ba_pcm_ring_map(). Otherwise, -1 is
+ *   returned and errno is set appropriately. */
+int ba_pcm_ring_create(size_t size) {
+
+	struct ba_pcm_ring *ring;
+	size_t _size = 1;
+	int fd, err;
+
+	while (_size < size)
+		_size <<= 1;
+
+	if (_size > UINT32_MAX / 2) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((fd = memfd_create("bluealsa-pcm", MFD_CLOEXEC)) == -1)
+		return -1;
+
+	if (ftruncate(fd, sizeof(*ring) + _size) == -1)
+		goto fail;
+
+	if ((ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0)) == MAP_FAILED)
+		goto fail;
+
+	ring->head = ring->tail = 0;
+	ring->size = _size;
+	ring->closed = 0;
+
+	munmap(ring, sizeof(*ring));
+	return fd;
+
+fail:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+/**
+ * Map shared memory PCM ring buffer.
+ *
+ * The header of the mapped ring buffer is writable by the other side, so
+ * it shall not be trusted after the mapping. The size of the data area is
+ * returned via the size parameter and it shall be used for all further
+ * operations instead of the size field stored in the shared header.
+ *
+ * @param fd File descriptor of the shared memory.
+ * @param size Address where the size of the data area will be stored.
+ * @return On success this function returns an address of the mapped ring
+ *   buffer. Otherwise, NULL is returned and errno is set appropriately. */
+struct ba_pcm_ring *ba_pcm_ring_map(int fd, uint32_t *size) {
+
+	struct ba_pcm_ring *ring;
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		return NULL;
+
+	if ((size_t)st.st_size <= sizeof(*ring) ||
+			(size_t)st.st_size - sizeof(*ring) > UINT32_MAX / 2) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0)) == MAP_FAILED)
+		return NULL;
+
+	/* do not trust the other side blindly */
+	const uint32_t _size = st.st_size - sizeof(*ring);
+	if (__atomic_load_n(&ring->size, __ATOMIC_RELAXED) != _size ||
+			(_size & (_size - 1)) != 0) {
+		munmap(ring, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	*size = _size;
+	return ring;
+}
+
+/**
+ * Unmap shared memory PCM ring buffer.
+ *
+ * @param ring Address of the mapped ring buffer.
+ * @param size The size of the data area returned by the ba_pcm_ring_map(). */
+void ba_pcm_ring_unmap(struct ba_pcm_ring *ring, uint32_t size) {
+	munmap(ring, sizeof(*ring) + size);
+}
+
+/**
+ * Allocate process-private PCM ring buffer.
+ *
+ * Such a ring buffer can be used for passing PCM data between threads
+ * of the same process. It shall be freed with the ba_pcm_ring_free().
+ *
+ * @param size The size of the ring buffer data area in bytes. It will be
+ *   rounded up to the nearest power of 2.
+ * @return On success this function returns an address of the ring buffer.
+ *   Otherwise, NULL is returned and errno is set appropriately. */
+struct ba_pcm_ring *ba_pcm_ring_alloc(size_t size) {
+
+	struct ba_pcm_ring *ring;
+	size_t _size = 1;
+
+	while (_size < size)
+		_size <<= 1;
+
+	if (_size > UINT32_MAX / 2) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((ring = calloc(1, sizeof(*ring) + _size)) == NULL)
+		return NULL;
+
+	ring->size = _size;
+	return ring;
+}
+
+/**
+ * Free process-private PCM ring buffer. */
+void ba_pcm_ring_free(struct ba_pcm_ring *ring) {
+	free(ring);
+}
+
+/**
+ * Read data from the ring buffer at the given position.
+ *
+ * This function shall be used by the consumer, which does not trust the
+ * other side. The consumer position and the size of the data area are kept
+ * in a private memory, and the producer position is clamped, so the memory
+ * outside the data area is never accessed.
+ *
+ * @param ring Address of the mapped ring buffer.
+ * @param size The size of the data area.
+ * @param tail Address of the private consumer position. It is updated by
+ *   this function.
+ * @param buffer Address of the destination buffer.
+ * @param len The maximal number of bytes to read.
+ * @return This function returns the number of bytes read. */
+size_t ba_pcm_ring_pread(struct ba_pcm_ring *ring, uint32_t size, uint32_t *tail,
+		void *buffer, size_t len) {
+
+	const size_t offset = *tail & (size - 1);
+	const size_t len_out = ba_pcm_ring_plen_out(ring, size, *tail);
+	size_t chunk;
+
+	if (len > len_out)
+		len = len_out;
+
+	chunk = size - offset < len ? size - offset : len;
+	memcpy(buffer, &ring->data[offset], chunk);
+	memcpy((uint8_t *)buffer + chunk, ring->data, len - chunk);
+
+	*tail += len;
+	__atomic_store_n(&ring->tail, *tail, __ATOMIC_RELEASE);
+	return len;
+}
+
+/**
+ * Write data to the ring buffer at the given position.
+ *
+ * This function is a producer counterpart of the ba_pcm_ring_pread().
+ *
+ * @param ring Address of the mapped ring buffer.
+ * @param size The size of the data area.
+ * @param head Address of the private producer position. It is updated by
+ *   this function.
+ * @param buffer Address of the source buffer.
+ * @param len The maximal number of bytes to write.
+ * @return This function returns the number of bytes written. */
+size_t ba_pcm_ring_pwrite(struct ba_pcm_ring *ring, uint32_t size, uint32_t *head,
+		const void *buffer, size_t len) {
+
+	const size_t offset = *head & (size - 1);
+	const size_t len_in = ba_pcm_ring_plen_in(ring, size, *head);
+	size_t chunk;
+
+	if (len > len_in)
+		len = len_in;
+
+	chunk = size - offset < len ? size - offset : len;
+	memcpy(&ring->data[offset], buffer, chunk);
+	memcpy(ring->data, (const uint8_t *)buffer + chunk, len - chunk);
+
+	*head += len;
+	__atomic_store_n(&ring->head, *head, __ATOMIC_RELEASE);
+	return len;
+}
+
+/**
+ * Get the address of the contiguous free space in the ring buffer.
+ *
+ * This function allows the producer to generate data in place, without
+ * an intermediate buffer. Generated data shall be committed with the
+ * ba_pcm_ring_pwrite_commit() function.
+ *
+ * @param ring Address of the mapped ring buffer.
+ * @param size The size of the data area.
+ * @param head The private producer position.
+ * @param len Address where the number of contiguous bytes available for
+ *   writing will be stored.
+ * @return This function returns the address of the free space. */
+void *ba_pcm_ring_pwrite_ptr(struct ba_pcm_ring *ring, uint32_t size, uint32_t head,
+		size_t *len) {
+
+	const size_t offset = head & (size - 1);
+	const size_t len_in = ba_pcm_ring_plen_in(ring, size, head);
+
+	*len = size - offset < len_in ? size - offset : len_in;
+	return &ring->data[offset];
+}
+
+/**
+ * Commit data generated in place.
+ *
+ * @param ring Address of the mapped ring buffer.
+ * @param head Address of the private producer position. It is updated by
+ *   this function.
+ * @param len The number of bytes written at the address returned by the
+ *   ba_pcm_ring_pwrite_ptr() function. */
+void ba_pcm_ring_pwrite_commit(struct ba_pcm_ring *ring, uint32_t *head, size_t len) {
+	*head += len;
+	__atomic_store_n(&ring->head, *head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Drop all data available for reading at the given position.
+ *
+ * @param ring Address of the mapped ring buffer.
+ * @param size The size of the data area.
+ * @param tail Address of the private consumer position. It is updated by
+ *   this function.
+ * @return This function returns the number of dropped bytes. */
+size_t ba_pcm_ring_pdrop(struct ba_pcm_ring *ring, uint32_t size, uint32_t *tail) {
+	const size_t len = ba_pcm_ring_plen_out(ring, size, *tail);
+	*tail += len;
+	__atomic_store_n(&ring->tail, *tail, __ATOMIC_RELEASE);
+	return len;
+}
+
+/**
+ * Get number of bytes available for reading at the given position.
+ *
+ * The producer position is clamped, so the returned value never exceeds
+ * the size of the data area.
+ *
+ * @param ring Address of the mapped ring buffer.
+ * @param size The size of the data area.
+ * @param tail The private consumer position.
+ * @return This function returns the number of bytes available for reading. */
+size_t ba_pcm_ring_plen_out(const struct ba_pcm_ring *ring, uint32_t size, uint32_t tail) {
+	const uint32_t len = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+	return len < size ? len : size;
+}
+
+/**
+ * Get number of bytes available for writing at the given position.
+ *
+ * The consumer position is clamped, so the returned value never exceeds
+ * the size of the data area.
+ *
+ * @param ring Address of the mapped ring buffer.
+ * @param size The size of the data area.
+ * @param head The private producer position.
+ * @return This function returns the number of bytes available for writing. */
+size_t ba_pcm_ring_plen_in(const struct ba_pcm_ring *ring, uint32_t size, uint32_t head) {
+	const uint32_t len = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	return len < size ? size - len : 0;
+}
+
+/**
+ * Read data from the ring buffer.
+ *
+ * This function shall be used only if the other side is trusted, e.g. for
+ * the process-private ring buffer.
+ *
+ * @param ring Address of the mapped ring buffer.
+ * @param buffer Address of the destination buffer.
+ * @param len The maximal number of bytes to read.
+ * @return This function returns the number of bytes read. */
+size_t ba_pcm_ring_read(struct ba_pcm_ring *ring, void *buffer, size_t len) {
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	return ba_pcm_ring_pread(ring, ring->size, &tail, buffer, len);
+}
+
+/**
+ * Write data to the ring buffer.
+ *
+ * This function shall be used only if the other side is trusted, e.g. for
+ * the process-private ring buffer.
+ *
+ * @param ring Address of the mapped ring buffer.
+ * @param buffer Address of the source buffer.
+ * @param len The maximal number of bytes to write.
+ * @return This function returns the number of bytes written. */
+size_t ba_pcm_ring_write(struct ba_pcm_ring *ring, const void *buffer, size_t len) {
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	return ba_pcm_ring_pwrite(ring, ring->size, &head, buffer, len);
+}
+
+/**
+ * Drop all data available for reading.
+ *
+ * This function shall be called by the consumer only.
+ *
+ * @param ring Address of the mapped ring buffer.
+ * @return This function returns the number of dropped bytes. */
+size_t ba_pcm_ring_drop(struct ba_pcm_ring *ring) {
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	return ba_pcm_ring_pdrop(ring, ring->size, &tail);
+}
@@ -0,0 +1,78 @@
+/*
+ * BlueALSA - pcm-ring.h
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_SHARED_PCMRING_H_
+#define BLUEALSA_SHARED_PCMRING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * PCM ring buffer placed in the shared memory.
+ *
+ * The ring buffer is shared between the BlueALSA server and the client. It
+ * has exactly one producer and one consumer, so there is no need for any
+ * locking. Positions are free running byte counters - they are updated
+ * with atomic operations only and wrap around naturally.
+ *
+ * The header is writable by both sides. A side which does not trust the
+ * other one shall keep its own position and the size of the data area in
+ * a private memory, and use the ba_pcm_ring_p*() functions only. */
+struct ba_pcm_ring {
+	/* producer position */
+	uint32_t head;
+	/* consumer position */
+	uint32_t tail;
+	/* size of the data area (power of 2) */
+	uint32_t size;
+	/* set by any side, which is not going to use the ring anymore */
+	uint32_t closed;
+	/* ring buffer data */
+	uint8_t data[];
+};
+
+int ba_pcm_ring_create(size_t size);
+struct ba_pcm_ring *ba_pcm_ring_map(int fd, uint32_t *size);
+void ba_pcm_ring_unmap(struct ba_pcm_ring *ring, uint32_t size);
+
+struct ba_pcm_ring *ba_pcm_ring_alloc(size_t size);
+void ba_pcm_ring_free(struct ba_pcm_ring *ring);
+
+/**
+ * Get number of bytes available for reading. */
+#define ba_pcm_ring_len_out(r) \
+	(__atomic_load_n(&(r)->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&(r)->tail, __ATOMIC_ACQUIRE))
+/**
+ * Get number of bytes available for writing. */
+#define ba_pcm_ring_len_in(r) ((r)->size - ba_pcm_ring_len_out(r))
+
+/**
+ * Mark the ring buffer as closed. */
+#define ba_pcm_ring_close(r) __atomic_store_n(&(r)->closed, 1, __ATOMIC_RELEASE)
+/**
+ * Check whether the other side has closed the ring buffer. */
+#define ba_pcm_ring_closed(r) __atomic_load_n(&(r)->closed, __ATOMIC_ACQUIRE)
+
+size_t ba_pcm_ring_pread(struct ba_pcm_ring *ring, uint32_t size, uint32_t *tail,
+		void *buffer, size_t len);
+size_t ba_pcm_ring_pwrite(struct ba_pcm_ring *ring, uint32_t size, uint32_t *head,
+		const void *buffer, size_t len);
+void *ba_pcm_ring_pwrite_ptr(struct ba_pcm_ring *ring, uint32_t size, uint32_t head,
+		size_t *len);
+void ba_pcm_ring_pwrite_commit(struct ba_pcm_ring *ring, uint32_t *head, size_t len);
+size_t ba_pcm_ring_pdrop(struct ba_pcm_ring *ring, uint32_t size, uint32_t *tail);
+size_t ba_pcm_ring_plen_out(const struct ba_pcm_ring *ring, uint32_t size, uint32_t tail);
+size_t ba_pcm_ring_plen_in(const struct ba_pcm_ring *ring, uint32_t size, uint32_t head);
+
+size_t ba_pcm_ring_read(struct ba_pcm_ring *ring, void *buffer, size_t len);
+size_t ba_pcm_ring_write(struct ba_pcm_ring *ring, const void *buffer, size_t len);
+size_t ba_pcm_ring_drop(struct ba_pcm_ring *ring);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * BlueALSA - resampler.c
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "shared/resampler.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared/defs.h"
+
+/**
+ * Initialize the polyphase windowed-sinc filter bank.
+ *
+ * @param r The resampler structure.
+ * @param cutoff Normalized cutoff frequency, where 1.0 is the Nyquist
+ *   frequency of the input signal. */
+static void resampler_init_filter(struct resampler *r, double cutoff) {
+
+	size_t p, t;
+
+	for (p = 0; p <= RESAMPLER_PHASES; p++) {
+
+		const double frac = (double)p / RESAMPLER_PHASES;
+		double sum = 0;
+
+		for (t = 0; t < RESAMPLER_TAPS; t++) {
+
+			/* distance from the filter center in the input frames */
+			double x = t - (RESAMPLER_TAPS / 2 - 1) - frac;
+			/* position within the Blackman window */
+			double u = (x + RESAMPLER_TAPS / 2) / RESAMPLER_TAPS;
+
+			double sinc = x == 0 ? 1 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+			double window = 0.42 - 0.5 * cos(2 * M_PI * u) + 0.08 * cos(4 * M_PI * u);
+
+			r->filter[p][t] = cutoff * sinc * window;
+			sum += r->filter[p][t];
+
+		}
+
+		/* normalize the DC gain of every phase to unity */
+		for (t = 0; t < RESAMPLER_TAPS; t++)
+			r->filter[p][t] /= sum;
+
+	}
+
+}
+
+/**
+ * Create new sample rate converter.
+ *
+ * @param channels The number of channels.
+ * @param rate_in Input sampling rate.
+ * @param rate_out Output sampling rate.
+ * @return On success this function returns newly allocated resampler
+ *   structure, which shall be freed with the resampler_free(). On error,
+ *   NULL is returned and errno is set to indicate the error. */
+struct resampler *resampler_init(unsigned int channels,
+		unsigned int rate_in, unsigned int rate_out) {
+
+	struct resampler *r;
+
+	if (channels == 0 || channels > ARRAYSIZE(r->history) ||
+			rate_in == 0 || rate_out == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		return NULL;
+
+	r->channels = channels;
+	r->ratio = r->step = (double)rate_in / rate_out;
+
+	/* In case of the down-sampling, the cutoff frequency has to be lowered
+	 * in order to suppress aliasing. Some margin is required anyway, due to
+	 * the finite filter length. */
+	resampler_init_filter(r, 0.9 * (r->ratio > 1 ? 1 / r->ratio : 1));
+
+	/* Pre-fill history with silence, so the first output frame can be
+	 * produced as soon as the first input frame is available. */
+	resampler_process(r, NULL, RESAMPLER_TAPS - 1, NULL);
+	if (r->history_len != RESAMPLER_TAPS - 1) {
+		resampler_free(r);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return r;
+}
+
+/**
+ * Release resampler resources. */
+void resampler_free(struct resampler *r) {
+
+	unsigned int i;
+
+	if (r == NULL)
+		return;
+
+	for (i = 0; i < r->channels; i++)
+		free(r->history[i]);
+	free(r);
+
+}
+
+/**
+ * Adjust the conversion ratio.
+ *
+ * @param r The resampler structure.
+ * @param ppm Correction in parts per million. Positive value means that
+ *   the input is consumed faster than it follows from the nominal ratio,
+ *   so less output frames are produced. */
+void resampler_set_drift(struct resampler *r, double ppm) {
+	r->step = r->ratio * (1 + ppm / 1000000);
+}
+
+/**
+ * Get the maximal number of output frames for the given input.
+ *
+ * @param r The resampler structure.
+ * @param frames The number of input frames.
+ * @return This function returns the upper limit of the number of frames
+ *   which might be produced by the resampler_process(). */
+size_t resampler_out_max(const struct resampler *r, size_t frames) {
+	double avail = (double)r->history_len + frames - RESAMPLER_TAPS + 1 - r->pos;
+	if (avail <= 0)
+		return 0;
+	return (size_t)(avail / r->step) + 1;
+}
+
+/**
+ * Convert interleaved S16 frames.
+ *
+ * All input frames are consumed - frames which can not be converted yet
+ * are stored in the internal history.
+ *
+ * @param r The resampler structure.
+ * @param in Input frames. If NULL, silence is used instead.
+ * @param frames The number of input frames.
+ * @param out Output buffer big enough to hold the number of frames given
+ *   by the resampler_out_max().
+ * @return This function returns the number of produced frames. If memory
+ *   for the history can not be allocated, input frames are dropped. */
+size_t resampler_process(struct resampler *r, const int16_t *in, size_t frames,
+		int16_t *out) {
+
+	const unsigned int channels = r->channels;
+	float coef[RESAMPLER_TAPS];
+	size_t produced = 0;
+	size_t i, t;
+	unsigned int ch;
+
+	if (r->history_len + frames > r->history_size) {
+		size_t size = r->history_len + frames + RESAMPLER_TAPS;
+		for (ch = 0; ch < channels; ch++) {
+			float *tmp;
+			if ((tmp = realloc(r->history[ch], size * sizeof(*tmp))) == NULL)
+				return 0;
+			r->history[ch] = tmp;
+		}
+		r->history_size = size;
+	}
+
+	/* de-interleave input, so the filter can be applied on continuous data */
+	for (ch = 0; ch < channels; ch++) {
+		float *dest = &r->history[ch][r->history_len];
+		if (in == NULL)
+			memset(dest, 0, frames * sizeof(*dest));
+		else
+			for (i = 0; i < frames; i++)
+				dest[i] = in[i * channels + ch];
+	}
+	r->history_len += frames;
+
+	while ((size_t)r->pos + RESAMPLER_TAPS <= r->history_len) {
+
+		const size_t idx = (size_t)r->pos;
+		const double phase = (r->pos - idx) * RESAMPLER_PHASES;
+		const unsigned int p = (unsigned int)phase;
+		const float a = phase - p;
+		const float *h0 = r->filter[p];
+		const float *h1 = r->filter[p + 1];
+
+		for (t = 0; t < RESAMPLER_TAPS; t++)
+			coef[t] = h0[t] + a * (h1[t] - h0[t]);
+
+		for (ch = 0; ch < channels; ch++) {
+			const float *x = &r->history[ch][idx];
+			float sum = 0;
+			for (t = 0; t < RESAMPLER_TAPS; t++)
+				sum += x[t] * coef[t];
+			long v = lrintf(sum);
+			out[produced * channels + ch] = v > INT16_MAX ? INT16_MAX :
+				v < INT16_MIN ? INT16_MIN : v;
+		}
+
+		produced++;
+		r->pos += r->step;
+
+	}
+
+	/* drop history which will not be used anymore */
+	size_t consumed = (size_t)r->pos;
+	if (consumed > r->history_len)
+		consumed = r->history_len;
+	for (ch = 0; ch < channels; ch++)
+		memmove(r->history[ch], &r->history[ch][consumed],
+				(r->history_len - consumed) * sizeof(*r->history[ch]));
+	r->history_len -= consumed;
+	r->pos -= consumed;
+
+	return produced;
+}
@@ -0,0 +1,59 @@
+/*
+ * BlueALSA - resampler.h
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#ifndef BLUEALSA_SHARED_RESAMPLER_H_
+#define BLUEALSA_SHARED_RESAMPLER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* number of the filter taps per phase */
+#define RESAMPLER_TAPS 32
+/* number of the filter phases (fractional delay resolution) */
+#define RESAMPLER_PHASES 128
+
+/**
+ * Asynchronous sample rate converter for the interleaved S16 PCM.
+ *
+ * The conversion is done with the windowed-sinc polyphase filter. Filter
+ * coefficients are linearly interpolated between adjacent phases, so the
+ * conversion ratio can be changed by an arbitrary (small) value at any
+ * time, e.g. in order to compensate a clock drift. */
+struct resampler {
+
+	unsigned int channels;
+
+	/* nominal input to output sampling rate ratio */
+	double ratio;
+	/* current input to output ratio including the drift correction */
+	double step;
+	/* position of the next output frame relative to the history start */
+	double pos;
+
+	/* polyphase filter bank with an extra phase for the interpolation */
+	float filter[RESAMPLER_PHASES + 1][RESAMPLER_TAPS];
+
+	/* de-interleaved history of the input frames */
+	float *history[8];
+	size_t history_len;
+	size_t history_size;
+
+};
+
+struct resampler *resampler_init(unsigned int channels,
+		unsigned int rate_in, unsigned int rate_out);
+void resampler_free(struct resampler *r);
+
+void resampler_set_drift(struct resampler *r, double ppm);
+size_t resampler_out_max(const struct resampler *r, size_t frames);
+size_t resampler_process(struct resampler *r, const int16_t *in, size_t frames,
+		int16_t *out);
+
+#endif
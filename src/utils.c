@@ -558,6 +558,29 @@ const char *ba_transport_type_to_string(struct ba_transport_type type) {
 	return "N/A";
 }
 
+#if ENABLE_MPEG
+/**
+ * Get string representation of the LAME encoder error code.
+ *
+ * @param error LAME encoder error code.
+ * @return Human-readable string. */
+const char *lame_encode_strerror(int err) {
+	switch (err) {
+	case -1:
+		return "Too small output buffer";
+	case -2:
+		return "Out of memory";
+	case -3:
+		return "Params not initialized";
+	case -4:
+		return "Psycho acoustic problem";
+	default:
+		debug("Unknown error code: %#x", err);
+		return "Unknown error";
+	}
+}
+#endif
+
 #if ENABLE_AAC
 /**
  * Get string representation of the FDK-AAC decoder error code.
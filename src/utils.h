@@ -48,6 +48,10 @@ void snd_pcm_scale_s16le(int16_t *buffer, size_t size, int channels,
 const char *bluetooth_a2dp_codec_to_string(uint16_t codec);
 const char *ba_transport_type_to_string(struct ba_transport_type type);
 
+#if ENABLE_MPEG
+const char *lame_encode_strerror(int err);
+#endif
+
 #if ENABLE_AAC
 #include <fdk-aac/aacdecoder_lib.h>
 #include <fdk-aac/aacenc_lib.h>
@@ -0,0 +1,244 @@
+/*
+ * fuzz-at.c
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ * This program exercises the AT message parser. It might be built as the
+ * libFuzzer target, e.g. with the following flags:
+ *
+ *   CFLAGS="-fsanitize=fuzzer,address -DFUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION"
+ *
+ * Otherwise, it is a standalone program, which feeds given input files
+ * through the parser (e.g. for reproducing fuzzer findings) or measures the
+ * parser throughput with the synthetic AT storm. For the meaningful results
+ * of the benchmark, build without the debug logging.
+ *
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/at.c"
+#include "../src/shared/log.c"
+
+/**
+ * Buffered AT stream - the same buffering scheme as in the RFCOMM reader. */
+struct at_stream {
+	struct bt_at at;
+	char buffer[256];
+	size_t len;
+	/* statistics */
+	unsigned long messages;
+	unsigned long invalid;
+};
+
+/**
+ * Append data to the stream and parse all complete messages. */
+static void at_stream_feed(struct at_stream *s, const char *data, size_t len) {
+
+	enum hfp_ind map[20];
+
+	while (len > 0) {
+
+		/* discard message which does not fit into the buffer */
+		if (s->len == sizeof(s->buffer) - 1)
+			s->len = 0;
+
+		size_t n = sizeof(s->buffer) - 1 - s->len;
+		if (n > len)
+			n = len;
+
+		memcpy(&s->buffer[s->len], data, n);
+		s->buffer[s->len + n] = '\0';
+		data += n;
+		len -= n;
+
+		char *msg = s->buffer;
+		char *tmp;
+
+		for (;;) {
+
+			if ((tmp = at_parse(msg, &s->at)) != NULL) {
+				if (s->at.type == AT_TYPE_RESP && strcmp(s->at.command, "+CIND") == 0)
+					at_parse_cind(s->at.value, map);
+				s->messages++;
+				msg = tmp;
+				continue;
+			}
+
+			if (errno == EAGAIN)
+				break;
+
+			/* skip invalid message */
+			msg += strspn(msg, "\r\n");
+			msg = strchr(msg, '\r') + 1;
+			s->invalid++;
+
+		}
+
+		s->len = strlen(msg);
+		memmove(s->buffer, msg, s->len + 1);
+
+	}
+
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+
+	struct at_stream s = { 0 };
+	enum hfp_ind map[20];
+	char *str;
+	size_t i;
+
+	if (size == 0)
+		return 0;
+
+	/* The first byte determines the size of chunks in which the rest of
+	 * the input is fed, so message splitting is covered as well. */
+	const size_t chunk = data[0] % 64 + 1;
+	for (i = 1; i < size; i += chunk)
+		at_stream_feed(&s, (const char *)&data[i], size - i < chunk ? size - i : chunk);
+
+	/* check the +CIND parser with the raw input as well */
+	if ((str = strndup((const char *)&data[1], size - 1)) != NULL) {
+		at_parse_cind(str, map);
+		free(str);
+	}
+
+	return 0;
+}
+
+#if !FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+
+/* Messages typically sent by the car kit and the phone during the call. */
+static const char *storm[] = {
+	"AT+CIND?\r",
+	"\r\n+CIND: 0,1,0,0,3,0,5\r\n",
+	"\r\nOK\r\n",
+	"AT+CLCC\r",
+	"\r\n+CIEV: 5,4\r\n",
+	"AT+VGS=12\r",
+	"AT+VGM=8\r",
+	"AT+XAPL=05AC-1234-0100,10\r",
+	"AT+IPHONEACCEV=2,1,5,2,0\r",
+	"\r\n+CIND: (\"call\",(0,1)),(\"callsetup\",(0-3)),(\"signal\",(0-5))\r\n",
+	"at+bia=0,1,1,1,0,0,0\r",
+	"\r\nRING\r\n",
+};
+
+static int benchmark(unsigned int count, size_t chunk) {
+
+	size_t len = 0;
+	size_t i;
+
+	for (i = 0; i < ARRAYSIZE(storm); i++)
+		len += strlen(storm[i]);
+
+	char *data;
+	if ((data = malloc(len * count)) == NULL)
+		return -1;
+
+	char *ptr = data;
+	for (; count > 0; count--)
+		for (i = 0; i < ARRAYSIZE(storm); i++)
+			ptr = stpcpy(ptr, storm[i]);
+	len = ptr - data;
+
+	struct at_stream s = { 0 };
+	struct timespec ts0, ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	for (i = 0; i < len; i += chunk)
+		at_stream_feed(&s, &data[i], len - i < chunk ? len - i : chunk);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	double elapsed = (ts.tv_sec - ts0.tv_sec) + (ts.tv_nsec - ts0.tv_nsec) / 1e9;
+	printf("Parsed %lu messages (%lu invalid) in %.3f s: %.0f msg/s, %.2f MiB/s\n",
+			s.messages, s.invalid, elapsed, s.messages / elapsed,
+			len / elapsed / (1024 * 1024));
+
+	free(data);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+	int opt;
+	const char *opts = "hb:c:";
+	struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "benchmark", required_argument, NULL, 'b' },
+		{ "chunk", required_argument, NULL, 'c' },
+		{ 0, 0, 0, 0 },
+	};
+
+	unsigned int count = 0;
+	size_t chunk = 64;
+
+	while ((opt = getopt_long(argc, argv, opts, longopts, NULL)) != -1)
+		switch (opt) {
+		case 'h':
+			printf("Usage:\n"
+					"  %s [OPTION]... [FILE]...\n"
+					"\nOptions:\n"
+					"  -h, --help\t\tprint this help and exit\n"
+					"  -b, --benchmark=NUM\tparse NUM repetitions of the AT storm\n"
+					"  -c, --chunk=BYTES\tsize of the simulated RFCOMM read\n",
+					argv[0]);
+			return EXIT_SUCCESS;
+		case 'b':
+			count = atoi(optarg);
+			break;
+		case 'c':
+			if ((chunk = atoi(optarg)) == 0) {
+				error("Invalid chunk size: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+
+	log_open(argv[0], false, false);
+
+	for (; optind < argc; optind++) {
+
+		FILE *f;
+		uint8_t data[64 * 1024];
+		size_t len;
+
+		if ((f = fopen(argv[optind], "rb")) == NULL) {
+			error("Couldn't open input file: %s", strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		len = fread(data, 1, sizeof(data), f);
+		fclose(f);
+
+		printf("Running: %s (%zu bytes)\n", argv[optind], len);
+		LLVMFuzzerTestOneInput(data, len);
+
+	}
+
+	if (count > 0 && benchmark(count, chunk) == -1) {
+		error("Couldn't run benchmark: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+#endif
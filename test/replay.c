@@ -0,0 +1,467 @@
+/*
+ * replay.c
+ * Copyright (c) 2016-2019 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ * This program feeds A2DP RTP stream captured into the pcap file (e.g. with
+ * the BA_COMMAND_TRANSPORT_CAPTURE) through the sink IO thread. Since there
+ * is no Bluetooth involved, the decoding path can be reproduced and checked
+ * deterministically. At the end, a summary with the decoding time, RTP loss
+ * and the checksum of the decoded PCM is printed.
+ *
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <assert.h>
+#include <byteswap.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "../src/at.c"
+#include "../src/ba-device.c"
+#include "../src/ba-transport.c"
+#include "../src/bluealsa.c"
+#include "../src/capture.c"
+#include "../src/ctl.c"
+#include "../src/io.c"
+#include "../src/pcm-output.c"
+#include "../src/rfcomm.c"
+#include "../src/utils.c"
+#include "../src/shared/ffb.c"
+#include "../src/shared/log.c"
+#include "../src/shared/pcm-ring.c"
+#include "../src/shared/rt.c"
+
+/* link types recognized by this program */
+#define LINKTYPE_BLUETOOTH_HCI_H4 187
+#define LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR 201
+
+/* time without decoded data after which the replay is finished */
+#define REPLAY_IDLE_TIMEOUT 500
+
+int bluez_a2dp_reconfigure(const char *transport_path, uint16_t codec_id,
+		unsigned int channels, unsigned int sampling) {
+	(void)transport_path; (void)codec_id; (void)channels; (void)sampling;
+	errno = ENOTSUP; return -1; }
+
+static a2dp_sbc_t cconfig_sbc = {
+	.frequency = SBC_SAMPLING_FREQ_44100,
+	.channel_mode = SBC_CHANNEL_MODE_JOINT_STEREO,
+	.block_length = SBC_BLOCK_LENGTH_16,
+	.subbands = SBC_SUBBANDS_8,
+	.allocation_method = SBC_ALLOCATION_LOUDNESS,
+	.min_bitpool = SBC_MIN_BITPOOL,
+	.max_bitpool = SBC_MAX_BITPOOL,
+};
+
+#if ENABLE_MPEG
+static a2dp_mpeg_t cconfig_mpeg = {
+	.layer = MPEG_LAYER_MP3,
+	.channel_mode = MPEG_CHANNEL_MODE_JOINT_STEREO,
+	.frequency = MPEG_SAMPLING_FREQ_44100,
+	MPEG_INIT_BITRATE(MPEG_BIT_RATE_VBR | MPEG_BIT_RATE_320000)
+};
+#endif
+
+#if ENABLE_AAC
+static a2dp_aac_t cconfig_aac = {
+	.object_type = AAC_OBJECT_TYPE_MPEG4_AAC_LC,
+	AAC_INIT_FREQUENCY(AAC_SAMPLING_FREQ_44100)
+	.channels = AAC_CHANNELS_2,
+	.vbr = 1,
+	AAC_INIT_BITRATE(0xFFFF)
+};
+#endif
+
+#if ENABLE_APTX && HAVE_APTX_DECODE
+static a2dp_aptx_t cconfig_aptx = {
+	.info.vendor_id = APTX_VENDOR_ID,
+	.info.codec_id = APTX_CODEC_ID,
+	.frequency = APTX_SAMPLING_FREQ_44100,
+	.channel_mode = APTX_CHANNEL_MODE_STEREO,
+};
+#endif
+
+#if ENABLE_LDAC && HAVE_LDAC_DECODE
+static a2dp_ldac_t cconfig_ldac = {
+	.info.vendor_id = LDAC_VENDOR_ID,
+	.info.codec_id = LDAC_CODEC_ID,
+	.frequency = LDAC_SAMPLING_FREQ_44100,
+	.channel_mode = LDAC_CHANNEL_MODE_STEREO,
+};
+#endif
+
+struct pcap_file {
+	FILE *f;
+	bool swapped;
+	uint32_t linktype;
+};
+
+struct replay_packet {
+	uint8_t data[2048];
+	size_t len;
+	/* packet time-stamp in microseconds */
+	uint64_t ts;
+};
+
+static uint32_t pcap_u32(const struct pcap_file *p, uint32_t v) {
+	return p->swapped ? bswap_32(v) : v;
+}
+
+static int pcap_open(struct pcap_file *p, const char *path) {
+
+	struct pcap_header header;
+
+	if ((p->f = fopen(path, "rb")) == NULL)
+		return -1;
+	if (fread(&header, sizeof(header), 1, p->f) != 1)
+		goto fail;
+
+	switch (header.magic) {
+	case 0xA1B2C3D4:
+		p->swapped = false;
+		break;
+	case 0xD4C3B2A1:
+		p->swapped = true;
+		break;
+	default:
+		fprintf(stderr, "Not a pcap file: %s\n", path);
+		goto fail;
+	}
+
+	p->linktype = pcap_u32(p, header.linktype);
+	if (p->linktype != LINKTYPE_BLUETOOTH_HCI_H4 &&
+			p->linktype != LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR) {
+		fprintf(stderr, "Unsupported pcap link type: %u\n", p->linktype);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	fclose(p->f);
+	return -1;
+}
+
+/**
+ * Read the next L2CAP packet sent over the given channel.
+ *
+ * Only complete (not fragmented) ACL packets are taken into account.
+ *
+ * @return On success this function returns 1. If there are no more packets
+ *   0 is returned. On error, -1 is returned. */
+static int pcap_read_l2cap(struct pcap_file *p, uint16_t cid,
+		struct replay_packet *packet) {
+
+	struct {
+		uint32_t ts_sec;
+		uint32_t ts_usec;
+		uint32_t incl_len;
+		uint32_t orig_len;
+	} rec;
+	uint8_t buffer[sizeof(packet->data) + 16];
+
+	while (fread(&rec, sizeof(rec), 1, p->f) == 1) {
+
+		const size_t len = pcap_u32(p, rec.incl_len);
+		const uint8_t *data = buffer;
+		size_t data_len = len;
+
+		if (len > sizeof(buffer)) {
+			fprintf(stderr, "Packet too long: %zu\n", len);
+			return -1;
+		}
+		if (fread(buffer, 1, len, p->f) != len)
+			return 0;
+
+		if (p->linktype == LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR) {
+			if (data_len < 4)
+				continue;
+			data += 4;
+			data_len -= 4;
+		}
+
+		/* H4 type + ACL header + L2CAP header */
+		if (data_len < 1 + 4 + 4 || data[0] != 0x02)
+			continue;
+		/* skip ACL continuation fragments */
+		if ((data[2] & 0x30) == 0x10)
+			continue;
+		if ((data[7] | data[8] << 8) != cid)
+			continue;
+
+		packet->len = data_len - 9;
+		memcpy(packet->data, data + 9, packet->len);
+		packet->ts = (uint64_t)pcap_u32(p, rec.ts_sec) * 1000000 + pcap_u32(p, rec.ts_usec);
+		return 1;
+	}
+
+	return 0;
+}
+
+static uint64_t replay_now(void) {
+	struct timespec ts;
+	gettimestamp(&ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Update the 64-bit FNV-1a hash with given data. */
+static uint64_t fnv1a64(uint64_t hash, const uint8_t *data, size_t len) {
+	while (len--)
+		hash = (hash ^ *data++) * 0x100000001B3;
+	return hash;
+}
+
+int main(int argc, char *argv[]) {
+
+	int opt;
+	const char *opts = "hc:s:mC:S:x:";
+	struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "codec", required_argument, NULL, 'c' },
+		{ "sampling", required_argument, NULL, 's' },
+		{ "mono", no_argument, NULL, 'm' },
+		{ "cid", required_argument, NULL, 'C' },
+		{ "speed", required_argument, NULL, 'S' },
+		{ "checksum", required_argument, NULL, 'x' },
+		{ 0, 0, 0, 0 },
+	};
+
+	const char *codec = "sbc";
+	unsigned int sampling = 44100;
+	bool mono = false;
+	uint16_t cid = 0x0040;
+	double speed = 0;
+	const char *checksum = NULL;
+
+	while ((opt = getopt_long(argc, argv, opts, longopts, NULL)) != -1)
+		switch (opt) {
+		case 'h':
+			printf("usage: %s [OPTION]... FILE\n"
+					"  -h, --help\t\tprint this help and exit\n"
+					"  -c, --codec=NAME\tcodec of the stream (sbc, mp3, aac, aptx, ldac)\n"
+					"  -s, --sampling=HZ\tsampling frequency of the stream\n"
+					"  -m, --mono\t\tstream is a single channel one\n"
+					"  -C, --cid=CID\t\tL2CAP channel of the stream\n"
+					"  -S, --speed=X\t\treplay speed, 0 - as fast as possible\n"
+					"  -x, --checksum=HEX\texpected checksum of the decoded PCM\n",
+					argv[0]);
+			return EXIT_SUCCESS;
+		case 'c':
+			codec = optarg;
+			break;
+		case 's':
+			sampling = atoi(optarg);
+			break;
+		case 'm':
+			mono = true;
+			break;
+		case 'C':
+			cid = strtol(optarg, NULL, 0);
+			break;
+		case 'S':
+			speed = atof(optarg);
+			break;
+		case 'x':
+			checksum = optarg;
+			break;
+		default:
+			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+
+	if (optind + 1 != argc) {
+		fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct ba_transport t = {
+		.type.profile = BA_TRANSPORT_PROFILE_A2DP_SINK,
+		.state = TRANSPORT_ACTIVE,
+		.mtu_read = sizeof(((struct replay_packet *)0)->data),
+		/* full volume, so the decoded PCM is not scaled */
+		.a2dp.ch1_volume = 127,
+		.a2dp.ch2_volume = 127,
+	};
+	void *(*routine)(void *) = NULL;
+
+	if (strcasecmp(codec, "sbc") == 0) {
+		t.type.codec = A2DP_CODEC_SBC;
+		t.a2dp.cconfig = (uint8_t *)&cconfig_sbc;
+		t.a2dp.cconfig_size = sizeof(cconfig_sbc);
+		cconfig_sbc.frequency = sampling == 48000 ? SBC_SAMPLING_FREQ_48000 :
+			sampling == 32000 ? SBC_SAMPLING_FREQ_32000 :
+			sampling == 16000 ? SBC_SAMPLING_FREQ_16000 : SBC_SAMPLING_FREQ_44100;
+		if (mono)
+			cconfig_sbc.channel_mode = SBC_CHANNEL_MODE_MONO;
+		routine = io_thread_a2dp_sink_sbc;
+	}
+#if ENABLE_MPEG
+	else if (strcasecmp(codec, "mp3") == 0) {
+		t.type.codec = A2DP_CODEC_MPEG12;
+		t.a2dp.cconfig = (uint8_t *)&cconfig_mpeg;
+		t.a2dp.cconfig_size = sizeof(cconfig_mpeg);
+		cconfig_mpeg.frequency = sampling == 48000 ? MPEG_SAMPLING_FREQ_48000 :
+			sampling == 32000 ? MPEG_SAMPLING_FREQ_32000 : MPEG_SAMPLING_FREQ_44100;
+		if (mono)
+			cconfig_mpeg.channel_mode = MPEG_CHANNEL_MODE_MONO;
+		routine = io_thread_a2dp_sink_mpeg;
+	}
+#endif
+#if ENABLE_AAC
+	else if (strcasecmp(codec, "aac") == 0) {
+		t.type.codec = A2DP_CODEC_MPEG24;
+		t.a2dp.cconfig = (uint8_t *)&cconfig_aac;
+		t.a2dp.cconfig_size = sizeof(cconfig_aac);
+		if (sampling == 48000)
+			AAC_SET_FREQUENCY(cconfig_aac, AAC_SAMPLING_FREQ_48000);
+		if (mono)
+			cconfig_aac.channels = AAC_CHANNELS_1;
+		routine = io_thread_a2dp_sink_aac;
+	}
+#endif
+#if ENABLE_APTX && HAVE_APTX_DECODE
+	else if (strcasecmp(codec, "aptx") == 0) {
+		t.type.codec = A2DP_CODEC_VENDOR_APTX;
+		t.a2dp.cconfig = (uint8_t *)&cconfig_aptx;
+		t.a2dp.cconfig_size = sizeof(cconfig_aptx);
+		cconfig_aptx.frequency = sampling == 48000 ? APTX_SAMPLING_FREQ_48000 :
+			sampling == 32000 ? APTX_SAMPLING_FREQ_32000 :
+			sampling == 16000 ? APTX_SAMPLING_FREQ_16000 : APTX_SAMPLING_FREQ_44100;
+		routine = io_thread_a2dp_sink_aptx;
+	}
+#endif
+#if ENABLE_LDAC && HAVE_LDAC_DECODE
+	else if (strcasecmp(codec, "ldac") == 0) {
+		t.type.codec = A2DP_CODEC_VENDOR_LDAC;
+		t.a2dp.cconfig = (uint8_t *)&cconfig_ldac;
+		t.a2dp.cconfig_size = sizeof(cconfig_ldac);
+		cconfig_ldac.frequency = sampling == 96000 ? LDAC_SAMPLING_FREQ_96000 :
+			sampling == 88200 ? LDAC_SAMPLING_FREQ_88200 :
+			sampling == 48000 ? LDAC_SAMPLING_FREQ_48000 : LDAC_SAMPLING_FREQ_44100;
+		if (mono)
+			cconfig_ldac.channel_mode = LDAC_CHANNEL_MODE_MONO;
+		routine = io_thread_a2dp_sink_ldac;
+	}
+#endif
+	else {
+		fprintf(stderr, "Unsupported codec: %s\n", codec);
+		return EXIT_FAILURE;
+	}
+
+	struct pcap_file pcap;
+	if (pcap_open(&pcap, argv[optind]) == -1) {
+		fprintf(stderr, "Couldn't open capture: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	assert(bluealsa_config_init() == 0);
+
+	int bt_fds[2];
+	int pcm_fds[2];
+
+	assert(pipe(t.sig_fd) == 0);
+	assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, bt_fds) == 0);
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pcm_fds) == 0);
+
+	t.bt_fd = bt_fds[1];
+	t.a2dp.pcm.fd = pcm_fds[0];
+	pthread_mutex_init(&t.mutex, NULL);
+	pthread_cond_init(&t.pcm_freed, NULL);
+
+	pthread_t thread;
+	assert(pthread_create(&thread, NULL, routine, &t) == 0);
+
+	struct replay_packet packet;
+	uint64_t ts_first = 0, ts_start = replay_now();
+	size_t packets = 0, bytes = 0, samples = 0;
+	uint64_t hash = 0xCBF29CE484222325;
+	int pending = pcap_read_l2cap(&pcap, cid, &packet);
+
+	struct pollfd pfds[] = {
+		{ -1, POLLOUT, 0 },
+		{ pcm_fds[1], POLLIN, 0 },
+	};
+
+	for (;;) {
+
+		int timeout = REPLAY_IDLE_TIMEOUT;
+
+		pfds[0].fd = -1;
+		if (pending == 1) {
+			if (packets == 0)
+				ts_first = packet.ts;
+			/* time left to the moment of the packet delivery */
+			int64_t delay = speed > 0 ? (int64_t)((packet.ts - ts_first) / speed) -
+				(int64_t)(replay_now() - ts_start) : 0;
+			if (delay <= 0)
+				pfds[0].fd = bt_fds[0];
+			else
+				timeout = delay / 1000 + 1;
+		}
+
+		int ret;
+		if ((ret = poll(pfds, ARRAYSIZE(pfds), timeout)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* no more data to decode */
+		if (ret == 0 && pending != 1 && timeout == REPLAY_IDLE_TIMEOUT)
+			break;
+
+		if (pfds[0].revents & POLLOUT) {
+			if (write(bt_fds[0], packet.data, packet.len) == -1)
+				break;
+			packets++;
+			bytes += packet.len;
+			pending = pcap_read_l2cap(&pcap, cid, &packet);
+		}
+
+		if (pfds[1].revents & POLLIN) {
+			uint8_t buffer[4096];
+			ssize_t len;
+			if ((len = read(pcm_fds[1], buffer, sizeof(buffer))) <= 0)
+				break;
+			hash = fnv1a64(hash, buffer, len);
+			samples += len / sizeof(int16_t);
+		}
+
+	}
+
+	const uint64_t elapsed = replay_now() - ts_start;
+
+	pthread_cancel(thread);
+	pthread_join(thread, NULL);
+	fclose(pcap.f);
+
+	const unsigned int channels = transport_get_channels(&t);
+	const double duration = (double)samples / channels / transport_get_sampling(&t);
+
+	printf("Packets: %zu (%zu bytes)\n", packets, bytes);
+	printf("RTP lost: %u\n", t.stats.rtp_lost);
+	printf("Decoded: %zu frames (%.3f s)\n", samples / channels, duration);
+	printf("Decoding time: %.3f ms (%.2f%% of real-time)\n", t.stats.codec_time / 1000.0,
+			duration > 0 ? t.stats.codec_time / 10000.0 / duration : 0);
+	printf("Decoding cost: %.2f us per packet\n",
+			packets > 0 ? (double)t.stats.codec_time / packets : 0);
+	printf("Replay time: %.3f ms\n", elapsed / 1000.0);
+	printf("Checksum: %016" PRIx64 "\n", hash);
+
+	if (checksum != NULL && strtoull(checksum, NULL, 16) != hash) {
+		fprintf(stderr, "Checksum mismatch: %s != %016" PRIx64 "\n", checksum, hash);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -29,15 +29,18 @@
 #include "../src/ba-adapter.c"
 #include "../src/ba-device.c"
 #include "../src/ba-transport.c"
+#include "../src/capture.c"
 #include "../src/ctl.c"
 #include "../src/io.h"
 #define io_thread_a2dp_sink_sbc _io_thread_a2dp_sink_sbc
 #include "../src/io.c"
 #undef io_thread_a2dp_sink_sbc
+#include "../src/pcm-output.c"
 #include "../src/rfcomm.c"
 #include "../src/utils.c"
 #include "../src/shared/ffb.c"
 #include "../src/shared/log.c"
+#include "../src/shared/pcm-ring.c"
 #include "../src/shared/rt.c"
 
 static const a2dp_sbc_t cconfig = {
@@ -129,6 +132,15 @@ struct ba_transport *test_transport_new_sco(struct ba_device *d,
 	return t;
 }
 
+int bluez_a2dp_reconfigure(const char *transport_path, uint16_t codec_id,
+		unsigned int channels, unsigned int sampling) {
+	debug("Reconfiguring %s: %s (%u ch, %u Hz)", transport_path,
+			bluetooth_a2dp_codec_to_string(codec_id), channels, sampling);
+	/* mocked remote devices support SBC only */
+	errno = ENOTSUP;
+	return -1;
+}
+
 void *io_thread_a2dp_sink_sbc(void *arg) {
 	struct ba_transport *t = (struct ba_transport *)arg;
 	pthread_cleanup_push(PTHREAD_CLEANUP(transport_pthread_cleanup), t);
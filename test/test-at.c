@@ -34,17 +34,26 @@ START_TEST(test_at_build) {
 
 START_TEST(test_at_parse_invalid) {
 	struct bt_at at;
+	char cmd1[] = "ABC\r";
+	char cmd2[] = "AT+CLCK?";
+	char cmd3[] = "\r\r";
+	char cmd4[] = "\r\nOK";
 	/* invalid AT command lines */
-	ck_assert_ptr_eq(at_parse("ABC\r", &at), NULL);
-	ck_assert_ptr_eq(at_parse("AT+CLCK?", &at), NULL);
-	ck_assert_ptr_eq(at_parse("\r\r", &at), NULL);
-	ck_assert_ptr_eq(at_parse("\r\nOK", &at), NULL);
+	ck_assert_ptr_eq(at_parse(cmd1, &at), NULL);
+	ck_assert_int_eq(errno, EBADMSG);
+	ck_assert_ptr_eq(at_parse(cmd2, &at), NULL);
+	ck_assert_int_eq(errno, EAGAIN);
+	ck_assert_ptr_eq(at_parse(cmd3, &at), NULL);
+	ck_assert_int_eq(errno, EAGAIN);
+	ck_assert_ptr_eq(at_parse(cmd4, &at), NULL);
+	ck_assert_int_eq(errno, EAGAIN);
 } END_TEST
 
 START_TEST(test_at_parse_cmd) {
 	struct bt_at at;
+	char cmd[] = "AT+CLCC\r";
 	/* parse AT plain command */
-	ck_assert_ptr_ne(at_parse("AT+CLCC\r", &at), NULL);
+	ck_assert_ptr_ne(at_parse(cmd, &at), NULL);
 	ck_assert_int_eq(at.type, AT_TYPE_CMD);
 	ck_assert_str_eq(at.command, "+CLCC");
 	ck_assert_ptr_eq(at.value, NULL);
@@ -52,8 +61,9 @@ START_TEST(test_at_parse_cmd) {
 
 START_TEST(test_at_parse_cmd_get) {
 	struct bt_at at;
+	char cmd[] = "AT+COPS?\r";
 	/* parse AT GET command */
-	ck_assert_ptr_ne(at_parse("AT+COPS?\r", &at), NULL);
+	ck_assert_ptr_ne(at_parse(cmd, &at), NULL);
 	ck_assert_int_eq(at.type, AT_TYPE_CMD_GET);
 	ck_assert_str_eq(at.command, "+COPS");
 	ck_assert_ptr_eq(at.value, NULL);
@@ -61,8 +71,9 @@ START_TEST(test_at_parse_cmd_get) {
 
 START_TEST(test_at_parse_cmd_set) {
 	struct bt_at at;
+	char cmd[] = "AT+CLCK=\"SC\",0,\"1234\"\r";
 	/* parse AT SET command */
-	ck_assert_ptr_ne(at_parse("AT+CLCK=\"SC\",0,\"1234\"\r", &at), NULL);
+	ck_assert_ptr_ne(at_parse(cmd, &at), NULL);
 	ck_assert_int_eq(at.type, AT_TYPE_CMD_SET);
 	ck_assert_str_eq(at.command, "+CLCK");
 	ck_assert_str_eq(at.value, "\"SC\",0,\"1234\"");
@@ -70,8 +81,9 @@ START_TEST(test_at_parse_cmd_set) {
 
 START_TEST(test_at_parse_cmd_test) {
 	struct bt_at at;
+	char cmd[] = "AT+COPS=?\r";
 	/* parse AT TEST command */
-	ck_assert_ptr_ne(at_parse("AT+COPS=?\r", &at), NULL);
+	ck_assert_ptr_ne(at_parse(cmd, &at), NULL);
 	ck_assert_int_eq(at.type, AT_TYPE_CMD_TEST);
 	ck_assert_str_eq(at.command, "+COPS");
 	ck_assert_ptr_eq(at.value, NULL);
@@ -79,8 +91,9 @@ START_TEST(test_at_parse_cmd_test) {
 
 START_TEST(test_at_parse_resp) {
 	struct bt_at at;
+	char cmd[] = "\r\n+CIND:0,0,1,4,0,4,0\r\n";
 	/* parse response result code */
-	ck_assert_ptr_ne(at_parse("\r\n+CIND:0,0,1,4,0,4,0\r\n", &at), NULL);
+	ck_assert_ptr_ne(at_parse(cmd, &at), NULL);
 	ck_assert_int_eq(at.type, AT_TYPE_RESP);
 	ck_assert_str_eq(at.command, "+CIND");
 	ck_assert_str_eq(at.value, "0,0,1,4,0,4,0");
@@ -88,8 +101,9 @@ START_TEST(test_at_parse_resp) {
 
 START_TEST(test_at_parse_resp_empty) {
 	struct bt_at at;
+	char cmd[] = "\r\n+CIND:\r\n";
 	/* parse response result code with empty value */
-	ck_assert_ptr_ne(at_parse("\r\n+CIND:\r\n", &at), NULL);
+	ck_assert_ptr_ne(at_parse(cmd, &at), NULL);
 	ck_assert_int_eq(at.type, AT_TYPE_RESP);
 	ck_assert_str_eq(at.command, "+CIND");
 	ck_assert_str_eq(at.value, "");
@@ -97,8 +111,9 @@ START_TEST(test_at_parse_resp_empty) {
 
 START_TEST(test_at_parse_resp_unsolicited) {
 	struct bt_at at;
+	char cmd[] = "\r\nRING\r\n";
 	/* parse unsolicited result code */
-	ck_assert_ptr_ne(at_parse("\r\nRING\r\n", &at), NULL);
+	ck_assert_ptr_ne(at_parse(cmd, &at), NULL);
 	ck_assert_int_eq(at.type, AT_TYPE_RESP);
 	ck_assert_str_eq(at.command, "");
 	ck_assert_str_eq(at.value, "RING");
@@ -106,8 +121,9 @@ START_TEST(test_at_parse_resp_unsolicited) {
 
 START_TEST(test_at_parse_case_sensitivity) {
 	struct bt_at at;
+	char cmd[] = "aT+tEsT=VaLuE\r";
 	/* case-insensitive command and case-sensitive value */
-	ck_assert_ptr_ne(at_parse("aT+tEsT=VaLuE\r", &at), NULL);
+	ck_assert_ptr_ne(at_parse(cmd, &at), NULL);
 	ck_assert_int_eq(at.type, AT_TYPE_CMD_SET);
 	ck_assert_str_eq(at.command, "+TEST");
 	ck_assert_str_eq(at.value, "VaLuE");
@@ -116,13 +132,31 @@ START_TEST(test_at_parse_case_sensitivity) {
 START_TEST(test_at_parse_multiple_cmds) {
 	struct bt_at at;
 	/* concatenated commands */
-	const char *cmd = "\r\nOK\r\n\r\n+COPS:1\r\n";
+	char cmd[] = "\r\nOK\r\n\r\n+COPS:1\r\n";
 	ck_assert_str_eq(at_parse(cmd, &at), &cmd[6]);
 	ck_assert_int_eq(at.type, AT_TYPE_RESP);
 	ck_assert_str_eq(at.command, "");
 	ck_assert_str_eq(at.value, "OK");
 } END_TEST
 
+START_TEST(test_at_parse_partial) {
+	struct bt_at at;
+	char buffer[64] = "\r\nOK\r";
+	char *next;
+	/* response split between reads */
+	ck_assert_ptr_ne(next = at_parse(buffer, &at), NULL);
+	ck_assert_str_eq(at.command, "");
+	ck_assert_str_eq(at.value, "OK");
+	strcat(next, "\n\r\n+CIE");
+	ck_assert_ptr_eq(at_parse(next, &at), NULL);
+	ck_assert_int_eq(errno, EAGAIN);
+	strcat(next, "V:1,1\r\n");
+	ck_assert_ptr_ne(next = at_parse(next, &at), NULL);
+	ck_assert_str_eq(at.command, "+CIEV");
+	ck_assert_str_eq(at.value, "1,1");
+	ck_assert_str_eq(next, "");
+} END_TEST
+
 START_TEST(test_at_parse_cind) {
 
 	enum hfp_ind indmap[20];
@@ -167,6 +201,7 @@ int main(void) {
 	tcase_add_test(tc, test_at_parse_resp_unsolicited);
 	tcase_add_test(tc, test_at_parse_case_sensitivity);
 	tcase_add_test(tc, test_at_parse_multiple_cmds);
+	tcase_add_test(tc, test_at_parse_partial);
 	tcase_add_test(tc, test_at_parse_cind);
 	tcase_add_test(tc, test_at_type2str);
 
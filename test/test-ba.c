@@ -12,15 +12,22 @@
 # include <config.h>
 #endif
 
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 #include <check.h>
 
 #include "../src/ba-adapter.c"
 #include "../src/ba-device.c"
 #include "../src/ba-transport.c"
 #include "../src/bluealsa.c"
+#include "../src/capture.c"
 #include "../src/utils.c"
 #include "../src/shared/defs.h"
 #include "../src/shared/log.c"
+#include "../src/shared/pcm-ring.c"
 
 struct ba_ctl *bluealsa_ctl_init(struct ba_adapter *a) {
 	(void)a; return (struct ba_ctl *)0xDEAD; }
@@ -89,7 +96,13 @@ START_TEST(test_ba_transport) {
 	ck_assert_str_eq(t->dbus_owner, "/owner");
 	ck_assert_str_eq(t->dbus_path, "/path");
 
+	ck_assert_ptr_eq(ba_transport_index_lookup("/path"), t);
+	ba_transport_index_unlock();
+	ck_assert_ptr_eq(ba_transport_index_lookup("/invalid"), NULL);
+
 	ba_transport_free(t);
+	ck_assert_ptr_eq(ba_transport_index_lookup("/path"), NULL);
+
 	ba_device_free(d);
 	ba_adapter_free(a);
 
@@ -111,6 +124,84 @@ START_TEST(test_cascade_free) {
 
 } END_TEST
 
+START_TEST(test_a2dp_handover) {
+
+	struct ba_adapter *a;
+	struct ba_device *d;
+	struct ba_transport *t;
+	struct ba_transport_type type = {
+		.profile = BA_TRANSPORT_PROFILE_A2DP_SOURCE,
+		.codec = A2DP_CODEC_SBC };
+	const uint8_t cconfig[4] = { 0 };
+	bdaddr_t addr = { 0 };
+	int pipefd[2];
+
+	ck_assert_int_eq(pipe(pipefd), 0);
+	ck_assert_ptr_ne(a = ba_adapter_new(0, NULL), NULL);
+	ck_assert_ptr_ne(d = ba_device_new(a, &addr, "Test"), NULL);
+
+	ck_assert_ptr_ne(t = transport_new_a2dp(d, type, "/owner", "/path/1", cconfig, sizeof(cconfig)), NULL);
+	t->a2dp.pcm.fd = pipefd[0];
+	t->a2dp.pcm.client = 10;
+
+	t->a2dp.handover = true;
+	ba_transport_free(t);
+	ck_assert_ptr_ne(d->a2dp_handover, NULL);
+
+	/* PCM shall be still opened */
+	ck_assert_int_eq(write(pipefd[1], "X", 1), 1);
+
+	type.codec = A2DP_CODEC_VENDOR_LDAC;
+	ck_assert_ptr_ne(t = transport_new_a2dp(d, type, "/owner", "/path/2", cconfig, sizeof(cconfig)), NULL);
+	ck_assert_ptr_eq(d->a2dp_handover, NULL);
+	ck_assert_int_eq(t->a2dp.pcm.fd, pipefd[0]);
+	ck_assert_int_eq(t->a2dp.pcm.client, 10);
+
+	/* without the handover flag the PCM is released */
+	ba_transport_free(t);
+	ck_assert_ptr_eq(d->a2dp_handover, NULL);
+	ck_assert_int_eq(fcntl(pipefd[0], F_GETFD), -1);
+
+	close(pipefd[1]);
+	ba_adapter_free(a);
+
+} END_TEST
+
+START_TEST(test_ba_capture) {
+
+	char path[] = "/tmp/test-ba-capture-XXXXXX";
+	const uint8_t packet[64] = { 0x80, 0x60 };
+	struct ba_capture *c;
+	struct stat st;
+	size_t i;
+
+	close(mkstemp(path));
+	ck_assert_ptr_ne(c = ba_capture_new(BA_CAPTURE_TYPE_ACL), NULL);
+
+	/* packets are not recorded when capture is not started */
+	ba_capture_packet(c, BA_CAPTURE_DIR_TX, packet, sizeof(packet));
+	ck_assert_int_eq(c->head, 0);
+
+	ck_assert_int_eq(ba_capture_start(c, path), 0);
+	ck_assert_int_eq(ba_capture_start(c, path), -1);
+
+	/* overflow the ring - excess packets shall be dropped */
+	for (i = 0; i < BA_CAPTURE_SLOTS * 2; i++)
+		ba_capture_packet(c, BA_CAPTURE_DIR_TX, packet, sizeof(packet));
+	ck_assert_int_gt(c->dropped, 0);
+
+	ba_capture_stop(c);
+	ck_assert_int_eq(c->head, c->tail);
+
+	/* pcap header + records with the H4 ACL and L2CAP headers */
+	ck_assert_int_eq(stat(path, &st), 0);
+	ck_assert_int_eq(st.st_size, 24 + c->head * (16 + 4 + 1 + 8 + sizeof(packet)));
+
+	ba_capture_free(c);
+	unlink(path);
+
+} END_TEST
+
 int main(void) {
 
 	Suite *s = suite_create(__FILE__);
@@ -123,6 +214,8 @@ int main(void) {
 	tcase_add_test(tc, test_ba_device);
 	tcase_add_test(tc, test_ba_transport);
 	tcase_add_test(tc, test_cascade_free);
+	tcase_add_test(tc, test_a2dp_handover);
+	tcase_add_test(tc, test_ba_capture);
 
 	srunner_run_all(sr, CK_ENV);
 	int nf = srunner_ntests_failed(sr);
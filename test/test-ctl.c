@@ -15,6 +15,7 @@
 
 #include "inc/server.inc"
 #include "../src/shared/ctl-client.c"
+#include "../src/shared/defs.h"
 #include "../src/shared/log.c"
 
 static bdaddr_t addr0;
@@ -30,6 +31,38 @@ START_TEST(test_open) {
 	pid_t pid = spawn_bluealsa_server(hci, 1, false, false, false);
 	ck_assert_int_ne(bluealsa_open(hci), -1);
 
+	uint32_t caps = BA_CAPABILITY_SNAPSHOT | (1 << 31);
+	ck_assert_int_ne(bluealsa_open_caps(hci, &caps), -1);
+	ck_assert_int_eq(caps, BA_CAPABILITY_SNAPSHOT);
+
+	waitpid(pid, NULL, 0);
+
+} END_TEST
+
+START_TEST(test_open_legacy) {
+
+	const char *hci = "hci-tc7";
+	pid_t pid = spawn_bluealsa_server(hci, 1, false, false, false);
+
+	struct sockaddr_un saddr = { .sun_family = AF_UNIX };
+	snprintf(saddr.sun_path, sizeof(saddr.sun_path) - 1,
+			BLUEALSA_RUN_STATE_DIR "/%s", hci);
+
+	int fd = -1;
+	ck_assert_int_ne(fd = socket(PF_UNIX, SOCK_SEQPACKET, 0), -1);
+	ck_assert_int_ne(connect(fd, (struct sockaddr *)(&saddr), sizeof(saddr)), -1);
+
+	/* legacy clients send bare version and expect unframed replies */
+	const uint16_t version = BLUEALSA_CRL_PROTO_VERSION_LEGACY;
+	ck_assert_int_eq(send(fd, &version, sizeof(version), 0), sizeof(version));
+
+	const struct ba_request req = { .command = BA_COMMAND_PING };
+	struct ba_msg_status status = { 0xAB };
+	ck_assert_int_eq(send(fd, &req, sizeof(req), 0), sizeof(req));
+	ck_assert_int_eq(read(fd, &status, sizeof(status) + 1), sizeof(status));
+	ck_assert_int_eq(status.code, BA_STATUS_CODE_SUCCESS);
+
+	close(fd);
 	waitpid(pid, NULL, 0);
 
 } END_TEST
@@ -45,8 +78,8 @@ START_TEST(test_subscribe) {
 	ck_assert_int_ne(bluealsa_event_subscribe(fd, BA_EVENT_TRANSPORT_ADDED), -1);
 
 	struct ba_msg_event ev0, ev1;
-	ck_assert_int_eq(read(fd, &ev0, sizeof(ev0)), sizeof(ev0));
-	ck_assert_int_eq(read(fd, &ev1, sizeof(ev1)), sizeof(ev1));
+	ck_assert_int_eq(bluealsa_event_recv(fd, &ev0, 0), 1);
+	ck_assert_int_eq(bluealsa_event_recv(fd, &ev1, 0), 1);
 
 	struct ba_msg_transport t0, t1;
 	ck_assert_int_ne(bluealsa_get_transport(fd, &addr0, BA_PCM_TYPE_A2DP | BA_PCM_STREAM_PLAYBACK, &t0), -1);
@@ -60,6 +93,45 @@ START_TEST(test_subscribe) {
 
 } END_TEST
 
+START_TEST(test_subscribe_payload) {
+
+	const char *hci = "hci-tc8";
+	pid_t pid = spawn_bluealsa_server(hci, 1, false, true, false);
+
+	int fd = -1, fd_ev = -1;
+	ck_assert_int_ne(fd = bluealsa_open(hci), -1);
+	ck_assert_int_ne(fd_ev = bluealsa_open(hci), -1);
+
+	ck_assert_int_ne(bluealsa_event_subscribe(fd_ev, BA_EVENT_VOLUME_CHANGED), -1);
+
+	struct ba_msg_transport t;
+	ck_assert_int_ne(bluealsa_get_transport(fd, &addr0, BA_PCM_TYPE_A2DP | BA_PCM_STREAM_PLAYBACK, &t), -1);
+
+	/* burst of volume changes shall be coalesced */
+	ck_assert_int_ne(bluealsa_set_transport_volume(fd, &t, false, 90, false, 90), -1);
+	ck_assert_int_ne(bluealsa_set_transport_volume(fd, &t, false, 100, false, 100), -1);
+	ck_assert_int_ne(bluealsa_set_transport_volume(fd, &t, true, 110, false, 110), -1);
+
+	struct ba_msg_event ev;
+	size_t events = 0;
+	do {
+		ck_assert_int_eq(bluealsa_event_recv(fd_ev, &ev, 0), 1);
+		ck_assert_int_eq(bluealsa_event_match(&t, &ev), 0);
+		ck_assert_int_eq(ev.payload, BA_EVENT_PAYLOAD_DEVICE | BA_EVENT_PAYLOAD_TRANSPORT);
+		ck_assert_int_le(++events, 3);
+	} while (ev.transport.ch1_volume != 110);
+
+	ck_assert_int_eq(ev.events, BA_EVENT_VOLUME_CHANGED);
+	ck_assert_int_eq(ev.transport.ch1_muted, 1);
+	ck_assert_int_eq(ev.transport.ch2_volume, 110);
+	ck_assert_int_eq(bacmp(&ev.device.addr, &addr0), 0);
+
+	close(fd_ev);
+	close(fd);
+	waitpid(pid, NULL, 0);
+
+} END_TEST
+
 START_TEST(test_get_devices) {
 
 	const char *hci = "hci-tc2";
@@ -102,6 +174,122 @@ START_TEST(test_get_devices) {
 
 } END_TEST
 
+START_TEST(test_get_snapshot) {
+
+	const char *hci = "hci-tc5";
+	pid_t pid = spawn_bluealsa_server(hci, 1, false, true, true);
+
+	int fd = -1;
+	ck_assert_int_ne(fd = bluealsa_open(hci), -1);
+
+	struct ba_msg_device *devices;
+	struct ba_msg_transport *transports;
+	size_t devices_count, transports_count;
+	ck_assert_int_eq(bluealsa_get_snapshot(fd, &devices, &devices_count,
+				&transports, &transports_count), 0);
+
+	ck_assert_int_eq(devices_count, 2);
+	ck_assert_int_eq(transports_count, 4);
+
+	size_t i, ii;
+	/* every transport has to have its device */
+	for (i = 0; i < transports_count; i++) {
+		for (ii = 0; ii < devices_count; ii++)
+			if (bacmp(&transports[i].addr, &devices[ii].addr) == 0)
+				break;
+		ck_assert_int_ne(ii, devices_count);
+		ck_assert_int_eq(transports[i].ch1_volume, 127);
+		ck_assert_int_eq(transports[i].ch2_volume, 127);
+	}
+
+	free(devices);
+	free(transports);
+
+	close(fd);
+	waitpid(pid, NULL, 0);
+
+} END_TEST
+
+START_TEST(test_get_stats) {
+
+	const char *hci = "hci-tc9";
+	pid_t pid = spawn_bluealsa_server(hci, 1, false, true, true);
+
+	int fd = -1;
+	uint32_t caps = BA_CAPABILITY_STATS;
+	ck_assert_int_ne(fd = bluealsa_open_caps(hci, &caps), -1);
+	ck_assert_int_eq(caps, BA_CAPABILITY_STATS);
+
+	struct ba_msg_transport_stats *stats;
+	ck_assert_int_eq(bluealsa_get_stats(fd, &stats), 4);
+
+	size_t i;
+	for (i = 0; i < 4; i++) {
+		ck_assert_int_eq(BA_PCM_TYPE(stats[i].transport.type), BA_PCM_TYPE_A2DP);
+		ck_assert_int_eq(stats[i].rtp_lost, 0);
+	}
+
+	free(stats);
+
+	close(fd);
+	waitpid(pid, NULL, 0);
+
+} END_TEST
+
+START_TEST(test_batch) {
+
+	const char *hci = "hci-tc6";
+	pid_t pid = spawn_bluealsa_server(hci, 1, false, true, false);
+
+	int fd = -1;
+	ck_assert_int_ne(fd = bluealsa_open(hci), -1);
+
+	const struct ba_request requests[] = {
+		{ .command = BA_COMMAND_PING },
+		{ .command = BA_COMMAND_TRANSPORT_GET, .addr = addr0,
+			.type = BA_PCM_TYPE_A2DP | BA_PCM_STREAM_PLAYBACK },
+		{ .command = BA_COMMAND_TRANSPORT_GET, .addr = addr1,
+			.type = BA_PCM_TYPE_A2DP | BA_PCM_STREAM_CAPTURE },
+		{ .command = BA_COMMAND_PCM_OPEN, .addr = addr0,
+			.type = BA_PCM_TYPE_A2DP | BA_PCM_STREAM_PLAYBACK },
+		{ .command = BA_COMMAND_LIST_TRANSPORTS },
+	};
+
+	struct ba_batch_reply replies[ARRAYSIZE(requests)];
+	void *buffer = NULL;
+
+	ck_assert_int_eq(bluealsa_batch(fd, requests, 0, replies, &buffer), -1);
+	ck_assert_int_eq(errno, EINVAL);
+
+	ck_assert_int_eq(bluealsa_batch(fd, requests, ARRAYSIZE(requests), replies, &buffer), 0);
+
+	ck_assert_int_eq(replies[0].err, 0);
+	ck_assert_int_eq(replies[0].size, 0);
+
+	struct ba_msg_transport t;
+	ck_assert_int_eq(replies[1].err, 0);
+	ck_assert_int_eq(replies[1].size, sizeof(t));
+	memcpy(&t, replies[1].data, sizeof(t));
+	ck_assert_int_eq(bacmp(&t.addr, &addr0), 0);
+
+	ck_assert_int_eq(replies[2].err, ENXIO);
+	ck_assert_int_eq(replies[2].size, 0);
+
+	ck_assert_int_eq(replies[3].err, EACCES);
+
+	ck_assert_int_eq(replies[4].err, 0);
+	ck_assert_int_eq(replies[4].size, 2 * sizeof(t));
+
+	free(buffer);
+
+	/* connection should be usable after the batch */
+	ck_assert_int_ne(bluealsa_get_transport(fd, &addr0, BA_PCM_TYPE_A2DP | BA_PCM_STREAM_PLAYBACK, &t), -1);
+
+	close(fd);
+	waitpid(pid, NULL, 0);
+
+} END_TEST
+
 START_TEST(test_get_transport) {
 
 	const char *hci = "hci-tc3";
@@ -131,6 +319,37 @@ START_TEST(test_get_transport) {
 
 } END_TEST
 
+START_TEST(test_set_transport_codec) {
+
+	const char *hci = "hci-tca";
+	pid_t pid = spawn_bluealsa_server(hci, 1, false, true, true);
+
+	int fd = -1;
+	uint32_t caps = BA_CAPABILITY_CODEC_SWITCH;
+	ck_assert_int_ne(fd = bluealsa_open_caps(hci, &caps), -1);
+	ck_assert_int_eq(caps, BA_CAPABILITY_CODEC_SWITCH);
+
+	struct ba_msg_transport t;
+
+	/* codec of the A2DP sink is selected by the remote device */
+	ck_assert_int_ne(bluealsa_get_transport(fd, &addr0, BA_PCM_TYPE_A2DP | BA_PCM_STREAM_CAPTURE, &t), -1);
+	ck_assert_int_eq(bluealsa_set_transport_codec(fd, &t, 0x00 /* SBC */), -1);
+	ck_assert_int_eq(errno, EACCES);
+
+	ck_assert_int_ne(bluealsa_get_transport(fd, &addr0, BA_PCM_TYPE_A2DP | BA_PCM_STREAM_PLAYBACK, &t), -1);
+	ck_assert_int_eq(bluealsa_set_transport_codec(fd, &t, t.codec), 0);
+	ck_assert_int_eq(bluealsa_set_transport_codec(fd, &t, 0x02 /* AAC */), -1);
+	ck_assert_int_eq(errno, ENOTSUP);
+
+	/* failed switch shall not affect the current transport */
+	ck_assert_int_ne(bluealsa_get_transport(fd, &addr0, BA_PCM_TYPE_A2DP | BA_PCM_STREAM_PLAYBACK, &t), -1);
+	ck_assert_int_eq(t.codec, 0x00 /* SBC */);
+
+	close(fd);
+	waitpid(pid, NULL, 0);
+
+} END_TEST
+
 START_TEST(test_open_transport) {
 
 	const char *hci = "hci-tc4";
@@ -180,6 +399,50 @@ START_TEST(test_open_transport) {
 
 } END_TEST
 
+START_TEST(test_open_transport_passthrough) {
+
+	const char *hci = "hci-tcb";
+	pid_t pid = spawn_bluealsa_server(hci, 1, false, true, true);
+
+	int fd = -1;
+	uint32_t caps = BA_CAPABILITY_PCM_SHM;
+	ck_assert_int_ne(fd = bluealsa_open_caps(hci, &caps), -1);
+
+	struct ba_msg_transport t;
+	ck_assert_int_ne(bluealsa_get_transport(fd, &addr0, BA_PCM_TYPE_A2DP | BA_PCM_STREAM_PLAYBACK, &t), -1);
+
+	/* passthrough mode has to be negotiated beforehand */
+	ck_assert_int_eq(bluealsa_open_transport_passthrough(fd, &t), -1);
+	ck_assert_int_eq(errno, EACCES);
+	close(fd);
+
+	caps = BA_CAPABILITY_PCM_PASSTHROUGH;
+	ck_assert_int_ne(fd = bluealsa_open_caps(hci, &caps), -1);
+	ck_assert_int_eq(caps, BA_CAPABILITY_PCM_PASSTHROUGH);
+
+	/* encoded frames are accepted by the A2DP source only */
+	ck_assert_int_ne(bluealsa_get_transport(fd, &addr0, BA_PCM_TYPE_A2DP | BA_PCM_STREAM_CAPTURE, &t), -1);
+	ck_assert_int_eq(bluealsa_open_transport_passthrough(fd, &t), -1);
+	ck_assert_int_eq(errno, EACCES);
+
+	ck_assert_int_ne(bluealsa_get_transport(fd, &addr0, BA_PCM_TYPE_A2DP | BA_PCM_STREAM_PLAYBACK, &t), -1);
+
+	int pcm_fd = -1;
+	ck_assert_int_ne(pcm_fd = bluealsa_open_transport_passthrough(fd, &t), -1);
+
+	/* message boundaries have to be preserved */
+	int type = 0;
+	socklen_t len = sizeof(type);
+	ck_assert_int_ne(getsockopt(pcm_fd, SOL_SOCKET, SO_TYPE, &type, &len), -1);
+	ck_assert_int_eq(type, SOCK_SEQPACKET);
+
+	ck_assert_int_ne(close(pcm_fd), -1);
+
+	close(fd);
+	waitpid(pid, NULL, 0);
+
+} END_TEST
+
 int main(int argc, char *argv[]) {
 	(void)argc;
 
@@ -199,10 +462,17 @@ int main(int argc, char *argv[]) {
 	tcase_set_timeout(tc, 10);
 
 	tcase_add_test(tc, test_open);
+	tcase_add_test(tc, test_open_legacy);
 	tcase_add_test(tc, test_subscribe);
+	tcase_add_test(tc, test_subscribe_payload);
 	tcase_add_test(tc, test_get_devices);
+	tcase_add_test(tc, test_get_snapshot);
+	tcase_add_test(tc, test_get_stats);
+	tcase_add_test(tc, test_batch);
 	tcase_add_test(tc, test_get_transport);
+	tcase_add_test(tc, test_set_transport_codec);
 	tcase_add_test(tc, test_open_transport);
+	tcase_add_test(tc, test_open_transport_passthrough);
 
 	srunner_run_all(sr, CK_ENV);
 	int nf = srunner_ntests_failed(sr);
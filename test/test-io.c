@@ -19,14 +19,22 @@
 #include "../src/ba-device.c"
 #include "../src/ba-transport.c"
 #include "../src/bluealsa.c"
+#include "../src/capture.c"
 #include "../src/ctl.c"
 #include "../src/io.c"
+#include "../src/pcm-output.c"
 #include "../src/rfcomm.c"
 #include "../src/utils.c"
 #include "../src/shared/ffb.c"
 #include "../src/shared/log.c"
+#include "../src/shared/pcm-ring.c"
 #include "../src/shared/rt.c"
 
+int bluez_a2dp_reconfigure(const char *transport_path, uint16_t codec_id,
+		unsigned int channels, unsigned int sampling) {
+	(void)transport_path; (void)codec_id; (void)channels; (void)sampling;
+	errno = ENOTSUP; return -1; }
+
 static const a2dp_sbc_t config_sbc_44100_stereo = {
 	.frequency = SBC_SAMPLING_FREQ_44100,
 	.channel_mode = SBC_CHANNEL_MODE_STEREO,
@@ -37,6 +45,13 @@ static const a2dp_sbc_t config_sbc_44100_stereo = {
 	.max_bitpool = SBC_MAX_BITPOOL,
 };
 
+static const a2dp_mpeg_t config_mpeg_44100_stereo = {
+	.layer = MPEG_LAYER_MP3,
+	.channel_mode = MPEG_CHANNEL_MODE_JOINT_STEREO,
+	.frequency = MPEG_SAMPLING_FREQ_44100,
+	MPEG_INIT_BITRATE(MPEG_BIT_RATE_128000)
+};
+
 static const a2dp_aac_t config_aac_44100_stereo = {
 	.object_type = AAC_OBJECT_TYPE_MPEG4_AAC_LC,
 	AAC_INIT_FREQUENCY(AAC_SAMPLING_FREQ_44100)
@@ -177,6 +192,96 @@ START_TEST(test_a2dp_sbc) {
 
 } END_TEST
 
+START_TEST(test_a2dp_sbc_passthrough) {
+
+	struct ba_transport transport = {
+		.type.codec = A2DP_CODEC_SBC,
+		.a2dp = {
+			.cconfig = (uint8_t *)&config_sbc_44100_stereo,
+			.cconfig_size = sizeof(config_sbc_44100_stereo),
+		},
+	};
+
+	sbc_t sbc;
+	ck_assert_int_eq(sbc_init_a2dp(&sbc, 0, &config_sbc_44100_stereo, sizeof(config_sbc_44100_stereo)), 0);
+
+	const size_t sbc_frame_len = sbc_get_frame_length(&sbc);
+	int16_t pcm[sbc_get_codesize(&sbc) / sizeof(int16_t) * 4];
+	uint8_t frames[sbc_frame_len * 4];
+	size_t frames_len = 0;
+	size_t i;
+
+	/* prepare four SBC frames which will be sent in a single message */
+	snd_pcm_sine_s16le(pcm, ARRAYSIZE(pcm), 2, 0, 0.01);
+	for (i = 0; i < 4; i++) {
+		ssize_t encoded;
+		ck_assert_int_gt(sbc_encode(&sbc, &pcm[i * ARRAYSIZE(pcm) / 4], sizeof(pcm) / 4,
+					&frames[frames_len], sizeof(frames) - frames_len, &encoded), 0);
+		frames_len += encoded;
+	}
+
+	int bt_fds[2];
+	int pcm_fds[2];
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, bt_fds), 0);
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pcm_fds), 0);
+
+	transport.type.profile = BA_TRANSPORT_PROFILE_A2DP_SOURCE;
+	transport.state = TRANSPORT_ACTIVE;
+	transport.bt_fd = bt_fds[0];
+	transport.a2dp.pcm.fd = pcm_fds[1];
+	transport.a2dp.pcm.passthrough = true;
+	/* MTU big enough for three SBC frames */
+	transport.mtu_write = RTP_HEADER_LEN + sizeof(rtp_media_header_t) + sbc_frame_len * 3;
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, io_thread_a2dp_source_passthrough, &transport);
+
+	ck_assert_int_eq(write(pcm_fds[0], frames, frames_len), frames_len);
+
+	uint8_t buffer[1024];
+	const rtp_media_header_t *rtp_media_header = (rtp_media_header_t *)&buffer[RTP_HEADER_LEN];
+	const uint8_t *rtp_payload = (uint8_t *)(rtp_media_header + 1);
+
+	/* encoded frames shall be passed to the BT socket untouched */
+	ck_assert_int_eq(read(bt_fds[1], buffer, sizeof(buffer)), transport.mtu_write);
+	ck_assert_int_eq(rtp_media_header->frame_count, 3);
+	ck_assert_int_eq(memcmp(rtp_payload, frames, sbc_frame_len * 3), 0);
+	ck_assert_int_eq(read(bt_fds[1], buffer, sizeof(buffer)),
+			RTP_HEADER_LEN + sizeof(rtp_media_header_t) + sbc_frame_len);
+	ck_assert_int_eq(rtp_media_header->frame_count, 1);
+	ck_assert_int_eq(memcmp(rtp_payload, &frames[sbc_frame_len * 3], sbc_frame_len), 0);
+
+	ck_assert_int_eq(pthread_cancel(thread), 0);
+	ck_assert_int_eq(pthread_timedjoin(thread, NULL, 1e6), 0);
+
+	close(pcm_fds[0]);
+	close(bt_fds[1]);
+	sbc_finish(&sbc);
+
+} END_TEST
+
+#if ENABLE_MPEG
+START_TEST(test_a2dp_mpeg) {
+
+	struct ba_transport transport = {
+		.type.codec = A2DP_CODEC_MPEG12,
+		.a2dp = {
+			.cconfig = (uint8_t *)&config_mpeg_44100_stereo,
+			.cconfig_size = sizeof(config_mpeg_44100_stereo),
+		},
+	};
+
+	/* MTU smaller than the MPEG frame, so the fragmentation is tested */
+	transport.mtu_write = 256;
+	test_a2dp_encoding(&transport, io_thread_a2dp_source_mpeg);
+
+	transport.mtu_read = transport.mtu_write;
+	test_a2dp_decoding(&transport, io_thread_a2dp_sink_mpeg);
+
+} END_TEST
+#endif
+
 #if ENABLE_AAC
 START_TEST(test_a2dp_aac) {
 
@@ -211,6 +316,11 @@ START_TEST(test_a2dp_aptx) {
 	transport.mtu_write = 40;
 	test_a2dp_encoding(&transport, io_thread_a2dp_source_aptx);
 
+#if HAVE_APTX_DECODE
+	transport.mtu_read = transport.mtu_write;
+	test_a2dp_decoding(&transport, io_thread_a2dp_sink_aptx);
+#endif
+
 } END_TEST
 #endif
 
@@ -228,6 +338,11 @@ START_TEST(test_a2dp_ldac) {
 	transport.mtu_write = RTP_HEADER_LEN + sizeof(rtp_media_header_t) + 679;
 	test_a2dp_encoding(&transport, io_thread_a2dp_source_ldac);
 
+#if HAVE_LDAC_DECODE
+	transport.mtu_read = transport.mtu_write;
+	test_a2dp_decoding(&transport, io_thread_a2dp_sink_ldac);
+#endif
+
 } END_TEST
 #endif
 
@@ -240,6 +355,10 @@ int main(void) {
 	suite_add_tcase(s, tc);
 
 	tcase_add_test(tc, test_a2dp_sbc);
+	tcase_add_test(tc, test_a2dp_sbc_passthrough);
+#if ENABLE_MPEG
+	tcase_add_test(tc, test_a2dp_mpeg);
+#endif
 #if ENABLE_AAC
 	config.aac_afterburner = true;
 	tcase_add_test(tc, test_a2dp_aac);
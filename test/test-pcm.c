@@ -15,6 +15,7 @@
 #include <getopt.h>
 #include <libgen.h>
 #include <spawn.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/wait.h>
@@ -31,7 +32,8 @@
 #define buffer_test_frames 1024
 #define dumprv(fn) fprintf(stderr, #fn " = %d\n", (int)fn)
 
-static int snd_pcm_open_bluealsa(snd_pcm_t **pcmp, const char *hci, snd_pcm_stream_t stream, int mode) {
+static int snd_pcm_open_bluealsa(snd_pcm_t **pcmp, const char *hci, bool shm,
+		snd_pcm_stream_t stream, int mode) {
 
 	char buffer[256];
 	snd_config_t *conf = NULL;
@@ -45,7 +47,8 @@ static int snd_pcm_open_bluealsa(snd_pcm_t **pcmp, const char *hci, snd_pcm_stre
 			"  device \"12:34:56:78:9A:BC\"\n"
 			"  profile \"a2dp\"\n"
 			"  delay 0\n"
-			"}\n", hci);
+			"  shm %s\n"
+			"}\n", hci, shm ? "yes" : "no");
 
 	if ((err = snd_config_top(&conf)) < 0)
 		goto fail;
@@ -140,7 +143,7 @@ START_TEST(test_playback_hw_constraints) {
 	snd_pcm_hw_params_t *params;
 	int d;
 
-	ck_assert_int_eq(snd_pcm_open_bluealsa(&pcm, hci, SND_PCM_STREAM_PLAYBACK, 0), 0);
+	ck_assert_int_eq(snd_pcm_open_bluealsa(&pcm, hci, false, SND_PCM_STREAM_PLAYBACK, 0), 0);
 
 	snd_pcm_hw_params_alloca(&params);
 	snd_pcm_hw_params_any(pcm, params);
@@ -216,7 +219,7 @@ START_TEST(test_playback) {
 	snd_pcm_uframes_t period_size;
 	snd_pcm_sframes_t delay;
 
-	ck_assert_int_eq(snd_pcm_open_bluealsa(&pcm, hci, SND_PCM_STREAM_PLAYBACK, 0), 0);
+	ck_assert_int_eq(snd_pcm_open_bluealsa(&pcm, hci, false, SND_PCM_STREAM_PLAYBACK, 0), 0);
 	ck_assert_int_eq(set_hw_params(pcm, pcm_channels, pcm_sampling, &pcm_buffer_time, &pcm_period_time), 0);
 	ck_assert_int_eq(snd_pcm_get_params(pcm, &buffer_size, &period_size), 0);
 	ck_assert_int_eq(set_sw_params(pcm, buffer_size, period_size), 0);
@@ -278,6 +281,73 @@ START_TEST(test_playback) {
 
 } END_TEST
 
+START_TEST(test_playback_shm) {
+
+	const char *hci = "hci-tp4";
+	pid_t pid = spawn_bluealsa_server(hci, 2, false, true, false);
+
+	int pcm_channels = 2;
+	int pcm_sampling = 44100;
+	unsigned int pcm_buffer_time = 500000;
+	unsigned int pcm_period_time = 100000;
+
+	snd_pcm_t *pcm = NULL;
+	snd_pcm_uframes_t buffer_size;
+	snd_pcm_uframes_t period_size;
+	snd_pcm_sframes_t delay;
+
+	ck_assert_int_eq(snd_pcm_open_bluealsa(&pcm, hci, true, SND_PCM_STREAM_PLAYBACK, 0), 0);
+	ck_assert_int_eq(set_hw_params(pcm, pcm_channels, pcm_sampling, &pcm_buffer_time, &pcm_period_time), 0);
+	ck_assert_int_eq(snd_pcm_get_params(pcm, &buffer_size, &period_size), 0);
+	ck_assert_int_eq(set_sw_params(pcm, buffer_size, period_size), 0);
+	ck_assert_int_eq(snd_pcm_prepare(pcm), 0);
+
+	int16_t *period = malloc(period_size * pcm_channels * sizeof(int16_t));
+	int i, x = 0;
+
+	/* fill-in buffer without starting playback */
+	int buffer_period_count = (buffer_size - 10) / period_size + 1;
+	for (i = 0; i < buffer_period_count - 1; i++) {
+		x = snd_pcm_sine_s16le(period, period_size * pcm_channels, pcm_channels, x, 441.0 / pcm_sampling);
+		ck_assert_int_gt(snd_pcm_writei(pcm, period, period_size), 0);
+	}
+
+	usleep(100000);
+
+	/* data written to the shared ring shall not be consumed before start */
+	ck_assert_int_eq(snd_pcm_state(pcm), SND_PCM_STATE_PREPARED);
+	ck_assert_int_eq(snd_pcm_delay(pcm, &delay), 0);
+	ck_assert_int_eq(delay, 18375);
+
+	x = snd_pcm_sine_s16le(period, period_size * pcm_channels, pcm_channels, x, 441.0 / pcm_sampling);
+	ck_assert_int_gt(snd_pcm_writei(pcm, period, period_size), 0);
+	ck_assert_int_eq(snd_pcm_state(pcm), SND_PCM_STATE_RUNNING);
+
+	/* server shall consume data in the real-time */
+	usleep(100000);
+	ck_assert_int_eq(snd_pcm_delay(pcm, &delay), 0);
+	ck_assert_int_gt(delay, 10000);
+	ck_assert_int_lt(delay, 20000);
+
+	/* allow under-run to occur */
+	usleep(500000);
+	ck_assert_int_eq(snd_pcm_state(pcm), SND_PCM_STATE_XRUN);
+
+	/* check successful recovery */
+	ck_assert_int_eq(snd_pcm_prepare(pcm), 0);
+	for (i = 0; i < buffer_period_count * 2; i++) {
+		x = snd_pcm_sine_s16le(period, period_size * pcm_channels, pcm_channels, x, 441.0 / pcm_sampling);
+		ck_assert_int_gt(snd_pcm_writei(pcm, period, period_size), 0);
+	}
+	ck_assert_int_eq(snd_pcm_state(pcm), SND_PCM_STATE_RUNNING);
+
+	ck_assert_int_eq(snd_pcm_close(pcm), 0);
+
+	free(period);
+	waitpid(pid, NULL, 0);
+
+} END_TEST
+
 /**
  * Make reference test for playback termination.
  *
@@ -357,7 +427,7 @@ START_TEST(test_playback_termination) {
 	unsigned int pcm_buffer_time = 500000;
 	unsigned int pcm_period_time = 100000;
 
-	ck_assert_int_eq(snd_pcm_open_bluealsa(&pcm, hci, SND_PCM_STREAM_PLAYBACK, 0), 0);
+	ck_assert_int_eq(snd_pcm_open_bluealsa(&pcm, hci, false, SND_PCM_STREAM_PLAYBACK, 0), 0);
 	ck_assert_int_eq(set_hw_params(pcm, 2, 44100, &pcm_buffer_time, &pcm_period_time), 0);
 	ck_assert_int_eq(snd_pcm_prepare(pcm), 0);
 
@@ -441,6 +511,7 @@ int main(int argc, char *argv[]) {
 
 	tcase_add_test(tc, test_playback_hw_constraints);
 	tcase_add_test(tc, test_playback);
+	tcase_add_test(tc, test_playback_shm);
 	tcase_add_test(tc, test_playback_termination);
 
 	srunner_run_all(sr, CK_ENV);
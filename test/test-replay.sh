@@ -0,0 +1,16 @@
+#!/bin/sh
+# BlueALSA - test-replay.sh
+# Copyright (c) 2016-2019 Arkadiusz Bokowy
+#
+# Replay captured A2DP streams through the sink IO threads and compare the
+# checksum of the decoded PCM with the expected one.
+#
+# The replay-sbc.pcap capture contains 40 RTP packets (L2CAP CID 0x0040)
+# with 5 mono SBC frames each (44.1 kHz, 16 blocks, 8 subbands, loudness,
+# bitpool 2). All scale factors are zero and the only allocated subband
+# carries mid-level samples, so every frame decodes to 128 zero samples.
+
+set -e
+
+./replay --codec=sbc --mono --checksum=4b1a73d6d85dc325 \
+	"${srcdir:-.}/replay-sbc.pcap"
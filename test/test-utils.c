@@ -8,12 +8,18 @@
  *
  */
 
+#include <stdlib.h>
+#include <unistd.h>
+
 #include <check.h>
 
+#include "../src/a2dp-cache.c"
 #include "../src/utils.c"
 #include "../src/shared/defs.h"
 #include "../src/shared/ffb.c"
 #include "../src/shared/log.c"
+#include "../src/shared/pcm-ring.c"
+#include "../src/shared/resampler.c"
 #include "../src/shared/rt.c"
 
 START_TEST(test_g_dbus_bluez_object_path_to_hci_dev_id) {
@@ -248,6 +254,119 @@ START_TEST(test_fifo_buffer) {
 
 } END_TEST
 
+START_TEST(test_pcm_ring_untrusted) {
+
+	struct ba_pcm_ring *ring;
+	uint8_t buffer[256] = { 0 };
+	uint32_t size;
+	uint32_t pos = 0;
+	int fd;
+
+	ck_assert_int_ne(fd = ba_pcm_ring_create(100), -1);
+	ck_assert_ptr_ne(ring = ba_pcm_ring_map(fd, &size), NULL);
+	ck_assert_int_eq(size, 128);
+	close(fd);
+
+	/* the other side might tamper with the header */
+	ring->size = 1024 * 1024;
+	ring->head = 1000;
+
+	ck_assert_int_eq(ba_pcm_ring_plen_out(ring, size, pos), 128);
+	ck_assert_int_eq(ba_pcm_ring_pread(ring, size, &pos, buffer, sizeof(buffer)), 128);
+	ck_assert_int_eq(pos, 128);
+	ck_assert_int_eq(ring->tail, 128);
+
+	ring->tail = 0xDEAD;
+	ck_assert_int_eq(ba_pcm_ring_plen_out(ring, size, pos), 128);
+	ck_assert_int_eq(ba_pcm_ring_pdrop(ring, size, &pos), 128);
+	ck_assert_int_eq(pos, 256);
+
+	/* producer position shall be kept private as well */
+	pos = 0;
+	ring->tail = 5000;
+	ck_assert_int_eq(ba_pcm_ring_plen_in(ring, size, pos), 0);
+	ck_assert_int_eq(ba_pcm_ring_pwrite(ring, size, &pos, buffer, sizeof(buffer)), 0);
+	ring->tail = 0;
+	ck_assert_int_eq(ba_pcm_ring_pwrite(ring, size, &pos, buffer, sizeof(buffer)), 128);
+	ck_assert_int_eq(ring->head, 128);
+
+	ba_pcm_ring_unmap(ring, size);
+
+} END_TEST
+
+START_TEST(test_resampler) {
+
+	int16_t in[441 * 2];
+	int16_t out[512 * 2];
+	struct resampler *r;
+	size_t i, len, frames = 0;
+
+	ck_assert_ptr_eq(resampler_init(0, 44100, 48000), NULL);
+	ck_assert_ptr_ne(r = resampler_init(2, 44100, 48000), NULL);
+
+	for (i = 0; i < ARRAYSIZE(in); i += 2) {
+		in[i] = 1000;
+		in[i + 1] = -1000;
+	}
+
+	/* one second of the DC signal shall be converted with the unity gain */
+	for (i = 0; i < 100; i++) {
+		size_t max = resampler_out_max(r, 441);
+		len = resampler_process(r, in, 441, out);
+		ck_assert_int_le(len, max);
+		ck_assert_int_le(max, ARRAYSIZE(out) / 2);
+		frames += len;
+	}
+
+	ck_assert_int_ge(frames, 48000 - RESAMPLER_TAPS);
+	ck_assert_int_le(frames, 48000 + 1);
+	ck_assert_int_eq(out[(len - 1) * 2], 1000);
+	ck_assert_int_eq(out[(len - 1) * 2 + 1], -1000);
+
+	/* positive drift correction shall produce less frames */
+	resampler_set_drift(r, 1000);
+	for (i = 0, frames = 0; i < 100; i++)
+		frames += resampler_process(r, in, 441, out);
+	ck_assert_int_lt(frames, 48000 - 40);
+
+	resampler_free(r);
+
+} END_TEST
+
+START_TEST(test_a2dp_cache) {
+
+	char dir[] = "/tmp/bluealsa-test-XXXXXX";
+	const uint8_t caps[] = { 0xFF, 0xFF, 0x02, 0x35 };
+	const uint8_t conf[] = { 0x21, 0x15, 0x02, 0x35 };
+	uint8_t buffer[sizeof(caps)];
+
+	ck_assert_ptr_ne(mkdtemp(dir), NULL);
+	char *path = g_build_filename(dir, "state", "a2dp-cache", NULL);
+
+	ck_assert_int_eq(a2dp_cache_init(path), 0);
+	ck_assert_int_eq(a2dp_cache_lookup(0, 0, caps, buffer, sizeof(buffer)), false);
+	a2dp_cache_store(0, 0, caps, conf, sizeof(conf));
+
+	/* cached configuration shall survive the restart */
+	ck_assert_int_eq(a2dp_cache_init(path), 0);
+	ck_assert_int_eq(a2dp_cache_lookup(0, 0, caps, buffer, sizeof(buffer)), true);
+	ck_assert_int_eq(memcmp(buffer, conf, sizeof(conf)), 0);
+
+	/* configurations are bound to the codec and the selection policy */
+	ck_assert_int_eq(a2dp_cache_lookup(2, 0, caps, buffer, sizeof(buffer)), false);
+	ck_assert_int_eq(a2dp_cache_lookup(0, 1, caps, buffer, sizeof(buffer)), false);
+
+	a2dp_cache_free();
+
+	unlink(path);
+	g_free(path);
+	path = g_build_filename(dir, "state", NULL);
+	rmdir(path);
+	rmdir(dir);
+	g_free(path);
+
+} END_TEST
+
 int main(void) {
 
 	Suite *s = suite_create(__FILE__);
@@ -263,6 +382,9 @@ int main(void) {
 	tcase_add_test(tc, test_snd_pcm_scale_s16le);
 	tcase_add_test(tc, test_difftimespec);
 	tcase_add_test(tc, test_fifo_buffer);
+	tcase_add_test(tc, test_pcm_ring_untrusted);
+	tcase_add_test(tc, test_resampler);
+	tcase_add_test(tc, test_a2dp_cache);
 
 	srunner_run_all(sr, CK_ENV);
 	int nf = srunner_ntests_failed(sr);
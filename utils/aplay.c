@@ -12,14 +12,17 @@
 # include <config.h>
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <math.h>
 #include <poll.h>
-#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 
 #include <alsa/asoundlib.h>
@@ -29,20 +32,133 @@
 #include "shared/defs.h"
 #include "shared/ffb.h"
 #include "shared/log.h"
+#include "shared/pcm-ring.h"
+#include "shared/resampler.h"
+#include "shared/rt.h"
+
+/* Low-latency mode period time and the minimal latency (in microseconds). */
+#define LL_PERIOD_TIME 10000
+#define LL_LATENCY_MIN 20000
+/* Interval (in seconds) of the low-latency target shrinking attempts. */
+#define LL_SHRINK_INTERVAL 10
+
+/* Clock drift compensation PI controller gains (in ppm per microsecond of
+ * the buffer fill error) and the maximal correction in ppm. */
+#define DRIFT_KP 0.005
+#define DRIFT_KI 0.0005
+#define DRIFT_MAX 2000
+
+/**
+ * Adaptive latency state used in the low-latency mode. */
+struct pcm_latency {
+	/* target latency (start threshold) in microseconds */
+	unsigned int target;
+	/* estimated FIFO arrival jitter in microseconds */
+	unsigned int jitter;
+	/* time-stamp of the last FIFO read */
+	struct timespec read_ts;
+	/* time-stamp of the last target adjustment */
+	struct timespec adjust_ts;
+};
+
+/**
+ * Clock drift compensation state used with the resampler. */
+struct pcm_drift {
+	/* smoothed buffer fill error in microseconds */
+	double error;
+	/* integral term of the controller in ppm */
+	double integral;
+	/* time-stamp of the last update */
+	struct timespec ts;
+};
+
+/**
+ * Type of the I/O source registered in the main loop. */
+enum io_source_type {
+	IO_SOURCE_EVENT,
+	IO_SOURCE_FIFO,
+	IO_SOURCE_PCM,
+	IO_SOURCE_MIXER,
+	IO_SOURCE_GLIB,
+};
+
+/**
+ * Data associated with every epoll registered file descriptor. */
+struct io_source {
+	enum io_source_type type;
+	/* associated PCM worker, if any */
+	struct pcm_worker *worker;
+	/* index of the PCM poll descriptor */
+	unsigned int index;
+};
+
+/**
+ * Poll descriptors of the ALSA PCM device. */
+struct pcm_poll {
+	struct pollfd *pfds;
+	struct io_source *srcs;
+	unsigned int count;
+	/* descriptors are registered in the main loop */
+	bool enabled;
+};
 
 struct pcm_worker {
 	struct ba_msg_transport transport;
-	pthread_t thread;
 	/* file descriptor of BlueALSA */
 	int ba_fd;
 	/* file descriptor of PCM FIFO */
 	int pcm_fd;
 	/* opened playback PCM device */
 	snd_pcm_t *pcm;
+	/* PCM device uses the mmap access */
+	bool pcm_mmap;
 	/* if true, playback is active */
 	bool active;
 	/* human-readable BT address */
 	char addr[18];
+	/* buffer for PCM data read from the FIFO */
+	ffb_int16_t buffer;
+	/* max number of samples read from the FIFO at once */
+	size_t max_read_len;
+	/* sampling rate of the PCM device (or the mixer) */
+	unsigned int rate;
+	/* converter from the transport sampling rate, if enabled */
+	struct resampler *resampler;
+	ffb_int16_t resampled;
+	struct pcm_drift drift;
+	/* PCM FIFO and PCM device poll descriptors */
+	struct io_source fifo_src;
+	bool fifo_polled;
+	struct pcm_poll pcm_poll;
+	/* inactivity timeout in milliseconds (-1 if disabled) */
+	int timeout;
+	/* time-stamp of the last FIFO read */
+	struct timespec active_ts;
+	/* PCM open has failed, retry after one second */
+	bool pcm_open_failed;
+	struct timespec pcm_open_ts;
+	/* pause requests state used in the single audio mode */
+	size_t pause_counter;
+	size_t pause_bytes;
+	/* adaptive latency state used in the low-latency mode */
+	struct pcm_latency latency;
+	/* worker has been removed and will be released */
+	bool removed;
+	/* next free worker in the pool */
+	struct pcm_worker *next;
+	/* software mixer source ring buffer */
+	struct ba_pcm_ring *ring;
+	/* software mixer per-channel gain (Q15) */
+	int gain[2];
+	/* software mixer source state */
+	struct {
+		/* source has buffered enough data to be mixed */
+		bool primed;
+		/* smoothed ring buffer fill level in frames */
+		size_t fill;
+		/* source can not be mixed (e.g. sampling mismatch) */
+		bool ignored;
+	} mix;
 };
 
 static unsigned int verbose = 0;
@@ -55,13 +171,51 @@ static size_t ba_addrs_count = 0;
 static unsigned int pcm_buffer_time = 500000;
 static unsigned int pcm_period_time = 100000;
 static bool pcm_mixer = true;
+static bool pcm_soft_mixer = false;
+static bool pcm_low_latency = false;
+static unsigned int pcm_rate = 0;
 
 static GDBusConnection *dbus = NULL;
 
-static pthread_rwlock_t workers_lock = PTHREAD_RWLOCK_INITIALIZER;
-static struct pcm_worker *workers = NULL;
+static int main_loop_epoll = -1;
+
+/* Poll descriptors of the default GLib main context, which are registered
+ * in the main loop, so D-Bus replies are dispatched as soon as they are
+ * received. */
+static struct {
+	GPollFD *fds;
+	struct io_source *srcs;
+	int count;
+	int size;
+	/* descriptors currently registered in the main loop */
+	GPollFD *registered;
+	int registered_count;
+	int priority;
+} glib_poll = { 0 };
+
+/* Workers are allocated separately, so pointers stored in the epoll data
+ * remain valid regardless of the workers array reallocation. Released
+ * workers are kept in the pool for later reuse. */
+static struct pcm_worker **workers = NULL;
 static size_t workers_count = 0;
 static size_t workers_size = 0;
+static struct pcm_worker *workers_pool = NULL;
+
+/* software mixer which owns the single playback PCM */
+static struct {
+	snd_pcm_t *pcm;
+	struct pcm_poll poll;
+	snd_pcm_uframes_t period_size;
+	unsigned int rate;
+	unsigned int channels;
+	size_t idle_periods;
+	int32_t *acc;
+	int16_t *out;
+	int16_t *buffer;
+	/* PCM open has failed, retry after one second */
+	bool open_failed;
+	struct timespec open_ts;
+} mixer = { 0 };
 
 static bool main_loop_on = true;
 static void main_loop_stop(int sig) {
@@ -94,9 +248,9 @@ static bool validate_transport(const bdaddr_t *addr, uint8_t type) {
 }
 
 static int pcm_set_hw_params(snd_pcm_t *pcm, int channels, int rate,
-		unsigned int *buffer_time, unsigned int *period_time, char **msg) {
+		unsigned int *buffer_time, unsigned int *period_time, bool *mmap, char **msg) {
 
-	const snd_pcm_access_t access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	snd_pcm_access_t access = SND_PCM_ACCESS_RW_INTERLEAVED;
 	const snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
 	snd_pcm_hw_params_t *params;
 	char buf[256];
@@ -109,7 +263,15 @@ static int pcm_set_hw_params(snd_pcm_t *pcm, int channels, int rate,
 		snprintf(buf, sizeof(buf), "Set all possible ranges: %s", snd_strerror(err));
 		goto fail;
 	}
-	if ((err = snd_pcm_hw_params_set_access(pcm, params, access)) != 0) {
+	/* prefer the mmap access, if requested and supported by the device */
+	if (mmap != NULL && *mmap) {
+		if (snd_pcm_hw_params_set_access(pcm, params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0)
+			access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+		else
+			*mmap = false;
+	}
+	if (access == SND_PCM_ACCESS_RW_INTERLEAVED &&
+			(err = snd_pcm_hw_params_set_access(pcm, params, access)) != 0) {
 		snprintf(buf, sizeof(buf), "Set assess type: %s: %s", snd_strerror(err), snd_pcm_access_name(access));
 		goto fail;
 	}
@@ -138,353 +300,1452 @@ static int pcm_set_hw_params(snd_pcm_t *pcm, int channels, int rate,
 		goto fail;
 	}
 
-	return 0;
+	return 0;
+
+fail:
+	if (msg != NULL)
+		*msg = strdup(buf);
+	return err;
+}
+
+static int pcm_set_sw_params(snd_pcm_t *pcm, snd_pcm_uframes_t buffer_size,
+		snd_pcm_uframes_t period_size, char **msg) {
+
+	snd_pcm_sw_params_t *params;
+	char buf[256];
+	int err;
+
+	snd_pcm_sw_params_alloca(&params);
+
+	if ((err = snd_pcm_sw_params_current(pcm, params)) != 0) {
+		snprintf(buf, sizeof(buf), "Get current params: %s", snd_strerror(err));
+		goto fail;
+	}
+
+	/* start the transfer when the buffer is full (or almost full) */
+	snd_pcm_uframes_t threshold = (buffer_size / period_size) * period_size;
+	if ((err = snd_pcm_sw_params_set_start_threshold(pcm, params, threshold)) != 0) {
+		snprintf(buf, sizeof(buf), "Set start threshold: %s: %lu", snd_strerror(err), threshold);
+		goto fail;
+	}
+
+	/* allow the transfer when at least period_size samples can be processed */
+	if ((err = snd_pcm_sw_params_set_avail_min(pcm, params, period_size)) != 0) {
+		snprintf(buf, sizeof(buf), "Set avail min: %s: %lu", snd_strerror(err), period_size);
+		goto fail;
+	}
+
+	if ((err = snd_pcm_sw_params(pcm, params)) != 0) {
+		snprintf(buf, sizeof(buf), "%s", snd_strerror(err));
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	if (msg != NULL)
+		*msg = strdup(buf);
+	return err;
+}
+
+/**
+ * Open and configure playback PCM device.
+ *
+ * @param pcm Address where the opened PCM handler will be stored.
+ * @param channels The number of channels.
+ * @param rate Sampling rate.
+ * @param buffer_time Requested buffer time, updated with the used one.
+ * @param period_time Requested period time, updated with the used one.
+ * @param mmap If not NULL and set to true, try to use the mmap access. On
+ *   return, it is set to false if the mmap access is not supported.
+ * @param msg Address where the error message will be stored.
+ * @return On success this function returns 0. Otherwise, negative error
+ *   code is returned. */
+static int pcm_open(snd_pcm_t **pcm, int channels, int rate,
+		unsigned int *buffer_time, unsigned int *period_time, bool *mmap, char **msg) {
+
+	snd_pcm_t *_pcm = NULL;
+	char buf[256];
+	char *tmp;
+	int err;
+
+	if ((err = snd_pcm_open(&_pcm, device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK)) != 0) {
+		snprintf(buf, sizeof(buf), "%s", snd_strerror(err));
+		goto fail;
+	}
+
+	if ((err = pcm_set_hw_params(_pcm, channels, rate, buffer_time, period_time, mmap, &tmp)) != 0) {
+		snprintf(buf, sizeof(buf), "Set HW params: %s", tmp);
+		goto fail;
+	}
+
+	snd_pcm_uframes_t buffer_size, period_size;
+	if ((err = snd_pcm_get_params(_pcm, &buffer_size, &period_size)) != 0) {
+		snprintf(buf, sizeof(buf), "Get params: %s", snd_strerror(err));
+		goto fail;
+	}
+
+	if ((err = pcm_set_sw_params(_pcm, buffer_size, period_size, &tmp)) != 0) {
+		snprintf(buf, sizeof(buf), "Set SW params: %s", tmp);
+		goto fail;
+	}
+
+	if ((err = snd_pcm_prepare(_pcm)) != 0) {
+		snprintf(buf, sizeof(buf), "Prepare: %s", snd_strerror(err));
+		goto fail;
+	}
+
+	*pcm = _pcm;
+	return 0;
+
+fail:
+	if (_pcm != NULL)
+		snd_pcm_close(_pcm);
+	if (msg != NULL)
+		*msg = strdup(buf);
+	return err;
+}
+
+/**
+ * Update PCM start threshold without touching other SW parameters. */
+static int pcm_set_start_threshold(snd_pcm_t *pcm, snd_pcm_uframes_t threshold) {
+
+	snd_pcm_sw_params_t *params;
+	int err;
+
+	snd_pcm_sw_params_alloca(&params);
+
+	if ((err = snd_pcm_sw_params_current(pcm, params)) != 0 ||
+			(err = snd_pcm_sw_params_set_start_threshold(pcm, params, threshold)) != 0)
+		return err;
+
+	return snd_pcm_sw_params(pcm, params);
+}
+
+/**
+ * Write interleaved frames to the PCM opened with the given access type. */
+static snd_pcm_sframes_t pcm_writei(snd_pcm_t *pcm, bool mmap,
+		const void *buffer, snd_pcm_uframes_t frames) {
+	if (mmap)
+		return snd_pcm_mmap_writei(pcm, buffer, frames);
+	return snd_pcm_writei(pcm, buffer, frames);
+}
+
+/**
+ * Start the PCM if the start threshold has been reached.
+ *
+ * Frames committed directly into the mmap area do not trigger the automatic
+ * start, so it has to be done by hand, the same way as the snd_pcm_writei()
+ * does it. */
+static int pcm_mmap_start(snd_pcm_t *pcm) {
+
+	snd_pcm_sw_params_t *params;
+	snd_pcm_uframes_t buffer_size, period_size;
+	snd_pcm_uframes_t threshold;
+	snd_pcm_sframes_t avail;
+	int err;
+
+	if (snd_pcm_state(pcm) != SND_PCM_STATE_PREPARED)
+		return 0;
+
+	snd_pcm_sw_params_alloca(&params);
+
+	if ((err = snd_pcm_sw_params_current(pcm, params)) != 0 ||
+			(err = snd_pcm_sw_params_get_start_threshold(params, &threshold)) != 0 ||
+			(err = snd_pcm_get_params(pcm, &buffer_size, &period_size)) != 0)
+		return err;
+
+	if ((avail = snd_pcm_avail_update(pcm)) < 0)
+		return avail;
+	if (buffer_size - avail >= threshold)
+		return snd_pcm_start(pcm);
+
+	return 0;
+}
+
+/**
+ * Recover PCM from the under-run and pre-roll it with silence.
+ *
+ * Instead of waiting for the FIFO to be refilled, the PCM is filled with
+ * silence, so the playback can be resumed as soon as the incoming data
+ * reaches the start threshold. */
+static int pcm_prepare_silence(snd_pcm_t *pcm, bool mmap, unsigned int channels,
+		snd_pcm_uframes_t frames) {
+
+	static const int16_t silence[1024 * 2] = { 0 };
+	snd_pcm_sframes_t ret;
+	int err;
+
+	if ((err = snd_pcm_prepare(pcm)) != 0)
+		return err;
+
+	while (frames > 0) {
+		snd_pcm_uframes_t len = MIN(frames, ARRAYSIZE(silence) / channels);
+		if ((ret = pcm_writei(pcm, mmap, silence, len)) < 0)
+			return ret;
+		frames -= ret;
+	}
+
+	return 0;
+}
+
+static void pcm_latency_init(struct pcm_latency *l) {
+	l->target = MAX(LL_LATENCY_MIN, pcm_period_time * 2);
+	l->jitter = 0;
+	gettimestamp(&l->read_ts);
+	l->adjust_ts = l->read_ts;
+}
+
+/**
+ * Update FIFO arrival jitter estimation.
+ *
+ * The jitter is calculated as a smoothed absolute difference between the
+ * time elapsed since the last read and the duration of the received audio,
+ * the same way as the RTP interarrival jitter (RFC 3550) is calculated. */
+static void pcm_latency_update(struct pcm_latency *l, size_t frames, unsigned int rate) {
+
+	struct timespec now, diff;
+	gettimestamp(&now);
+	difftimespec(&l->read_ts, &now, &diff);
+	l->read_ts = now;
+
+	long elapsed = diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+	long d = labs(elapsed - (long)(frames * 1000000 / rate));
+
+	/* ignore gaps caused by the inactivity or the pause */
+	if (d > (long)pcm_buffer_time)
+		return;
+
+	l->jitter = (long)l->jitter + (d - (long)l->jitter) / 16;
+
+}
+
+/**
+ * Increase the target latency after the under-run. */
+static void pcm_latency_underrun(struct pcm_latency *l) {
+	l->target = MIN(l->target * 3 / 2, pcm_buffer_time);
+	gettimestamp(&l->adjust_ts);
+	debug("Increased target latency: %u us", l->target);
+}
+
+/**
+ * Try to decrease the target latency.
+ *
+ * If there was no under-run for a while, the target latency is decreased
+ * by one period, but not below the value derived from the estimated FIFO
+ * arrival jitter.
+ *
+ * @return This function returns true if the target latency was changed. */
+static bool pcm_latency_shrink(struct pcm_latency *l) {
+
+	struct timespec now;
+	gettimestamp(&now);
+
+	if (now.tv_sec - l->adjust_ts.tv_sec < LL_SHRINK_INTERVAL)
+		return false;
+	l->adjust_ts = now;
+
+	unsigned int min = MAX(LL_LATENCY_MIN, pcm_period_time + l->jitter * 2);
+	if (l->target <= min)
+		return false;
+
+	l->target = MAX(min, l->target - pcm_period_time);
+	debug("Decreased target latency: %u us (jitter: %u us)", l->target, l->jitter);
+	return true;
+}
+
+static struct pcm_worker *get_active_worker(void) {
+
+	size_t i;
+
+	for (i = 0; i < workers_count; i++)
+		if (workers[i]->active)
+			return workers[i];
+
+	return NULL;
+}
+
+static void pause_device_player_finish(GObject *source, GAsyncResult *result, void *userdata) {
+
+	bdaddr_t *dev = userdata;
+	GDBusMessage *rep;
+	GError *err = NULL;
+	size_t i;
+
+	if ((rep = g_dbus_connection_send_message_with_reply_finish(
+					G_DBUS_CONNECTION(source), result, &err)) != NULL &&
+			g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR)
+		g_dbus_message_to_gerror(rep, &err);
+
+	if (err != NULL) {
+		debug("Couldn't pause player: %s", err->message);
+		/* pause command does not work, stop further requests */
+		for (i = 0; i < workers_count; i++)
+			if (bacmp(&workers[i]->transport.addr, dev) == 0)
+				workers[i]->pause_counter = 5;
+		g_error_free(err);
+	}
+	else
+		debug("Requested playback pause");
+
+	if (rep != NULL)
+		g_object_unref(rep);
+	g_free(dev);
+}
+
+/**
+ * Request playback pause on the device player.
+ *
+ * The request is sent asynchronously, so an unresponsive BlueZ will not
+ * stall the main loop. The reply is dispatched by the main loop. */
+static void pause_device_player(const bdaddr_t *dev) {
+
+	GDBusMessage *msg;
+	char obj[64];
+
+	sprintf(obj, "/org/bluez/%s/dev_%2.2X_%2.2X_%2.2X_%2.2X_%2.2X_%2.2X/player0",
+			ba_interface, dev->b[5], dev->b[4], dev->b[3], dev->b[2], dev->b[1], dev->b[0]);
+	msg = g_dbus_message_new_method_call("org.bluez", obj, "org.bluez.MediaPlayer1", "Pause");
+
+	g_dbus_connection_send_message_with_reply(dbus, msg,
+			G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL,
+			pause_device_player_finish, g_memdup(dev, sizeof(*dev)));
+
+	g_object_unref(msg);
+}
+
+/**
+ * Convert BlueALSA transport volume into the Q15 gain.
+ *
+ * This conversion uses the same loudness scale as the BlueALSA server
+ * uses for the software volume of the A2DP source. */
+static int volume_to_gain(bool muted, unsigned int volume) {
+	if (muted)
+		return 0;
+	return lround(pow(10, (-64 + 64.0 * volume / 127) / 20) * (1 << 15));
+}
+
+static void pcm_worker_set_gain(struct pcm_worker *w, const struct ba_msg_transport *t) {
+	w->gain[0] = volume_to_gain(t->ch1_muted, t->ch1_volume);
+	w->gain[1] = volume_to_gain(t->ch2_muted, t->ch2_volume);
+}
+
+/**
+ * Add scaled source PCM frames to the mixer accumulator.
+ *
+ * If the number of source frames differs from the number of mixer frames,
+ * the source is stretched (or squeezed) with the nearest neighbor method.
+ * It is used for a tiny clock drift correction only, so a better (and more
+ * expensive) interpolation does not make any audible difference.
+ *
+ * @param acc The mixer accumulator.
+ * @param channels The number of mixer channels.
+ * @param frames The number of mixer frames.
+ * @param in The source PCM buffer.
+ * @param in_channels The number of source channels.
+ * @param in_frames The number of source frames.
+ * @param gain Per-channel gain in the Q15 format. */
+static void mixer_add_source(int32_t *acc, unsigned int channels, size_t frames,
+		const int16_t *in, unsigned int in_channels, size_t in_frames, const int gain[2]) {
+
+	size_t i;
+
+	/* The most common case - the same number of channels and frames. Keep
+	 * this loop simple, so it can be vectorized by the compiler. */
+	if (channels == in_channels && frames == in_frames) {
+		if (channels == 1)
+			for (i = 0; i < frames; i++)
+				acc[i] += (in[i] * gain[0]) >> 15;
+		else
+			for (i = 0; i < frames; i++) {
+				acc[i * 2 + 0] += (in[i * 2 + 0] * gain[0]) >> 15;
+				acc[i * 2 + 1] += (in[i * 2 + 1] * gain[1]) >> 15;
+			}
+		return;
+	}
+
+	for (i = 0; i < frames; i++) {
+		const int16_t *frame = &in[i * in_frames / frames * in_channels];
+		if (channels == in_channels) {
+			acc[i * channels] += (frame[0] * gain[0]) >> 15;
+			if (channels == 2)
+				acc[i * 2 + 1] += (frame[1] * gain[1]) >> 15;
+		}
+		else if (channels == 2) {
+			/* up-mix mono source */
+			acc[i * 2 + 0] += (frame[0] * gain[0]) >> 15;
+			acc[i * 2 + 1] += (frame[0] * gain[0]) >> 15;
+		}
+		else
+			/* down-mix stereo source */
+			acc[i] += ((frame[0] * gain[0] >> 15) + (frame[1] * gain[1] >> 15)) / 2;
+	}
+
+}
+
+/**
+ * Convert the mixer accumulator into the S16 PCM with saturation.
+ *
+ * This loop is written in a way which allows the compiler to vectorize
+ * it with the saturating pack instructions. */
+static void mixer_saturate_s16(int16_t *out, const int32_t *acc, size_t samples) {
+	size_t i;
+	for (i = 0; i < samples; i++) {
+		int32_t v = acc[i];
+		out[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+	}
+}
+
+/**
+ * Get the number of milliseconds elapsed since the given time-stamp. */
+static long elapsed_ms(const struct timespec *ts) {
+
+	struct timespec now, diff;
+	gettimestamp(&now);
+
+	if (difftimespec(ts, &now, &diff) <= 0)
+		return 0;
+	return diff.tv_sec * 1000 + diff.tv_nsec / 1000000;
+}
+
+/**
+ * Register (or unregister) file descriptor in the main loop.
+ *
+ * @param op The epoll_ctl() operation.
+ * @param fd File descriptor to register.
+ * @param events Requested epoll events.
+ * @param src I/O source associated with the file descriptor.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+static int io_source_ctl(int op, int fd, uint32_t events, struct io_source *src) {
+	struct epoll_event ev = { .events = events, .data.ptr = src };
+	return epoll_ctl(main_loop_epoll, op, fd, &ev);
+}
+
+/**
+ * Prepare the GLib main context for the main loop iteration.
+ *
+ * The GLib main context has to be acquired by the calling thread. Every
+ * call of this function has to be followed by the glib_poll_dispatch().
+ *
+ * @return This function returns the timeout of the GLib main context in
+ *   milliseconds, or -1 if there is no timeout. */
+static int glib_poll_prepare(void) {
+
+	GMainContext *context = g_main_context_default();
+	bool changed = false;
+	int timeout;
+	int i;
+
+	g_main_context_prepare(context, &glib_poll.priority);
+
+	while ((glib_poll.count = g_main_context_query(context, glib_poll.priority,
+					&timeout, glib_poll.fds, glib_poll.size)) > glib_poll.size) {
+
+		const int size = glib_poll.count;
+		GPollFD *fds = realloc(glib_poll.fds, sizeof(*fds) * size);
+		GPollFD *registered = realloc(glib_poll.registered, sizeof(*registered) * size);
+		struct io_source *srcs = realloc(glib_poll.srcs, sizeof(*srcs) * size);
+
+		if (fds != NULL)
+			glib_poll.fds = fds;
+		if (registered != NULL)
+			glib_poll.registered = registered;
+		if (srcs != NULL)
+			glib_poll.srcs = srcs;
+
+		if (fds == NULL || registered == NULL || srcs == NULL) {
+			/* poll as many descriptors as we can */
+			error("Couldn't allocate GLib poll descriptors: %s", strerror(ENOMEM));
+			glib_poll.count = glib_poll.size;
+			break;
+		}
+
+		/* sources have been moved, so they have to be registered again */
+		glib_poll.size = size;
+		changed = true;
+
+	}
+
+	if (glib_poll.count != glib_poll.registered_count)
+		changed = true;
+	for (i = 0; !changed && i < glib_poll.count; i++)
+		if (glib_poll.fds[i].fd != glib_poll.registered[i].fd ||
+				glib_poll.fds[i].events != glib_poll.registered[i].events)
+			changed = true;
+
+	if (changed) {
+
+		/* descriptors which have been closed are removed by the kernel */
+		for (i = 0; i < glib_poll.registered_count; i++)
+			io_source_ctl(EPOLL_CTL_DEL, glib_poll.registered[i].fd, 0, NULL);
+
+		for (i = 0; i < glib_poll.count; i++) {
+			glib_poll.srcs[i].type = IO_SOURCE_GLIB;
+			glib_poll.srcs[i].worker = NULL;
+			glib_poll.srcs[i].index = i;
+			/* poll events have the same values as the epoll ones */
+			if (io_source_ctl(EPOLL_CTL_ADD, glib_poll.fds[i].fd,
+						glib_poll.fds[i].events, &glib_poll.srcs[i]) == -1)
+				warn("Couldn't register GLib poll: %s", strerror(errno));
+			glib_poll.registered[i] = glib_poll.fds[i];
+		}
+
+		glib_poll.registered_count = glib_poll.count;
+
+	}
+
+	for (i = 0; i < glib_poll.count; i++)
+		glib_poll.fds[i].revents = 0;
+
+	return timeout;
+}
+
+/**
+ * Dispatch GLib main context sources which are ready. */
+static void glib_poll_dispatch(void) {
+	GMainContext *context = g_main_context_default();
+	if (g_main_context_check(context, glib_poll.priority, glib_poll.fds, glib_poll.count))
+		g_main_context_dispatch(context);
+}
+
+static void glib_poll_free(void) {
+	free(glib_poll.fds);
+	free(glib_poll.srcs);
+	free(glib_poll.registered);
+	memset(&glib_poll, 0, sizeof(glib_poll));
+}
+
+/**
+ * Initialize poll descriptors of the given PCM device.
+ *
+ * @param p The PCM poll structure.
+ * @param pcm The ALSA PCM device.
+ * @param type I/O source type for the main loop dispatching.
+ * @param w Associated PCM worker, or NULL.
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+static int pcm_poll_init(struct pcm_poll *p, snd_pcm_t *pcm,
+		enum io_source_type type, struct pcm_worker *w) {
+
+	unsigned int i;
+	int count;
+
+	p->enabled = false;
+	if ((count = snd_pcm_poll_descriptors_count(pcm)) <= 0) {
+		errno = count < 0 ? -count : EINVAL;
+		return -1;
+	}
+
+	p->count = count;
+	p->pfds = malloc(sizeof(*p->pfds) * p->count);
+	p->srcs = malloc(sizeof(*p->srcs) * p->count);
+	if (p->pfds == NULL || p->srcs == NULL) {
+		free(p->pfds);
+		free(p->srcs);
+		p->pfds = NULL;
+		p->srcs = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	snd_pcm_poll_descriptors(pcm, p->pfds, p->count);
+	for (i = 0; i < p->count; i++) {
+		p->srcs[i].type = type;
+		p->srcs[i].worker = w;
+		p->srcs[i].index = i;
+	}
+
+	return 0;
+}
+
+/**
+ * Register (or unregister) PCM poll descriptors in the main loop. */
+static void pcm_poll_enable(struct pcm_poll *p, bool enable) {
+
+	unsigned int i;
+
+	if (p->enabled == enable)
+		return;
+
+	for (i = 0; i < p->count; i++) {
+		int op = enable ? EPOLL_CTL_ADD : EPOLL_CTL_DEL;
+		/* poll events have the same values as the epoll ones */
+		if (io_source_ctl(op, p->pfds[i].fd, p->pfds[i].events, &p->srcs[i]) == -1 &&
+				errno != EEXIST && errno != ENOENT)
+			warn("Couldn't update PCM poll: %s", strerror(errno));
+	}
+
+	p->enabled = enable;
+}
+
+static void pcm_poll_free(struct pcm_poll *p) {
+	pcm_poll_enable(p, false);
+	free(p->pfds);
+	free(p->srcs);
+	p->pfds = NULL;
+	p->srcs = NULL;
+	p->count = 0;
+}
+
+/**
+ * Translate epoll events into the PCM poll events.
+ *
+ * @param p The PCM poll structure.
+ * @param pcm The ALSA PCM device.
+ * @param index Index of the poll descriptor which has triggered.
+ * @param events Events returned by the epoll_wait().
+ * @return This function returns PCM poll events. */
+static unsigned short pcm_poll_revents(struct pcm_poll *p, snd_pcm_t *pcm,
+		unsigned int index, uint32_t events) {
+
+	unsigned short revents = 0;
+	unsigned int i;
+
+	if (index >= p->count)
+		return 0;
+
+	for (i = 0; i < p->count; i++)
+		p->pfds[i].revents = 0;
+	p->pfds[index].revents = events;
+
+	if (snd_pcm_poll_descriptors_revents(pcm, p->pfds, p->count, &revents) < 0)
+		return POLLERR;
+	return revents;
+}
+
+/**
+ * Mix one period of PCM frames from all active sources.
+ *
+ * @param acc The mixer accumulator, which has to be zeroed beforehand.
+ * @param rate Mixer sampling rate.
+ * @param channels The number of mixer channels.
+ * @param frames The number of mixer frames (period size).
+ * @param buffer Temporary buffer big enough to hold frames + 1 stereo
+ *   frames.
+ * @return This function returns the number of mixed sources. */
+static size_t mixer_mix_sources(int32_t *acc, unsigned int rate, unsigned int channels,
+		size_t frames, int16_t *buffer) {
+
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i < workers_count; i++) {
+		struct pcm_worker *w = workers[i];
+		const size_t frame_size = w->transport.channels * sizeof(int16_t);
+
+		if (w->ring == NULL)
+			continue;
+
+		if (!w->active) {
+			if (w->mix.primed)
+				ba_pcm_ring_drop(w->ring);
+			w->mix.primed = false;
+			continue;
+		}
+
+		if (w->rate != rate) {
+			if (!w->mix.ignored)
+				warn("Couldn't mix %s: Sampling mismatch: %u != %u",
+						w->addr, w->rate, rate);
+			w->mix.ignored = true;
+			ba_pcm_ring_drop(w->ring);
+			continue;
+		}
+
+		size_t fill = ba_pcm_ring_len_out(w->ring) / frame_size;
+
+		/* Do not start mixing the source until it has buffered two periods.
+		 * This will absorb the jitter of the Bluetooth transfer. */
+		if (!w->mix.primed) {
+			if (fill < frames * 2)
+				continue;
+			w->mix.primed = true;
+			w->mix.fill = fill;
+		}
+
+		/* Correct the clock drift between the source and the mixer by dropping
+		 * or duplicating a single frame per period. The decision is based on
+		 * the smoothed fill level, so the jitter will not trigger it. */
+		w->mix.fill = (w->mix.fill * 15 + fill) / 16;
+		size_t in_frames = frames;
+		if (w->mix.fill > frames * 3)
+			in_frames++;
+		else if (w->mix.fill < frames)
+			in_frames--;
+
+		size_t out_frames = frames;
+		size_t len = ba_pcm_ring_read(w->ring, buffer, in_frames * frame_size) / frame_size;
+
+		/* on the source under-run, wait for the buffer to be refilled */
+		if (len < in_frames) {
+			debug("Mixer source under-run: %s", w->addr);
+			w->mix.primed = false;
+			if (len == 0)
+				continue;
+			in_frames = out_frames = MIN(len, frames);
+		}
+
+		mixer_add_source(acc, channels, out_frames, buffer,
+				w->transport.channels, in_frames, w->gain);
+		count++;
+
+	}
+
+	return count;
+}
+
+static void mixer_close(void) {
+	if (mixer.pcm != NULL) {
+		pcm_poll_free(&mixer.poll);
+		snd_pcm_close(mixer.pcm);
+		mixer.pcm = NULL;
+	}
+	free(mixer.acc);
+	free(mixer.out);
+	free(mixer.buffer);
+	mixer.acc = NULL;
+	mixer.out = mixer.buffer = NULL;
+}
+
+/**
+ * Open the mixer PCM device, if there is an active source.
+ *
+ * The PCM device is opened with the configuration of the first active
+ * source. Other sources with a different sampling rate will be ignored.
+ *
+ * @return On success this function returns 0. Otherwise, -1 is returned
+ *   and errno is set to indicate the error. */
+static int mixer_open(void) {
+
+	unsigned int buffer_time = pcm_buffer_time;
+	unsigned int period_time = pcm_period_time;
+	snd_pcm_uframes_t buffer_size;
+	struct pcm_worker *w;
+	size_t i;
+	char *tmp;
+
+	if ((w = get_active_worker()) == NULL)
+		return 0;
+
+	/* after PCM open failure wait one second before retry */
+	if (mixer.open_failed && elapsed_ms(&mixer.open_ts) < 1000)
+		return 0;
+
+	mixer.rate = w->rate;
+	mixer.channels = w->transport.channels;
+
+	if (pcm_open(&mixer.pcm, mixer.channels, mixer.rate,
+				&buffer_time, &period_time, NULL, &tmp) != 0) {
+		warn("Couldn't open PCM: %s", tmp);
+		mixer.open_failed = true;
+		gettimestamp(&mixer.open_ts);
+		free(tmp);
+		return 0;
+	}
+
+	mixer.open_failed = false;
+	snd_pcm_get_params(mixer.pcm, &buffer_size, &mixer.period_size);
+
+	mixer.acc = malloc(mixer.period_size * mixer.channels * sizeof(*mixer.acc));
+	mixer.out = malloc(mixer.period_size * mixer.channels * sizeof(*mixer.out));
+	mixer.buffer = malloc((mixer.period_size + 1) * 2 * sizeof(*mixer.buffer));
+	if (mixer.acc == NULL || mixer.out == NULL || mixer.buffer == NULL) {
+		error("Couldn't create mixer buffers: %s", strerror(ENOMEM));
+		goto fail;
+	}
+
+	if (pcm_poll_init(&mixer.poll, mixer.pcm, IO_SOURCE_MIXER, NULL) == -1) {
+		error("Couldn't get PCM poll descriptors: %s", strerror(errno));
+		goto fail;
+	}
+
+	pcm_poll_enable(&mixer.poll, true);
+
+	for (i = 0; i < workers_count; i++)
+		workers[i]->mix.ignored = false;
+
+	mixer.idle_periods = 0;
+
+	if (verbose >= 2) {
+		printf("Used mixer configuration:\n"
+				"  PCM buffer time: %u us (%zu bytes)\n"
+				"  PCM period time: %u us (%zu bytes)\n"
+				"  Sampling rate: %u Hz\n"
+				"  Channels: %u\n",
+				buffer_time, snd_pcm_frames_to_bytes(mixer.pcm, buffer_size),
+				period_time, snd_pcm_frames_to_bytes(mixer.pcm, mixer.period_size),
+				mixer.rate, mixer.channels);
+	}
+
+	return 0;
+
+fail:
+	mixer_close();
+	return -1;
+}
+
+/**
+ * Fill all free periods of the mixer PCM device.
+ *
+ * The mixer is paced by the playback device clock - new period is mixed
+ * only if there is a free space for it in the PCM buffer.
+ *
+ * @return On success this function returns 0. Otherwise, -1 is returned. */
+static int mixer_process(void) {
+
+	const size_t samples = mixer.period_size * mixer.channels;
+	snd_pcm_sframes_t frames;
+
+	while (mixer.pcm != NULL) {
+
+		if ((frames = snd_pcm_avail_update(mixer.pcm)) < 0)
+			goto xrun;
+		if ((snd_pcm_uframes_t)frames < mixer.period_size)
+			break;
+
+		memset(mixer.acc, 0, samples * sizeof(*mixer.acc));
+
+		/* Close the PCM device if there was no active source for a while - the
+		 * same way as it is done by the PCM worker without the mixer. */
+		if (mixer_mix_sources(mixer.acc, mixer.rate, mixer.channels,
+					mixer.period_size, mixer.buffer) != 0)
+			mixer.idle_periods = 0;
+		else if (++mixer.idle_periods > mixer.rate / 2 / mixer.period_size) {
+			debug("Mixer marked as inactive");
+			mixer_close();
+			break;
+		}
+
+		mixer_saturate_s16(mixer.out, mixer.acc, samples);
+
+		if ((frames = snd_pcm_writei(mixer.pcm, mixer.out, mixer.period_size)) >= 0)
+			continue;
+
+xrun:
+		switch (-frames) {
+		case EAGAIN:
+			return 0;
+		case EPIPE:
+			debug("An underrun has occurred");
+			if (pcm_low_latency)
+				pcm_prepare_silence(mixer.pcm, false, mixer.channels, mixer.period_size);
+			else
+				snd_pcm_prepare(mixer.pcm);
+			break;
+		default:
+			error("Couldn't write to PCM: %s", snd_strerror(frames));
+			return -1;
+		}
+
+	}
+
+	return 0;
+}
+
+static void pcm_worker_close_pcm(struct pcm_worker *w) {
+	if (w->pcm != NULL) {
+		pcm_poll_free(&w->pcm_poll);
+		snd_pcm_close(w->pcm);
+		w->pcm = NULL;
+	}
+}
+
+/**
+ * Register (or unregister) PCM FIFO in the main loop. */
+static void pcm_worker_poll_fifo(struct pcm_worker *w, bool enable) {
+
+	if (w->pcm_fd == -1 || w->fifo_polled == enable)
+		return;
+
+	if (io_source_ctl(enable ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+				w->pcm_fd, EPOLLIN, &w->fifo_src) == -1)
+		warn("Couldn't update PCM FIFO poll: %s", strerror(errno));
+
+	w->fifo_polled = enable;
+}
+
+/**
+ * Apply new target latency to the worker PCM.
+ *
+ * The PCM is re-opened only if the new target does not fit in the current
+ * buffer or if the buffer is much bigger than required. Otherwise, only
+ * the start threshold is updated and excess frames are rewound.
+ *
+ * @param w The PCM worker.
+ * @param l The adaptive latency state.
+ * @param pending The number of frames which are pending for the write. If
+ *   the PCM is in the under-run state, it is pre-rolled with the silence
+ *   so the target latency will be reached with these frames. */
+static void pcm_worker_set_latency(struct pcm_worker *w, const struct pcm_latency *l,
+		snd_pcm_uframes_t pending) {
+
+	snd_pcm_uframes_t target = (uint64_t)w->rate * l->target / 1000000;
+	snd_pcm_uframes_t buffer_size, period_size;
+	snd_pcm_sframes_t delay;
+
+	snd_pcm_get_params(w->pcm, &buffer_size, &period_size);
+
+	if (target + period_size > buffer_size || target * 4 < buffer_size) {
+		debug("Re-opening PCM: %s", w->addr);
+		pcm_worker_close_pcm(w);
+		return;
+	}
+
+	pcm_set_start_threshold(w->pcm, target);
+
+	if (snd_pcm_state(w->pcm) == SND_PCM_STATE_XRUN) {
+		if (pcm_prepare_silence(w->pcm, w->pcm_mmap, w->transport.channels,
+					target > pending ? target - pending : 0) != 0)
+			snd_pcm_prepare(w->pcm);
+		return;
+	}
+
+	/* drop excess frames from the buffer, if it is supported */
+	if (snd_pcm_delay(w->pcm, &delay) == 0 && delay > (snd_pcm_sframes_t)target)
+		snd_pcm_rewind(w->pcm, MIN((snd_pcm_uframes_t)(delay - target),
+					(snd_pcm_uframes_t)snd_pcm_rewindable(w->pcm)));
+
+}
+
+/**
+ * Get the buffer with frames ready to be played. */
+static ffb_int16_t *pcm_worker_out(struct pcm_worker *w) {
+	return w->resampler != NULL ? &w->resampled : &w->buffer;
+}
+
+/**
+ * Update main loop registration of the worker descriptors.
+ *
+ * The PCM device is polled only if there are pending frames, and the FIFO
+ * is polled only if there is a free space in the buffer. In other words,
+ * the FIFO reading is throttled by the PCM device. */
+static void pcm_worker_update_poll(struct pcm_worker *w) {
+	if (w->pcm != NULL)
+		pcm_poll_enable(&w->pcm_poll, ffb_len_out(pcm_worker_out(w)) >= w->transport.channels);
+	pcm_worker_poll_fifo(w, ffb_len_in(&w->buffer) > 0);
+}
+
+/**
+ * Convert whole frames from the FIFO buffer, if the resampler is enabled.
+ *
+ * @return This function returns the buffer with frames ready to be played. */
+static ffb_int16_t *pcm_worker_resample(struct pcm_worker *w) {
+
+	const unsigned int channels = w->transport.channels;
+	size_t frames = ffb_len_out(&w->buffer) / channels;
+
+	if (w->resampler == NULL)
+		return &w->buffer;
+
+	/* wait for the free space, so no input frames will be lost */
+	if (frames > 0 &&
+			resampler_out_max(w->resampler, frames) <= ffb_len_in(&w->resampled) / channels) {
+		ffb_seek(&w->resampled, channels *
+				resampler_process(w->resampler, w->buffer.data, frames, w->resampled.tail));
+		ffb_shift(&w->buffer, frames * channels);
+	}
+
+	return &w->resampled;
+}
+
+/**
+ * Update the resampler ratio based on the buffer fill level.
+ *
+ * Clock drift between the Bluetooth device and the output device results
+ * in a slowly changing buffer fill level. The PI controller trims the
+ * resampler ratio, so the fill level will be kept around the target.
+ *
+ * @param w The PCM worker.
+ * @param delay The number of frames buffered for the playback.
+ * @param target The target number of buffered frames. */
+static void pcm_worker_update_drift(struct pcm_worker *w,
+		snd_pcm_sframes_t delay, snd_pcm_uframes_t target) {
+
+	struct pcm_drift *d = &w->drift;
+	struct timespec now, diff;
+
+	gettimestamp(&now);
+	difftimespec(&d->ts, &now, &diff);
+	d->ts = now;
+
+	/* ignore gaps caused by the inactivity or the PCM re-open */
+	if (diff.tv_sec > 0)
+		return;
+
+	double dt = diff.tv_nsec / 1e9;
+	double error = (double)(delay - (snd_pcm_sframes_t)target) * 1000000 / w->rate;
+	d->error += (error - d->error) / 16;
+
+	d->integral += DRIFT_KI * d->error * dt;
+	d->integral = MIN(MAX(d->integral, -DRIFT_MAX), DRIFT_MAX);
+
+	double ppm = DRIFT_KP * d->error + d->integral;
+	resampler_set_drift(w->resampler, MIN(MAX(ppm, -DRIFT_MAX), DRIFT_MAX));
+
+}
+
+/**
+ * Handle PCM transfer error.
+ *
+ * @param w The PCM worker.
+ * @param err Negative error code returned by the PCM transfer function.
+ * @return This function returns 0 if the error has been handled, or -1 if
+ *   the error is fatal. */
+static int pcm_worker_recover(struct pcm_worker *w, int err) {
+	switch (-err) {
+	case EAGAIN:
+		return 0;
+	case EPIPE:
+		debug("An underrun has occurred");
+		if (pcm_low_latency) {
+			pcm_latency_underrun(&w->latency);
+			pcm_worker_set_latency(w, &w->latency,
+					ffb_len_out(pcm_worker_out(w)) / w->transport.channels);
+			return 0;
+		}
+		snd_pcm_prepare(w->pcm);
+		return 0;
+	default:
+		error("Couldn't write to PCM: %s", snd_strerror(err));
+		return -1;
+	}
+}
+
+/**
+ * Write buffered frames to the worker PCM.
+ *
+ * @return On success this function returns 0. Otherwise, -1 is returned. */
+static int pcm_worker_write(struct pcm_worker *w) {
+
+	ffb_int16_t *buffer = pcm_worker_resample(w);
+	snd_pcm_sframes_t frames = ffb_len_out(buffer) / w->transport.channels;
+
+	if ((frames = pcm_writei(w->pcm, w->pcm_mmap, buffer->data, frames)) < 0) {
+		if (pcm_worker_recover(w, frames) == -1)
+			return -1;
+		frames = 0;
+	}
+
+	/* move leftovers to the beginning and reposition tail */
+	ffb_shift(buffer, frames * w->transport.channels);
 
-fail:
-	if (msg != NULL)
-		*msg = strdup(buf);
-	return err;
+	/* Keep the overall latency at the start threshold in the low-latency mode.
+	 * Otherwise, keep the PCM buffer almost full, with some headroom for the
+	 * incoming data jitter. */
+	snd_pcm_uframes_t buffer_size, period_size;
+	snd_pcm_sframes_t delay;
+	if (w->resampler != NULL && w->pcm != NULL &&
+			snd_pcm_state(w->pcm) == SND_PCM_STATE_RUNNING &&
+			snd_pcm_delay(w->pcm, &delay) == 0 &&
+			snd_pcm_get_params(w->pcm, &buffer_size, &period_size) == 0)
+		pcm_worker_update_drift(w, delay + ffb_len_out(buffer) / w->transport.channels,
+				pcm_low_latency ? (uint64_t)w->rate * w->latency.target / 1000000 :
+				buffer_size - period_size);
+
+	if (pcm_low_latency && w->pcm != NULL && pcm_latency_shrink(&w->latency))
+		pcm_worker_set_latency(w, &w->latency, 0);
+
+	pcm_worker_update_poll(w);
+	return 0;
 }
 
-static int pcm_set_sw_params(snd_pcm_t *pcm, snd_pcm_uframes_t buffer_size,
-		snd_pcm_uframes_t period_size, char **msg) {
-
-	snd_pcm_sw_params_t *params;
-	char buf[256];
-	int err;
+/**
+ * Open the worker PCM device.
+ *
+ * @return On success this function returns 0. Otherwise, -1 is returned. */
+static int pcm_worker_open_pcm(struct pcm_worker *w) {
 
-	snd_pcm_sw_params_alloca(&params);
+	unsigned int buffer_time = pcm_buffer_time;
+	unsigned int period_time = pcm_period_time;
+	snd_pcm_uframes_t buffer_size;
+	snd_pcm_uframes_t period_size;
+	char *tmp;
 
-	if ((err = snd_pcm_sw_params_current(pcm, params)) != 0) {
-		snprintf(buf, sizeof(buf), "Get current params: %s", snd_strerror(err));
-		goto fail;
+	/* In the low-latency mode the buffer is twice the target latency, so
+	 * the target might be adjusted (in some range) without re-opening. */
+	if (pcm_low_latency) {
+		buffer_time = w->latency.target * 2;
+		period_time = MIN(pcm_period_time, w->latency.target / 2);
 	}
 
-	/* start the transfer when the buffer is full (or almost full) */
-	snd_pcm_uframes_t threshold = (buffer_size / period_size) * period_size;
-	if ((err = snd_pcm_sw_params_set_start_threshold(pcm, params, threshold)) != 0) {
-		snprintf(buf, sizeof(buf), "Set start threshold: %s: %lu", snd_strerror(err), threshold);
+	/* resampled data can not be read into the mmap area directly */
+	w->pcm_mmap = w->resampler == NULL;
+	if (pcm_open(&w->pcm, w->transport.channels, w->rate,
+				&buffer_time, &period_time, &w->pcm_mmap, &tmp) != 0) {
+		warn("Couldn't open PCM: %s", tmp);
+		free(tmp);
 		goto fail;
 	}
 
-	/* allow the transfer when at least period_size samples can be processed */
-	if ((err = snd_pcm_sw_params_set_avail_min(pcm, params, period_size)) != 0) {
-		snprintf(buf, sizeof(buf), "Set avail min: %s: %lu", snd_strerror(err), period_size);
+	if (pcm_poll_init(&w->pcm_poll, w->pcm, IO_SOURCE_PCM, w) == -1) {
+		warn("Couldn't get PCM poll descriptors: %s", strerror(errno));
+		snd_pcm_close(w->pcm);
+		w->pcm = NULL;
 		goto fail;
 	}
 
-	if ((err = snd_pcm_sw_params(pcm, params)) != 0) {
-		snprintf(buf, sizeof(buf), "%s", snd_strerror(err));
-		goto fail;
+	snd_pcm_get_params(w->pcm, &buffer_size, &period_size);
+	w->max_read_len = period_size * w->transport.channels;
+	w->pcm_open_failed = false;
+
+	if (pcm_low_latency)
+		pcm_set_start_threshold(w->pcm,
+				(uint64_t)w->rate * w->latency.target / 1000000);
+
+	if (verbose >= 2) {
+		printf("Used configuration for %s:\n"
+				"  PCM buffer time: %u us (%zu bytes)\n"
+				"  PCM period time: %u us (%zu bytes)\n"
+				"  PCM access: %s\n"
+				"  Sampling rate: %u Hz\n"
+				"  Channels: %u\n",
+				w->addr,
+				buffer_time, snd_pcm_frames_to_bytes(w->pcm, buffer_size),
+				period_time, snd_pcm_frames_to_bytes(w->pcm, period_size),
+				w->pcm_mmap ? "mmap" : "read/write",
+				w->rate, w->transport.channels);
 	}
 
 	return 0;
 
 fail:
-	if (msg != NULL)
-		*msg = strdup(buf);
-	return err;
+	/* After PCM open failure wait one second before retry. In the meantime
+	 * PCM FIFO will be drained, so the buffered data has to be dropped. */
+	w->max_read_len = w->buffer.size;
+	w->pcm_open_failed = true;
+	gettimestamp(&w->pcm_open_ts);
+	ffb_rewind(&w->buffer);
+	return -1;
 }
 
-static int pcm_open(snd_pcm_t **pcm, int channels, int rate,
-		unsigned int *buffer_time, unsigned int *period_time, char **msg) {
+/**
+ * Mark the worker as inactive and release the PCM device. */
+static void pcm_worker_deactivate(struct pcm_worker *w) {
+	debug("Device marked as inactive: %s", w->addr);
+	w->max_read_len = w->transport.sampling * w->transport.channels / 100;
+	w->pause_counter = w->pause_bytes = 0;
+	ffb_rewind(&w->buffer);
+	ffb_rewind(&w->resampled);
+	memset(&w->drift, 0, sizeof(w->drift));
+	pcm_worker_close_pcm(w);
+	w->active = false;
+	w->timeout = -1;
+	pcm_worker_update_poll(w);
+}
 
-	snd_pcm_t *_pcm = NULL;
-	char buf[256];
-	char *tmp;
-	int err;
+/**
+ * Get the number of milliseconds left to the worker inactivity timeout.
+ *
+ * @return This function returns -1 if the timeout is disabled. */
+static int pcm_worker_get_timeout(const struct pcm_worker *w) {
+	if (w->timeout == -1)
+		return -1;
+	return MAX(0, w->timeout - elapsed_ms(&w->active_ts));
+}
 
-	if ((err = snd_pcm_open(&_pcm, device, SND_PCM_STREAM_PLAYBACK, 0)) != 0) {
-		snprintf(buf, sizeof(buf), "%s", snd_strerror(err));
-		goto fail;
-	}
+/**
+ * Read PCM data from the FIFO directly into the PCM mmap area.
+ *
+ * Only whole frames are committed to the PCM device. The trailing partial
+ * frame (if any) is stored in the worker buffer, so the next read will be
+ * done via the buffer and the regular write function.
+ *
+ * @return This function returns 1 if the data has been transferred, 0 if
+ *   the buffered path shall be used instead, or -1 on a fatal error. */
+static int pcm_worker_read_mmap(struct pcm_worker *w) {
+
+	const size_t frame_size = w->transport.channels * sizeof(int16_t);
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset;
+	snd_pcm_uframes_t frames;
+	snd_pcm_sframes_t ret;
+	ssize_t len;
 
-	if ((err = pcm_set_hw_params(_pcm, channels, rate, buffer_time, period_time, &tmp)) != 0) {
-		snprintf(buf, sizeof(buf), "Set HW params: %s", tmp);
-		goto fail;
-	}
+	if ((ret = snd_pcm_avail_update(w->pcm)) < 0)
+		return pcm_worker_recover(w, ret);
+	/* there is no free space in the PCM buffer */
+	if (ret == 0)
+		return 0;
 
-	snd_pcm_uframes_t buffer_size, period_size;
-	if ((err = snd_pcm_get_params(_pcm, &buffer_size, &period_size)) != 0) {
-		snprintf(buf, sizeof(buf), "Get params: %s", snd_strerror(err));
-		goto fail;
-	}
+	frames = MIN((snd_pcm_uframes_t)ret, w->max_read_len / w->transport.channels);
+	if ((ret = snd_pcm_mmap_begin(w->pcm, &areas, &offset, &frames)) < 0)
+		return pcm_worker_recover(w, ret);
 
-	if ((err = pcm_set_sw_params(_pcm, buffer_size, period_size, &tmp)) != 0) {
-		snprintf(buf, sizeof(buf), "Set SW params: %s", tmp);
-		goto fail;
+	/* the data has to be laid out exactly as in the FIFO */
+	if (areas[0].step != frame_size * 8) {
+		snd_pcm_mmap_commit(w->pcm, offset, 0);
+		w->pcm_mmap = false;
+		return 0;
 	}
 
-	if ((err = snd_pcm_prepare(_pcm)) != 0) {
-		snprintf(buf, sizeof(buf), "Prepare: %s", snd_strerror(err));
-		goto fail;
+	uint8_t *head = (uint8_t *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+	if ((len = read(w->pcm_fd, head, frames * frame_size)) == -1) {
+		snd_pcm_mmap_commit(w->pcm, offset, 0);
+		if (errno == EAGAIN || errno == EINTR)
+			return 1;
+		error("PCM FIFO read error: %s", strerror(errno));
+		return -1;
 	}
 
-	*pcm = _pcm;
-	return 0;
+	gettimestamp(&w->active_ts);
+	w->active = true;
+	w->timeout = 500;
 
-fail:
-	if (_pcm != NULL)
-		snd_pcm_close(_pcm);
-	if (msg != NULL)
-		*msg = strdup(buf);
-	return err;
-}
+	if (pcm_low_latency)
+		pcm_latency_update(&w->latency, len / frame_size, w->transport.sampling);
 
-static struct pcm_worker *get_active_worker(void) {
+	frames = len / frame_size;
+	size_t samples = (len - frames * frame_size) / sizeof(int16_t);
+	memcpy(w->buffer.data, head + frames * frame_size, samples * sizeof(int16_t));
+	ffb_seek(&w->buffer, samples);
 
-	struct pcm_worker *w = NULL;
-	size_t i;
+	if ((ret = snd_pcm_mmap_commit(w->pcm, offset, frames)) < 0 ||
+			(ret = pcm_mmap_start(w->pcm)) < 0)
+		if (pcm_worker_recover(w, ret) == -1)
+			return -1;
 
-	pthread_rwlock_rdlock(&workers_lock);
+	if (pcm_low_latency && w->pcm != NULL && pcm_latency_shrink(&w->latency))
+		pcm_worker_set_latency(w, &w->latency, 0);
 
-	for (i = 0; i < workers_count; i++)
-		if (workers[i].active) {
-			w = &workers[i];
-			break;
+	pcm_worker_update_poll(w);
+	return 1;
+}
+
+/**
+ * Read PCM data from the FIFO and dispatch it.
+ *
+ * @return On success this function returns 0. Otherwise, -1 is returned. */
+static int pcm_worker_read(struct pcm_worker *w) {
+
+	ssize_t ret;
+
+	/* If the PCM device is opened, this worker is the one which shall play
+	 * audio. In such case try to bypass the buffer and read into the PCM
+	 * mmap area directly. */
+	if (w->pcm != NULL && w->pcm_mmap && ffb_len_out(&w->buffer) == 0 &&
+			(ret = pcm_worker_read_mmap(w)) != 0)
+		return ret == -1 ? -1 : 0;
+
+	size_t _in = MIN(w->max_read_len, ffb_len_in(&w->buffer));
+	if ((ret = read(w->pcm_fd, w->buffer.tail, _in * sizeof(int16_t))) == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		error("PCM FIFO read error: %s", strerror(errno));
+		return -1;
+	}
+
+	gettimestamp(&w->active_ts);
+
+	/* If PCM mixer is disabled, check whether we should play audio. In order
+	 * not to flood BT connection with AVRCP packets, we are going to send pause
+	 * command every 0.5 second. */
+	if (!pcm_mixer) {
+		size_t pause_threshold = w->transport.sampling * w->transport.channels / 2 * sizeof(int16_t);
+		struct pcm_worker *worker = get_active_worker();
+		if (worker != NULL && worker != w) {
+			if (w->pause_counter < 5 &&
+					(w->pause_bytes += ret) > pause_threshold) {
+				pause_device_player(&w->transport.addr);
+				w->pause_counter++;
+				w->pause_bytes = 0;
+				w->timeout = 100;
+			}
+			return 0;
 		}
+	}
 
-	pthread_rwlock_unlock(&workers_lock);
+	/* With the software mixer, pass data to the mixer. Partial frames are
+	 * kept in the buffer until the rest of the frame is read. */
+	if (pcm_soft_mixer) {
 
-	return w;
-}
+		w->active = true;
+		w->timeout = 500;
 
-static int pause_device_player(const bdaddr_t *dev) {
+		ffb_seek(&w->buffer, ret / sizeof(*w->buffer.data));
+		ffb_int16_t *buffer = pcm_worker_resample(w);
+		size_t samples = ffb_len_out(buffer) / w->transport.channels * w->transport.channels;
+		size_t len = samples * sizeof(*buffer->data);
 
-	GDBusMessage *msg = NULL, *rep = NULL;
-	GError *err = NULL;
-	char obj[64];
-	int ret = 0;
+		if (ba_pcm_ring_write(w->ring, buffer->data, len) != len)
+			debug("Mixer source overrun: %s", w->addr);
 
-	sprintf(obj, "/org/bluez/%s/dev_%2.2X_%2.2X_%2.2X_%2.2X_%2.2X_%2.2X/player0",
-			ba_interface, dev->b[5], dev->b[4], dev->b[3], dev->b[2], dev->b[1], dev->b[0]);
-	msg = g_dbus_message_new_method_call("org.bluez", obj, "org.bluez.MediaPlayer1", "Pause");
+		ffb_shift(buffer, samples);
 
-	if ((rep = g_dbus_connection_send_message_with_reply_sync(dbus, msg,
-					G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, NULL, NULL, &err)) == NULL)
-		goto fail;
-	if (g_dbus_message_get_message_type(rep) == G_DBUS_MESSAGE_TYPE_ERROR) {
-		g_dbus_message_to_gerror(rep, &err);
-		goto fail;
-	}
+		/* keep the ring fill level at the mixer priming level */
+		if (w->resampler != NULL && w->mix.primed)
+			pcm_worker_update_drift(w,
+					ba_pcm_ring_len_out(w->ring) / (w->transport.channels * sizeof(int16_t)),
+					(uint64_t)w->rate * pcm_period_time * 2 / 1000000);
 
-	debug("Requested playback pause");
-	goto final;
+		return 0;
+	}
 
-fail:
-	ret = -1;
+	if (pcm_low_latency)
+		pcm_latency_update(&w->latency, ret / sizeof(int16_t) / w->transport.channels,
+				w->transport.sampling);
 
-final:
-	if (msg != NULL)
-		g_object_unref(msg);
-	if (rep != NULL)
-		g_object_unref(rep);
-	if (err != NULL) {
-		debug("Couldn't pause player: %s", err->message);
-		g_error_free(err);
+	if (w->pcm == NULL) {
+		/* drain PCM FIFO until the next open retry */
+		if (w->pcm_open_failed && elapsed_ms(&w->pcm_open_ts) < 1000)
+			return 0;
+		if (pcm_worker_open_pcm(w) == -1)
+			return 0;
 	}
 
-	return ret;
+	/* mark device as active and set timeout to 500ms */
+	w->active = true;
+	w->timeout = 500;
+
+	ffb_seek(&w->buffer, ret / sizeof(*w->buffer.data));
+	return pcm_worker_write(w);
 }
 
-static void pcm_worker_routine_exit(struct pcm_worker *worker) {
-	if (worker->pcm_fd != -1) {
-		close(worker->pcm_fd);
-		worker->pcm_fd = -1;
-	}
-	if (worker->ba_fd != -1) {
-		close(worker->ba_fd);
-		worker->ba_fd = -1;
+/**
+ * Release all resources of the worker except the memory. */
+static void pcm_worker_close(struct pcm_worker *w) {
+	pcm_worker_close_pcm(w);
+	if (w->pcm_fd != -1) {
+		pcm_worker_poll_fifo(w, false);
+		close(w->pcm_fd);
+		w->pcm_fd = -1;
 	}
-	if (worker->pcm != NULL) {
-		snd_pcm_close(worker->pcm);
-		worker->pcm = NULL;
+	if (w->ba_fd != -1) {
+		close(w->ba_fd);
+		w->ba_fd = -1;
 	}
-	debug("Exiting PCM worker %s", worker->addr);
+	w->active = false;
+	w->timeout = -1;
 }
 
-static void *pcm_worker_routine(void *arg) {
-	struct pcm_worker *w = (struct pcm_worker *)arg;
+/**
+ * Open BlueALSA transport and register its FIFO in the main loop.
+ *
+ * @return On success this function returns 0. Otherwise, -1 is returned. */
+static int pcm_worker_open(struct pcm_worker *w) {
 
 	size_t pcm_1s_samples = w->transport.sampling * w->transport.channels;
-	ffb_int16_t buffer = { 0 };
-
-	/* Cancellation should be possible only in the carefully selected place
-	 * in order to prevent memory leaks and resources not being released. */
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-
-	pthread_cleanup_push(PTHREAD_CLEANUP(pcm_worker_routine_exit), w);
-	pthread_cleanup_push(PTHREAD_CLEANUP(ffb_int16_free), &buffer);
 
 	/* create buffer big enough to hold 100 ms of PCM data */
-	if (ffb_init(&buffer, pcm_1s_samples / 10) == NULL) {
+	if (ffb_init(&w->buffer, pcm_1s_samples / 10) == NULL ||
+			(w->resampler != NULL && ffb_init(&w->resampled,
+					(size_t)w->rate * w->transport.channels / 10 +
+					(RESAMPLER_TAPS + 1) * w->transport.channels) == NULL)) {
 		error("Couldn't create PCM buffer: %s", strerror(ENOMEM));
-		goto fail;
+		return -1;
 	}
 
 	if ((w->ba_fd = bluealsa_open(ba_interface)) == -1) {
 		error("Couldn't open BlueALSA: %s", strerror(errno));
-		goto fail;
+		return -1;
 	}
 
 	w->transport.type = BA_PCM_TYPE(w->transport.type) | BA_PCM_STREAM_CAPTURE;
 	if ((w->pcm_fd = bluealsa_open_transport(w->ba_fd, &w->transport)) == -1) {
 		error("Couldn't open PCM FIFO: %s", strerror(errno));
-		goto fail;
+		return -1;
 	}
 
+	/* Reading from the FIFO won't block unless there is an open connection
+	 * on the writing side. However, the main loop must not block at all, so
+	 * the FIFO is switched to the non-blocking mode. */
+	fcntl(w->pcm_fd, F_SETFL, fcntl(w->pcm_fd, F_GETFL) | O_NONBLOCK);
+
 	/* Initialize the max read length to 10 ms. Later, when the PCM device
 	 * will be opened, this value will be adjusted to one period size. */
-	size_t pcm_max_read_len = pcm_1s_samples / 100;
-	size_t pcm_open_retries = 0;
-
-	/* These variables determine how and when the pause command will be send
-	 * to the device player. In order not to flood BT connection with AVRCP
-	 * packets, we are going to send pause command every 0.5 second. */
-	size_t pause_threshold = pcm_1s_samples / 2 * sizeof(int16_t);
-	size_t pause_counter = 0;
-	size_t pause_bytes = 0;
-
-	struct pollfd pfds[] = {{ w->pcm_fd, POLLIN, 0 }};
-	int timeout = -1;
-
-	debug("Starting PCM loop");
-	while (main_loop_on) {
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	w->max_read_len = pcm_1s_samples / 100;
 
-		ssize_t ret;
-
-		/* Reading from the FIFO won't block unless there is an open connection
-		 * on the writing side. However, the server does not open PCM FIFO until
-		 * a transport is created. With the A2DP, the transport is created when
-		 * some clients (BT device) requests audio transfer. */
-		switch (poll(pfds, ARRAYSIZE(pfds), timeout)) {
-		case -1:
-			if (errno == EINTR)
-				continue;
-			error("PCM FIFO poll error: %s", strerror(errno));
-			goto fail;
-		case 0:
-			debug("Device marked as inactive: %s", w->addr);
-			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-			pcm_max_read_len = pcm_1s_samples / 100;
-			pause_counter = pause_bytes = 0;
-			ffb_rewind(&buffer);
-			if (w->pcm != NULL) {
-				snd_pcm_close(w->pcm);
-				w->pcm = NULL;
-			}
-			w->active = false;
-			timeout = -1;
-			continue;
-		}
-
-		/* FIFO has been terminated on the writing side */
-		if (pfds[0].revents & POLLHUP)
-			break;
+	pcm_worker_poll_fifo(w, true);
+	return 0;
+}
 
-		size_t _in = MIN(pcm_max_read_len, ffb_len_in(&buffer));
-		if ((ret = read(w->pcm_fd, buffer.tail, _in * sizeof(int16_t))) == -1) {
-			if (errno == EINTR)
-				continue;
-			error("PCM FIFO read error: %s", strerror(errno));
-			goto fail;
-		}
+static struct pcm_worker *pcm_worker_new(const struct ba_msg_transport *transport) {
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-
-		/* If PCM mixer is disabled, check whether we should play audio. */
-		if (!pcm_mixer) {
-			struct pcm_worker *worker = get_active_worker();
-			if (worker != NULL && worker != w) {
-				if (pause_counter < 5 && (pause_bytes += ret) > pause_threshold) {
-					if (pause_device_player(&w->transport.addr) == -1)
-						/* pause command does not work, stop further requests */
-						pause_counter = 5;
-					pause_counter++;
-					pause_bytes = 0;
-					timeout = 100;
-				}
-				continue;
-			}
-		}
+	struct pcm_worker *w;
 
-		if (w->pcm == NULL) {
+	if (workers_count == workers_size) {
+		struct pcm_worker **tmp = workers;
+		size_t size = workers_size + 4;  /* coarse-grained realloc */
+		if ((tmp = realloc(tmp, sizeof(*tmp) * size)) == NULL)
+			return NULL;
+		workers = tmp;
+		workers_size = size;
+	}
 
-			unsigned int buffer_time = pcm_buffer_time;
-			unsigned int period_time = pcm_period_time;
-			snd_pcm_uframes_t buffer_size;
-			snd_pcm_uframes_t period_size;
-			char *tmp;
+	if ((w = workers_pool) != NULL)
+		workers_pool = w->next;
+	else if ((w = malloc(sizeof(*w))) == NULL)
+		return NULL;
+
+	memset(w, 0, sizeof(*w));
+	memcpy(&w->transport, transport, sizeof(w->transport));
+	ba2str(&w->transport.addr, w->addr);
+	w->pcm_fd = -1;
+	w->ba_fd = -1;
+	w->fifo_src.type = IO_SOURCE_FIFO;
+	w->fifo_src.worker = w;
+	w->timeout = -1;
+	w->rate = pcm_rate != 0 ? pcm_rate : transport->sampling;
+	pcm_worker_set_gain(w, transport);
+	pcm_latency_init(&w->latency);
+
+	/* With the fixed output rate, the resampler is used even if the transport
+	 * sampling rate matches, because of the clock drift compensation. */
+	if (pcm_rate != 0 && (w->resampler = resampler_init(transport->channels,
+					transport->sampling, pcm_rate)) == NULL)
+		goto fail;
 
-			/* After PCM open failure wait one second before retry. This can not be
-			 * done with a single sleep() call, because we have to drain PCM FIFO. */
-			if (pcm_open_retries++ % 20 != 0) {
-				usleep(50000);
-				continue;
-			}
+	/* ring buffer for the mixer shall be able to hold 500 ms of audio */
+	if (pcm_soft_mixer && (w->ring = ba_pcm_ring_alloc(
+					w->rate * transport->channels * sizeof(int16_t) / 2)) == NULL)
+		goto fail;
 
-			if (pcm_open(&w->pcm, w->transport.channels, w->transport.sampling,
-						&buffer_time, &period_time, &tmp) != 0) {
-				warn("Couldn't open PCM: %s", tmp);
-				pcm_max_read_len = buffer.size;
-				usleep(50000);
-				free(tmp);
-				continue;
-			}
+	workers[workers_count++] = w;
+	return w;
 
-			snd_pcm_get_params(w->pcm, &buffer_size, &period_size);
-			pcm_max_read_len = period_size * w->transport.channels;
-			pcm_open_retries = 0;
-
-			if (verbose >= 2) {
-				printf("Used configuration for %s:\n"
-						"  PCM buffer time: %u us (%zu bytes)\n"
-						"  PCM period time: %u us (%zu bytes)\n"
-						"  Sampling rate: %u Hz\n"
-						"  Channels: %u\n",
-						w->addr,
-						buffer_time, snd_pcm_frames_to_bytes(w->pcm, buffer_size),
-						period_time, snd_pcm_frames_to_bytes(w->pcm, period_size),
-						w->transport.sampling, w->transport.channels);
-			}
+fail:
+	resampler_free(w->resampler);
+	w->next = workers_pool;
+	workers_pool = w;
+	return NULL;
+}
 
-		}
+/**
+ * Mark the worker as removed.
+ *
+ * The worker memory is not released immediately, because there might be
+ * pending epoll events which refer to it. */
+static void pcm_worker_remove(struct pcm_worker *w) {
+	debug("Exiting PCM worker %s", w->addr);
+	pcm_worker_close(w);
+	w->removed = true;
+}
 
-		/* mark device as active and set timeout to 500ms */
-		w->active = true;
-		timeout = 500;
-
-		/* calculate the overall number of frames in the buffer */
-		ffb_seek(&buffer, ret / sizeof(*buffer.data));
-		snd_pcm_sframes_t frames = ffb_len_out(&buffer) / w->transport.channels;
-
-		if ((frames = snd_pcm_writei(w->pcm, buffer.data, frames)) < 0)
-			switch (-frames) {
-			case EPIPE:
-				debug("An underrun has occurred");
-				snd_pcm_prepare(w->pcm);
-				usleep(50000);
-				frames = 0;
-				break;
-			default:
-				error("Couldn't write to PCM: %s", snd_strerror(frames));
-				goto fail;
-			}
+/**
+ * Return all removed workers to the pool. */
+static void pcm_workers_collect(void) {
 
-		/* move leftovers to the beginning and reposition tail */
-		ffb_shift(&buffer, frames * w->transport.channels);
+	size_t i;
 
+	for (i = 0; i < workers_count; i++) {
+		struct pcm_worker *w = workers[i];
+		if (!w->removed)
+			continue;
+		ffb_int16_free(&w->buffer);
+		ffb_int16_free(&w->resampled);
+		resampler_free(w->resampler);
+		if (w->ring != NULL)
+			ba_pcm_ring_free(w->ring);
+		w->next = workers_pool;
+		workers_pool = w;
+		workers[i--] = workers[--workers_count];
 	}
 
-fail:
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
-	return NULL;
 }
 
-static int start_pcm_worker_routine(struct ba_msg_transport *transport) {
+static int start_pcm_worker(struct ba_msg_transport *transport) {
+
+	struct pcm_worker *w;
 
 	/* check whether SCO has selected codec */
 	if (BA_PCM_TYPE(transport->type) == BA_PCM_TYPE_SCO &&
@@ -493,35 +1754,17 @@ static int start_pcm_worker_routine(struct ba_msg_transport *transport) {
 		return 0;
 	}
 
-	pthread_rwlock_wrlock(&workers_lock);
-
-	workers_count++;
-	if (workers_size < workers_count) {
-		workers_size += 4;  /* coarse-grained realloc */
-		if ((workers = realloc(workers, sizeof(*workers) * workers_size)) == NULL) {
-			error("Couldn't (re)allocate memory for PCM workers: %s", strerror(ENOMEM));
-			pthread_rwlock_unlock(&workers_lock);
-			return -1;
-		}
+	if ((w = pcm_worker_new(transport)) == NULL) {
+		error("Couldn't create PCM worker: %s", strerror(errno));
+		return -1;
 	}
 
-	struct pcm_worker *worker = &workers[workers_count - 1];
-	memcpy(&worker->transport, transport, sizeof(worker->transport));
-	ba2str(&worker->transport.addr, worker->addr);
-	worker->active = false;
-	worker->pcm_fd = -1;
-	worker->ba_fd = -1;
-	worker->pcm = NULL;
-
-	pthread_rwlock_unlock(&workers_lock);
+	debug("Creating PCM worker %s", w->addr);
 
-	debug("Creating PCM worker %s", worker->addr);
-
-	if ((errno = pthread_create(&worker->thread, NULL, pcm_worker_routine, worker)) != 0) {
-		error("Couldn't create PCM worker %s: %s", worker->addr, strerror(errno));
-		workers_count--;
-		return -1;
-	}
+	/* On failure, keep the worker closed until the transport is removed,
+	 * so the failure will not be reported again and again. */
+	if (pcm_worker_open(w) == -1)
+		pcm_worker_close(w);
 
 	return 0;
 }
@@ -537,16 +1780,82 @@ static int start_available_transports(int ba_fd) {
 
 	for (i = 0; i < len; i++)
 		if (validate_transport(&transports[i].addr, transports[i].type))
-			start_pcm_worker_routine(&transports[i]);
+			start_pcm_worker(&transports[i]);
 
 	free(transports);
 	return 0;
 }
 
+/**
+ * Process BlueALSA event notification.
+ *
+ * @param ba_fd BlueALSA control socket.
+ * @param ba_event_fd BlueALSA socket subscribed for events.
+ * @return On success this function returns 0. Otherwise, -1 is returned. */
+static int process_event(int ba_fd, int ba_event_fd) {
+
+	struct ba_msg_event ev;
+	int ret;
+	size_t i;
+
+	while ((ret = bluealsa_event_recv(ba_event_fd, &ev, MSG_DONTWAIT)) == -1 &&
+			errno == EINTR)
+		continue;
+	if (ret == -1 && errno == EAGAIN)
+		return 0;
+	if (ret != 1) {
+		error("Couldn't read event: %s", strerror(ret == -1 ? errno : ECONNRESET));
+		return -1;
+	}
+
+	if (!validate_transport(&ev.addr, ev.type))
+		return 0;
+
+	/* Volume is applied by the software mixer only. If the event does not
+	 * carry the transport state, it has to be fetched from the server. */
+	if (ev.events & BA_EVENT_VOLUME_CHANGED) {
+		ev.events &= ~BA_EVENT_VOLUME_CHANGED;
+		if (!(ev.payload & BA_EVENT_PAYLOAD_TRANSPORT) &&
+				bluealsa_get_transport(ba_fd, &ev.addr, ev.type, &ev.transport) == -1)
+			warn("Couldn't get transport: %s", strerror(errno));
+		else
+			for (i = 0; i < workers_count; i++)
+				if (!workers[i]->removed &&
+						bluealsa_event_match(&workers[i]->transport, &ev) == 0)
+					pcm_worker_set_gain(workers[i], &ev.transport);
+	}
+
+	/* for simplicity's sake, treat change event as "remove & add" */
+	if (ev.events & BA_EVENT_TRANSPORT_CHANGED)
+		ev.events = BA_EVENT_TRANSPORT_ADDED | BA_EVENT_TRANSPORT_REMOVED;
+
+	if (ev.events & BA_EVENT_TRANSPORT_REMOVED)
+		for (i = 0; i < workers_count; i++) {
+			struct pcm_worker *w = workers[i];
+			if (!w->removed && bluealsa_event_match(&w->transport, &ev) == 0) {
+				pcm_worker_remove(w);
+				break;
+			}
+		}
+
+	if (ev.events & BA_EVENT_TRANSPORT_ADDED) {
+		struct ba_msg_transport transport;
+		if (bluealsa_get_transport(ba_fd, &ev.addr, ev.type, &transport) == -1) {
+			error("Couldn't get transport: %s", strerror(errno));
+			return -1;
+		}
+		if (start_pcm_worker(&transport) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
 int main(int argc, char *argv[]) {
 
 	int opt;
 	const char *opts = "hVvi:d:";
+	bool pcm_period_time_set = false;
 	const struct option longopts[] = {
 		{ "help", no_argument, NULL, 'h' },
 		{ "version", no_argument, NULL, 'V' },
@@ -558,6 +1867,9 @@ int main(int argc, char *argv[]) {
 		{ "profile-a2dp", no_argument, NULL, 1 },
 		{ "profile-sco", no_argument, NULL, 2 },
 		{ "single-audio", no_argument, NULL, 5 },
+		{ "soft-mixer", no_argument, NULL, 6 },
+		{ "low-latency", no_argument, NULL, 7 },
+		{ "pcm-rate", required_argument, NULL, 8 },
 		{ 0, 0, 0, 0 },
 	};
 
@@ -575,9 +1887,12 @@ usage:
 					"  -d, --pcm=NAME\tPCM device to use\n"
 					"  --pcm-buffer-time=INT\tPCM buffer time\n"
 					"  --pcm-period-time=INT\tPCM period time\n"
+					"  --pcm-rate=INT\t\tresample to fixed PCM sampling rate\n"
 					"  --profile-a2dp\tuse A2DP profile\n"
 					"  --profile-sco\t\tuse SCO profile\n"
 					"  --single-audio\tsingle audio mode\n"
+					"  --soft-mixer\t\tmix all sources into a single PCM\n"
+					"  --low-latency\t\tadaptive low-latency mode\n"
 					"\nNote:\n"
 					"If one wants to receive audio from more than one Bluetooth device, it is\n"
 					"possible to specify more than one MAC address. By specifying any/empty MAC\n"
@@ -613,11 +1928,21 @@ usage:
 			break;
 		case 4 /* --pcm-period-time */ :
 			pcm_period_time = atoi(optarg);
+			pcm_period_time_set = true;
 			break;
 
 		case 5 /* --single-audio */ :
 			pcm_mixer = false;
 			break;
+		case 6 /* --soft-mixer */ :
+			pcm_soft_mixer = true;
+			break;
+		case 7 /* --low-latency */ :
+			pcm_low_latency = true;
+			break;
+		case 8 /* --pcm-rate */ :
+			pcm_rate = atoi(optarg);
+			break;
 
 		default:
 			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
@@ -627,11 +1952,17 @@ usage:
 	if (optind == argc)
 		goto usage;
 
+	/* In the low-latency mode the buffer time is the upper limit of the
+	 * adaptive latency, so the default period has to be much shorter. */
+	if (pcm_low_latency && !pcm_period_time_set)
+		pcm_period_time = LL_PERIOD_TIME;
+
 	log_open(argv[0], false, false);
 
 	int status = EXIT_SUCCESS;
 	int ba_fd = -1;
 	int ba_event_fd = -1;
+	uint32_t ba_event_caps = BA_CAPABILITY_EVENT_PAYLOAD;
 	size_t i;
 
 	ba_addrs_count = argc - optind;
@@ -652,8 +1983,11 @@ usage:
 
 		char *ba_str = malloc(19 * ba_addrs_count + 1);
 		char *tmp = ba_str;
+		char rate[16];
 		size_t i;
 
+		snprintf(rate, sizeof(rate), "%u Hz", pcm_rate);
+
 		for (i = 0; i < ba_addrs_count; i++, tmp += 19)
 			ba2str(&ba_addrs[i], stpcpy(tmp, ", "));
 
@@ -663,10 +1997,16 @@ usage:
 				"  PCM buffer time: %u us\n"
 				"  PCM period time: %u us\n"
 				"  Bluetooth device(s): %s\n"
-				"  Profile: %s\n",
+				"  Profile: %s\n"
+				"  Software mixer: %s\n"
+				"  Low-latency mode: %s\n"
+				"  PCM sampling rate: %s\n",
 				ba_interface, device, pcm_buffer_time, pcm_period_time,
 				ba_addr_any ? "ANY" : &ba_str[2],
-				ba_type == BA_PCM_TYPE_A2DP ? "A2DP" : "SCO");
+				ba_type == BA_PCM_TYPE_A2DP ? "A2DP" : "SCO",
+				pcm_soft_mixer ? "yes" : "no",
+				pcm_low_latency ? "yes" : "no",
+				pcm_rate != 0 ? rate : "transport");
 
 		free(ba_str);
 	}
@@ -682,7 +2022,7 @@ usage:
 	}
 
 	if ((ba_fd = bluealsa_open(ba_interface)) == -1 ||
-			(ba_event_fd = bluealsa_open(ba_interface)) == -1) {
+			(ba_event_fd = bluealsa_open_caps(ba_interface, &ba_event_caps)) == -1) {
 		error("BlueALSA connection failed: %s", strerror(errno));
 		goto fail;
 	}
@@ -690,11 +2030,19 @@ usage:
 	if (bluealsa_event_subscribe(ba_event_fd,
 				BA_EVENT_TRANSPORT_ADDED |
 				BA_EVENT_TRANSPORT_CHANGED |
-				BA_EVENT_TRANSPORT_REMOVED) == -1) {
+				BA_EVENT_TRANSPORT_REMOVED |
+				BA_EVENT_VOLUME_CHANGED) == -1) {
 		error("BlueALSA subscription failed: %s", strerror(errno));
 		goto fail;
 	}
 
+	struct io_source event_src = { .type = IO_SOURCE_EVENT };
+	if ((main_loop_epoll = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+			io_source_ctl(EPOLL_CTL_ADD, ba_event_fd, EPOLLIN, &event_src) == -1) {
+		error("Couldn't create main loop: %s", strerror(errno));
+		goto fail;
+	}
+
 	if (start_available_transports(ba_fd) == -1) {
 		error("Couldn't start available transports: %s", strerror(errno));
 		goto fail;
@@ -704,56 +2052,100 @@ usage:
 	sigaction(SIGTERM, &sigact, NULL);
 	sigaction(SIGINT, &sigact, NULL);
 
+	/* D-Bus replies are dispatched by our main loop */
+	g_main_context_acquire(g_main_context_default());
+
 	debug("Starting main loop");
 	while (main_loop_on) {
 
-		struct ba_msg_event ev;
-		ssize_t ret;
-		size_t i;
-
-		struct pollfd pfds[] = {{ ba_event_fd, POLLIN, 0 }};
-		if (poll(pfds, ARRAYSIZE(pfds), -1) == -1 && errno == EINTR)
-			continue;
+		struct epoll_event events[16];
+		int timeout;
+		int count;
+		int n;
+
+		/* wake up on the nearest GLib source or worker inactivity timeout */
+		timeout = glib_poll_prepare();
+		for (i = 0; i < workers_count; i++) {
+			int tmp = pcm_worker_get_timeout(workers[i]);
+			if (tmp != -1 && (timeout == -1 || tmp < timeout))
+				timeout = tmp;
+		}
 
-		while ((ret = recv(ba_event_fd, &ev, sizeof(ev), MSG_DONTWAIT)) == -1 &&
-				errno == EINTR)
-			continue;
-		if (ret != sizeof(ev)) {
-			error("Couldn't read event: %s", strerror(ret == -1 ? errno : EBADMSG));
-			goto fail;
+		if ((count = epoll_wait(main_loop_epoll, events, ARRAYSIZE(events), timeout)) == -1) {
+			if (errno != EINTR) {
+				error("Main loop poll error: %s", strerror(errno));
+				goto fail;
+			}
+			count = 0;
 		}
 
-		if (!validate_transport(&ev.addr, ev.type))
-			continue;
+		for (n = 0; n < count; n++)
+			if (((struct io_source *)events[n].data.ptr)->type == IO_SOURCE_GLIB)
+				glib_poll.fds[((struct io_source *)events[n].data.ptr)->index].revents =
+					events[n].events;
+
+		/* dispatch D-Bus replies (if any) */
+		glib_poll_dispatch();
 
-		/* for simplicity's sake, treat change event as "remove & add" */
-		if (ev.events & BA_EVENT_TRANSPORT_CHANGED)
-			ev.events = BA_EVENT_TRANSPORT_ADDED | BA_EVENT_TRANSPORT_REMOVED;
-
-		if (ev.events & BA_EVENT_TRANSPORT_REMOVED)
-			for (i = 0; i < workers_count; i++) {
-				struct pcm_worker *worker = &workers[i];
-				if (bluealsa_event_match(&worker->transport, &ev) == 0) {
-					pthread_cancel(worker->thread);
-					pthread_join(worker->thread, NULL);
-					memcpy(worker, &workers[workers_count - 1], sizeof(*worker));
-					workers_count--;
+		for (n = 0; n < count; n++) {
+
+			struct io_source *src = events[n].data.ptr;
+			struct pcm_worker *w = src->worker;
+			unsigned short revents;
+
+			switch (src->type) {
+			case IO_SOURCE_EVENT:
+				if (process_event(ba_fd, ba_event_fd) == -1)
+					goto fail;
+				break;
+
+			case IO_SOURCE_FIFO:
+				if (w->removed || w->pcm_fd == -1)
 					break;
+				/* FIFO has been terminated on the writing side */
+				if (events[n].events & EPOLLHUP ||
+						pcm_worker_read(w) == -1) {
+					debug("Closing PCM worker %s", w->addr);
+					pcm_worker_close(w);
 				}
-			}
+				break;
 
-		if (ev.events & BA_EVENT_TRANSPORT_ADDED) {
-			struct ba_msg_transport transport;
-			if (bluealsa_get_transport(ba_fd, &ev.addr, ev.type, &transport) == -1) {
-				error("Couldn't get transport: %s", strerror(errno));
-				goto fail;
-			}
-			if (start_pcm_worker_routine(&transport) == -1) {
-				error("Couldn't start PCM worker: %s", strerror(errno));
-				goto fail;
+			case IO_SOURCE_PCM:
+				if (w->removed || w->pcm == NULL)
+					break;
+				revents = pcm_poll_revents(&w->pcm_poll, w->pcm, src->index, events[n].events);
+				if (revents & (POLLOUT | POLLERR) && pcm_worker_write(w) == -1) {
+					debug("Closing PCM worker %s", w->addr);
+					pcm_worker_close(w);
+				}
+				break;
+
+			case IO_SOURCE_MIXER:
+				if (mixer.pcm == NULL)
+					break;
+				revents = pcm_poll_revents(&mixer.poll, mixer.pcm, src->index, events[n].events);
+				if (revents & (POLLOUT | POLLERR) && mixer_process() == -1)
+					mixer_close();
+				break;
+
+			case IO_SOURCE_GLIB:
+				/* already dispatched */
+				break;
 			}
+
 		}
 
+		for (i = 0; i < workers_count; i++)
+			if (!workers[i]->removed && pcm_worker_get_timeout(workers[i]) == 0)
+				pcm_worker_deactivate(workers[i]);
+
+		/* From now on, there are no pending events which might refer to the
+		 * removed workers, so they can be safely released. */
+		pcm_workers_collect();
+
+		if (pcm_soft_mixer && mixer.pcm == NULL && mixer_open() == -1)
+			goto fail;
+
 	}
 
 	goto success;
@@ -762,6 +2154,19 @@ fail:
 	status = EXIT_FAILURE;
 
 success:
+	for (i = 0; i < workers_count; i++)
+		pcm_worker_remove(workers[i]);
+	pcm_workers_collect();
+	while (workers_pool != NULL) {
+		struct pcm_worker *w = workers_pool;
+		workers_pool = w->next;
+		free(w);
+	}
+	free(workers);
+	mixer_close();
+	glib_poll_free();
+	if (main_loop_epoll != -1)
+		close(main_loop_epoll);
 	if (ba_fd != -1)
 		close(ba_fd);
 	if (ba_event_fd != -1)
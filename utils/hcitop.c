@@ -12,9 +12,12 @@
 # include <config.h>
 #endif
 
+#include <errno.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <ncurses.h>
@@ -24,6 +27,23 @@
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 
+#include "a2dp-codecs.h"
+#include "hfp.h"
+#include "shared/ctl-client.h"
+#include "shared/defs.h"
+
+/* the maximal number of transports for which the history is kept */
+#define TRANSPORTS_MAX 64
+
+/**
+ * Previous sample of the transport statistics. */
+struct transport_sample {
+	int hci;
+	/* refresh iteration in which the sample was taken */
+	size_t refresh;
+	struct ba_msg_transport_stats stats;
+};
+
 static const struct {
 	unsigned int bit;
 	char flag;
@@ -88,19 +108,170 @@ static void sprint_hci_flags(char *str, unsigned int flags) {
 	str[i] = '\0';
 }
 
+static const char *get_transport_type(uint8_t type) {
+	switch (BA_PCM_TYPE(type)) {
+	case BA_PCM_TYPE_A2DP:
+		return type & BA_PCM_STREAM_PLAYBACK ? "A2DP-SRC" : "A2DP-SNK";
+	case BA_PCM_TYPE_SCO:
+		return "SCO";
+	default:
+		return "?";
+	}
+}
+
+static const char *get_codec_name(uint8_t type, uint16_t codec) {
+
+	if (BA_PCM_TYPE(type) == BA_PCM_TYPE_SCO)
+		switch (codec) {
+		case HFP_CODEC_CVSD:
+			return "CVSD";
+		case HFP_CODEC_MSBC:
+			return "mSBC";
+		default:
+			return "?";
+		}
+
+	switch (codec) {
+	case A2DP_CODEC_SBC:
+		return "SBC";
+	case A2DP_CODEC_MPEG12:
+		return "MP3";
+	case A2DP_CODEC_MPEG24:
+		return "AAC";
+	case A2DP_CODEC_VENDOR_APTX:
+		return "aptX";
+	case A2DP_CODEC_VENDOR_APTX_HD:
+		return "aptX-HD";
+	case A2DP_CODEC_VENDOR_LDAC:
+		return "LDAC";
+	default:
+		return "?";
+	}
+}
+
+/**
+ * Find previous sample of the given transport statistics.
+ *
+ * @return This function returns the sample slot. If the transport was not
+ *   seen before, the first free slot is returned and its statistics are
+ *   initialized with the current ones. */
+static struct transport_sample *get_transport_sample(struct transport_sample *samples,
+		size_t *count, int hci, const struct ba_msg_transport_stats *stats) {
+
+	size_t i;
+
+	for (i = 0; i < *count; i++)
+		if (samples[i].hci == hci &&
+				samples[i].stats.transport.type == stats->transport.type &&
+				bacmp(&samples[i].stats.transport.addr, &stats->transport.addr) == 0)
+			return &samples[i];
+
+	if (*count == TRANSPORTS_MAX)
+		return NULL;
+
+	samples[i].hci = hci;
+	samples[i].stats = *stats;
+	(*count)++;
+
+	return &samples[i];
+}
+
+/**
+ * Print statistics of all transports available on the given HCI device.
+ *
+ * @param row The first screen row to use.
+ * @param hci The HCI device index.
+ * @param name The HCI device name.
+ * @param fd Address of the BlueALSA connection socket. If the connection
+ *   is not established, new connection attempt will be made.
+ * @param samples Previous samples used for the rate calculations.
+ * @param count The number of previous samples.
+ * @param refresh The current refresh iteration.
+ * @param interval Time elapsed since the previous samples in milliseconds.
+ * @return This function returns the number of printed rows. */
+static int print_transports(int row, int hci, const char *name, int *fd,
+		struct transport_sample *samples, size_t *count, size_t refresh,
+		unsigned int interval) {
+
+	const char *template_row = "%5s %17s %8s %7s %8s %6s %6s %6s %5s %7s";
+	struct ba_msg_transport_stats *stats;
+	ssize_t i, num;
+
+	if (*fd == -1) {
+		uint32_t caps = BA_CAPABILITY_STATS;
+		if ((*fd = bluealsa_open_caps(name, &caps)) == -1)
+			return 0;
+		if (!(caps & BA_CAPABILITY_STATS)) {
+			close(*fd);
+			*fd = -1;
+			return 0;
+		}
+	}
+
+	if ((num = bluealsa_get_stats(*fd, &stats)) == -1) {
+		/* reconnect during the next refresh */
+		close(*fd);
+		*fd = -1;
+		return 0;
+	}
+
+	for (i = 0; i < num; i++) {
+
+		const struct ba_msg_transport_stats *s = &stats[i];
+		struct transport_sample *prev;
+
+		if ((prev = get_transport_sample(samples, count, hci, s)) == NULL)
+			continue;
+
+		const struct ba_msg_transport_stats *p = &prev->stats;
+		/* counters are free-running, so unsigned arithmetic handles wrap */
+		const uint32_t d_bytes = s->bt_bytes - p->bt_bytes;
+		const uint32_t d_packets = s->bt_packets - p->bt_packets;
+		const uint32_t d_codec = s->codec_time - p->codec_time;
+
+		char addr[18], bitrate[9], packets[7], lost[7], queue[7];
+		char cpu[6], delay[8];
+
+		ba2str(&s->transport.addr, addr);
+		humanize_number(bitrate, sizeof(bitrate),
+				interval > 0 ? 8000ULL * d_bytes / interval : 0,
+				"b", HN_AUTOSCALE, HN_DECIMAL);
+		snprintf(packets, sizeof(packets), "%u",
+				interval > 0 ? (unsigned int)(1000ULL * d_packets / interval) : 0);
+		snprintf(lost, sizeof(lost), "%u", s->rtp_lost);
+		humanize_number(queue, sizeof(queue), s->bt_queued, "B", HN_AUTOSCALE, 0);
+		snprintf(cpu, sizeof(cpu), "%.1f",
+				interval > 0 ? 0.1 * d_codec / interval : 0);
+		snprintf(delay, sizeof(delay), "%.1f", 0.1 * s->transport.delay);
+
+		mvprintw(row + i, 0, template_row, name, addr,
+				get_transport_type(s->transport.type),
+				get_codec_name(s->transport.type, s->transport.codec),
+				bitrate, packets, lost, queue, cpu, delay);
+
+		prev->stats = *s;
+		prev->refresh = refresh;
+	}
+
+	free(stats);
+	return num;
+}
+
 int main(int argc, char *argv[]) {
 
 	int opt;
-	const char *opts = "hVd:";
+	const char *opts = "hVd:H";
 	const struct option longopts[] = {
 		{ "help", no_argument, NULL, 'h' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "delay", required_argument, NULL, 'd' },
+		{ "hci-only", no_argument, NULL, 'H' },
 		{ 0, 0, 0, 0 },
 	};
 
 	int delay_sec = 1;
 	int delay_msec = 0;
+	bool transports = true;
 
 	while ((opt = getopt_long(argc, argv, opts, longopts, NULL)) != -1)
 		switch (opt) {
@@ -108,7 +279,8 @@ int main(int argc, char *argv[]) {
 			printf("usage: %s [ -d sec ]\n"
 					"  -h, --help\t\tprint this help and exit\n"
 					"  -V, --version\t\tprint version and exit\n"
-					"  -d, --delay=SEC\tdelay time interval\n",
+					"  -d, --delay=SEC\tdelay time interval\n"
+					"  -H, --hci-only\tdo not show BlueALSA transports\n",
 					argv[0]);
 			return EXIT_SUCCESS;
 
@@ -125,6 +297,10 @@ int main(int argc, char *argv[]) {
 			}
 			break;
 
+		case 'H' /* --hci-only */ :
+			transports = false;
+			break;
+
 		default:
 			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
 			return EXIT_FAILURE;
@@ -133,10 +309,16 @@ int main(int argc, char *argv[]) {
 	struct hci_dev_info devices[HCI_MAX_DEV];
 	unsigned int byte_rx[HCI_MAX_DEV][3];
 	unsigned int byte_tx[HCI_MAX_DEV][3];
+	int ba_fds[HCI_MAX_DEV];
+	struct transport_sample samples[TRANSPORTS_MAX];
+	size_t samples_count = 0;
+	struct timespec ts_prev = { 0 };
 	size_t ii;
 
 	memset(byte_rx, 0, sizeof(byte_rx));
 	memset(byte_tx, 0, sizeof(byte_tx));
+	for (ii = 0; ii < ARRAYSIZE(ba_fds); ii++)
+		ba_fds[ii] = -1;
 
 	initscr();
 	cbreak();
@@ -189,6 +371,38 @@ int main(int argc, char *argv[]) {
 			mvprintw(i + 1, 0, template_row, devices[i].name, flags, rx, tx, rx_rate, tx_rate);
 		}
 
+		if (transports) {
+
+			struct timespec ts;
+			unsigned int interval;
+			int row = count + 2;
+
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			interval = ts_prev.tv_sec == 0 ? 0 :
+				(ts.tv_sec - ts_prev.tv_sec) * 1000 + (ts.tv_nsec - ts_prev.tv_nsec) / 1000000;
+			ts_prev = ts;
+
+			move(row, 0);
+			clrtobot();
+
+			attron(A_REVERSE);
+			mvprintw(row++, 0, "%5s %17s %8s %7s %8s %6s %6s %6s %5s %7s",
+					"HCI", "DEVICE", "PROFILE", "CODEC", "BITRATE", "PKT/s", "LOST", "QUEUE", "CPU%", "DELAY");
+			attroff(A_REVERSE);
+
+			for (i = 0; i < count; i++)
+				row += print_transports(row, devices[i].dev_id, devices[i].name,
+						&ba_fds[devices[i].dev_id], samples, &samples_count, ii, interval);
+
+			/* forget transports which are gone */
+			size_t j, n;
+			for (j = n = 0; j < samples_count; j++)
+				if (samples[j].refresh == ii)
+					samples[n++] = samples[j];
+			samples_count = n;
+
+		}
+
 		timeout(delay_sec * 1000 + delay_msec);
 		if (getch() == 'q')
 			break;
@@ -196,5 +410,10 @@ int main(int argc, char *argv[]) {
 	}
 
 	endwin();
+
+	for (ii = 0; ii < ARRAYSIZE(ba_fds); ii++)
+		if (ba_fds[ii] != -1)
+			close(ba_fds[ii]);
+
 	return EXIT_SUCCESS;
 }